@@ -692,10 +692,22 @@ void writer_writebit(writer_t*w, int bit)
 }
 void writer_writebits(writer_t*w, unsigned int data, int bits)
 {
-    int t;
-    for(t=0;t<bits;t++)
+    /* fill the current byte with as many bits as fit, instead of one bit at a time */
+    while(bits>0)
     {
-	writer_writebit(w, (data >> (bits-t-1))&1);
+	int n;
+	if(w->bitpos==8) 
+	{
+	    w->write(w, &w->mybyte, 1);
+	    w->bitpos = 0;
+	    w->mybyte = 0;
+	}
+	n = 8 - w->bitpos;
+	if(n > bits)
+	    n = bits;
+	bits -= n;
+	w->mybyte |= ((data >> bits) & (0xff >> (8-n))) << (8 - w->bitpos - n);
+	w->bitpos += n;
     }
 }
 void writer_resetbits(writer_t*w)
@@ -717,12 +729,23 @@ unsigned int reader_readbit(reader_t*r)
 }
 unsigned int reader_readbits(reader_t*r, int num)
 {
-    int t;
-    int val = 0;
-    for(t=0;t<num;t++)
+    /* the underlying reader is shared with the byte functions, so we can't
+       read ahead, but we can take all remaining bits of a byte at once */
+    unsigned int val = 0;
+    while(num>0)
     {
-	val<<=1;
-	val|=reader_readbit(r);
+	int n;
+	if(r->bitpos==8) 
+	{
+	    r->bitpos=0;
+	    r->read(r, &r->mybyte, 1);
+	}
+	n = 8 - r->bitpos;
+	if(n > num)
+	    n = num;
+	val = (val<<n) | ((r->mybyte >> (8 - r->bitpos - n)) & (0xff >> (8-n)));
+	r->bitpos += n;
+	num -= n;
     }
     return val;
 }
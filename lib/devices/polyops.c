@@ -75,6 +75,9 @@ int polyops_setparameter(struct _gfxdevice*dev, const char*key, const char*value
 {
     dbg("polyops_setparameter");
     internal_t*i = (internal_t*)dev->internal;
+    if(!strcmp(key, "threads")) {
+	gfxpoly_set_threads(atoi(value));
+    }
     if(i->out) return i->out->setparameter(i->out,key,value);
     else return 0;
 }
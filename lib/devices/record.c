@@ -40,6 +40,10 @@
 #include "../log.h"
 #include "../os.h"
 #include "../png.h"
+#include "../mem.h"
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
 #ifdef HAVE_FASTLZ
 #include "../fastlz.h"
 #endif
@@ -54,6 +58,28 @@ typedef struct _state {
     gfxcolor_t last_color[16];
     gfxmatrix_t last_matrix[16];
 
+    /* the font of the last glyph (-1 for none), if have_last_char is set */
+    int last_font;
+    char have_last_char;
+
+    /* while replaying: the version of the recording, and its fonts by number */
+    int version;
+    gfxfont_t**fonts;
+    int fonts_size;
+
+    /* while replaying: the recording, if it is in memory, and buffers
+       which are reused for every operation */
+    unsigned char*data;
+    int length;
+    char data_is_private;
+    gfxline_t*lines;
+    int lines_size;
+    gfxcolor_t*pixels;
+    int pixels_size;
+    gfxcxform_t cxform;
+    unsigned char*frame;
+    int frame_size;
+
 #ifdef STATS
     int size_matrices;
     int size_positions;
@@ -65,11 +91,39 @@ typedef struct _state {
 #endif
 } state_t;
 
+/* byte offsets of all pages and fonts in a recording, so that single pages
+   can be replayed without reading the pages before them */
+typedef struct _recordindex {
+    U32*pages;
+    int num_pages;
+    int pages_size;
+
+    U32*fonts;
+    char**font_ids;
+    int num_fonts;
+    int fonts_size;
+} recordindex_t;
+
 typedef struct _internal {
-    gfxfontlist_t* fontlist;
+    /* all fonts, and copies of their ids (the caller may free a font
+       once it has been drawn). Font numbers start at 1 */
+    gfxfont_t**fonts;
+    char**font_ids;
+    int num_fonts;
+    int fonts_size;
+    gfxfont_t*lookup_font;
+    int lookup_nr;
+
     state_t state;
+    recordindex_t index;
 
     writer_t w;
+    /* with compression, pages are collected here, and then written
+       to w as one compressed frame */
+    char compress;
+    char in_page;
+    writer_t page;
+
     int cliplevel;
     char use_tempfile;
     char*filename;
@@ -77,9 +131,12 @@ typedef struct _internal {
 
 typedef struct _internal_result {
     char use_tempfile;
+    char keep_file;
+    char is_input; // filename belongs to the caller (gfxresult_record_load)
     char*filename;
     void*data;
     int length;
+    recordindex_t index;
 } internal_result_t;
 
 #define OP_END 0x00
@@ -96,9 +153,30 @@ typedef struct _internal_result {
 #define OP_STARTPAGE 0x0b
 #define OP_ENDPAGE 0x0c
 #define OP_FINISH 0x0d
-
+#define OP_HEADER 0x0e
+#define OP_FRAME 0x0f
+
+/* version 1 recordings have no header. Version 2 added OP_HEADER, numbered
+   fonts, the glyph cache (FLAG_SAME_AS_LAST) and compressed frames. */
+#define RECORD_VERSION 2
+
+#define COMPRESSION_ZLIB 1
+#define COMPRESSION_FASTLZ 2
+#define COMPRESSION_LZ4 3
+
+/* the index footer follows OP_END: the font table (offset and id of every
+   OP_ADDFONT), the page table (offset of every OP_STARTPAGE), and a trailer
+   with the footer's own offset and INDEX_MAGIC */
+#define INDEX_MAGIC 0x58444e49 /* "INDX" */
+
+/* flags of OP_DRAWCHAR. With FLAG_SAME_AS_LAST, font, color and matrix are
+   those of the previous glyph, and only the position is stored: as absolute
+   doubles, or as float deltas (FLAG_FLOAT_DELTA) if those are exact.
+   FLAG_SAME_Y omits an unchanged y position. */
 #define FLAG_SAME_AS_LAST 0x10
 #define FLAG_ZERO_FONT 0x20
+#define FLAG_SAME_Y 0x40
+#define FLAG_FLOAT_DELTA 0x80
 
 #define LINE_MOVETO 0x0e
 #define LINE_LINETO 0x0f
@@ -140,37 +218,60 @@ static void dumpLine(writer_t*w, state_t*state, gfxline_t*line)
     state->size_lines += 1;
 #endif
 }
+/* if the recording is in memory, r is a memreader over s->data, and
+   r->pos is its read position */
+static inline U8 readU8(reader_t*r, state_t*s)
+{
+    if(s->data && r->pos < s->length)
+	return s->data[r->pos++];
+    return reader_readU8(r);
+}
+static void readDoubles(reader_t*r, state_t*s, double*d, int num)
+{
+    if(s->data && r->pos + num*8 <= s->length) {
+	memcpy(d, &s->data[r->pos], num*8);
+	r->pos += num*8;
+    } else {
+	int t;
+	for(t=0;t<num;t++)
+	    d[t] = reader_readDouble(r);
+    }
+}
+/* the returned line lives in s->lines, and stays valid until the next call */
 static gfxline_t* readLine(reader_t*r, state_t*s)
 {
-    gfxline_t*start = 0, *pos = 0;
+    int num = 0;
     while(1) {
-	unsigned char op = reader_readU8(r);
+	unsigned char op = readU8(r, s);
 	if(op == OP_END)
 	    break;
-	gfxline_t*line = (gfxline_t*)rfx_calloc(sizeof(gfxline_t));
-	if(!start) {
-	    start = pos = line;
-	} else {
-	    pos->next = line;
-	    pos = line;
+	if(num >= s->lines_size) {
+	    s->lines_size = s->lines_size?s->lines_size*2:64;
+	    s->lines = (gfxline_t*)rfx_realloc(s->lines, sizeof(gfxline_t)*s->lines_size);
 	}
+	gfxline_t*line = &s->lines[num++];
+	memset(line, 0, sizeof(gfxline_t));
+	double d[4];
 	if(op == LINE_MOVETO) {
 	    line->type = gfx_moveTo;
-	    line->x = reader_readDouble(r);
-	    line->y = reader_readDouble(r);
+	    readDoubles(r, s, d, 2);
+	    line->x = d[0]; line->y = d[1];
 	} else if(op == LINE_LINETO) {
 	    line->type = gfx_lineTo;
-	    line->x = reader_readDouble(r);
-	    line->y = reader_readDouble(r);
+	    readDoubles(r, s, d, 2);
+	    line->x = d[0]; line->y = d[1];
 	} else if(op == LINE_SPLINETO) {
 	    line->type = gfx_splineTo;
-	    line->x = reader_readDouble(r);
-	    line->y = reader_readDouble(r);
-	    line->sx = reader_readDouble(r);
-	    line->sy = reader_readDouble(r);
+	    readDoubles(r, s, d, 4);
+	    line->x = d[0]; line->y = d[1];
+	    line->sx = d[2]; line->sy = d[3];
 	}
     }
-    return start;
+    int t;
+    for(t=0;t<num-1;t++) {
+	s->lines[t].next = &s->lines[t+1];
+    }
+    return num?s->lines:0;
 }
 
 static void dumpImage(writer_t*w, state_t*state, gfximage_t*img)
@@ -227,13 +328,32 @@ static void dumpImage(writer_t*w, state_t*state, gfximage_t*img)
     state->size_images += w->pos - oldpos;
 #endif
 }
+static gfxcolor_t* pixelbuffer(state_t*state, int num)
+{
+    if(num > state->pixels_size) {
+	state->pixels_size = num;
+	state->pixels = (gfxcolor_t*)rfx_realloc(state->pixels, sizeof(gfxcolor_t)*num);
+    }
+    return state->pixels;
+}
+/* the returned pixels point either into the recording (if that is a private
+   copy, which output devices may modify) or into state->pixels, and stay
+   valid until the next call */
 static gfximage_t readImage(reader_t*r, state_t*state)
 {
     gfximage_t img;
     img.width = reader_readU16(r);
     img.height = reader_readU16(r);
     uLongf size = img.width*img.height*sizeof(gfxcolor_t);
-    img.data = malloc(size);
+#ifndef COMPRESS_IMAGES
+    if(state->data && state->data_is_private && r->pos + size <= state->length &&
+       !((ptroff_t)&state->data[r->pos]&3)) {
+	img.data = (gfxcolor_t*)&state->data[r->pos];
+	r->pos += size;
+	return img;
+    }
+#endif
+    img.data = pixelbuffer(state, img.width*img.height);
 #ifdef COMPRESS_IMAGES
     uLongf compressdata_size = reader_readU32(r);
     void*compressdata = malloc(compressdata_size);
@@ -368,12 +488,13 @@ static void dumpCXForm(writer_t*w, state_t*state, gfxcxform_t*c)
 	writer_writeFloat(w, c->ar); writer_writeFloat(w, c->ag); writer_writeFloat(w, c->ab); writer_writeFloat(w, c->aa);
     }
 }
+/* the returned cxform lives in the state, and stays valid until the next call */
 static gfxcxform_t* readCXForm(reader_t*r, state_t*state)
 {
     U8 type = reader_readU8(r);
     if(!type)
 	return 0;
-    gfxcxform_t* c = (gfxcxform_t*)rfx_calloc(sizeof(gfxcxform_t));
+    gfxcxform_t* c = &state->cxform;
     c->rr = reader_readFloat(r); c->rg = reader_readFloat(r); c->rb = reader_readFloat(r); c->ra = reader_readFloat(r);
     c->gr = reader_readFloat(r); c->gg = reader_readFloat(r); c->gb = reader_readFloat(r); c->ga = reader_readFloat(r);
     c->br = reader_readFloat(r); c->bg = reader_readFloat(r); c->bb = reader_readFloat(r); c->ba = reader_readFloat(r);
@@ -423,7 +544,7 @@ static gfxfont_t*readFont(reader_t*r, state_t*state)
     font->unicode2glyph = (int*)rfx_calloc(sizeof(font->unicode2glyph[0])*font->max_unicode);
     int t;
     for(t=0;t<font->num_glyphs;t++) {
-	font->glyphs[t].line = readLine(r, state);
+	font->glyphs[t].line = gfxline_clone(readLine(r, state));
 	font->glyphs[t].advance = reader_readDouble(r);
 	font->glyphs[t].unicode = reader_readU32(r);
 	font->glyphs[t].name = reader_readString(r);
@@ -449,6 +570,30 @@ void state_clear(state_t*state)
 	    state->last_string[t] = 0;
 	}
     }
+    state->have_last_char = 0;
+}
+
+static void state_free(state_t*state)
+{
+    state_clear(state);
+    if(state->lines) free(state->lines);
+    if(state->pixels) free(state->pixels);
+    if(state->fonts) free(state->fonts);
+    if(state->frame) free(state->frame);
+    memset(state, 0, sizeof(state_t));
+}
+
+static void state_setfont(state_t*state, int nr, gfxfont_t*font)
+{
+    if(nr >= state->fonts_size) {
+	int size = state->fonts_size?state->fonts_size*2:64;
+	while(size <= nr)
+	    size *= 2;
+	state->fonts = (gfxfont_t**)rfx_realloc(state->fonts, sizeof(gfxfont_t*)*size);
+	memset(&state->fonts[state->fonts_size], 0, sizeof(gfxfont_t*)*(size-state->fonts_size));
+	state->fonts_size = size;
+    }
+    state->fonts[nr] = font;
 }
 
 static char* read_string(reader_t*r, state_t*state, U8 id, U8 flags)
@@ -487,45 +632,222 @@ static gfxmatrix_t read_matrix(reader_t*r, state_t*state, U8 id, U8 flags)
     return m;
 }
 
+/* ------------------------------ compressed frames -------------------------- */
+
+static void dumpHeader(writer_t*w)
+{
+    writer_writeU8(w, OP_HEADER);
+    writer_writeU8(w, RECORD_VERSION);
+}
+
+static void dumpFrame(writer_t*w, void*data, int len)
+{
+    U8 method;
+    void*compressdata;
+    int compressdata_size;
+#if defined(HAVE_LZ4)
+    method = COMPRESSION_LZ4;
+    int bound = LZ4_compressBound(len);
+    compressdata = malloc(bound);
+    compressdata_size = LZ4_compress_default((const char*)data, (char*)compressdata, len, bound);
+#elif defined(HAVE_FASTLZ)
+    method = COMPRESSION_FASTLZ;
+    compressdata = malloc(len + len/16 + 66);
+    compressdata_size = fastlz_compress_level(1, data, len, compressdata);
+#else
+    method = COMPRESSION_ZLIB;
+    uLongf size = compressBound(len);
+    compressdata = malloc(size);
+    compress2(compressdata, &size, data, len, Z_BEST_SPEED);
+    compressdata_size = size;
+#endif
+    writer_writeU8(w, OP_FRAME);
+    writer_writeU8(w, method);
+    writer_writeU32(w, len);
+    writer_writeU32(w, compressdata_size);
+    w->write(w, compressdata, compressdata_size);
+    free(compressdata);
+}
+
+/* decompresses a frame into state->frame, and returns its size (or -1) */
+static int readFrame(reader_t*r, state_t*state)
+{
+    U8 method = reader_readU8(r);
+    U32 len = reader_readU32(r);
+    U32 compressdata_size = reader_readU32(r);
+
+    void*compressdata;
+    char free_compressdata = 0;
+    if(state->data && r->pos + compressdata_size <= state->length) {
+	compressdata = &state->data[r->pos];
+	r->pos += compressdata_size;
+    } else {
+	compressdata = malloc(compressdata_size);
+	free_compressdata = 1;
+	if(r->read(r, compressdata, compressdata_size) != compressdata_size) {
+	    free(compressdata);
+	    return -1;
+	}
+    }
+    if(len > state->frame_size) {
+	state->frame_size = len;
+	state->frame = (unsigned char*)rfx_realloc(state->frame, len);
+    }
+
+    int ret = -1;
+    switch(method) {
+	case COMPRESSION_ZLIB: {
+	    uLongf size = len;
+	    if(uncompress(state->frame, &size, compressdata, compressdata_size) == Z_OK && size == len)
+		ret = len;
+	    break;
+	}
+#ifdef HAVE_FASTLZ
+	case COMPRESSION_FASTLZ:
+	    if(fastlz_decompress(compressdata, compressdata_size, state->frame, len) == len)
+		ret = len;
+	    break;
+#endif
+#ifdef HAVE_LZ4
+	case COMPRESSION_LZ4:
+	    if(LZ4_decompress_safe((const char*)compressdata, (char*)state->frame, compressdata_size, len) == len)
+		ret = len;
+	    break;
+#endif
+	default:
+	    msg("<error> record: unsupported frame compression %d", method);
+    }
+    if(free_compressdata)
+	free(compressdata);
+    return ret;
+}
+
+/* -------------------------------- page index ------------------------------- */
+
+static void index_addpage(recordindex_t*index, U32 offset)
+{
+    if(index->num_pages >= index->pages_size) {
+	index->pages_size = index->pages_size?index->pages_size*2:64;
+	index->pages = (U32*)rfx_realloc(index->pages, sizeof(U32)*index->pages_size);
+    }
+    index->pages[index->num_pages++] = offset;
+}
+static void index_addfont(recordindex_t*index, U32 offset, const char*id)
+{
+    if(index->num_fonts >= index->fonts_size) {
+	index->fonts_size = index->fonts_size?index->fonts_size*2:64;
+	index->fonts = (U32*)rfx_realloc(index->fonts, sizeof(U32)*index->fonts_size);
+	index->font_ids = (char**)rfx_realloc(index->font_ids, sizeof(char*)*index->fonts_size);
+    }
+    index->fonts[index->num_fonts] = offset;
+    index->font_ids[index->num_fonts] = strdup(id);
+    index->num_fonts++;
+}
+static void index_clear(recordindex_t*index)
+{
+    int t;
+    for(t=0;t<index->num_fonts;t++) {
+	free(index->font_ids[t]);
+    }
+    if(index->fonts) free(index->fonts);
+    if(index->font_ids) free(index->font_ids);
+    if(index->pages) free(index->pages);
+    memset(index, 0, sizeof(recordindex_t));
+}
+static void dumpIndex(writer_t*w, recordindex_t*index)
+{
+    U32 start = w->pos;
+    int t;
+    writer_writeU32(w, index->num_fonts);
+    for(t=0;t<index->num_fonts;t++) {
+	writer_writeU32(w, index->fonts[t]);
+	writer_writeString(w, index->font_ids[t]);
+    }
+    writer_writeU32(w, index->num_pages);
+    for(t=0;t<index->num_pages;t++) {
+	writer_writeU32(w, index->pages[t]);
+    }
+    writer_writeU32(w, start);
+    writer_writeU32(w, INDEX_MAGIC);
+}
+static char readIndex(reader_t*r, int length, recordindex_t*index)
+{
+    memset(index, 0, sizeof(recordindex_t));
+    if(length < 8 || r->seek(r, length-8)<0)
+	return 0;
+    U32 start = reader_readU32(r);
+    U32 magic = reader_readU32(r);
+    if(magic != INDEX_MAGIC || start > length-8 || r->seek(r, start)<0)
+	return 0;
+    int num_fonts = reader_readU32(r);
+    if(num_fonts<0 || num_fonts>length)
+	return 0;
+    int t;
+    for(t=0;t<num_fonts;t++) {
+	U32 offset = reader_readU32(r);
+	char*id = reader_readString(r);
+	index_addfont(index, offset, id);
+	free(id);
+    }
+    int num_pages = reader_readU32(r);
+    if(num_pages<0 || num_pages>length) {
+	index_clear(index);
+	return 0;
+    }
+    for(t=0;t<num_pages;t++) {
+	index_addpage(index, reader_readU32(r));
+    }
+    return 1;
+}
+
 /* --------------------------- record device operations ---------------------- */
 
+static writer_t* op_writer(internal_t*i)
+{
+    return (i->compress && i->in_page)?&i->page:&i->w;
+}
+
 static int record_setparameter(struct _gfxdevice*dev, const char*key, const char*value)
 {
     internal_t*i = (internal_t*)dev->internal;
+    writer_t*w = op_writer(i);
     msg("<trace> record: %08x SETPARAM %s %s\n", dev, key, value);
-    writer_writeU8(&i->w, OP_SETPARAM);
-    writer_writeString(&i->w, key);
-    writer_writeString(&i->w, value);
+    writer_writeU8(w, OP_SETPARAM);
+    writer_writeString(w, key);
+    writer_writeString(w, value);
     return 1;
 }
 
 static void record_stroke(struct _gfxdevice*dev, gfxline_t*line, gfxcoord_t width, gfxcolor_t*color, gfx_capType cap_style, gfx_joinType joint_style, gfxcoord_t miterLimit)
 {
     internal_t*i = (internal_t*)dev->internal;
+    writer_t*w = op_writer(i);
     msg("<trace> record: %08x STROKE\n", dev);
-    writer_writeU8(&i->w, OP_STROKE);
-    writer_writeDouble(&i->w, width);
-    writer_writeDouble(&i->w, miterLimit);
-    dumpColor(&i->w, &i->state, color);
-    writer_writeU8(&i->w, cap_style);
-    writer_writeU8(&i->w, joint_style);
-    dumpLine(&i->w, &i->state, line);
+    writer_writeU8(w, OP_STROKE);
+    writer_writeDouble(w, width);
+    writer_writeDouble(w, miterLimit);
+    dumpColor(w, &i->state, color);
+    writer_writeU8(w, cap_style);
+    writer_writeU8(w, joint_style);
+    dumpLine(w, &i->state, line);
 }
 
 static void record_startclip(struct _gfxdevice*dev, gfxline_t*line)
 {
     internal_t*i = (internal_t*)dev->internal;
+    writer_t*w = op_writer(i);
     msg("<trace> record: %08x STARTCLIP\n", dev);
-    writer_writeU8(&i->w, OP_STARTCLIP);
-    dumpLine(&i->w, &i->state, line);
+    writer_writeU8(w, OP_STARTCLIP);
+    dumpLine(w, &i->state, line);
     i->cliplevel++;
 }
 
 static void record_endclip(struct _gfxdevice*dev)
 {
     internal_t*i = (internal_t*)dev->internal;
+    writer_t*w = op_writer(i);
     msg("<trace> record: %08x ENDCLIP\n", dev);
-    writer_writeU8(&i->w, OP_ENDCLIP);
+    writer_writeU8(w, OP_ENDCLIP);
     i->cliplevel--;
     if(i->cliplevel<0) {
 	msg("<error> record: endclip() without startclip()");
@@ -535,123 +857,253 @@ static void record_endclip(struct _gfxdevice*dev)
 static void record_fill(struct _gfxdevice*dev, gfxline_t*line, gfxcolor_t*color)
 {
     internal_t*i = (internal_t*)dev->internal;
+    writer_t*w = op_writer(i);
     msg("<trace> record: %08x FILL\n", dev);
-    writer_writeU8(&i->w, OP_FILL);
-    dumpColor(&i->w, &i->state, color);
-    dumpLine(&i->w, &i->state, line);
+    writer_writeU8(w, OP_FILL);
+    dumpColor(w, &i->state, color);
+    dumpLine(w, &i->state, line);
 }
 
 static void record_fillbitmap(struct _gfxdevice*dev, gfxline_t*line, gfximage_t*img, gfxmatrix_t*matrix, gfxcxform_t*cxform)
 {
     internal_t*i = (internal_t*)dev->internal;
+    writer_t*w = op_writer(i);
     msg("<trace> record: %08x FILLBITMAP\n", dev);
-    writer_writeU8(&i->w, OP_FILLBITMAP);
-    dumpImage(&i->w, &i->state, img);
-    dumpMatrix(&i->w, &i->state, matrix);
-    dumpLine(&i->w, &i->state, line);
-    dumpCXForm(&i->w, &i->state, cxform);
+    writer_writeU8(w, OP_FILLBITMAP);
+    dumpImage(w, &i->state, img);
+    dumpMatrix(w, &i->state, matrix);
+    dumpLine(w, &i->state, line);
+    dumpCXForm(w, &i->state, cxform);
 }
 
 static void record_fillgradient(struct _gfxdevice*dev, gfxline_t*line, gfxgradient_t*gradient, gfxgradienttype_t type, gfxmatrix_t*matrix)
 {
     internal_t*i = (internal_t*)dev->internal;
+    writer_t*w = op_writer(i);
     msg("<trace> record: %08x FILLGRADIENT %08x\n", dev, gradient);
-    writer_writeU8(&i->w, OP_FILLGRADIENT);
-    writer_writeU8(&i->w, type);
-    dumpGradient(&i->w, &i->state, gradient);
-    dumpMatrix(&i->w, &i->state, matrix);
-    dumpLine(&i->w, &i->state, line);
+    writer_writeU8(w, OP_FILLGRADIENT);
+    writer_writeU8(w, type);
+    dumpGradient(w, &i->state, gradient);
+    dumpMatrix(w, &i->state, matrix);
+    dumpLine(w, &i->state, line);
+}
+
+/* returns the number of a font, or 0 if it wasn't stored yet */
+static int font_number(internal_t*i, gfxfont_t*font)
+{
+    /* a font allocated where a freed one was has the same address,
+       but another id */
+    if(font == i->lookup_font && !strcmp(font->id, i->font_ids[i->lookup_nr-1]))
+	return i->lookup_nr;
+    int nr = 0, t;
+    for(t=0;t<i->num_fonts;t++) {
+	if(!strcmp(i->font_ids[t], font->id)) {
+	    nr = t+1;
+	    break;
+	}
+    }
+    if(nr) {
+	/* most glyphs use the same font as the one before */
+	i->lookup_font = font;
+	i->lookup_nr = nr;
+    }
+    return nr;
 }
 
 static void record_addfont(struct _gfxdevice*dev, gfxfont_t*font)
 {
     internal_t*i = (internal_t*)dev->internal;
+    if(!font)
+	return;
     msg("<trace> record: %08x ADDFONT %s\n", dev, font->id);
-    if(font && !gfxfontlist_hasfont(i->fontlist, font)) {
+    if(!font_number(i, font)) {
+	/* fonts are never part of a compressed page frame, so that the font
+	   table can point to them */
+	index_addfont(&i->index, i->w.pos, font->id);
 	writer_writeU8(&i->w, OP_ADDFONT);
+	write_compressed_uint(&i->w, i->num_fonts);
 	dumpFont(&i->w, &i->state, font);
-	i->fontlist = gfxfontlist_addfont(i->fontlist, font);
+
+	if(i->num_fonts >= i->fonts_size) {
+	    i->fonts_size = i->fonts_size?i->fonts_size*2:64;
+	    i->fonts = (gfxfont_t**)rfx_realloc(i->fonts, sizeof(gfxfont_t*)*i->fonts_size);
+	    i->font_ids = (char**)rfx_realloc(i->font_ids, sizeof(char*)*i->fonts_size);
+	}
+	i->font_ids[i->num_fonts] = strdup(font->id);
+	i->fonts[i->num_fonts++] = font;
     }
 }
 
 static void record_drawchar(struct _gfxdevice*dev, gfxfont_t*font, int glyphnr, gfxcolor_t*color, gfxmatrix_t*matrix)
 {
     internal_t*i = (internal_t*)dev->internal;
-    if(font && !gfxfontlist_hasfont(i->fontlist, font)) {
+    writer_t*w;
+    int fontnr = -1;
+    if(font) {
 	record_addfont(dev, font);
+	fontnr = font_number(i, font) - 1;
     }
+    w = op_writer(i);
 
     msg("<trace> record: %08x DRAWCHAR %d\n", glyphnr, dev);
-    const char*font_id = (font&&font->id)?font->id:"*NULL*";
+#ifdef STATS
+    int oldpos = w->pos;
+#endif
     
     gfxmatrix_t*l = &i->state.last_matrix[OP_DRAWCHAR];
 
     U8 flags = 0;
-    if(!font)
-	flags |= FLAG_ZERO_FONT;
-
-    char same_font = i->state.last_string[OP_DRAWCHAR] && !strcmp(i->state.last_string[OP_DRAWCHAR], font_id);
+    char same_font = i->state.have_last_char && i->state.last_font == fontnr;
     char same_matrix = (l->m00 == matrix->m00) && (l->m01 == matrix->m01) && (l->m10 == matrix->m10) && (l->m11 == matrix->m11);
     char same_color = !memcmp(color, &i->state.last_color[OP_DRAWCHAR], sizeof(gfxcolor_t));
 
-    /* FIXME
-    if(same_font && same_matrix && same_color)
+    if(same_font && same_matrix && same_color) {
 	flags |= FLAG_SAME_AS_LAST;
-    */
-
-    writer_writeU8(&i->w, OP_DRAWCHAR|flags);
-    writer_writeU32(&i->w, glyphnr);
-#ifdef STATS
-    i->state.size_chars += 5;
-#endif
-
-    if(!(flags&FLAG_SAME_AS_LAST)) {
-	if(!(flags&FLAG_ZERO_FONT))
-	    writer_writeString(&i->w, font_id);
-	dumpColor(&i->w, &i->state, color);
-	dumpMatrix(&i->w, &i->state, matrix);
-
-	if(i->state.last_string[OP_DRAWCHAR])
-	    free(i->state.last_string[OP_DRAWCHAR]);
-	i->state.last_string[OP_DRAWCHAR] = strdup(font_id);
-
+	float dx = matrix->tx - l->tx;
+	float dy = matrix->ty - l->ty;
+	if(matrix->ty == l->ty)
+	    flags |= FLAG_SAME_Y;
+	if(l->tx + dx == matrix->tx && ((flags&FLAG_SAME_Y) || l->ty + dy == matrix->ty))
+	    flags |= FLAG_FLOAT_DELTA;
+
+	writer_writeU8(w, OP_DRAWCHAR|flags);
+	write_compressed_uint(w, glyphnr);
+	if(flags&FLAG_FLOAT_DELTA) {
+	    writer_writeFloat(w, dx);
+	    if(!(flags&FLAG_SAME_Y))
+		writer_writeFloat(w, dy);
+	} else if(flags&FLAG_SAME_Y) {
+	    writer_writeDouble(w, matrix->tx);
+	} else {
+	    dumpXY(w, &i->state, matrix);
+	}
+	l->tx = matrix->tx;
+	l->ty = matrix->ty;
+    } else {
+	if(fontnr<0)
+	    flags |= FLAG_ZERO_FONT;
+	writer_writeU8(w, OP_DRAWCHAR|flags);
+	write_compressed_uint(w, glyphnr);
+	if(fontnr>=0)
+	    write_compressed_uint(w, fontnr);
+	dumpColor(w, &i->state, color);
+	dumpMatrix(w, &i->state, matrix);
+
+	i->state.last_font = fontnr;
+	i->state.have_last_char = 1;
 	i->state.last_color[OP_DRAWCHAR] = *color;
 	i->state.last_matrix[OP_DRAWCHAR] = *matrix;
-    } else {
-	dumpXY(&i->w, &i->state, matrix);
     }
+#ifdef STATS
+    i->state.size_chars += w->pos - oldpos;
+#endif
 }
 
 static void record_startpage(struct _gfxdevice*dev, int width, int height)
 {
     internal_t*i = (internal_t*)dev->internal;
     msg("<trace> record: %08x STARTPAGE\n", dev);
-    writer_writeU8(&i->w, OP_STARTPAGE);
-    writer_writeU16(&i->w, width);
-    writer_writeU16(&i->w, height);
+    index_addpage(&i->index, i->w.pos);
+    /* pages must not refer to cached primitives of earlier pages */
+    state_clear(&i->state);
+    i->in_page = 1;
+    writer_t*w = op_writer(i);
+    writer_writeU8(w, OP_STARTPAGE);
+    writer_writeU16(w, width);
+    writer_writeU16(w, height);
+}
+
+static void flush_page(internal_t*i)
+{
+    if(i->compress && i->page.pos) {
+	int len = 0;
+	void*data = writer_growmemwrite_memptr(&i->page, &len);
+	dumpFrame(&i->w, data, len);
+	writer_growmemwrite_reset(&i->page);
+    }
 }
 
 static void record_endpage(struct _gfxdevice*dev)
 {
     internal_t*i = (internal_t*)dev->internal;
+    writer_t*w = op_writer(i);
     msg("<trace> record: %08x ENDPAGE\n", dev);
-    writer_writeU8(&i->w, OP_ENDPAGE);
+    writer_writeU8(w, OP_ENDPAGE);
+    flush_page(i);
+    i->in_page = 0;
 }
 
 static void record_drawlink(struct _gfxdevice*dev, gfxline_t*line, const char*action, const char*text)
 {
     internal_t*i = (internal_t*)dev->internal;
+    writer_t*w = op_writer(i);
     msg("<trace> record: %08x DRAWLINK\n", dev);
-    writer_writeU8(&i->w, OP_DRAWLINK);
-    dumpLine(&i->w, &i->state, line);
-    writer_writeString(&i->w, action?action:"");
-    writer_writeString(&i->w, text?text:"");
+    writer_writeU8(w, OP_DRAWLINK);
+    dumpLine(w, &i->state, line);
+    writer_writeString(w, action?action:"");
+    writer_writeString(w, text?text:"");
 }
 
 /* ------------------------------- replaying --------------------------------- */
 
-static void replay(struct _gfxdevice*dev, gfxdevice_t*out, reader_t*r, gfxfontlist_t**fontlist)
+static void replay_font(gfxdevice_t*out, reader_t*r, state_t*state, gfxfontlist_t**fontlist)
+{
+    int nr = state->version>=2?read_compressed_uint(r):-1;
+    gfxfont_t*font = readFont(r, state);
+    gfxfont_t*known = gfxfontlist_findfont(*fontlist, (char*)font->id);
+    if(!known) {
+	*fontlist = gfxfontlist_addfont(*fontlist, font);
+	out->addfont(out, font);
+    } else {
+	gfxfont_free(font);
+	font = known;
+    }
+    if(nr>=0)
+	state_setfont(state, nr, font);
+}
+
+static void readHeader(reader_t*r, state_t*state)
+{
+    state->version = reader_readU8(r);
+    if(state->version > RECORD_VERSION) {
+	msg("<error> record: unsupported version %d", state->version);
+    }
+}
+
+/* prepares reading a result. File based results are mapped into memory,
+   so that lines and images can be read without copying them around. */
+static memfile_t* replay_open(internal_result_t*i, state_t*state, reader_t*r)
+{
+    memfile_t*file = 0;
+    memset(state, 0, sizeof(state_t));
+    if(i->use_tempfile) {
+	file = memfile_open(i->filename);
+	if(!file) {
+	    reader_init_filereader2(r, i->filename);
+	    return 0;
+	}
+	state->data = (unsigned char*)file->data;
+	state->length = file->len;
+	state->data_is_private = 1;
+    } else {
+	state->data = (unsigned char*)i->data;
+	state->length = i->length;
+    }
+    reader_init_memreader(r, state->data, state->length);
+    return file;
+}
+static void replay_close(memfile_t*file, state_t*state, reader_t*r)
+{
+    r->dealloc(r);
+    state_free(state);
+    if(file)
+	memfile_close(file);
+}
+
+/* returns 1 if single_page is set and the end of the page was reached */
+static int replay(struct _gfxdevice*dev, gfxdevice_t*out, state_t*state, reader_t*r, gfxfontlist_t**fontlist, char single_page)
 {
+    int ret = 0;
     internal_t*i = 0;
     if(dev) {
 	i = (internal_t*)dev->internal;
@@ -661,9 +1113,6 @@ static void replay(struct _gfxdevice*dev, gfxdevice_t*out, reader_t*r, gfxfontli
 	fontlist = &_fontlist;
     }
 
-    state_t state;
-    memset(&state, 0, sizeof(state));
-
     while(1) {
 	unsigned char op;
 	if(r->read(r, &op, 1)!=1)
@@ -674,6 +1123,37 @@ static void replay(struct _gfxdevice*dev, gfxdevice_t*out, reader_t*r, gfxfontli
 	switch(op) {
 	    case OP_END:
 		goto finish;
+	    case OP_HEADER: {
+		readHeader(r, state);
+		if(state->version > RECORD_VERSION)
+		    goto finish;
+		break;
+	    }
+	    case OP_FRAME: {
+		msg("<trace> replay: FRAME");
+		int len = readFrame(r, state);
+		if(len<0) {
+		    msg("<error> record: corrupt frame");
+		    goto finish;
+		}
+		/* replay the frame's contents from state->frame */
+		unsigned char*data = state->data;
+		int length = state->length;
+		char data_is_private = state->data_is_private;
+		state->data = state->frame;
+		state->length = len;
+		state->data_is_private = 1;
+		reader_t fr;
+		reader_init_memreader(&fr, state->frame, len);
+		ret = replay(dev, out, state, &fr, fontlist, single_page);
+		fr.dealloc(&fr);
+		state->data = data;
+		state->length = length;
+		state->data_is_private = data_is_private;
+		if(ret)
+		    goto finish;
+		break;
+	    }
 	    case OP_SETPARAM: {
 		msg("<trace> replay: SETPARAM");
 		char*key;
@@ -689,12 +1169,17 @@ static void replay(struct _gfxdevice*dev, gfxdevice_t*out, reader_t*r, gfxfontli
 		msg("<trace> replay: STARTPAGE");
 		U16 width = reader_readU16(r);
 		U16 height = reader_readU16(r);
+		state_clear(state);
 		out->startpage(out, width, height);
 		break;
 	    }
 	    case OP_ENDPAGE: {
 		msg("<trace> replay: ENDPAGE");
 		out->endpage(out);
+		if(single_page) {
+		    ret = 1;
+		    goto finish;
+		}
 		break;
 	    }
 	    case OP_FINISH: {
@@ -705,7 +1190,7 @@ static void replay(struct _gfxdevice*dev, gfxdevice_t*out, reader_t*r, gfxfontli
 		msg("<trace> replay: STROKE");
 		double width = reader_readDouble(r);
 		double miterlimit = reader_readDouble(r);
-		gfxcolor_t color = readColor(r, &state);
+		gfxcolor_t color = readColor(r, state);
 		gfx_capType captype;
 		int v = reader_readU8(r);
 		switch (v) {
@@ -720,16 +1205,14 @@ static void replay(struct _gfxdevice*dev, gfxdevice_t*out, reader_t*r, gfxfontli
 		    case 1: jointtype = gfx_joinRound; break;
 		    case 2: jointtype = gfx_joinBevel; break;
 		}
-		gfxline_t* line = readLine(r, &state);
+		gfxline_t* line = readLine(r, state);
 		out->stroke(out, line, width, &color, captype, jointtype,miterlimit);
-		gfxline_free(line);
 		break;
 	    }
 	    case OP_STARTCLIP: {
 		msg("<trace> replay: STARTCLIP");
-		gfxline_t* line = readLine(r, &state);
+		gfxline_t* line = readLine(r, state);
 		out->startclip(out, line);
-		gfxline_free(line);
 		break;
 	    }
 	    case OP_ENDCLIP: {
@@ -739,23 +1222,18 @@ static void replay(struct _gfxdevice*dev, gfxdevice_t*out, reader_t*r, gfxfontli
 	    }
 	    case OP_FILL: {
 		msg("<trace> replay: FILL");
-		gfxcolor_t color = readColor(r, &state);
-		gfxline_t* line = readLine(r, &state);
+		gfxcolor_t color = readColor(r, state);
+		gfxline_t* line = readLine(r, state);
 		out->fill(out, line, &color);
-		gfxline_free(line);
 		break;
 	    }
 	    case OP_FILLBITMAP: {
 		msg("<trace> replay: FILLBITMAP");
-		gfximage_t img = readImage(r, &state);
-		gfxmatrix_t matrix = readMatrix(r, &state);
-		gfxline_t* line = readLine(r, &state);
-		gfxcxform_t* cxform = readCXForm(r, &state);
+		gfximage_t img = readImage(r, state);
+		gfxmatrix_t matrix = readMatrix(r, state);
+		gfxline_t* line = readLine(r, state);
+		gfxcxform_t* cxform = readCXForm(r, state);
 		out->fillbitmap(out, line, &img, &matrix, cxform);
-		gfxline_free(line);
-		if(cxform)
-		    free(cxform);
-		free(img.data);img.data=0;
 		break;
 	    }
 	    case OP_FILLGRADIENT: {
@@ -768,46 +1246,72 @@ static void replay(struct _gfxdevice*dev, gfxdevice_t*out, reader_t*r, gfxfontli
 		    case 1:
 		      type = gfxgradient_linear; break;
 		}  
-		gfxgradient_t*gradient = readGradient(r, &state);
-		gfxmatrix_t matrix = readMatrix(r, &state);
-		gfxline_t* line = readLine(r, &state);
+		gfxgradient_t*gradient = readGradient(r, state);
+		gfxmatrix_t matrix = readMatrix(r, state);
+		gfxline_t* line = readLine(r, state);
 		out->fillgradient(out, line, gradient, type, &matrix);
 		break;
 	    }
 	    case OP_DRAWLINK: {
 		msg("<trace> replay: DRAWLINK");
-		gfxline_t* line = readLine(r, &state);
+		gfxline_t* line = readLine(r, state);
 		char* s = reader_readString(r);
 		char* t = reader_readString(r);
 		out->drawlink(out,line,s, t);
-		gfxline_free(line);
 		free(s);
+		free(t);
 		break;
 	    }
 	    case OP_ADDFONT: {
 		msg("<trace> replay: ADDFONT out=%08x(%s)", out, out->name);
-		gfxfont_t*font = readFont(r, &state);
-		if(!gfxfontlist_hasfont(*fontlist, font)) {
-		    *fontlist = gfxfontlist_addfont(*fontlist, font);
-		    out->addfont(out, font);
-		} else {
-		    gfxfont_free(font);
-		}
+		replay_font(out, r, state, fontlist);
 		break;
 	    }
 	    case OP_DRAWCHAR: {
+		if(state->version >= 2) {
+		    U32 glyph = read_compressed_uint(r);
+		    gfxmatrix_t*l = &state->last_matrix[OP_DRAWCHAR];
+		    if(flags&FLAG_SAME_AS_LAST) {
+			if(flags&FLAG_FLOAT_DELTA) {
+			    l->tx += reader_readFloat(r);
+			    if(!(flags&FLAG_SAME_Y))
+				l->ty += reader_readFloat(r);
+			} else if(flags&FLAG_SAME_Y) {
+			    l->tx = reader_readDouble(r);
+			} else {
+			    readXY(r, state, l);
+			}
+		    } else {
+			state->last_font = (flags&FLAG_ZERO_FONT)?-1:read_compressed_uint(r);
+			state->last_color[OP_DRAWCHAR] = readColor(r, state);
+			*l = readMatrix(r, state);
+		    }
+		    int nr = state->last_font;
+		    gfxfont_t*font = 0;
+		    if(nr>=0 && nr<state->fonts_size)
+			font = state->fonts[nr];
+		    if(!font && nr>=0 && i && nr<i->num_fonts) {
+			/* fonts which were already flushed. The font the caller
+			   passed to drawchar() may be gone by now, so use the copy
+			   the output device got. */
+			font = gfxfontlist_findfont(*fontlist, i->font_ids[nr]);
+		    }
+		    gfxcolor_t color = state->last_color[OP_DRAWCHAR];
+		    gfxmatrix_t matrix = *l;
+		    msg("<trace> replay: DRAWCHAR font=%d glyph=%d (flags=%d)", nr, glyph, flags);
+		    out->drawchar(out, font, glyph, &color, &matrix);
+		    break;
+		}
+		/* version 1 */
 		U32 glyph = reader_readU32(r);
 		gfxmatrix_t m = {1,0,0, 0,1,0};
 		char* id = 0;
 		if(!(flags&FLAG_ZERO_FONT))
-		    id = read_string(r, &state, op, flags);
-		gfxcolor_t color = read_color(r, &state, op, flags);
-		gfxmatrix_t matrix = read_matrix(r, &state, op, flags);
+		    id = read_string(r, state, op, flags);
+		gfxcolor_t color = read_color(r, state, op, flags);
+		gfxmatrix_t matrix = read_matrix(r, state, op, flags);
 
 		gfxfont_t*font = id?gfxfontlist_findfont(*fontlist, id):0;
-		if(i && !font) {
-		    font = gfxfontlist_findfont(i->fontlist, id);
-		}
 		msg("<trace> replay: DRAWCHAR font=%s glyph=%d (flags=%d)", id, glyph, flags);
 		out->drawchar(out, font, glyph, &color, &matrix);
 		if(id)
@@ -817,23 +1321,70 @@ static void replay(struct _gfxdevice*dev, gfxdevice_t*out, reader_t*r, gfxfontli
 	}
     }
 finish:
-    state_clear(&state);
-    r->dealloc(r);
     if(_fontlist)
 	gfxfontlist_free(_fontlist, 0);
+    return ret;
 }
 void gfxresult_record_replay(gfxresult_t*result, gfxdevice_t*device, gfxfontlist_t**fontlist)
 {
     internal_result_t*i = (internal_result_t*)result->internal;
     
+    state_t state;
     reader_t r;
-    if(i->use_tempfile) {
-	reader_init_filereader2(&r, i->filename);
-    } else {
-	reader_init_memreader(&r, i->data, i->length);
+    memfile_t*file = replay_open(i, &state, &r);
+    replay(0, device, &state, &r, fontlist, 0);
+    replay_close(file, &state, &r);
+}
+
+int gfxresult_record_num_pages(gfxresult_t*result)
+{
+    internal_result_t*i = (internal_result_t*)result->internal;
+    return i->index.num_pages;
+}
+
+/* replays page <pagenr> (starting at 1), together with all fonts defined
+   before it. Every call uses its own reader, so different pages of the same
+   recording can be replayed by different threads at the same time. */
+void gfxresult_record_replay_page(gfxresult_t*result, int pagenr, gfxdevice_t*device, gfxfontlist_t**fontlist)
+{
+    internal_result_t*i = (internal_result_t*)result->internal;
+    if(pagenr<1 || pagenr>i->index.num_pages) {
+	msg("<error> record: page %d doesn't exist (%d pages)", pagenr, i->index.num_pages);
+	return;
     }
+    U32 offset = i->index.pages[pagenr-1];
 
-    replay(0, device, &r, fontlist);
+    gfxfontlist_t*_fontlist=0;
+    if(!fontlist) {
+	fontlist = &_fontlist;
+    }
+
+    state_t state;
+    reader_t r;
+    memfile_t*file = replay_open(i, &state, &r);
+    if(reader_readU8(&r) == OP_HEADER)
+	readHeader(&r, &state);
+    int t;
+    for(t=0;t<i->index.num_fonts && i->index.fonts[t]<offset;t++) {
+	r.seek(&r, i->index.fonts[t]);
+	if(reader_readU8(&r) != OP_ADDFONT) {
+	    msg("<error> record: bad font table entry %d", t);
+	    continue;
+	}
+	gfxfont_t*known = gfxfontlist_findfont(*fontlist, i->index.font_ids[t]);
+	if(!known) {
+	    replay_font(device, &r, &state, fontlist);
+	} else if(state.version >= 2) {
+	    state_setfont(&state, read_compressed_uint(&r), known);
+	}
+    }
+
+    r.seek(&r, offset);
+    replay(0, device, &state, &r, fontlist, 1);
+    replay_close(file, &state, &r);
+
+    if(_fontlist)
+	gfxfontlist_free(_fontlist, 0);
 }
 
 static void record_result_write(gfxresult_t*r, int filedesc)
@@ -846,8 +1397,21 @@ static void record_result_write(gfxresult_t*r, int filedesc)
 static int record_result_save(gfxresult_t*r, const char*filename)
 {
     internal_result_t*i = (internal_result_t*)r->internal;
-    if(i->use_tempfile) {
-	move_file(i->filename, filename);
+    if(i->use_tempfile && i->is_input) {
+	/* never move a file we didn't create */
+	if(copy_file(i->filename, filename)<0) {
+	    msg("<error> Couldn't copy %s to %s", i->filename, filename);
+	    return -1;
+	}
+    } else if(i->use_tempfile) {
+	if(move_file(i->filename, filename)<0) {
+	    msg("<error> Couldn't move %s to %s", i->filename, filename);
+	    return -1;
+	}
+	/* keep the result replayable from its new location */
+	free(i->filename);
+	i->filename = strdup(filename);
+	i->keep_file = 1;
     } else {
 	FILE*fi = fopen(filename, "wb");
 	if(!fi) {
@@ -876,9 +1440,11 @@ static void record_result_destroy(gfxresult_t*r)
 	free(i->data);i->data = 0;
     }
     if(i->filename) {
-	unlink(i->filename);
+	if(!i->keep_file)
+	    unlink(i->filename);
 	free(i->filename);
     }
+    index_clear(&i->index);
     free(r->internal);r->internal = 0;
     free(r);
 }
@@ -908,20 +1474,30 @@ static void hexdumpMem(unsigned char*data, int len)
     }
 }
 
+static void replay_writer(gfxdevice_t*dev, gfxdevice_t*out, state_t*state, writer_t*w, gfxfontlist_t**fontlist)
+{
+    int len=0;
+    void*data = writer_growmemwrite_memptr(w, &len);
+    state->data = (unsigned char*)data;
+    state->length = len;
+    state->data_is_private = 0;
+    reader_t r;
+    reader_init_memreader(&r, data, len);
+    replay(dev, out, state, &r, fontlist, 0);
+    r.dealloc(&r);
+}
+
 void gfxdevice_record_show(gfxdevice_t*dev)
 {
     internal_t*i = (internal_t*)dev->internal;
-    writer_t w;
-
-    int len;
-    void*data = writer_growmemwrite_memptr(&i->w, &len);
 
     gfxdevice_t out;
     gfxdevice_dummy_init(&out, NULL);
 
-    reader_t r;
-    reader_init_memreader(&r, data, len);
-    replay(dev, &out, &r, NULL);
+    state_t state;
+    memset(&state, 0, sizeof(state));
+    replay_writer(dev, &out, &state, &i->w, NULL);
+    state_free(&state);
 }
 
 void gfxdevice_record_flush(gfxdevice_t*dev, gfxdevice_t*out, gfxfontlist_t**fontlist)
@@ -929,12 +1505,20 @@ void gfxdevice_record_flush(gfxdevice_t*dev, gfxdevice_t*out, gfxfontlist_t**fon
     internal_t*i = (internal_t*)dev->internal;
     if(out) {
 	if(!i->use_tempfile) {
-	    int len=0;
-	    void*data = writer_growmemwrite_memptr(&i->w, &len);
-	    reader_t r;
-	    reader_init_memreader(&r, data, len);
-	    replay(dev, out, &r, fontlist);
+	    state_t state;
+	    memset(&state, 0, sizeof(state));
+	    replay_writer(dev, out, &state, &i->w, fontlist);
 	    writer_growmemwrite_reset(&i->w);
+	    if(i->compress && i->in_page) {
+		/* the part of the current page which wasn't compressed yet */
+		replay_writer(dev, out, &state, &i->page, fontlist);
+		writer_growmemwrite_reset(&i->page);
+	    }
+	    state_free(&state);
+	    index_clear(&i->index);
+	    /* the next flush starts with a fresh glyph cache */
+	    state_clear(&i->state);
+	    dumpHeader(&i->w);
 	} else {
 	    msg("<fatal> Flushing not supported for file based record device");
 	    exit(1);
@@ -951,6 +1535,7 @@ static gfxresult_t* record_finish(struct _gfxdevice*dev)
 	msg("<error> Warning: unclosed cliplevels");
     }
 
+    flush_page(i);
     state_clear(&i->state);
 
 #ifdef STATS
@@ -970,12 +1555,22 @@ static gfxresult_t* record_finish(struct _gfxdevice*dev)
 #endif
     
     writer_writeU8(&i->w, OP_END);
+    dumpIndex(&i->w, &i->index);
     
-    gfxfontlist_free(i->fontlist, 0);
+    int t;
+    for(t=0;t<i->num_fonts;t++)
+	free(i->font_ids[t]);
+    if(i->font_ids)
+	free(i->font_ids);
+    if(i->fonts)
+	free(i->fonts);
+    if(i->compress)
+	i->page.finish(&i->page);
    
-    internal_result_t*ir = (internal_result_t*)rfx_calloc(sizeof(gfxresult_t));
+    internal_result_t*ir = (internal_result_t*)rfx_calloc(sizeof(internal_result_t));
    
     ir->use_tempfile = i->use_tempfile;
+    ir->index = i->index;
     if(i->use_tempfile) {
 	ir->filename = i->filename;
     } else {
@@ -995,6 +1590,34 @@ static gfxresult_t* record_finish(struct _gfxdevice*dev)
     return result;
 }
 
+gfxresult_t* gfxresult_record_load(const char*filename)
+{
+    reader_t r;
+    if(reader_init_filereader2(&r, filename)<0) {
+	msg("<error> Couldn't open file %s", filename);
+	return 0;
+    }
+    int length = file_size(filename);
+
+    internal_result_t*ir = (internal_result_t*)rfx_calloc(sizeof(internal_result_t));
+    if(!readIndex(&r, length, &ir->index)) {
+	msg("<warning> record: %s has no page index", filename);
+    }
+    r.dealloc(&r);
+
+    ir->use_tempfile = 1;
+    ir->keep_file = 1;
+    ir->is_input = 1;
+    ir->filename = strdup(filename);
+
+    gfxresult_t*result= (gfxresult_t*)rfx_calloc(sizeof(gfxresult_t));
+    result->save = record_result_save;
+    result->get = record_result_get;
+    result->destroy = record_result_destroy;
+    result->internal = ir;
+    return result;
+}
+
 void gfxdevice_record_init(gfxdevice_t*dev, char use_tempfile)
 {
     internal_t*i = (internal_t*)rfx_calloc(sizeof(internal_t));
@@ -1012,7 +1635,7 @@ void gfxdevice_record_init(gfxdevice_t*dev, char use_tempfile)
 	i->filename = strdup(mktempname(buffer, "gfx"));
 	writer_init_filewriter2(&i->w, i->filename);
     }
-    i->fontlist = gfxfontlist_create();
+    dumpHeader(&i->w);
     i->cliplevel = 0;
 
     dev->setparameter = record_setparameter;
@@ -1030,3 +1653,17 @@ void gfxdevice_record_init(gfxdevice_t*dev, char use_tempfile)
     dev->finish = record_finish;
 }
 
+void gfxdevice_record_set_compression(gfxdevice_t*dev, char compress)
+{
+    internal_t*i = (internal_t*)dev->internal;
+    if(i->in_page) {
+	msg("<error> record: compression can't be changed inside a page");
+	return;
+    }
+    if(compress && !i->compress) {
+	writer_init_growingmemwriter(&i->page, 1048576);
+    } else if(!compress && i->compress) {
+	i->page.finish(&i->page);
+    }
+    i->compress = compress;
+}
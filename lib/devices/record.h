@@ -36,8 +36,17 @@ gfxdevice_t* gfxdevice_record_new(char*filename);
 
 void gfxdevice_record_flush(gfxdevice_t*, gfxdevice_t*, gfxfontlist_t**);
 
+/* store every page as a compressed frame */
+void gfxdevice_record_set_compression(gfxdevice_t*, char compress);
+
 void gfxresult_record_replay(gfxresult_t*, gfxdevice_t*, gfxfontlist_t**);
 
+/* random access to the pages of a recording, via its page index */
+int gfxresult_record_num_pages(gfxresult_t*);
+void gfxresult_record_replay_page(gfxresult_t*, int pagenr, gfxdevice_t*, gfxfontlist_t**);
+
+gfxresult_t* gfxresult_record_load(const char*filename);
+
 void gfxdevice_record_show(gfxdevice_t*dev);
 
 #ifdef __cplusplus
@@ -22,8 +22,20 @@
 #include <stdio.h>
 #include <math.h>
 #include <memory.h>
+#include "../../config.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+#include <pthread.h>
+#define USE_THREADS
+#endif
 #include "../gfxdevice.h"
 #include "../gfxtools.h"
+#include "../gfximage.h"
 #include "../mem.h"
 #include "../types.h"
 #include "../png.h"
@@ -44,17 +56,39 @@ typedef struct _renderline
     int num;
 } renderline_t;
 
+struct _internal;
+
 typedef struct _internal_result {
     gfximage_t img;
+    /* in streaming mode, the page's display list. img is only
+       filled in if somebody asks for the whole image. */
+    struct _internal*page;
     struct _internal_result*next;
     char palette;
 } internal_result_t;
 
 typedef struct _clipbuffer {
     U32*data;
+    unsigned char*coverage; // instead of data, for the coverage rasterizer
     struct _clipbuffer*next;
 } clipbuffer_t;
 
+typedef enum {renderop_fill,renderop_stroke,renderop_startclip,renderop_endclip,renderop_fillbitmap,renderop_fillgradient} renderop_type_t;
+
+/* a drawing operation, as stored in the display list in threaded mode */
+typedef struct _renderop {
+    renderop_type_t type;
+    gfxline_t*line;
+    gfxcolor_t color;
+    double width;
+    gfximage_t*image;
+    gfxmatrix_t matrix;
+    RGBA*gradient;
+    char linear_or_radial;
+    double ymin, ymax; // vertical extent of line
+    struct _renderop*next;
+} renderop_t;
+
 typedef struct _internal {
     int width;
     int height;
@@ -64,21 +98,52 @@ typedef struct _internal {
     int multiply;
     int antialize;
     int zoom;
+    int supersample; // antialize, unless we use the coverage rasterizer
+    char coverage;
     int ymin, ymax;
     int fillwhite;
 
     char palette;
 
+    /* the (supersampled) rows band_y0 to band_y1 of the page which img,
+       lines and clipbuf hold. Unless we render in bands, that's the whole page. */
+    int band_y0, band_y1;
+
     RGBA* img;
 
     clipbuffer_t*clipbuf;
 
     renderline_t*lines;
 
+    /* accumulation buffer of the coverage rasterizer, and the range
+       of cells which were touched in each row */
+    float*cells;
+    int*cells_x0;
+    int*cells_x1;
+    unsigned char*covline;
+
+    /* scratch space for sort_renderpoints() */
+    U32*sortbuf;
+    int sortbuf_size;
+
+    /* with threads>1, drawing operations are collected in a display list
+       and rasterized band by band in render_endpage(). In streaming mode,
+       that only happens when the page is saved, and only a few bands are
+       in memory at any time. */
+    int threads;
+    char streaming;
+    char record; // threads>1 || streaming
+    int clipdepth;
+    renderop_t*ops;
+    renderop_t*ops_last;
+
     internal_result_t*results;
     internal_result_t*result_next;
 } internal_t;
 
+/* number of (output) rows in a band */
+#define BAND_HEIGHT 32
+
 typedef enum {filltype_solid,filltype_clip,filltype_bitmap,filltype_gradient} filltype_t;
 
 typedef struct _fillinfo {
@@ -96,12 +161,12 @@ static inline void add_pixel(internal_t*i, float x, int y)
 {
     renderpoint_t p;
 
-    if(x >= i->width2 || y >= i->height2 || y<0) return;
+    if(x >= i->width2 || y >= i->band_y1 || y<i->band_y0) return;
     p.x = x;
     if(y<i->ymin) i->ymin = y;
     if(y>i->ymax) i->ymax = y;
 
-    renderline_t*l = &i->lines[y];
+    renderline_t*l = &i->lines[y - i->band_y0];
 
     if(l->num == l->size) {
 	l->size += 32;
@@ -117,11 +182,115 @@ static inline void add_pixel(internal_t*i, float x, int y)
 
 #define INT(x) ((int)((x)+16)-16)
 
-static void add_line(gfxdevice_t*dev , double x1, double y1, double x2, double y2)
+/* coverage rasterizer: instead of collecting crossings on a supersampled
+   grid, every edge adds the exact area it covers to an accumulation buffer
+   of cells (one per pixel, plus two). A running sum over a row of cells
+   then gives the (signed) coverage of each pixel. */
+static void add_coverage_segment(internal_t*i, double x0, double y0, double x1, double y1)
+{
+    double w = i->width2;
+
+    /* split the segment at the left and right border. What's left of
+       the page only matters in that it covers everything to the right
+       of it, so we move it to x=0. */
+    if((x0<0 && x1>0) || (x0>0 && x1<0)) {
+	double ys = y0 + (0-x0)*(y1-y0)/(x1-x0);
+	add_coverage_segment(i, x0, y0, 0, ys);
+	add_coverage_segment(i, 0, ys, x1, y1);
+	return;
+    }
+    if((x0<w && x1>w) || (x0>w && x1<w)) {
+	double ys = y0 + (w-x0)*(y1-y0)/(x1-x0);
+	add_coverage_segment(i, x0, y0, w, ys);
+	add_coverage_segment(i, w, ys, x1, y1);
+	return;
+    }
+    if(x0<0) x0=0;
+    if(x1<0) x1=0;
+    if(x0>w) x0=w;
+    if(x1>w) x1=w;
+
+    double dir = 1.0;
+    if(y0 == y1)
+	return;
+    if(y0 > y1) {
+	double t;
+	t = x0;x0 = x1;x1 = t;
+	t = y0;y0 = y1;y1 = t;
+	dir = -1.0;
+    }
+    double dxdy = (x1-x0)/(y1-y0);
+
+    int y = (int)floor(y0);
+    int yend = (int)ceil(y1);
+    if(y < i->band_y0) y = i->band_y0;
+    if(yend > i->band_y1) yend = i->band_y1;
+    if(y >= yend)
+	return;
+    if(y < i->ymin) i->ymin = y;
+    if(yend-1 > i->ymax) i->ymax = yend-1;
+
+    int rowsize = i->width2+2;
+    for(;y<yend;y++) {
+	int row = y - i->band_y0;
+	float*a = &i->cells[row*rowsize];
+	double ya = y>y0?y:y0;
+	double yb = y+1<y1?y+1:y1;
+	double dy = yb - ya;
+	if(dy<=0)
+	    continue;
+	double xa = x0 + (ya-y0)*dxdy;
+	double xb = x0 + (yb-y0)*dxdy;
+	/* guard against rounding errors */
+	if(xa<0) xa=0; else if(xa>w) xa=w;
+	if(xb<0) xb=0; else if(xb>w) xb=w;
+	double d = dy*dir;
+	double l = xa<xb?xa:xb;
+	double r = xa<xb?xb:xa;
+	double lfloor = floor(l);
+	double rceil = ceil(r);
+	int li = (int)lfloor;
+	int ri = (int)rceil;
+	if(ri <= li+1) {
+	    /* the edge stays inside one pixel */
+	    double xm = 0.5*(xa+xb) - lfloor;
+	    a[li] += d - d*xm;
+	    a[li+1] += d*xm;
+	    if(ri < li+1) ri = li+1;
+	} else {
+	    double s = 1.0/(r-l);
+	    double lf = l - lfloor;
+	    double a0 = 0.5*s*(1-lf)*(1-lf);
+	    double rf = r - rceil + 1;
+	    double am = 0.5*s*rf*rf;
+	    a[li] += d*a0;
+	    if(ri == li+2) {
+		a[li+1] += d*(1-a0-am);
+	    } else {
+		double a1 = s*(1.5-lf);
+		int x;
+		a[li+1] += d*(a1-a0);
+		for(x=li+2;x<ri-1;x++) {
+		    a[x] += d*s;
+		}
+		double a2 = a1 + (ri-li-3)*s;
+		a[ri-1] += d*(1-a2-am);
+	    }
+	    a[ri] += d*am;
+	}
+	if(li < i->cells_x0[row]) i->cells_x0[row] = li;
+	if(ri > i->cells_x1[row]) i->cells_x1[row] = ri;
+    }
+}
+
+static void add_line(internal_t*i, double x1, double y1, double x2, double y2)
 {
-    internal_t*i = (internal_t*)dev->internal;
     double diffx, diffy;
     double ny1, ny2, stepx;
+    if(i->coverage) {
+	add_coverage_segment(i, x1, y1, x2, y2);
+	return;
+    }
 /*    if(DEBUG&4) {
         int l = sqrt((x2-x1)*(x2-x1) + (y2-y1)*(y2-y1));
         printf(" l[%d - %.2f/%.2f -> %.2f/%.2f]\n", l, x1/20.0, y1/20.0, x2/20.0, y2/20.0);
@@ -160,6 +329,8 @@ static void add_line(gfxdevice_t*dev , double x1, double y1, double x2, double y
 	double posx=0;
 	double startx = x1;
 
+	if(endy >= i->band_y1)
+	    endy = i->band_y1-1;
 	while(posy<=endy) {
 	    float xx = (float)(startx + posx);
 	    add_pixel(i, xx ,posy);
@@ -169,12 +340,10 @@ static void add_line(gfxdevice_t*dev , double x1, double y1, double x2, double y
     }
 }
 #define PI 3.14159265358979
-static void add_solidline(gfxdevice_t*dev, double x1, double y1, double x2, double y2, double width)
+static void add_solidline(internal_t*i, double x1, double y1, double x2, double y2, double width)
 {
     /* TODO: handle cap styles */
 
-    internal_t*i = (internal_t*)dev->internal;
-
     double dx = x2-x1;
     double dy = y2-y1;
     double sd;
@@ -221,7 +390,7 @@ static void add_solidline(gfxdevice_t*dev, double x1, double y1, double x2, doub
 
     xx = x2+vx;
     yy = y2+vy;
-    add_line(dev, x1+vx, y1+vy, xx, yy);
+    add_line(i, x1+vx, y1+vy, xx, yy);
     lastx = xx;
     lasty = yy;
     for(t=1;t<segments;t++) {
@@ -229,19 +398,19 @@ static void add_solidline(gfxdevice_t*dev, double x1, double y1, double x2, doub
         double c = cos(t*PI/segments);
         xx = (x2 + vx*c - vy*s);
         yy = (y2 + vx*s + vy*c);
-        add_line(dev, lastx, lasty, xx, yy);
+        add_line(i, lastx, lasty, xx, yy);
         lastx = xx;
         lasty = yy;
     }
     
     xx = (x2-vx);
     yy = (y2-vy);
-    add_line(dev, lastx, lasty, xx, yy);
+    add_line(i, lastx, lasty, xx, yy);
     lastx = xx;
     lasty = yy;
     xx = (x1-vx);
     yy = (y1-vy);
-    add_line(dev, lastx, lasty, xx, yy);
+    add_line(i, lastx, lasty, xx, yy);
     lastx = xx;
     lasty = yy;
     for(t=1;t<segments;t++) {
@@ -249,57 +418,192 @@ static void add_solidline(gfxdevice_t*dev, double x1, double y1, double x2, doub
         double c = cos(t*PI/segments);
         xx = (x1 - vx*c + vy*s);
         yy = (y1 - vx*s - vy*c);
-        add_line(dev, lastx, lasty, xx, yy);
+        add_line(i, lastx, lasty, xx, yy);
         lastx = xx;
         lasty = yy;
     }
-    add_line(dev, lastx, lasty, (x1+vx), (y1+vy));
+    add_line(i, lastx, lasty, (x1+vx), (y1+vy));
 }
 
-static int compare_renderpoints(const void * _a, const void * _b)
+/* Most scanlines only have a handful of crossings (two for a glyph stem),
+   so we insertion sort those. Long scanlines (e.g. a page full of text in
+   a single fill) are radix sorted, using the bit pattern of the floats. */
+#define INSERTION_SORT_MAX 24
+
+static inline U32 float_to_key(float f)
 {
-    renderpoint_t*a = (renderpoint_t*)_a;
-    renderpoint_t*b = (renderpoint_t*)_b;
-    if(a->x < b->x) return -1;
-    if(a->x > b->x) return 1;
-    return 0;
+    U32 u;
+    memcpy(&u, &f, sizeof(u));
+    return (u&0x80000000)?~u:(u|0x80000000);
+}
+static inline float key_to_float(U32 k)
+{
+    U32 u = (k&0x80000000)?(k&0x7fffffff):~k;
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+static void sort_renderpoints(internal_t*i, renderpoint_t*points, int num)
+{
+    int t;
+    if(num <= INSERTION_SORT_MAX) {
+	for(t=1;t<num;t++) {
+	    renderpoint_t p = points[t];
+	    int s = t;
+	    while(s>0 && points[s-1].x > p.x) {
+		points[s] = points[s-1];
+		s--;
+	    }
+	    points[s] = p;
+	}
+	return;
+    }
+
+    if(i->sortbuf_size < num*2) {
+	i->sortbuf_size = num*2;
+	i->sortbuf = (U32*)rfx_realloc(i->sortbuf, sizeof(U32)*i->sortbuf_size);
+    }
+    U32*keys = i->sortbuf;
+    U32*tmp = &i->sortbuf[num];
+    for(t=0;t<num;t++) {
+	keys[t] = float_to_key(points[t].x);
+    }
+    int shift;
+    for(shift=0;shift<32;shift+=8) {
+	int count[256];
+	memset(count, 0, sizeof(count));
+	for(t=0;t<num;t++) {
+	    count[(keys[t]>>shift)&255]++;
+	}
+	if(count[(keys[0]>>shift)&255] == num) {
+	    /* all keys have the same digit, nothing to do */
+	    continue;
+	}
+	int pos = 0;
+	for(t=0;t<256;t++) {
+	    int c = count[t];
+	    count[t] = pos;
+	    pos += c;
+	}
+	for(t=0;t<num;t++) {
+	    U32 k = keys[t];
+	    tmp[count[(k>>shift)&255]++] = k;
+	}
+	U32*swap = keys;keys = tmp;tmp = swap;
+    }
+    for(t=0;t<num;t++) {
+	points[t].x = key_to_float(keys[t]);
+    }
+}
+
+/* span kernels. These process runs of pixels that are entirely inside
+   the clip area. col is premultiplied. */
+static void solid_span(RGBA*line, int n, RGBA col)
+{
+    int x = 0;
+#ifdef __SSE2__
+    U32 c;
+    memcpy(&c, &col, sizeof(c));
+    __m128i v = _mm_set1_epi32(c);
+    for(;x+4<=n;x+=4) {
+	_mm_storeu_si128((__m128i*)&line[x], v);
+    }
+#endif
+    for(;x<n;x++) {
+	line[x] = col;
+    }
+}
+
+static inline void blend_pixel(RGBA*p, RGBA col, int ainv)
+{
+    p->r = ((p->r*ainv)/255)+col.r;
+    p->g = ((p->g*ainv)/255)+col.g;
+    p->b = ((p->b*ainv)/255)+col.b;
+    p->a = ((p->a*ainv)/255)+col.a;
+}
+
+static void blend_span(RGBA*line, int n, RGBA col)
+{
+    int ainv = 255-col.a;
+    int x = 0;
+#ifdef __SSE2__
+    U32 c;
+    memcpy(&c, &col, sizeof(c));
+    __m128i vcol = _mm_set1_epi32(c);
+    __m128i vainv = _mm_set1_epi16(ainv);
+    __m128i one = _mm_set1_epi16(1);
+    __m128i zero = _mm_setzero_si128();
+    for(;x+4<=n;x+=4) {
+	__m128i p = _mm_loadu_si128((__m128i*)&line[x]);
+	__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(p, zero), vainv);
+	__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(p, zero), vainv);
+	/* (v+1+(v>>8))>>8 == v/255 for 0<=v<=255*255 */
+	lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(lo, one), _mm_srli_epi16(lo, 8)), 8);
+	hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(hi, one), _mm_srli_epi16(hi, 8)), 8);
+	/* can't overflow: v*ainv/255 + c*a/255 <= 255 */
+	_mm_storeu_si128((__m128i*)&line[x], _mm_add_epi8(_mm_packus_epi16(lo, hi), vcol));
+    }
+#endif
+    for(;x<n;x++) {
+	blend_pixel(&line[x], col, ainv);
+    }
+}
+
+static void and_line(U32*z, U32*z2, int n)
+{
+    int x = 0;
+#ifdef __SSE2__
+    for(;x+4<=n;x+=4) {
+	__m128i a = _mm_loadu_si128((__m128i*)&z[x]);
+	__m128i b = _mm_loadu_si128((__m128i*)&z2[x]);
+	_mm_storeu_si128((__m128i*)&z[x], _mm_and_si128(a, b));
+    }
+#endif
+    for(;x<n;x++) {
+	z[x] &= z2[x];
+    }
 }
 
 static void fill_line_solid(RGBA*line, U32*z, int y, int x1, int x2, RGBA col)
 {
     int x = x1;
+    int ainv = 255-col.a;
 
-    U32 bit = 1<<(x1&31);
-    int bitpos = (x1/32);
+    /* we always fill at least one pixel */
+    if(x2 <= x1)
+	x2 = x1+1;
 
     if(col.a!=255) {
-        int ainv = 255-col.a;
         col.r = (col.r*col.a)/255;
         col.g = (col.g*col.a)/255;
         col.b = (col.b*col.a)/255;
-        do {
-	    if(z[bitpos]&bit) {
-		line[x].r = ((line[x].r*ainv)/255)+col.r;
-		line[x].g = ((line[x].g*ainv)/255)+col.g;
-		line[x].b = ((line[x].b*ainv)/255)+col.b;
-		//line[x].a = 255;
-		line[x].a = ((line[x].a*ainv)/255)+col.a;
-	    }
-	    bit <<= 1;
-	    if(!bit) {
-		bit = 1;bitpos++;
-	    }
-        } while(++x<x2);
-    } else {
-        do {
-	    if(z[bitpos]&bit) {
-		line[x] = col;
-	    }
-	    bit <<= 1;
-	    if(!bit) {
-		bit = 1;bitpos++;
+    }
+
+    /* walk the clip mask one 32 bit word at a time */
+    while(x<x2) {
+	U32 bits = z[x>>5];
+	int end = (x|31)+1;
+	if(end > x2)
+	    end = x2;
+	if(bits == 0xffffffff) {
+	    if(col.a!=255)
+		blend_span(&line[x], end-x, col);
+	    else
+		solid_span(&line[x], end-x, col);
+	} else if(bits) {
+	    U32 bit = 1<<(x&31);
+	    for(;x<end;x++) {
+		if(bits&bit) {
+		    if(col.a!=255)
+			blend_pixel(&line[x], col, ainv);
+		    else
+			line[x] = col;
+		}
+		bit <<= 1;
 	    }
-        } while(++x<x2);
+	}
+	x = end;
     }
 }
 
@@ -425,19 +729,20 @@ static void fill_line_clip(RGBA*line, U32*z, int y, int x1, int x2)
 {
     int x = x1;
 
-    U32 bit = 1<<(x1&31);
-    int bitpos = (x1/32);
+    if(x2 <= x1)
+	x2 = x1+1;
 
-    do {
-	z[bitpos]|=bit;
-	bit <<= 1;
-	if(!bit) {
-	    bit = 1;bitpos++;
-	}
-    } while(++x<x2);
+    while(x<x2) {
+	int end = (x|31)+1;
+	if(end > x2)
+	    end = x2;
+	int n = end-x;
+	z[x>>5] |= n==32 ? 0xffffffff : ((1u<<n)-1) << (x&31);
+	x = end;
+    }
 }
 
-void fill_line(gfxdevice_t*dev, RGBA*line, U32*zline, int y, int startx, int endx, fillinfo_t*fill)
+static void fill_line(RGBA*line, U32*zline, int y, int startx, int endx, fillinfo_t*fill)
 {
     if(fill->type == filltype_solid)
 	fill_line_solid(line, zline, y, startx, endx, *fill->color);
@@ -449,20 +754,187 @@ void fill_line(gfxdevice_t*dev, RGBA*line, U32*zline, int y, int startx, int end
 	fill_line_gradient(line, zline, y, startx, endx, fill);
 }
 
-void fill(gfxdevice_t*dev, fillinfo_t*fill)
+/* turns an accumulated (signed) coverage into an alpha value, using the
+   even/odd rule, like the scanline rasterizer */
+static inline int coverage_to_alpha(float c)
+{
+    if(c<0) c=-c;
+    if(c>1) {
+	c = fmodf(c, 2);
+	if(c>1) c = 2-c;
+    }
+    return (int)(c*255+0.5);
+}
+
+static void fill_line_coverage(RGBA*line, unsigned char*cov, int y, int x1, int x2, fillinfo_t*info)
+{
+    int x;
+    RGBA col;
+    double xx1=0,yy1=0,xinc1=0,yinc1=0;
+
+    if(info->type == filltype_solid) {
+	col = *info->color;
+	col.r = (col.r*col.a)/255;
+	col.g = (col.g*col.a)/255;
+	col.b = (col.b*col.a)/255;
+    } else {
+	gfxmatrix_t*m = info->matrix;
+	gfximage_t*b = info->image;
+	if(info->type == filltype_bitmap && (!b || !b->width || !b->height)) {
+	    gfxcolor_t red = {255,255,0,0};
+	    fillinfo_t info2;
+	    memset(&info2, 0, sizeof(info2));
+	    info2.type = filltype_solid;
+	    info2.color = &red;
+	    fill_line_coverage(line, cov, y, x1, x2, &info2);
+	    return;
+	}
+	double det = m->m00*m->m11 - m->m01*m->m10;
+	if(fabs(det) < 0.0005) {
+	    /* x direction equals y direction */
+	    return;
+	}
+	det = 1.0/det;
+	xx1 =  (  (-m->tx) * m->m11 - (y - m->ty) * m->m10) * det;
+	yy1 =  (- (-m->tx) * m->m01 + (y - m->ty) * m->m00) * det;
+	xinc1 = m->m11 * det;
+	yinc1 = m->m01 * det;
+    }
+
+    for(x=x1;x<x2;x++) {
+	int a = cov[x];
+	if(!a)
+	    continue;
+	RGBA c;
+	if(info->type == filltype_solid) {
+	    if(a==255 && col.a==255) {
+		line[x] = col;
+		continue;
+	    }
+	    c = col;
+	} else if(info->type == filltype_bitmap) {
+	    gfximage_t*b = info->image;
+	    int xx = (int)(xx1 + x * xinc1);
+	    int yy = (int)(yy1 - x * yinc1);
+	    if(info->linear_or_radial) {
+		if(xx<0) xx=0;
+		if(xx>=b->width) xx = b->width-1;
+		if(yy<0) yy=0;
+		if(yy>=b->height) yy = b->height-1;
+	    } else {
+		xx %= b->width;
+		yy %= b->height;
+		if(xx<0) xx += b->width;
+		if(yy<0) yy += b->height;
+	    }
+	    /* needs bitmap with premultiplied alpha */
+	    c = b->data[yy*b->width+xx];
+	} else {
+            int pos = 0;
+            if(info->linear_or_radial) {
+                double xx = xx1 + x * xinc1;
+                double yy = yy1 + y * yinc1;
+                double r = sqrt(xx*xx + yy*yy);
+                if(r>1) r = 1;
+                pos = (int)(r*255.999);
+            } else {
+                double r = xx1 + x * xinc1;
+                if(r>1) r = 1;
+                if(r<-1) r = -1;
+                pos = (int)((r+1)*127.999);
+            }
+	    c = info->gradient[pos];
+	}
+	if(a!=255) {
+	    c.r = (c.r*a)/255;
+	    c.g = (c.g*a)/255;
+	    c.b = (c.b*a)/255;
+	    c.a = (c.a*a)/255;
+	}
+	if(info->type == filltype_solid) {
+	    blend_pixel(&line[x], c, 255-c.a);
+	} else {
+	    /* not all sources deliver premultiplied images, so saturate */
+	    int ainv = 255-c.a;
+	    int r = ((line[x].r*ainv)/255)+c.r;
+	    int g = ((line[x].g*ainv)/255)+c.g;
+	    int b = ((line[x].b*ainv)/255)+c.b;
+	    line[x].r = r>255?255:r;
+	    line[x].g = g>255?255:g;
+	    line[x].b = b>255?255:b;
+	    line[x].a = ((line[x].a*ainv)/255)+c.a;
+	}
+    }
+}
+
+static void fill_coverage(internal_t*i, fillinfo_t*fill)
+{
+    int y;
+    int rowsize = i->width2+2;
+    unsigned char*cov = i->covline;
+    for(y=i->ymin;y<=i->ymax;y++) {
+	int row = y - i->band_y0;
+	int x0 = i->cells_x0[row];
+	int x1 = i->cells_x1[row];
+	if(x1 < x0)
+	    continue;
+	float*a = &i->cells[row*rowsize];
+	unsigned char*clip = &i->clipbuf->coverage[i->width2*row];
+	RGBA*line = &i->img[i->width2*row];
+	float acc = 0;
+	int x;
+	for(x=x0;x<=x1;x++) {
+	    acc += a[x];
+	    a[x] = 0;
+	    if(x < i->width2)
+		cov[x] = coverage_to_alpha(acc);
+	}
+	i->cells_x0[row] = 0x7fffffff;
+	i->cells_x1[row] = -1;
+	int end = x1+1<i->width2?x1+1:i->width2;
+	/* an unclosed outline extends to the right border */
+	int rest = coverage_to_alpha(acc);
+	if(rest) {
+	    for(;end<i->width2;end++)
+		cov[end] = rest;
+	}
+
+	if(fill->type == filltype_clip) {
+	    if(i->clipbuf->next) {
+		unsigned char*parent = &i->clipbuf->next->coverage[i->width2*row];
+		for(x=x0;x<end;x++)
+		    clip[x] = (cov[x]*parent[x])/255;
+	    } else {
+		memcpy(&clip[x0], &cov[x0], end-x0);
+	    }
+	} else {
+	    for(x=x0;x<end;x++)
+		cov[x] = (cov[x]*clip[x])/255;
+	    fill_line_coverage(line, cov, y, x0, end, fill);
+	}
+    }
+    i->ymin = 0x7fffffff;
+    i->ymax = -0x80000000;
+}
+
+static void fill(internal_t*i, fillinfo_t*fill)
 {
-    internal_t*i = (internal_t*)dev->internal;
     int y;
     U32 clipdepth = 0;
+    if(i->coverage) {
+	fill_coverage(i, fill);
+	return;
+    }
     for(y=i->ymin;y<=i->ymax;y++) {
-	renderpoint_t*points = i->lines[y].points;
-        RGBA*line = &i->img[i->width2*y];
-        U32*zline = &i->clipbuf->data[i->bitwidth*y];
+	int row = y - i->band_y0;
+	renderpoint_t*points = i->lines[row].points;
+        RGBA*line = &i->img[i->width2*row];
+        U32*zline = &i->clipbuf->data[i->bitwidth*row];
 
 	int n;
-	int num = i->lines[y].num;
+	int num = i->lines[row].num;
 	int lastx;
-        qsort(points, num, sizeof(renderpoint_t), compare_renderpoints);
+	sort_renderpoints(i, points, num);
 
         for(n=0;n<num;n++) {
             renderpoint_t*p = &points[n];
@@ -477,7 +949,7 @@ void fill(gfxdevice_t*dev, fillinfo_t*fill)
                 endx = 0;
 
 	    if(!(n&1))
-		fill_line(dev, line, zline, y, startx, endx, fill);
+		fill_line(line, zline, y, startx, endx, fill);
 
 	    lastx = endx;
             if(endx == i->width2)
@@ -485,24 +957,29 @@ void fill(gfxdevice_t*dev, fillinfo_t*fill)
         }
 	if(fill->type == filltype_clip) {
 	    if(i->clipbuf->next) {
-		U32*line2 = &i->clipbuf->next->data[i->bitwidth*y];
-		int x;
-		for(x=0;x<i->bitwidth;x++)
-		    zline[x] &= line2[x];
+		U32*line2 = &i->clipbuf->next->data[i->bitwidth*row];
+		and_line(zline, line2, i->bitwidth);
 	    }
 	}
 
-	i->lines[y].num = 0;
+	i->lines[row].num = 0;
     }
 }
 
-void fill_solid(gfxdevice_t*dev, gfxcolor_t* color)
+static void fill_solid(internal_t*i, gfxcolor_t* color)
 {
     fillinfo_t info;
     memset(&info, 0, sizeof(info));
     info.type = filltype_solid;
     info.color = color;
-    fill(dev, &info);
+    fill(i, &info);
+}
+
+static void update_zoom(internal_t*i)
+{
+    /* the coverage rasterizer antializes without supersampling */
+    i->supersample = i->coverage?1:i->antialize;
+    i->zoom = i->supersample * i->multiply;
 }
 
 int render_setparameter(struct _gfxdevice*dev, const char*key, const char*value)
@@ -510,38 +987,63 @@ int render_setparameter(struct _gfxdevice*dev, const char*key, const char*value)
     internal_t*i = (internal_t*)dev->internal;
     if(!strcmp(key, "antialize") || !strcmp(key, "antialise")) {
 	i->antialize = atoi(value);
-	i->zoom = i->antialize * i->multiply;
+	update_zoom(i);
 	return 1;
     } else if(!strcmp(key, "multiply")) {
 	i->multiply = atoi(value);
-	i->zoom = i->antialize * i->multiply;
+	update_zoom(i);
 	fprintf(stderr, "Warning: multiply not implemented yet\n");
 	return 1;
+    } else if(!strcmp(key, "coverage")) {
+	i->coverage = atoi(value);
+	update_zoom(i);
+	return 1;
+    } else if(!strcmp(key, "streaming")) {
+	i->streaming = atoi(value);
+	i->record = i->threads>1 || i->streaming;
+	return 1;
     } else if(!strcmp(key, "fillwhite")) {
 	i->fillwhite = atoi(value);
 	return 1;
     } else if(!strcmp(key, "palette")) {
 	i->palette = atoi(value);
 	return 1;
+    } else if(!strcmp(key, "threads")) {
+	i->threads = atoi(value);
+#ifdef USE_THREADS
+	if(i->threads<=0) {
+	    /* one thread per cpu */
+#ifdef _SC_NPROCESSORS_ONLN
+	    i->threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	    if(i->threads<=0)
+		i->threads = 1;
+	}
+#else
+	i->threads = 1;
+#endif
+	i->record = i->threads>1 || i->streaming;
+	return 1;
     }
     return 0;
 }
 
-void newclip(struct _gfxdevice*dev)
+static void newclip(internal_t*i)
 {
-    internal_t*i = (internal_t*)dev->internal;
-    
+    int height = i->band_y1 - i->band_y0;
     clipbuffer_t*c = (clipbuffer_t*)rfx_calloc(sizeof(clipbuffer_t));
-    c->data = (U32*)rfx_calloc(sizeof(U32) * i->bitwidth * i->height2);
+    if(i->coverage) {
+	c->coverage = (unsigned char*)rfx_calloc(i->width2 * height);
+    } else {
+	c->data = (U32*)rfx_calloc(sizeof(U32) * i->bitwidth * height);
+	memset(c->data, 0, sizeof(U32)*i->bitwidth*height);
+    }
     c->next = i->clipbuf;
     i->clipbuf = c;
-    memset(c->data, 0, sizeof(U32)*i->bitwidth*i->height2);
 }
 
-void endclip(struct _gfxdevice*dev, char removelast)
+static void endclip(internal_t*i, char removelast)
 {
-    internal_t*i = (internal_t*)dev->internal;
-   
     /* test for at least one cliplevel (the one we created ourselves) */
     if(!i->clipbuf || (!i->clipbuf->next && !removelast)) {
 	fprintf(stderr, "endclip without any active clip buffers\n");
@@ -552,12 +1054,12 @@ void endclip(struct _gfxdevice*dev, char removelast)
     i->clipbuf = i->clipbuf->next;
     c->next = 0;
     free(c->data);c->data = 0;
+    free(c->coverage);c->coverage = 0;
     free(c);
 }
 
-void render_stroke(struct _gfxdevice*dev, gfxline_t*line, gfxcoord_t width, gfxcolor_t*color, gfx_capType cap_style, gfx_joinType joint_style, gfxcoord_t miterLimit)
+static void stroke_line(internal_t*i, gfxline_t*line, gfxcoord_t width, gfxcolor_t*color)
 {
-    internal_t*i = (internal_t*)dev->internal;
     double x,y;
     
     /*if(cap_style != gfx_capRound || joint_style != gfx_joinRound) {
@@ -569,8 +1071,8 @@ void render_stroke(struct _gfxdevice*dev, gfxline_t*line, gfxcoord_t width, gfxc
         } else if(line->type == gfx_lineTo) {
 	    double x1=x*i->zoom,y1=y*i->zoom;
 	    double x3=line->x*i->zoom,y3=line->y*i->zoom;
-	    add_solidline(dev, x1, y1, x3, y3, width * i->zoom);
-	    fill_solid(dev, color);
+	    add_solidline(i, x1, y1, x3, y3, width * i->zoom);
+	    fill_solid(i, color);
         } else if(line->type == gfx_splineTo) {
 	    int t,parts;
 	    double xx,yy;
@@ -590,8 +1092,8 @@ void render_stroke(struct _gfxdevice*dev, gfxline_t*line, gfxcoord_t width, gfxc
                 double nx = (double)(t*t*x3 + 2*t*(parts-t)*x2 + (parts-t)*(parts-t)*x1)/(double)(parts*parts);
                 double ny = (double)(t*t*y3 + 2*t*(parts-t)*y2 + (parts-t)*(parts-t)*y1)/(double)(parts*parts);
                 
-		add_solidline(dev, xx, yy, nx, ny, width * i->zoom);
-		fill_solid(dev, color);
+		add_solidline(i, xx, yy, nx, ny, width * i->zoom);
+		fill_solid(i, color);
                 xx = nx;
                 yy = ny;
             }
@@ -602,9 +1104,8 @@ void render_stroke(struct _gfxdevice*dev, gfxline_t*line, gfxcoord_t width, gfxc
     }
 }
 
-static void draw_line(gfxdevice_t*dev, gfxline_t*line)
+static void draw_line(internal_t*i, gfxline_t*line)
 {
-    internal_t*i = (internal_t*)dev->internal;
     double x=0,y=0;
 
     while(line)
@@ -616,7 +1117,7 @@ static void draw_line(gfxdevice_t*dev, gfxline_t*line)
 	    double x1=x*i->zoom,y1=y*i->zoom;
 	    double x3=line->x*i->zoom,y3=line->y*i->zoom;
             
-            add_line(dev, x1, y1, x3, y3);
+            add_line(i, x1, y1, x3, y3);
         } else if(line->type == gfx_splineTo) {
 	    int c,t,parts,qparts;
 	    double xx,yy;
@@ -636,7 +1137,7 @@ static void draw_line(gfxdevice_t*dev, gfxline_t*line)
                 double nx = (double)(t*t*x3 + 2*t*(parts-t)*x2 + (parts-t)*(parts-t)*x1)/(double)(parts*parts);
                 double ny = (double)(t*t*y3 + 2*t*(parts-t)*y2 + (parts-t)*(parts-t)*y1)/(double)(parts*parts);
                 
-                add_line(dev, xx, yy, nx, ny);
+                add_line(i, xx, yy, nx, ny);
                 xx = nx;
                 yy = ny;
             }
@@ -647,72 +1148,43 @@ static void draw_line(gfxdevice_t*dev, gfxline_t*line)
     }
 }
 
-void render_startclip(struct _gfxdevice*dev, gfxline_t*line)
+static void startclip(internal_t*i, gfxline_t*line)
 {
-    internal_t*i = (internal_t*)dev->internal;
     fillinfo_t info;
     memset(&info, 0, sizeof(info));
-    newclip(dev);
+    newclip(i);
     info.type = filltype_clip;
-    draw_line(dev, line);
-    fill(dev, &info);
-}
-
-void render_endclip(struct _gfxdevice*dev)
-{
-    internal_t*i = (internal_t*)dev->internal;
-    endclip(dev, 0);
-}
-
-void render_fill(struct _gfxdevice*dev, gfxline_t*line, gfxcolor_t*color)
-{
-    internal_t*i = (internal_t*)dev->internal;
-
-    draw_line(dev, line);
-    fill_solid(dev, color);
+    draw_line(i, line);
+    fill(i, &info);
 }
 
-void render_fillbitmap(struct _gfxdevice*dev, gfxline_t*line, gfximage_t*img, gfxmatrix_t*matrix, gfxcxform_t*cxform)
+static void fillbitmap(internal_t*i, gfxline_t*line, gfximage_t*img, gfxmatrix_t*matrix)
 {
-    internal_t*i = (internal_t*)dev->internal;
-
-    gfxmatrix_t m2 = *matrix;
-
-    draw_line(dev, line);
+    draw_line(i, line);
 
     fillinfo_t info;
     memset(&info, 0, sizeof(info));
     info.type = filltype_bitmap;
     info.image = img;
-    info.matrix = &m2;
-    info.cxform = cxform;
-
-    m2.m00 *= i->zoom; m2.m01 *= i->zoom; m2.tx *= i->zoom;
-    m2.m10 *= i->zoom; m2.m11 *= i->zoom; m2.ty *= i->zoom;
-
-    fill(dev, &info);
+    info.matrix = matrix;
+    fill(i, &info);
 }
 
-void render_fillgradient(struct _gfxdevice*dev, gfxline_t*line, gfxgradient_t*gradient, gfxgradienttype_t type, gfxmatrix_t*matrix)
+static void fillgradient(internal_t*i, gfxline_t*line, RGBA*g, char linear_or_radial, gfxmatrix_t*matrix)
 {
-    internal_t*i = (internal_t*)dev->internal;
-    
-    gfxmatrix_t m2 = *matrix;
+    draw_line(i, line);
 
-    draw_line(dev, line);
-
-    RGBA g[256];
     fillinfo_t info;
     memset(&info, 0, sizeof(info));
     info.type = filltype_gradient;
     info.gradient = g;
-    info.matrix = &m2;
-
-    m2.m00 *= i->zoom; m2.m01 *= i->zoom; m2.tx *= i->zoom;
-    m2.m10 *= i->zoom; m2.m11 *= i->zoom; m2.ty *= i->zoom;
-
-    info.linear_or_radial = type == gfxgradient_radial;
+    info.matrix = matrix;
+    info.linear_or_radial = linear_or_radial;
+    fill(i, &info);
+}
 
+static char make_gradient(RGBA*g, gfxgradient_t*gradient)
+{
     int pos = 0;
     gfxcolor_t color = {0,0,0,0};
     pos=0;
@@ -721,7 +1193,7 @@ void render_fillgradient(struct _gfxdevice*dev, gfxline_t*line, gfxgradient_t*gr
         int t;
         if(nextpos>256) {
             msg("<error> Invalid gradient- contains values > 1.0");
-            return;
+            return 0;
         }
         
         gfxcolor_t nextcolor = gradient->color;
@@ -747,8 +1219,188 @@ void render_fillgradient(struct _gfxdevice*dev, gfxline_t*line, gfxgradient_t*gr
     if(pos!=256) {
         msg("<error> Invalid gradient- doesn't end with 1.0");
     }
+    return 1;
+}
+
+static void set_op_line(renderop_t*op, gfxline_t*line)
+{
+    op->line = line;
+    if(line) {
+	gfxbbox_t bbox = gfxline_getbbox(line);
+	op->ymin = bbox.ymin;
+	op->ymax = bbox.ymax;
+	if(line->type != gfx_moveTo) {
+	    /* draw_line() starts at the origin */
+	    if(op->ymin > 0) op->ymin = 0;
+	    if(op->ymax < 0) op->ymax = 0;
+	}
+    }
+}
+
+static renderop_t* add_op(internal_t*i, renderop_type_t type, gfxline_t*line)
+{
+    renderop_t*op = (renderop_t*)rfx_calloc(sizeof(renderop_t));
+    op->type = type;
+    set_op_line(op, line?gfxline_clone(line):0);
+    if(i->ops_last)
+	i->ops_last->next = op;
+    else
+	i->ops = op;
+    i->ops_last = op;
+    return op;
+}
+
+static void free_ops(internal_t*i)
+{
+    renderop_t*op = i->ops;
+    while(op) {
+	renderop_t*next = op->next;
+	if(op->line)
+	    gfxline_free(op->line);
+	if(op->image)
+	    gfximage_free(op->image);
+	if(op->gradient)
+	    rfx_free(op->gradient);
+	rfx_free(op);
+	op = next;
+    }
+    i->ops = i->ops_last = 0;
+}
+
+static void replay_ops(internal_t*i, renderop_t*op)
+{
+    for(;op;op=op->next) {
+	if(op->line && op->type != renderop_startclip) {
+	    /* skip drawing operations which don't touch this band. (Clip
+	       operations always need to be replayed, to keep the clip stack
+	       intact.) */
+	    double w = op->type == renderop_stroke ? op->width : 0;
+	    if((op->ymax + w)*i->zoom + 1 < i->band_y0 ||
+	       (op->ymin - w)*i->zoom - 1 > i->band_y1)
+		continue;
+	}
+	switch(op->type) {
+	    case renderop_fill:
+		draw_line(i, op->line);
+		fill_solid(i, &op->color);
+	    break;
+	    case renderop_stroke:
+		stroke_line(i, op->line, op->width, &op->color);
+	    break;
+	    case renderop_startclip:
+		startclip(i, op->line);
+	    break;
+	    case renderop_endclip:
+		endclip(i, 0);
+	    break;
+	    case renderop_fillbitmap:
+		fillbitmap(i, op->line, op->image, &op->matrix);
+	    break;
+	    case renderop_fillgradient:
+		fillgradient(i, op->line, op->gradient, op->linear_or_radial, &op->matrix);
+	    break;
+	}
+    }
+}
+
+void render_stroke(struct _gfxdevice*dev, gfxline_t*line, gfxcoord_t width, gfxcolor_t*color, gfx_capType cap_style, gfx_joinType joint_style, gfxcoord_t miterLimit)
+{
+    internal_t*i = (internal_t*)dev->internal;
+    if(i->record) {
+	renderop_t*op = add_op(i, renderop_stroke, line);
+	op->width = width;
+	op->color = *color;
+	return;
+    }
+    stroke_line(i, line, width, color);
+}
+
+void render_startclip(struct _gfxdevice*dev, gfxline_t*line)
+{
+    internal_t*i = (internal_t*)dev->internal;
+    if(i->record) {
+	add_op(i, renderop_startclip, line);
+	i->clipdepth++;
+	return;
+    }
+    startclip(i, line);
+}
+
+void render_endclip(struct _gfxdevice*dev)
+{
+    internal_t*i = (internal_t*)dev->internal;
+    if(i->record) {
+	if(!i->clipdepth) {
+	    fprintf(stderr, "endclip without any active clip buffers\n");
+	    return;
+	}
+	add_op(i, renderop_endclip, 0);
+	i->clipdepth--;
+	return;
+    }
+    endclip(i, 0);
+}
+
+void render_fill(struct _gfxdevice*dev, gfxline_t*line, gfxcolor_t*color)
+{
+    internal_t*i = (internal_t*)dev->internal;
+    if(i->record) {
+	renderop_t*op = add_op(i, renderop_fill, line);
+	op->color = *color;
+	return;
+    }
+
+    draw_line(i, line);
+    fill_solid(i, color);
+}
+
+void render_fillbitmap(struct _gfxdevice*dev, gfxline_t*line, gfximage_t*img, gfxmatrix_t*matrix, gfxcxform_t*cxform)
+{
+    internal_t*i = (internal_t*)dev->internal;
+
+    gfxmatrix_t m2 = *matrix;
+    m2.m00 *= i->zoom; m2.m01 *= i->zoom; m2.tx *= i->zoom;
+    m2.m10 *= i->zoom; m2.m11 *= i->zoom; m2.ty *= i->zoom;
+
+    if(i->record) {
+	/* the image only stays valid for the duration of this call */
+	renderop_t*op = add_op(i, renderop_fillbitmap, line);
+	op->matrix = m2;
+	if(img && img->width && img->height) {
+	    op->image = gfximage_new(img->width, img->height);
+	    memcpy(op->image->data, img->data, sizeof(gfxcolor_t)*img->width*img->height);
+	}
+	return;
+    }
 
-    fill(dev, &info);
+    fillbitmap(i, line, img, &m2);
+}
+
+void render_fillgradient(struct _gfxdevice*dev, gfxline_t*line, gfxgradient_t*gradient, gfxgradienttype_t type, gfxmatrix_t*matrix)
+{
+    internal_t*i = (internal_t*)dev->internal;
+    
+    gfxmatrix_t m2 = *matrix;
+    m2.m00 *= i->zoom; m2.m01 *= i->zoom; m2.tx *= i->zoom;
+    m2.m10 *= i->zoom; m2.m11 *= i->zoom; m2.ty *= i->zoom;
+
+    if(i->record) {
+	RGBA*g = (RGBA*)rfx_calloc(sizeof(RGBA)*256);
+	if(!make_gradient(g, gradient)) {
+	    rfx_free(g);
+	    return;
+	}
+	renderop_t*op = add_op(i, renderop_fillgradient, line);
+	op->gradient = g;
+	op->matrix = m2;
+	op->linear_or_radial = type == gfxgradient_radial;
+	return;
+    }
+
+    RGBA g[256];
+    if(!make_gradient(g, gradient))
+	return;
+    fillgradient(i, line, g, type == gfxgradient_radial, &m2);
 }
 
 void render_addfont(struct _gfxdevice*dev, gfxfont_t*font)
@@ -768,8 +1420,14 @@ void render_drawchar(struct _gfxdevice*dev, gfxfont_t*font, int glyphnr, gfxcolo
     gfxglyph_t*glyph = &font->glyphs[glyphnr];
     gfxline_t*line2 = gfxline_clone(glyph->line);
     gfxline_transform(line2, matrix);
-    draw_line(dev, line2);
-    fill_solid(dev, color);
+    if(i->record) {
+	renderop_t*op = add_op(i, renderop_fill, 0);
+	set_op_line(op, line2);
+	op->color = *color;
+	return;
+    }
+    draw_line(i, line2);
+    fill_solid(i, color);
     gfxline_free(line2);
     
     return;
@@ -779,6 +1437,60 @@ void render_result_write(gfxresult_t*r, int filedesc)
 {
     internal_result_t*i= (internal_result_t*)r->internal;
 }
+
+static int render_ops(internal_t*i, gfxcolor_t*dest, int y0, int y1);
+
+/* returns the image of a page, rasterizing its display list if necessary */
+static gfximage_t* result_image(internal_result_t*i)
+{
+    if(!i->img.data && i->page) {
+	i->img.data = (gfxcolor_t*)malloc((size_t)i->img.width*i->img.height*sizeof(gfxcolor_t));
+	render_ops(i->page, i->img.data, 0, i->page->height2);
+    }
+    return &i->img;
+}
+
+/* rasterizes a page's display list a few bands at a time, and passes
+   the rows on to the png encoder right away */
+static void save_streamed(internal_result_t*i, const char*filename)
+{
+    internal_t*page = i->page;
+    pngwriter_t*w = png_writer_new(filename, page->width, page->height);
+    if(!w)
+	return;
+    png_writer_set_threads(w, page->threads);
+    int rows = BAND_HEIGHT*page->threads;
+    gfxcolor_t*buf = (gfxcolor_t*)malloc(sizeof(gfxcolor_t)*page->width*rows);
+    int unclosed = 0;
+    int y;
+    for(y=0;y<page->height;y+=rows) {
+	int num = page->height-y < rows ? page->height-y : rows;
+	int u = render_ops(page, buf, y*page->supersample, (y+num)*page->supersample);
+	if(!y)
+	    unclosed = u;
+	png_writer_write_lines(w, (unsigned char*)buf, num);
+    }
+    png_writer_finish(w);
+    free(buf);
+    if(unclosed) {
+        fprintf(stderr, "Warning: %d unclosed clip(s) while processing endpage()\n", unclosed);
+    }
+}
+
+static void save_page(internal_result_t*i, const char*filename)
+{
+    if(i->page && !i->img.data && !i->palette) {
+	save_streamed(i, filename);
+	return;
+    }
+    gfximage_t*img = result_image(i);
+    if(!i->palette) {
+	png_write(filename, (unsigned char*)img->data, img->width, img->height);
+    } else {
+	png_write_palette_based_2(filename, (unsigned char*)img->data, img->width, img->height);
+    }
+}
+
 int render_result_save(gfxresult_t*r, const char*filename)
 {
     internal_result_t*i= (internal_result_t*)r->internal;
@@ -794,22 +1506,15 @@ int render_result_save(gfxresult_t*r, const char*filename)
 		strchr("pP",origname[l-3]) && filename[l-4]=='.') {
 	    origname[l-4] = 0;
 	}
-	while(i->next) {
+	while(i) {
 	    sprintf(filenamebuf, "%s.%d.png", origname, nr);
-            if(!i->palette) {
-	        png_write(filename, (unsigned char*)i->img.data, i->img.width, i->img.height);
-            } else {
-	        png_write_palette_based_2(filename, (unsigned char*)i->img.data, i->img.width, i->img.height);
-            }
+	    save_page(i, filenamebuf);
+	    i = i->next;
 	    nr++;
 	}
 	free(origname);
     } else {
-        if(!i->palette) {
-	    png_write(filename, (unsigned char*)i->img.data, i->img.width, i->img.height);
-	} else {
-	    png_write_palette_based_2(filename, (unsigned char*)i->img.data, i->img.width, i->img.height);
-	}
+	save_page(i, filename);
     }
     return 1;
 }
@@ -851,7 +1556,7 @@ void*render_result_get(gfxresult_t*r, const char*name)
 		return 0;
             pagenr--;
 	}
-	return gfximage_asXPM(&i->img, 64);
+	return gfximage_asXPM(result_image(i), 64);
     } else if(!strncmp(name,"page",4)) {
 	int pagenr = atoi(&name[4]);
 	if(pagenr<0)
@@ -862,7 +1567,7 @@ void*render_result_get(gfxresult_t*r, const char*name)
 		return 0;
             pagenr--;
 	}
-	return &i->img;
+	return result_image(i);
     }
     return 0;
 }
@@ -873,6 +1578,10 @@ void render_result_destroy(gfxresult_t*r)
     while(i) {
 	internal_result_t*next = i->next;
 	free(i->img.data);i->img.data = 0;
+	if(i->page) {
+	    free_ops(i->page);
+	    rfx_free(i->page);i->page = 0;
+	}
 
         /* FIXME memleak
            the following rfx_free causes a segfault on WIN32 machines,
@@ -901,78 +1610,132 @@ gfxresult_t* render_finish(struct _gfxdevice*dev)
     return res;
 }
 
-void render_startpage(struct _gfxdevice*dev, int width, int height)
+/* allocates image, scanline and clip buffers for the rows y0 to y1 */
+static void band_alloc(internal_t*i, int y0, int y1)
 {
-    internal_t*i = (internal_t*)dev->internal;
     int y;
+    int height = y1 - y0;
+    i->band_y0 = y0;
+    i->band_y1 = y1;
 
-    if(i->width2 || i->height2) {
-	fprintf(stderr, "Error: startpage() called twice (no endpage()?)\n");
-	exit(1);
-    }
-    
-    i->width = width*i->multiply;
-    i->height = height*i->multiply;
-    i->width2 = width*i->zoom;
-    i->height2 = height*i->zoom;
-    i->bitwidth = (i->width2+31)/32;
-
-    i->lines = (renderline_t*)rfx_alloc(i->height2*sizeof(renderline_t));
-    for(y=0;y<i->height2;y++) {
+    i->lines = (renderline_t*)rfx_alloc(height*sizeof(renderline_t));
+    for(y=0;y<height;y++) {
 	memset(&i->lines[y], 0, sizeof(renderline_t));
         i->lines[y].points = 0;
         i->lines[y].num = 0;
     }
-    i->img = (RGBA*)rfx_calloc(sizeof(RGBA)*i->width2*i->height2);
+    i->img = (RGBA*)rfx_calloc(sizeof(RGBA)*i->width2*height);
     if(i->fillwhite) {
-	memset(i->img, 0xff, sizeof(RGBA)*i->width2*i->height2);
+	memset(i->img, 0xff, sizeof(RGBA)*i->width2*height);
     }
 
     i->ymin = 0x7fffffff;
     i->ymax = -0x80000000;
 
+    if(i->coverage) {
+	i->cells = (float*)rfx_calloc(sizeof(float)*(i->width2+2)*height);
+	i->cells_x0 = (int*)rfx_alloc(sizeof(int)*height);
+	i->cells_x1 = (int*)rfx_alloc(sizeof(int)*height);
+	for(y=0;y<height;y++) {
+	    i->cells_x0[y] = 0x7fffffff;
+	    i->cells_x1[y] = -1;
+	}
+	i->covline = (unsigned char*)rfx_calloc(i->width2);
+    }
 
     /* initialize initial clipping field, which doesn't clip anything yet */
-    newclip(dev);
-    memset(i->clipbuf->data, 255, sizeof(U32)*i->bitwidth*i->height2);
+    newclip(i);
+    if(i->coverage) {
+	memset(i->clipbuf->coverage, 255, i->width2*height);
+    } else {
+	memset(i->clipbuf->data, 255, sizeof(U32)*i->bitwidth*height);
+    }
 }
 
-static void store_image(internal_t*i, internal_result_t*ir)
+/* frees the buffers allocated by band_alloc(). Returns the number of
+   clip buffers which were still active */
+static int band_free(internal_t*i)
 {
-    ir->img.data = (gfxcolor_t*)malloc(i->width*i->height*sizeof(gfxcolor_t));
-    ir->img.width = i->width;
-    ir->img.height = i->height;
+    int y;
+    endclip(i, 1);
+    int unclosed = 0;
+    while(i->clipbuf) {
+	endclip(i, 1);
+        unclosed++;
+    }
+
+    for(y=0;y<i->band_y1-i->band_y0;y++) {
+	rfx_free(i->lines[y].points); i->lines[y].points = 0;
+    }
+    rfx_free(i->lines);i->lines=0;
+
+    if(i->img) {rfx_free(i->img);i->img = 0;}
+    if(i->sortbuf) {rfx_free(i->sortbuf);i->sortbuf = 0;i->sortbuf_size = 0;}
+    if(i->cells) {
+	rfx_free(i->cells);i->cells = 0;
+	rfx_free(i->cells_x0);i->cells_x0 = 0;
+	rfx_free(i->cells_x1);i->cells_x1 = 0;
+	rfx_free(i->covline);i->covline = 0;
+    }
+    return unclosed;
+}
+
+void render_startpage(struct _gfxdevice*dev, int width, int height)
+{
+    internal_t*i = (internal_t*)dev->internal;
+
+    if(i->width2 || i->height2) {
+	fprintf(stderr, "Error: startpage() called twice (no endpage()?)\n");
+	exit(1);
+    }
+    
+    i->width = width*i->multiply;
+    i->height = height*i->multiply;
+    i->width2 = width*i->zoom;
+    i->height2 = height*i->zoom;
+    i->bitwidth = (i->width2+31)/32;
 
-    gfxcolor_t*dest = ir->img.data;
+    if(i->record) {
+	/* buffers are allocated per band, in render_endpage() */
+	i->clipdepth = 0;
+	return;
+    }
+
+    band_alloc(i, 0, i->height2);
+}
 
-    if(i->antialize <= 1) /* no antializing */ {
+/* downsamples the supersampled rows in src (which need to be a multiple
+   of supersample) into dest */
+static void downsample(internal_t*i, RGBA*src, int rows, gfxcolor_t*dest)
+{
+    if(i->supersample <= 1) /* no antializing */ {
 	int y;
-	for(y=0;y<i->height;y++) {
-	    RGBA*line = &i->img[y*i->width];
+	for(y=0;y<rows;y++) {
+	    RGBA*line = &src[y*i->width];
 	    memcpy(&dest[y*i->width], line, sizeof(RGBA)*i->width);
 	}
     } else {
-	RGBA**lines = (RGBA**)rfx_calloc(sizeof(RGBA*)*i->antialize);
-	int q = i->antialize*i->antialize;
+	RGBA**lines = (RGBA**)rfx_calloc(sizeof(RGBA*)*i->supersample);
+	int q = i->supersample*i->supersample;
 	int ypos = 0;
 	int y;
 	int y2=0;
-	for(y=0;y<i->height2;y++) {
+	for(y=0;y<rows;y++) {
 	    int n;
-	    ypos = y % i->antialize;
-	    lines[ypos] = &i->img[y*i->width2];
-	    if(ypos == i->antialize-1) {
+	    ypos = y % i->supersample;
+	    lines[ypos] = &src[y*i->width2];
+	    if(ypos == i->supersample-1) {
 		RGBA*out = &dest[(y2++)*i->width];
 		int x;
 		int r,g,b,a;
 		for(x=0;x<i->width;x++) {
-		    int xpos = x*i->antialize;
+		    int xpos = x*i->supersample;
 		    int yp;
 		    U32 r=0,g=0,b=0,a=0;
-		    for(yp=0;yp<i->antialize;yp++) {
+		    for(yp=0;yp<i->supersample;yp++) {
 			RGBA*lp = &lines[yp][xpos];
 			int xp;
-			for(xp=0;xp<i->antialize;xp++) {
+			for(xp=0;xp<i->supersample;xp++) {
 			    RGBA*p = &lp[xp];
 			    r += p->r;
 			    g += p->g;
@@ -991,6 +1754,94 @@ static void store_image(internal_t*i, internal_result_t*ir)
     }
 }
 
+typedef struct _bandjob {
+    internal_t*i;
+    gfxcolor_t*dest;
+    int y0, y1;
+    int band_height;
+    int num_bands;
+    int next_band;
+    int unclosed;
+#ifdef USE_THREADS
+    pthread_mutex_t mutex;
+#endif
+} bandjob_t;
+
+static void* render_bands(void*_job)
+{
+    bandjob_t*job = (bandjob_t*)_job;
+    internal_t*i = job->i;
+    while(1) {
+#ifdef USE_THREADS
+	pthread_mutex_lock(&job->mutex);
+#endif
+	int nr = job->next_band++;
+#ifdef USE_THREADS
+	pthread_mutex_unlock(&job->mutex);
+#endif
+	if(nr >= job->num_bands)
+	    break;
+
+	int y0 = job->y0 + nr*job->band_height;
+	int y1 = y0 + job->band_height;
+	if(y1 > job->y1)
+	    y1 = job->y1;
+
+	internal_t band = *i;
+	band.clipbuf = 0;
+	band.sortbuf = 0;
+	band.sortbuf_size = 0;
+	band_alloc(&band, y0, y1);
+	replay_ops(&band, i->ops);
+	int row = (y0 - job->y0)/i->supersample;
+	downsample(&band, band.img, y1-y0, &job->dest[row*i->width]);
+	int unclosed = band_free(&band);
+	if(!nr)
+	    job->unclosed = unclosed;
+    }
+    return 0;
+}
+
+/* rasterizes the (supersampled) rows y0 to y1 of the display list, one band
+   at a time, using i->threads workers. Returns the number of unclosed clips. */
+static int render_ops(internal_t*i, gfxcolor_t*dest, int y0, int y1)
+{
+    bandjob_t job;
+    memset(&job, 0, sizeof(job));
+    job.i = i;
+    job.dest = dest;
+    job.y0 = y0;
+    job.y1 = y1;
+    job.band_height = BAND_HEIGHT*i->zoom;
+    job.num_bands = (y1 - y0 + job.band_height - 1) / job.band_height;
+
+#ifdef USE_THREADS
+    int num_threads = i->threads;
+    if(num_threads > job.num_bands)
+	num_threads = job.num_bands;
+    pthread_t*threads = (pthread_t*)rfx_calloc(sizeof(pthread_t)*num_threads);
+    pthread_mutex_init(&job.mutex, 0);
+    int t;
+    int started = 0;
+    for(t=1;t<num_threads;t++) {
+	if(pthread_create(&threads[t], 0, render_bands, &job)) {
+	    msg("<warning> Couldn't create render thread");
+	    break;
+	}
+	started++;
+    }
+    render_bands(&job);
+    for(t=1;t<=started;t++) {
+	pthread_join(threads[t], 0);
+    }
+    pthread_mutex_destroy(&job.mutex);
+    rfx_free(threads);
+#else
+    render_bands(&job);
+#endif
+    return job.unclosed;
+}
+
 void render_endpage(struct _gfxdevice*dev)
 {
     internal_t*i = (internal_t*)dev->internal;
@@ -1000,23 +1851,30 @@ void render_endpage(struct _gfxdevice*dev)
 	exit(1);
     }
 
-    endclip(dev, 1);
+    internal_result_t*ir= (internal_result_t*)rfx_calloc(sizeof(internal_result_t));
+    ir->palette = i->palette;
+    ir->img.width = i->width;
+    ir->img.height = i->height;
+
     int unclosed = 0;
-    while(i->clipbuf) {
-	endclip(dev, 1);
-        unclosed++;
+    if(i->streaming) {
+	/* keep the display list around until the page is saved */
+	ir->page = (internal_t*)rfx_alloc(sizeof(internal_t));
+	*ir->page = *i;
+	ir->page->results = ir->page->result_next = 0;
+	i->ops = i->ops_last = 0;
+    } else if(i->record) {
+	ir->img.data = (gfxcolor_t*)malloc((size_t)i->width*i->height*sizeof(gfxcolor_t));
+	unclosed = render_ops(i, ir->img.data, 0, i->height2);
+	free_ops(i);
+    } else {
+	ir->img.data = (gfxcolor_t*)malloc((size_t)i->width*i->height*sizeof(gfxcolor_t));
+	downsample(i, i->img, i->height2, ir->img.data);
+	unclosed = band_free(i);
     }
-
     if(unclosed) {
-        fprintf(stderr, "Warning: %d unclosed clip(s) while processing endpage()\n", unclosed);
+	fprintf(stderr, "Warning: %d unclosed clip(s) while processing endpage()\n", unclosed);
     }
-    
-    internal_result_t*ir= (internal_result_t*)rfx_calloc(sizeof(internal_result_t));
-    ir->palette = i->palette;
-
-    int y,x;
-
-    store_image(i, ir);
 
     ir->next = 0;
     if(i->result_next) {
@@ -1027,13 +1885,6 @@ void render_endpage(struct _gfxdevice*dev)
     }
     i->result_next = ir;
 
-    for(y=0;y<i->height2;y++) {
-	rfx_free(i->lines[y].points); i->lines[y].points = 0;
-    }
-    rfx_free(i->lines);i->lines=0;
-
-    if(i->img) {rfx_free(i->img);i->img = 0;}
-
     i->width2 = 0;
     i->height2 = 0;
 }
@@ -1059,6 +1910,8 @@ void gfxdevice_render_init(gfxdevice_t*dev)
     i->antialize = 1;
     i->multiply = 1;
     i->zoom = 1;
+    i->supersample = 1;
+    i->threads = 1;
 
     dev->setparameter = render_setparameter;
     dev->startpage = render_startpage;
@@ -1082,3 +1935,133 @@ gfxdevice_t* gfxdevice_render_new()
     gfxdevice_render_init(d);
     return d;
 }
+
+#ifdef BENCHMARK
+#include <time.h>
+
+/* the previous implementations, for comparison */
+static int compare_renderpoints(const void * _a, const void * _b)
+{
+    renderpoint_t*a = (renderpoint_t*)_a;
+    renderpoint_t*b = (renderpoint_t*)_b;
+    if(a->x < b->x) return -1;
+    if(a->x > b->x) return 1;
+    return 0;
+}
+
+static void fill_line_solid_ref(RGBA*line, U32*z, int y, int x1, int x2, RGBA col)
+{
+    int x = x1;
+
+    U32 bit = 1<<(x1&31);
+    int bitpos = (x1/32);
+
+    if(col.a!=255) {
+        int ainv = 255-col.a;
+        col.r = (col.r*col.a)/255;
+        col.g = (col.g*col.a)/255;
+        col.b = (col.b*col.a)/255;
+        do {
+	    if(z[bitpos]&bit) {
+		line[x].r = ((line[x].r*ainv)/255)+col.r;
+		line[x].g = ((line[x].g*ainv)/255)+col.g;
+		line[x].b = ((line[x].b*ainv)/255)+col.b;
+		line[x].a = ((line[x].a*ainv)/255)+col.a;
+	    }
+	    bit <<= 1;
+	    if(!bit) {
+		bit = 1;bitpos++;
+	    }
+        } while(++x<x2);
+    } else {
+        do {
+	    if(z[bitpos]&bit) {
+		line[x] = col;
+	    }
+	    bit <<= 1;
+	    if(!bit) {
+		bit = 1;bitpos++;
+	    }
+        } while(++x<x2);
+    }
+}
+
+static void benchmark_sort(int num, int count)
+{
+    internal_t i;
+    memset(&i, 0, sizeof(i));
+    renderpoint_t*p1 = (renderpoint_t*)malloc(sizeof(renderpoint_t)*num);
+    renderpoint_t*p2 = (renderpoint_t*)malloc(sizeof(renderpoint_t)*num);
+    double t1 = 0, t2 = 0;
+    int r, t;
+    srand(num);
+    for(r=0;r<count;r++) {
+	for(t=0;t<num;t++) {
+	    p1[t].x = p2[t].x = (rand()%40000)/16.0 - 100;
+	}
+	clock_t c1 = clock();
+	qsort(p1, num, sizeof(renderpoint_t), compare_renderpoints);
+	clock_t c2 = clock();
+	sort_renderpoints(&i, p2, num);
+	clock_t c3 = clock();
+	t1 += c2-c1;
+	t2 += c3-c2;
+	if(memcmp(p1, p2, sizeof(renderpoint_t)*num)) {
+	    printf("sort mismatch for %d points\n", num);
+	    exit(1);
+	}
+    }
+    printf("sort %5d points: qsort %7.1f ms  sort_renderpoints %7.1f ms\n", num,
+	    t1*1000.0/CLOCKS_PER_SEC, t2*1000.0/CLOCKS_PER_SEC);
+    free(p1);free(p2);rfx_free(i.sortbuf);
+}
+
+static void benchmark_fill(const char*name, int alpha, int clipped)
+{
+    const int width = 2448, rows = 20000;
+    RGBA*line1 = (RGBA*)malloc(sizeof(RGBA)*width);
+    RGBA*line2 = (RGBA*)malloc(sizeof(RGBA)*width);
+    U32*z = (U32*)malloc(sizeof(U32)*(width+31)/32*4);
+    RGBA col = {alpha, 40, 80, 200};
+    int t;
+    for(t=0;t<width;t++) {
+	line1[t].a = line2[t].a = 255;
+	line1[t].r = line2[t].r = t*7;
+	line1[t].g = line2[t].g = t*13;
+	line1[t].b = line2[t].b = t*3;
+    }
+    for(t=0;t<(width+31)/32;t++) {
+	z[t] = clipped?(t&1?0xffffffff:0x0ff00ff0):0xffffffff;
+    }
+    clock_t c1 = clock();
+    for(t=0;t<rows;t++) {
+	fill_line_solid_ref(line1, z, t, t%17, width-t%13, col);
+    }
+    clock_t c2 = clock();
+    for(t=0;t<rows;t++) {
+	fill_line_solid(line2, z, t, t%17, width-t%13, col);
+    }
+    clock_t c3 = clock();
+    if(memcmp(line1, line2, sizeof(RGBA)*width)) {
+	printf("fill mismatch (%s)\n", name);
+	exit(1);
+    }
+    printf("fill %-16s: scalar %7.1f ms  span kernels %7.1f ms\n", name,
+	    (c2-c1)*1000.0/CLOCKS_PER_SEC, (c3-c2)*1000.0/CLOCKS_PER_SEC);
+    free(line1);free(line2);free(z);
+}
+
+int main()
+{
+    benchmark_sort(2, 1000000);
+    benchmark_sort(8, 200000);
+    benchmark_sort(64, 50000);
+    benchmark_sort(1000, 2000);
+    benchmark_sort(20000, 100);
+    benchmark_fill("opaque", 255, 0);
+    benchmark_fill("alpha", 128, 0);
+    benchmark_fill("opaque, clipped", 255, 1);
+    benchmark_fill("alpha, clipped", 128, 1);
+    return 0;
+}
+#endif
@@ -43,6 +43,10 @@
 #include "swf.h"
 #include "../gfxpoly.h"
 #include "../gfximage.h"
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+#include <pthread.h>
+#define USE_THREADS
+#endif
 
 #define CHARDATAMAX 1024
 #define CHARMIDX 0
@@ -210,6 +214,16 @@ typedef struct _swfoutput_internal
 
     char* mark;
 
+    /* with threads>1, the drawing operations of a page are recorded, and
+       the page is converted to SWF tags on a worker thread, using its own
+       id space. The resulting tags are renumbered and appended to the
+       movie in page order (see merge_page()) */
+    int config_threads;
+    int num_fonts; // with threads>1, font ids are counted down from 65535
+    struct _pagejob*recording; // page currently being recorded
+    struct _pagequeue*queue;
+    struct _pagejob*job; // for page devices: the page we belong to
+
 } swfoutput_internal;
 
 static const int NO_FONT3=0;
@@ -309,7 +323,7 @@ static int id_error = 0;
 static U16 getNewID(gfxdevice_t* dev)
 {
     swfoutput_internal*i = (swfoutput_internal*)dev->internal;
-    if(i->currentswfid == 65535) {
+    if(i->currentswfid == 65535 - i->num_fonts) {
 	if(!id_error) {
 	    msg("<error> ID Table overflow");
 	    msg("<error> This file is too complex to render- SWF only supports 65536 shapes at once");
@@ -334,6 +348,24 @@ static U16 getNewDepth(gfxdevice_t* dev)
     }
     return ++i->depth;
 }
+/* fonts are shared between pages, so if pages get their own id space
+   (threads>1), font ids are allocated from the top of the id range */
+static U16 getNewFontID(gfxdevice_t* dev)
+{
+    swfoutput_internal*i = (swfoutput_internal*)dev->internal;
+    if(i->config_threads<=1)
+	return getNewID(dev);
+    if(i->currentswfid >= 65535 - i->num_fonts) {
+	if(!id_error) {
+	    msg("<error> ID Table overflow");
+	    msg("<error> This file is too complex to render- SWF only supports 65536 shapes at once");
+	}
+	id_error=1;
+	i->overflow = 1;
+	exit(1);
+    }
+    return 65535 - i->num_fonts++;
+}
 
 static void startshape(gfxdevice_t* dev);
 static void starttext(gfxdevice_t* dev);
@@ -1111,12 +1143,11 @@ void swf_startframe(gfxdevice_t*dev, int width, int height)
     i->chardata = 0;
 }
 
-void swf_endframe(gfxdevice_t*dev)
+/* the tags which end a frame: showframe, and the removal of all objects
+   which were placed on the page */
+static void finishframe(gfxdevice_t*dev)
 {
     swfoutput_internal*i = (swfoutput_internal*)dev->internal;
-    
-    if(!i->pagefinished)
-        endpage(dev);
 
     if( (i->swf->fileVersion <= 8) && (i->config_insertstoptag) ) {
 	ActionTAG*atag=0;
@@ -1143,6 +1174,16 @@ void swf_endframe(gfxdevice_t*dev)
     }
 }
 
+void swf_endframe(gfxdevice_t*dev)
+{
+    swfoutput_internal*i = (swfoutput_internal*)dev->internal;
+    
+    if(!i->pagefinished)
+        endpage(dev);
+
+    finishframe(dev);
+}
+
 static void setBackground(gfxdevice_t*dev, int x1, int y1, int x2, int y2)
 {
     swfoutput_internal*i = (swfoutput_internal*)dev->internal;
@@ -1175,15 +1216,8 @@ static void setBackground(gfxdevice_t*dev, int x1, int y1, int x2, int y2)
     swf_ObjectPlaceClip(i->tag,shapeid,getNewDepth(dev),0,0,0,65535);
 }
 
-/* initialize the swf writer */
-void gfxdevice_swf_init(gfxdevice_t* dev)
+static void set_device_functions(gfxdevice_t* dev)
 {
-    memset(dev, 0, sizeof(gfxdevice_t));
-    
-    dev->name = "swf";
-
-    dev->internal = init_internal_struct(); // set config to default values
-
     dev->startpage = swf_startframe;
     dev->endpage = swf_endframe;
     dev->finish = swf_finish;
@@ -1197,6 +1231,18 @@ void gfxdevice_swf_init(gfxdevice_t* dev)
     dev->addfont = swf_addfont;
     dev->drawchar = swf_drawchar;
     dev->drawlink = swf_drawlink;
+}
+
+/* initialize the swf writer */
+void gfxdevice_swf_init(gfxdevice_t* dev)
+{
+    memset(dev, 0, sizeof(gfxdevice_t));
+    
+    dev->name = "swf";
+
+    dev->internal = init_internal_struct(); // set config to default values
+
+    set_device_functions(dev);
 
     swfoutput_internal*i = (swfoutput_internal*)dev->internal;
     i->dev = dev;
@@ -2048,6 +2094,8 @@ for(t=0;t<picpos;t++)
 ///////////
 
 
+static void set_parallel_functions(gfxdevice_t*dev);
+
 int swf_setparameter(gfxdevice_t*dev, const char*name, const char*value)
 {
     swfoutput_internal*i = (swfoutput_internal*)dev->internal;
@@ -2184,6 +2232,28 @@ int swf_setparameter(gfxdevice_t*dev, const char*name, const char*value)
 	i->config_linkcolor.g = NIBBLE(value[2])<<4 | NIBBLE(value[3]);
 	i->config_linkcolor.b = NIBBLE(value[4])<<4 | NIBBLE(value[5]);
 	i->config_linkcolor.a = NIBBLE(value[6])<<4 | NIBBLE(value[7]);
+    } else if(!strcmp(name, "threads")) {
+	int threads = atoi(value);
+#ifdef USE_THREADS
+	if(threads<=0) {
+	    /* one thread per cpu */
+#ifdef _SC_NPROCESSORS_ONLN
+	    threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	    if(threads<=0)
+		threads = 1;
+	}
+#else
+	threads = 1;
+#endif
+	if(!i->firstpage || i->fontlist) {
+	    msg("<warning> swf: threads needs to be set before the first page");
+	    return 1;
+	}
+	i->config_threads = threads;
+	set_device_functions(dev);
+	if(threads>1)
+	    set_parallel_functions(dev);
     } else if(!strcmp(name, "help")) {
 	printf("\nSWF layer options:\n");
         printf("jpegsubpixels=<pixels>      resolution adjustment for jpeg images (same as jpegdpi, but in pixels)\n");
@@ -2214,6 +2284,7 @@ int swf_setparameter(gfxdevice_t*dev, const char*name, const char*value)
         printf("jpegquality=<quality>       set compression quality of jpeg images\n");
 	printf("splinequality=<value>       Set the quality of spline convertion to value (0-100, default: 100).\n");
 	printf("disablelinks                Disable links.\n");
+	printf("threads=<num>               convert pages on <num> threads in parallel (0: one per cpu)\n");
     } else {
 	return 0;
     }
@@ -3001,7 +3072,7 @@ static void swf_addfont(gfxdevice_t*dev, gfxfont_t*font)
     } else {
 	i->fontlist = l;
     }
-    swf_FontSetID(l->swffont, getNewID(i->dev));
+    swf_FontSetID(l->swffont, getNewFontID(i->dev));
 
     if(getScreenLogLevel() >= LOGLEVEL_DEBUG)  {
 	int iii;
@@ -3100,6 +3171,9 @@ static void setfontscale(gfxdevice_t*dev,double m11,double m12, double m21,doubl
 }
 
 
+static void drawglyph(gfxdevice_t*dev, int glyph, gfxcolor_t*color, gfxmatrix_t*matrix);
+static void pagejob_useglyph(struct _pagejob*job, SWFFONT*font, int glyph, int size);
+
 static void swf_drawchar(gfxdevice_t*dev, gfxfont_t*font, int glyph, gfxcolor_t*color, gfxmatrix_t*matrix)
 {
     swfoutput_internal*i = (swfoutput_internal*)dev->internal;
@@ -3130,6 +3204,13 @@ static void swf_drawchar(gfxdevice_t*dev, gfxfont_t*font, int glyph, gfxcolor_t*
 	msg("<warning> No character %d in font %s (%d chars)", glyph, FIXNULL((char*)i->swffont->name), i->swffont->numchars);
 	return;
     }
+    drawglyph(dev, glyph, color, matrix);
+}
+
+/* draw a glyph of the current font (i->swffont) */
+static void drawglyph(gfxdevice_t*dev, int glyph, gfxcolor_t*color, gfxmatrix_t*matrix)
+{
+    swfoutput_internal*i = (swfoutput_internal*)dev->internal;
     glyph = i->swffont->glyph2glyph[glyph];
     
     setfontscale(dev, matrix->m00, matrix->m01, matrix->m10, matrix->m11, matrix->tx, matrix->ty, 0);
@@ -3190,6 +3271,791 @@ static void swf_drawchar(gfxdevice_t*dev, gfxfont_t*font, int glyph, gfxcolor_t*
     } else {
 	i->chardata = charbuffer_append(i->chardata, i->swffont, glyph, x, y, i->current_font_size, *(RGBA*)color, &i->fontmatrix);
     }
-    swf_FontUseGlyph(i->swffont, glyph, i->current_font_size);
-    return;
+    if(i->job) {
+	pagejob_useglyph(i->job, i->swffont, glyph, i->current_font_size);
+    } else {
+	swf_FontUseGlyph(i->swffont, glyph, i->current_font_size);
+    }
+}
+
+// --------------------------------------------------------------------
+// parallel page conversion (threads>1)
+
+typedef enum {
+    PAGEOP_STARTCLIP,
+    PAGEOP_ENDCLIP,
+    PAGEOP_STROKE,
+    PAGEOP_FILL,
+    PAGEOP_FILLBITMAP,
+    PAGEOP_FILLGRADIENT,
+    PAGEOP_DRAWGLYPH,
+    PAGEOP_DRAWLINK,
+    PAGEOP_SETPARAMETER
+} pageoptype_t;
+
+typedef struct _pageop {
+    pageoptype_t type;
+    gfxline_t*line;
+    gfxcolor_t color;
+    gfxcoord_t width;
+    gfx_capType cap_style;
+    gfx_joinType joint_style;
+    gfxcoord_t miterLimit;
+    gfximage_t*img;
+    gfxmatrix_t matrix;
+    gfxcxform_t*cxform;
+    gfxgradient_t*gradient;
+    gfxgradienttype_t gradienttype;
+    SWFFONT*font;
+    int glyph;
+    char*s1;
+    char*s2;
+    struct _pageop*next;
+} pageop_t;
+
+typedef struct _glyphuse {
+    SWFFONT*font;
+    int glyph;
+    int size;
+} glyphuse_t;
+
+typedef struct _pagejob {
+    pageop_t*ops;
+    pageop_t*lastop;
+
+    /* the device the page is rendered to. Its internal struct is a copy of
+       the main device's, with an empty tag list and ids starting at 1 */
+    gfxdevice_t dev;
+
+    /* swf_FontUseGlyph() calls, replayed in page order by merge_page() */
+    glyphuse_t*glyphs;
+    int num_glyphs;
+    int glyphs_size;
+
+    char endframe;
+    char done;
+    struct _pagejob*next;
+} pagejob_t;
+
+static void pagejob_useglyph(pagejob_t*job, SWFFONT*font, int glyph, int size)
+{
+    if(job->num_glyphs == job->glyphs_size) {
+	job->glyphs_size = job->glyphs_size ? job->glyphs_size*2 : 256;
+	job->glyphs = (glyphuse_t*)rfx_realloc(job->glyphs, sizeof(glyphuse_t)*job->glyphs_size);
+    }
+    glyphuse_t*u = &job->glyphs[job->num_glyphs++];
+    u->font = font;
+    u->glyph = glyph;
+    u->size = size;
+}
+
+#ifdef USE_THREADS
+
+typedef struct _pagequeue {
+    pagejob_t*first; // oldest page which isn't merged yet
+    pagejob_t*last;
+    pagejob_t*next; // next page to be picked up by a worker
+    int num_pending;
+
+    pthread_t*threads;
+    int num_threads;
+    char shutdown;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    pthread_cond_t done;
+} pagequeue_t;
+
+static gfximage_t* image_clone(gfximage_t*img)
+{
+    gfximage_t*n = (gfximage_t*)rfx_alloc(sizeof(gfximage_t));
+    *n = *img;
+    n->data = (gfxcolor_t*)rfx_alloc(sizeof(gfxcolor_t)*img->width*img->height);
+    memcpy(n->data, img->data, sizeof(gfxcolor_t)*img->width*img->height);
+    return n;
+}
+
+static gfxgradient_t* gradient_clone(gfxgradient_t*g)
+{
+    gfxgradient_t*start = 0, *last = 0;
+    while(g) {
+	gfxgradient_t*n = (gfxgradient_t*)rfx_alloc(sizeof(gfxgradient_t));
+	*n = *g;
+	n->next = 0;
+	if(last) last->next = n;
+	else start = n;
+	last = n;
+	g = g->next;
+    }
+    return start;
+}
+
+static void pageop_free(pageop_t*op)
+{
+    if(op->line) gfxline_free(op->line);
+    if(op->img) gfximage_free(op->img);
+    if(op->cxform) free(op->cxform);
+    if(op->gradient) gfxgradient_destroy(op->gradient);
+    if(op->s1) free(op->s1);
+    if(op->s2) free(op->s2);
+    free(op);
+}
+
+static pageop_t* page_addop(swfoutput_internal*i, pageoptype_t type, gfxline_t*line)
+{
+    pagejob_t*job = i->recording;
+    pageop_t*op = (pageop_t*)rfx_calloc(sizeof(pageop_t));
+    op->type = type;
+    op->line = line ? gfxline_clone(line) : 0;
+    if(job->lastop) job->lastop->next = op;
+    else job->ops = op;
+    job->lastop = op;
+    return op;
+}
+
+static pagejob_t* pagejob_new(swfoutput_internal*i)
+{
+    pagejob_t*job = (pagejob_t*)rfx_calloc(sizeof(pagejob_t));
+    swfoutput_internal*p = (swfoutput_internal*)rfx_alloc(sizeof(swfoutput_internal));
+    memcpy(p, i, sizeof(swfoutput_internal));
+
+    job->dev.name = "swf";
+    job->dev.internal = p;
+    set_device_functions(&job->dev);
+
+    p->dev = &job->dev;
+    p->swf = (SWF*)rfx_calloc(sizeof(SWF));
+    p->swf->fileVersion = i->swf->fileVersion;
+    /* placeholder, so that the tag list is never empty */
+    p->swf->firstTag = p->tag = swf_InsertTag(NULL, ST_END);
+    p->currentswfid = p->startids = 0;
+    p->fontlist = 0;
+    p->mark = i->mark ? strdup(i->mark) : 0;
+    p->recording = 0;
+    p->queue = 0;
+    p->job = job;
+    return job;
+}
+
+/* runs on a worker thread */
+static void pagejob_render(pagejob_t*job)
+{
+    gfxdevice_t*dev = &job->dev;
+    swfoutput_internal*p = (swfoutput_internal*)dev->internal;
+    pageop_t*op = job->ops;
+    while(op) {
+	pageop_t*next = op->next;
+	switch(op->type) {
+	    case PAGEOP_STARTCLIP:
+		dev->startclip(dev, op->line);
+	    break;
+	    case PAGEOP_ENDCLIP:
+		dev->endclip(dev);
+	    break;
+	    case PAGEOP_STROKE:
+		dev->stroke(dev, op->line, op->width, &op->color, op->cap_style, op->joint_style, op->miterLimit);
+	    break;
+	    case PAGEOP_FILL:
+		dev->fill(dev, op->line, &op->color);
+	    break;
+	    case PAGEOP_FILLBITMAP:
+		dev->fillbitmap(dev, op->line, op->img, &op->matrix, op->cxform);
+	    break;
+	    case PAGEOP_FILLGRADIENT:
+		dev->fillgradient(dev, op->line, op->gradient, op->gradienttype, &op->matrix);
+	    break;
+	    case PAGEOP_DRAWGLYPH:
+		p->swffont = op->font;
+		drawglyph(dev, op->glyph, &op->color, &op->matrix);
+	    break;
+	    case PAGEOP_DRAWLINK:
+		dev->drawlink(dev, op->line, op->s1, op->s2);
+	    break;
+	    case PAGEOP_SETPARAMETER:
+		dev->setparameter(dev, op->s1, op->s2);
+	    break;
+	}
+	pageop_free(op);
+	op = next;
+    }
+    job->ops = job->lastop = 0;
+    endpage(dev);
+}
+
+/* renumber the local ids (1..num_ids) of a page, starting at base+1 */
+static void renumber_tag(TAG*tag, int base, int num_ids)
+{
+    if(swf_isDefiningTag(tag)) {
+	int id = swf_GetDefineID(tag);
+	if(id>=1 && id<=num_ids)
+	    swf_SetDefineID(tag, base+id);
+    }
+    int num = swf_GetNumUsedIDs(tag);
+    if(num) {
+	int*positions = (int*)rfx_alloc(sizeof(int)*num);
+	swf_GetUsedIDs(tag, positions);
+	int t;
+	for(t=0;t<num;t++) {
+	    int id = GET16(&tag->data[positions[t]]);
+	    if(id>=1 && id<=num_ids) {
+		id += base;
+		PUT16(&tag->data[positions[t]], id);
+	    }
+	}
+	rfx_free(positions);
+    }
+    /* tag readers like swf_ButtonGetAction() expect to start at 0 */
+    swf_SetTagPos(tag, 0);
+}
+
+/* link buttons are placed with the instance name "button<id>" (see drawlink()),
+   which has to follow the button to its new id */
+static void rename_button(TAG*tag, int base, char*is_button, int num_ids)
+{
+    SWFPLACEOBJECT obj;
+    char buf[80];
+    swf_GetPlaceObject(tag, &obj);
+    if(obj.id>=1 && obj.id<=num_ids && is_button[obj.id] && obj.name) {
+	sprintf(buf, "button%d", obj.id);
+	if(!strcmp(obj.name, buf)) {
+	    rfx_free(obj.name);
+	    sprintf(buf, "button%d", base+obj.id);
+	    obj.name = strdup(buf);
+	    swf_ResetTag(tag, tag->id);
+	    swf_SetPlaceObject(tag, &obj);
+	}
+    }
+    swf_PlaceObjectFree(&obj);
+}
+
+/* append the tags of a rendered page to the movie. Runs on the main thread,
+   in page order, so the output doesn't depend on the number of threads */
+static void merge_page(gfxdevice_t*dev, pagejob_t*job)
+{
+    swfoutput_internal*i = (swfoutput_internal*)dev->internal;
+    swfoutput_internal*p = (swfoutput_internal*)job->dev.internal;
+
+    int base = i->currentswfid;
+    int num_ids = p->currentswfid;
+    if(base + num_ids > 65535 - i->num_fonts) {
+	if(!id_error) {
+	    msg("<error> ID Table overflow");
+	    msg("<error> This file is too complex to render- SWF only supports 65536 shapes at once");
+	}
+	id_error=1;
+	i->overflow = 1;
+	exit(1);
+    }
+
+    TAG*first = swf_DeleteTag(p->swf, p->swf->firstTag);
+    if(first) {
+	TAG*tag;
+	char*is_button = p->hasbuttons ? (char*)rfx_calloc(num_ids+1) : 0;
+	for(tag=first;tag;tag=tag->next) {
+	    if(is_button) {
+		if(tag->id == ST_DEFINEBUTTON || tag->id == ST_DEFINEBUTTON2) {
+		    int id = swf_GetDefineID(tag);
+		    if(id>=1 && id<=num_ids)
+			is_button[id] = 1;
+		} else if(tag->id == ST_PLACEOBJECT2) {
+		    rename_button(tag, base, is_button, num_ids);
+		}
+	    }
+	    renumber_tag(tag, base, num_ids);
+	}
+	if(is_button)
+	    rfx_free(is_button);
+	first->prev = i->tag;
+	p->tag->next = i->tag->next;
+	if(p->tag->next)
+	    p->tag->next->prev = p->tag;
+	i->tag->next = first;
+	i->tag = p->tag;
+    }
+    i->currentswfid += num_ids;
+    i->depth = p->depth;
+    i->hasbuttons |= p->hasbuttons;
+    i->overflow |= p->overflow;
+
+    int t;
+    for(t=0;t<job->num_glyphs;t++) {
+	glyphuse_t*u = &job->glyphs[t];
+	swf_FontUseGlyph(u->font, u->glyph, u->size);
+    }
+
+    if(job->endframe)
+	finishframe(dev);
+
+    if(p->mark) free(p->mark);
+    free(p->swf);
+    free(p);
+    if(job->glyphs) free(job->glyphs);
+    free(job);
+}
+
+static void* page_worker(void*_q)
+{
+    pagequeue_t*q = (pagequeue_t*)_q;
+    pthread_mutex_lock(&q->mutex);
+    while(1) {
+	while(!q->next && !q->shutdown)
+	    pthread_cond_wait(&q->work, &q->mutex);
+	pagejob_t*job = q->next;
+	if(!job)
+	    break;
+	q->next = job->next;
+	pthread_mutex_unlock(&q->mutex);
+
+	pagejob_render(job);
+
+	pthread_mutex_lock(&q->mutex);
+	job->done = 1;
+	pthread_cond_broadcast(&q->done);
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return 0;
 }
+
+/* merge finished pages, waiting for pages to finish as long as more
+   than max_pending pages are outstanding */
+static void merge_pages(gfxdevice_t*dev, int max_pending)
+{
+    swfoutput_internal*i = (swfoutput_internal*)dev->internal;
+    pagequeue_t*q = i->queue;
+    if(!q)
+	return;
+    while(q->first) {
+	pthread_mutex_lock(&q->mutex);
+	while(!q->first->done && q->num_pending > max_pending)
+	    pthread_cond_wait(&q->done, &q->mutex);
+	pagejob_t*job = q->first;
+	if(!job->done) {
+	    pthread_mutex_unlock(&q->mutex);
+	    break;
+	}
+	q->first = job->next;
+	if(!q->first)
+	    q->last = 0;
+	q->num_pending--;
+	pthread_mutex_unlock(&q->mutex);
+
+	merge_page(dev, job);
+    }
+}
+
+static void queue_page(gfxdevice_t*dev, pagejob_t*job)
+{
+    swfoutput_internal*i = (swfoutput_internal*)dev->internal;
+    pagequeue_t*q = i->queue;
+    if(!q) {
+	q = i->queue = (pagequeue_t*)rfx_calloc(sizeof(pagequeue_t));
+	pthread_mutex_init(&q->mutex, 0);
+	pthread_cond_init(&q->work, 0);
+	pthread_cond_init(&q->done, 0);
+	q->num_threads = i->config_threads;
+	q->threads = (pthread_t*)rfx_calloc(sizeof(pthread_t)*q->num_threads);
+	int t;
+	for(t=0;t<q->num_threads;t++) {
+	    if(pthread_create(&q->threads[t], 0, page_worker, q)) {
+		msg("<fatal> Couldn't create page thread");
+		exit(1);
+	    }
+	}
+    }
+    pthread_mutex_lock(&q->mutex);
+    if(q->last) q->last->next = job;
+    else q->first = job;
+    q->last = job;
+    if(!q->next)
+	q->next = job;
+    q->num_pending++;
+    pthread_cond_signal(&q->work);
+    pthread_mutex_unlock(&q->mutex);
+
+    /* don't let recorded pages pile up if the workers can't keep up */
+    merge_pages(dev, q->num_threads*2);
+}
+
+static void stop_workers(gfxdevice_t*dev)
+{
+    swfoutput_internal*i = (swfoutput_internal*)dev->internal;
+    pagequeue_t*q = i->queue;
+    if(!q)
+	return;
+    merge_pages(dev, 0);
+    pthread_mutex_lock(&q->mutex);
+    q->shutdown = 1;
+    pthread_cond_broadcast(&q->work);
+    pthread_mutex_unlock(&q->mutex);
+    int t;
+    for(t=0;t<q->num_threads;t++)
+	pthread_join(q->threads[t], 0);
+    pthread_mutex_destroy(&q->mutex);
+    pthread_cond_destroy(&q->work);
+    pthread_cond_destroy(&q->done);
+    free(q->threads);
+    free(q);
+    i->queue = 0;
+}
+
+/* the functions below are the device functions with threads>1. Inside
+   a page they record, outside of it they pass through to the normal device
+   functions, after all pending pages have been merged. */
+
+static void pswf_startframe(gfxdevice_t*dev, int width, int height)
+{
+    swfoutput_internal*i = (swfoutput_internal*)dev->internal;
+    if(!i->pagefinished)
+	merge_pages(dev, 0);
+    swf_startframe(dev, width, height);
+    if(i->config_watermark || i->config_showclipshapes) {
+	/* these carry state from one page to the next */
+	return;
+    }
+    i->recording = pagejob_new(i);
+    i->pagefinished = 1;
+}
+
+static void pswf_endframe(gfxdevice_t*dev)
+{
+    swfoutput_internal*i = (swfoutput_internal*)dev->internal;
+    if(!i->recording) {
+	merge_pages(dev, 0);
+	swf_endframe(dev);
+	return;
+    }
+    pagejob_t*job = i->recording;
+    i->recording = 0;
+    job->endframe = 1;
+    queue_page(dev, job);
+}
+
+static gfxresult_t* pswf_finish(gfxdevice_t*dev)
+{
+    swfoutput_internal*i = (swfoutput_internal*)dev->internal;
+    if(i->recording) {
+	pagejob_t*job = i->recording;
+	i->recording = 0;
+	queue_page(dev, job);
+    }
+    stop_workers(dev);
+    return swf_finish(dev);
+}
+
+static int pswf_setparameter(gfxdevice_t*dev, const char*key, const char*value)
+{
+    swfoutput_internal*i = (swfoutput_internal*)dev->internal;
+    if(i->recording && strcmp(key, "threads")) {
+	pageop_t*op = page_addop(i, PAGEOP_SETPARAMETER, 0);
+	op->s1 = strdup(key);
+	op->s2 = strdup(value);
+	int ret = swf_setparameter(dev, key, value);
+	/* the image this applies to is drawn by the page device */
+	i->jpeg = 0;
+	return ret;
+    }
+    return swf_setparameter(dev, key, value);
+}
+
+static void pswf_startclip(gfxdevice_t*dev, gfxline_t*line)
+{
+    swfoutput_internal*i = (swfoutput_internal*)dev->internal;
+    if(!i->recording) {
+	merge_pages(dev, 0);
+	swf_startclip(dev, line);
+	return;
+    }
+    page_addop(i, PAGEOP_STARTCLIP, line);
+}
+
+static void pswf_endclip(gfxdevice_t*dev)
+{
+    swfoutput_internal*i = (swfoutput_internal*)dev->internal;
+    if(!i->recording) {
+	merge_pages(dev, 0);
+	swf_endclip(dev);
+	return;
+    }
+    page_addop(i, PAGEOP_ENDCLIP, 0);
+}
+
+static void pswf_stroke(gfxdevice_t*dev, gfxline_t*line, gfxcoord_t width, gfxcolor_t*color, gfx_capType cap_style, gfx_joinType joint_style, gfxcoord_t miterLimit)
+{
+    swfoutput_internal*i = (swfoutput_internal*)dev->internal;
+    if(!i->recording) {
+	merge_pages(dev, 0);
+	swf_stroke(dev, line, width, color, cap_style, joint_style, miterLimit);
+	return;
+    }
+    pageop_t*op = page_addop(i, PAGEOP_STROKE, line);
+    op->width = width;
+    op->color = *color;
+    op->cap_style = cap_style;
+    op->joint_style = joint_style;
+    op->miterLimit = miterLimit;
+}
+
+static void pswf_fill(gfxdevice_t*dev, gfxline_t*line, gfxcolor_t*color)
+{
+    swfoutput_internal*i = (swfoutput_internal*)dev->internal;
+    if(!i->recording) {
+	merge_pages(dev, 0);
+	swf_fill(dev, line, color);
+	return;
+    }
+    page_addop(i, PAGEOP_FILL, line)->color = *color;
+}
+
+static void pswf_fillbitmap(gfxdevice_t*dev, gfxline_t*line, gfximage_t*img, gfxmatrix_t*matrix, gfxcxform_t*cxform)
+{
+    swfoutput_internal*i = (swfoutput_internal*)dev->internal;
+    if(!i->recording) {
+	merge_pages(dev, 0);
+	swf_fillbitmap(dev, line, img, matrix, cxform);
+	return;
+    }
+    pageop_t*op = page_addop(i, PAGEOP_FILLBITMAP, line);
+    op->img = image_clone(img);
+    op->matrix = *matrix;
+    if(cxform) {
+	op->cxform = (gfxcxform_t*)rfx_alloc(sizeof(gfxcxform_t));
+	*op->cxform = *cxform;
+    }
+}
+
+static void pswf_fillgradient(gfxdevice_t*dev, gfxline_t*line, gfxgradient_t*gradient, gfxgradienttype_t type, gfxmatrix_t*matrix)
+{
+    swfoutput_internal*i = (swfoutput_internal*)dev->internal;
+    if(!i->recording) {
+	merge_pages(dev, 0);
+	swf_fillgradient(dev, line, gradient, type, matrix);
+	return;
+    }
+    pageop_t*op = page_addop(i, PAGEOP_FILLGRADIENT, line);
+    op->gradient = gradient_clone(gradient);
+    op->gradienttype = type;
+    op->matrix = *matrix;
+}
+
+static void pswf_drawchar(gfxdevice_t*dev, gfxfont_t*font, int glyph, gfxcolor_t*color, gfxmatrix_t*matrix)
+{
+    swfoutput_internal*i = (swfoutput_internal*)dev->internal;
+    if(!i->recording) {
+	merge_pages(dev, 0);
+	swf_drawchar(dev, font, glyph, color, matrix);
+	return;
+    }
+    if(!font) {
+	msg("<error> swf_drawchar called (glyph %d) without font", glyph);
+	return;
+    }
+    if(i->config_drawonlyshapes) {
+	gfxline_t*line = gfxline_clone(font->glyphs[glyph].line);
+	gfxline_transform(line, matrix);
+	pageop_t*op = page_addop(i, PAGEOP_FILL, 0);
+	op->line = line;
+	op->color = *color;
+	return;
+    }
+    /* fonts are resolved here, so that the page devices never have to
+       look at the font list */
+    if(!i->swffont || !i->swffont->name || strcmp((char*)i->swffont->name,font->id))
+	swf_switchfont(dev, font->id);
+    if(!i->swffont) {
+	msg("<warning> swf_drawchar: Font is NULL");
+	return;
+    }
+    if(glyph<0 || glyph>=i->swffont->numchars) {
+	msg("<warning> No character %d in font %s (%d chars)", glyph, FIXNULL((char*)i->swffont->name), i->swffont->numchars);
+	return;
+    }
+    pageop_t*op = page_addop(i, PAGEOP_DRAWGLYPH, 0);
+    op->font = i->swffont;
+    op->glyph = glyph;
+    op->color = *color;
+    op->matrix = *matrix;
+}
+
+static void pswf_drawlink(gfxdevice_t*dev, gfxline_t*line, const char*action, const char*text)
+{
+    swfoutput_internal*i = (swfoutput_internal*)dev->internal;
+    if(!i->recording) {
+	merge_pages(dev, 0);
+	swf_drawlink(dev, line, action, text);
+	return;
+    }
+    pageop_t*op = page_addop(i, PAGEOP_DRAWLINK, line);
+    op->s1 = strdup(action);
+    op->s2 = text ? strdup(text) : 0;
+}
+
+static void set_parallel_functions(gfxdevice_t*dev)
+{
+    dev->startpage = pswf_startframe;
+    dev->endpage = pswf_endframe;
+    dev->finish = pswf_finish;
+    dev->fillbitmap = pswf_fillbitmap;
+    dev->setparameter = pswf_setparameter;
+    dev->stroke = pswf_stroke;
+    dev->startclip = pswf_startclip;
+    dev->endclip = pswf_endclip;
+    dev->fill = pswf_fill;
+    dev->fillgradient = pswf_fillgradient;
+    dev->drawchar = pswf_drawchar;
+    dev->drawlink = pswf_drawlink;
+}
+
+#else
+
+static void set_parallel_functions(gfxdevice_t*dev)
+{
+}
+
+#endif
+
+#ifdef MAIN
+#include <assert.h>
+
+/* a few pages of text, shapes and links */
+static SWF* render_test_pages(const char*threads, const char*flashversion)
+{
+    gfxdevice_t dev;
+    gfxdevice_swf_init(&dev);
+    dev.setparameter(&dev, "threads", threads);
+    dev.setparameter(&dev, "flashversion", flashversion);
+
+    gfxfont_t*font = (gfxfont_t*)rfx_calloc(sizeof(gfxfont_t));
+    font->id = strdup("testfont");
+    font->num_glyphs = 20;
+    font->glyphs = (gfxglyph_t*)rfx_calloc(sizeof(gfxglyph_t)*font->num_glyphs);
+    font->max_unicode = 128;
+    font->unicode2glyph = (int*)rfx_calloc(sizeof(int)*font->max_unicode);
+    int t;
+    for(t=0;t<font->num_glyphs;t++) {
+	font->glyphs[t].line = gfxline_makecircle(300,300,100+t*10,300);
+	font->glyphs[t].advance = 600;
+	font->glyphs[t].unicode = 'a'+t;
+	font->unicode2glyph['a'+t] = t;
+    }
+    dev.addfont(&dev, font);
+
+    int p;
+    for(p=0;p<12;p++) {
+	dev.startpage(&dev, 600, 800);
+	int n;
+	for(n=0;n<100;n++) {
+	    gfxcolor_t c = {255, n*2, p*20, 0};
+	    gfxmatrix_t m = {0.02, 0, (n%10)*50.0, 0, 0.02, (n/10)*50.0+20};
+	    dev.drawchar(&dev, font, (n+p)%font->num_glyphs, &c, &m);
+	    if(n%25 == 0) {
+		gfxline_t*l = gfxline_makecircle(n*5, p*50, 40+p, 30);
+		dev.fill(&dev, l, &c);
+		gfxline_free(l);
+	    }
+	    if(n%40 == 0) {
+		char url[40];
+		sprintf(url, n%80 ? "page%d" : "http://localhost/%d", p+1);
+		gfxline_t*l = gfxline_makerectangle(20+n, 700, 120+n, 740);
+		dev.drawlink(&dev, l, url, 0);
+		gfxline_free(l);
+	    }
+	}
+	dev.endpage(&dev);
+    }
+    gfxresult_t*r = dev.finish(&dev);
+    SWF*swf = (SWF*)r->get(r, "swf");
+    r->destroy(r);
+    return swf;
+}
+
+/* every link button must be placed under the name the link scripts use */
+static void check_button_names(SWF*swf)
+{
+    char*is_button = (char*)rfx_calloc(65536);
+    int num = 0;
+    TAG*tag;
+    for(tag=swf->firstTag;tag;tag=tag->next) {
+	if(tag->id == ST_DEFINEBUTTON || tag->id == ST_DEFINEBUTTON2)
+	    is_button[swf_GetDefineID(tag)] = 1;
+	if(tag->id == ST_PLACEOBJECT2) {
+	    SWFPLACEOBJECT obj;
+	    swf_GetPlaceObject(tag, &obj);
+	    if(obj.id && is_button[obj.id]) {
+		char buf[80];
+		sprintf(buf, "button%d", obj.id);
+		assert(obj.name && !strcmp(obj.name, buf));
+		num++;
+	    }
+	    swf_PlaceObjectFree(&obj);
+	}
+    }
+    assert(num == 12*3);
+    free(is_button);
+}
+
+/* the parallel output may only differ from the serial one in the
+   character ids it assigns */
+static void compare_swfs(SWF*serial, SWF*parallel)
+{
+    U16*map = (U16*)rfx_calloc(sizeof(U16)*65536);
+    TAG*t1 = serial->firstTag, *t2 = parallel->firstTag;
+    for(;t1 && t2;t1=t1->next, t2=t2->next) {
+	assert(t1->id == t2->id);
+	if(swf_isDefiningTag(t1))
+	    map[swf_GetDefineID(t1)] = swf_GetDefineID(t2);
+
+	TAG*tag = swf_InsertTag(0, t1->id);
+	swf_SetBlock(tag, t1->data, t1->len);
+	if(tag->id == ST_PLACEOBJECT2) {
+	    SWFPLACEOBJECT obj;
+	    char buf[80];
+	    swf_GetPlaceObject(tag, &obj);
+	    sprintf(buf, "button%d", obj.id);
+	    if(obj.name && !strcmp(obj.name, buf)) {
+		rfx_free(obj.name);
+		sprintf(buf, "button%d", map[obj.id]);
+		obj.name = strdup(buf);
+		swf_ResetTag(tag, tag->id);
+		swf_SetPlaceObject(tag, &obj);
+	    }
+	    swf_PlaceObjectFree(&obj);
+	}
+	if(swf_isDefiningTag(tag))
+	    swf_SetDefineID(tag, map[swf_GetDefineID(tag)]);
+	int num = swf_GetNumUsedIDs(tag);
+	if(num) {
+	    int*positions = (int*)rfx_alloc(sizeof(int)*num);
+	    swf_GetUsedIDs(tag, positions);
+	    int t;
+	    for(t=0;t<num;t++) {
+		int id = GET16(&tag->data[positions[t]]);
+		PUT16(&tag->data[positions[t]], map[id]);
+	    }
+	    rfx_free(positions);
+	}
+	assert(tag->len == t2->len && !memcmp(tag->data, t2->data, tag->len));
+	swf_DeleteTag(0, tag);
+    }
+    assert(!t1 && !t2);
+    free(map);
+}
+
+int main()
+{
+#ifdef USE_THREADS
+    SWF*serial = render_test_pages("1", "8");
+    SWF*parallel = render_test_pages("4", "8");
+    check_button_names(serial);
+    check_button_names(parallel);
+    compare_swfs(serial, parallel);
+    swf_FreeTags(serial);free(serial);
+    swf_FreeTags(parallel);free(parallel);
+
+    /* with flash 9, the link handlers are bound to the button names */
+    parallel = render_test_pages("4", "9");
+    check_button_names(parallel);
+    swf_FreeTags(parallel);free(parallel);
+#endif
+    return 0;
+}
+#endif
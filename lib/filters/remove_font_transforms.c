@@ -187,75 +187,93 @@ static void glyph_transform(gfxglyph_t*g, mymatrix_t*mm)
     gfxline_transform(g->line, &m);
 }
 
-static gfxresult_t* pass1_finish(gfxfilter_t*f, gfxdevice_t*out)
+static void transformedfont_make(transformedfont_t*fd)
 {
-    internal_t*i = (internal_t*)f->internal;
-    DICT_ITERATE_DATA(i->matrices, transformedfont_t*, fd) {
-	gfxfont_t*font = fd->font = rfx_calloc(sizeof(gfxfont_t));
-	char id[80];
-	static int fontcount=0;
-	sprintf(id, "font%d", fontcount++);
-	font->id = strdup(id);
-	int t;
-	int count=0;
-	for(t=0;t<fd->orig->num_glyphs;t++) {
-	    if(fd->used[t]) 
-		count++;
-	}
-	font->num_glyphs = count;
-	font->glyphs = rfx_calloc(sizeof(gfxglyph_t)*font->num_glyphs);
-	count = 0;
-	for(t=0;t<fd->orig->num_glyphs;t++) {
-	    if(fd->used[t]) {
-		font->glyphs[count] = fd->orig->glyphs[t];
-		glyph_transform(&font->glyphs[count], &fd->matrix);
-		fd->used[t] = count + 1;
-		count++;
-	    }
+    gfxfont_t*font = fd->font = rfx_calloc(sizeof(gfxfont_t));
+    char id[80];
+    static int fontcount=0;
+    sprintf(id, "font%d", fontcount++);
+    font->id = strdup(id);
+    int t;
+    int count=0;
+    for(t=0;t<fd->orig->num_glyphs;t++) {
+	if(fd->used[t]) 
+	    count++;
+    }
+    font->num_glyphs = count;
+    font->glyphs = rfx_calloc(sizeof(gfxglyph_t)*font->num_glyphs);
+    count = 0;
+    for(t=0;t<fd->orig->num_glyphs;t++) {
+	if(fd->used[t]) {
+	    font->glyphs[count] = fd->orig->glyphs[t];
+	    glyph_transform(&font->glyphs[count], &fd->matrix);
+	    fd->used[t] = count + 1;
+	    count++;
 	}
+    }
 
-	/* adjust the origin so that every character is to the
-	   right of the origin */
-	gfxbbox_t total = {0,0,0,0};
-	double average_xmax = 0;
-	for(t=0;t<count;t++) {
-	    gfxline_t*line = font->glyphs[t].line;
-	    gfxbbox_t b = gfxline_getbbox(line);
-	    total = gfxbbox_expand_to_bbox(total, b);
-	}
-	if(count) 
-	    average_xmax /= count;
-
-	fd->dx = 0;//-total.xmin;
-
-	font->ascent = total.ymax;
-	font->descent = -total.ymin;
-
-	for(t=0;t<count;t++) {
-	    gfxglyph_t*g = &font->glyphs[t];
-	    gfxline_t*line = font->glyphs[t].line;
-
-	    if(fd->matrix.alpha) {
-		while(line) {
-		    line->x += fd->dx;
-		    line->sx += fd->dx;
-		    line = line->next;
-		}
-	    } else {
-		gfxline_free(g->line);
-		/* for OCR: remove the outlines of characters that are only
-		   ever displayed with alpha=0 */
-		g->line = (gfxline_t*)rfx_calloc(sizeof(gfxline_t));
-		g->line->type = gfx_moveTo;
-		g->line->x = g->advance;
+    /* adjust the origin so that every character is to the
+       right of the origin */
+    gfxbbox_t total = {0,0,0,0};
+    double average_xmax = 0;
+    for(t=0;t<count;t++) {
+	gfxline_t*line = font->glyphs[t].line;
+	gfxbbox_t b = gfxline_getbbox(line);
+	total = gfxbbox_expand_to_bbox(total, b);
+    }
+    if(count) 
+	average_xmax /= count;
+
+    fd->dx = 0;//-total.xmin;
+
+    font->ascent = total.ymax;
+    font->descent = -total.ymin;
+
+    for(t=0;t<count;t++) {
+	gfxglyph_t*g = &font->glyphs[t];
+	gfxline_t*line = font->glyphs[t].line;
+
+	if(fd->matrix.alpha) {
+	    while(line) {
+		line->x += fd->dx;
+		line->sx += fd->dx;
+		line = line->next;
 	    }
+	} else {
+	    gfxline_free(g->line);
+	    /* for OCR: remove the outlines of characters that are only
+	       ever displayed with alpha=0 */
+	    g->line = (gfxline_t*)rfx_calloc(sizeof(gfxline_t));
+	    g->line->type = gfx_moveTo;
+	    g->line->x = g->advance;
 	}
+    }
+
+    gfxfont_fix_unicode(font, 1);
+}
 
-	gfxfont_fix_unicode(font, 1);
+static gfxresult_t* pass1_finish(gfxfilter_t*f, gfxdevice_t*out)
+{
+    internal_t*i = (internal_t*)f->internal;
+    DICT_ITERATE_DATA(i->matrices, transformedfont_t*, fd) {
+	transformedfont_make(fd);
     }
     return out->finish(out);
 }
 
+static void draw_transformed(transformedfont_t*d, int glyphnr, gfxcolor_t*color, gfxmatrix_t*scalematrix, gfxdevice_t*out)
+{
+    scalematrix->tx -= d->dx*scalematrix->m00;
+
+    /* if this character is invisible (alpha=0), then we will have removed the
+       outline, so we make set the alpha color channel to "fully visible" again to allow
+       output devices to be more performant (transparency is expensive) */
+    if(!d->matrix.alpha) 
+	color->a = 255;
+
+    out->drawchar(out, d->font, d->used[glyphnr]-1, color, scalematrix);
+}
+
 static void pass2_addfont(gfxfilter_t*f, gfxfont_t*font, gfxdevice_t*out)
 {
     /* we throw away original fonts, and do the addfont() for the transformed
@@ -276,17 +294,39 @@ static void pass2_drawchar(gfxfilter_t*f, gfxfont_t*font, int glyphnr, gfxcolor_
 
     mymatrix_t m;
     gfxmatrix_t scalematrix;
-    matrix_convert(matrix, font->id?font->id:"unknown", &m, &scalematrix, color.a);
+    if(!matrix_convert(matrix, font->id?font->id:"unknown", &m, &scalematrix, color.a))
+	return;
     transformedfont_t*d = dict_lookup(i->matrices, &m);
-    scalematrix.tx -= d->dx*scalematrix.m00;
-
-    /* if this character is invisible (alpha=0), then we will have removed the
-       outline, so we make set the alpha color channel to "fully visible" again to allow
-       output devices to be more performant (transparency is expensive) */
-    if(!m.alpha) 
-	color.a = 255;
+    draw_transformed(d, glyphnr, &color, &scalematrix, out);
+}
 
-    out->drawchar(out, d->font, d->used[glyphnr]-1, &color, &scalematrix);
+/* online mode: a transformed font is created, with all the glyphs of
+   the original font, the first time a (font, matrix) combination is
+   seen, and handed to the output device right before its first use.
+   This needs no recording, at the price of fonts which may contain
+   glyphs which are never drawn. */
+static void online_drawchar(gfxfilter_t*f, gfxfont_t*font, int glyphnr, gfxcolor_t*_color, gfxmatrix_t*matrix, gfxdevice_t*out)
+{
+    internal_t*i = (internal_t*)f->internal;
+    gfxcolor_t color = *_color;
+    mymatrix_t m;
+    gfxmatrix_t scalematrix;
+    if(!font->id) 
+	msg("<error> Font has no ID");
+    if(!matrix_convert(matrix, font->id?font->id:"unknown", &m, &scalematrix, color.a))
+	return;
+    transformedfont_t*d = dict_lookup(i->matrices, &m);
+    if(!d) {
+	d = transformedfont_new(font, &m);
+	int t;
+	for(t=0;t<font->num_glyphs;t++) {
+	    d->used[t] = 1;
+	}
+	transformedfont_make(d);
+	dict_put(i->matrices, &m, d);
+	out->addfont(out, d->font);
+    }
+    draw_transformed(d, glyphnr, &color, &scalematrix, out);
 }
 
 static gfxresult_t* pass2_finish(gfxfilter_t*f, gfxdevice_t*out)
@@ -324,3 +364,18 @@ void gfxtwopassfilter_remove_font_transforms_init(gfxtwopassfilter_t*f)
     i->first = 1;
 }
 
+void gfxfilter_remove_font_transforms_online_init(gfxfilter_t*f)
+{
+    internal_t*i = (internal_t*)rfx_calloc(sizeof(internal_t));
+
+    memset(f, 0, sizeof(gfxfilter_t));
+    f->type = gfxfilter_onepass;
+
+    f->name = "remove font transforms";
+    f->addfont = pass2_addfont;
+    f->drawchar = online_drawchar;
+    f->finish = pass2_finish;
+    f->internal = i;
+
+    i->matrices = dict_new2(&mymatrix_type);
+}
@@ -175,7 +175,14 @@ static void pass2_startpage(gfxfilter_t*f, int width, int height, gfxdevice_t*ou
 static void pass2_endpage(gfxfilter_t*f, gfxdevice_t*out)
 {
     internal_t*i = (internal_t*)f->internal;
-    i->current_page = i->current_page->next;
+    /* pass 2 never looks at a page again once it's done with it */
+    page_t*page = i->current_page;
+    i->current_page = page->next;
+    i->first_page = page->next;
+    if(i->last_page == page)
+        i->last_page = 0;
+    free(page->visible);
+    free(page);
     out->endpage(out);
 }
 static void pass2_addfont(gfxfilter_t*f, gfxfont_t*font, gfxdevice_t*out)
@@ -238,5 +245,8 @@ void gfxtwopassfilter_remove_invisible_characters_init(gfxtwopassfilter_t*f)
     f->pass2.endpage = pass2_endpage;
     f->pass2.finish = pass2_finish;
     f->pass2.internal = i;
+
+    /* the visibility of a character only depends on the page it's on */
+    f->page_scope = 1;
 }
 
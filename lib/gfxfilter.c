@@ -37,6 +37,10 @@ typedef struct _internal {
     int num_passes;
     gfxdevice_t record;
     gfxtwopassfilter_t*twopass;
+
+    /* for page scope two pass filters: */
+    gfxdevice_t*pass2;
+    gfxfontlist_t*fonts;
 } internal_t;
 
 static int filter_setparameter(gfxdevice_t*dev, const char*key, const char*value)
@@ -311,15 +315,98 @@ static gfxresult_t* twopass_finish(gfxdevice_t*dev)
     return twopass_finish(dev);
 }
 
-gfxdevice_t*gfxtwopassfilter_apply(gfxtwopassfilter_t*_twopass, gfxdevice_t*out)
+static void pagescope_endpage(gfxdevice_t*dev)
+{
+    internal_t*i = (internal_t*)dev->internal;
+    if(i->filter->endpage) {
+	filter_endpage(dev);
+    } else {
+	passthrough_endpage(dev);
+    }
+    /* pass 1 is done with this page- run pass 2 over it, and
+       start the next page with an empty recording */
+    gfxdevice_record_flush(&i->record, i->pass2, &i->fonts);
+}
+
+static gfxresult_t* pagescope_finish(gfxdevice_t*dev)
+{
+    internal_t*i = (internal_t*)dev->internal;
+
+    gfxresult_t*r;
+    if(i->filter->finish) {
+	r = i->filter->finish(i->filter, i->out);
+    } else {
+	r = i->out->finish(i->out);
+    }
+    /* anything which came after the last page */
+    gfxresult_record_replay(r, i->pass2, &i->fonts);
+    r->destroy(r);
+
+    internal_t*i2 = (internal_t*)i->pass2->internal;
+    if(i2->filter->finish) {
+	r = i2->filter->finish(i2->filter, i2->out);
+    } else {
+	r = i2->out->finish(i2->out);
+    }
+    gfxfontlist_free(i->fonts, 0);
+    free(i2);
+    free(i->pass2);
+    free(i->twopass);
+    free(i);
+    dev->internal = 0;
+    free(dev);
+    return r;
+}
+
+static gfxdevice_t*pagescope_apply(gfxtwopassfilter_t*twopass, gfxdevice_t*out)
 {
     internal_t*i = (internal_t*)rfx_calloc(sizeof(internal_t));
     gfxdevice_t*dev = (gfxdevice_t*)rfx_calloc(sizeof(gfxdevice_t));
 
+    /* pass 1 only needs to hold a single page, so it records into memory,
+       and every endpage() streams the page on to pass 2 */
+    gfxdevice_record_init(&i->record, /*use tempfile*/0);
+
+    internal_t*i2 = (internal_t*)rfx_calloc(sizeof(internal_t));
+    i2->filter = &twopass->pass2;
+    i2->out = out;
+    i2->pass = 2;
+    i->pass2 = (gfxdevice_t*)rfx_calloc(sizeof(gfxdevice_t));
+    i->pass2->internal = i2;
+    setup_twopass(i->pass2, i2->filter);
+
+    i->out = &i->record;
+    i->final_out = out;
+    i->twopass = twopass;
+    i->pass = 1;
+    i->num_passes = 2;
+
+    dev->internal = i;
+
+    i->filter = &twopass->pass1;
+    setup_twopass(dev, i->filter);
+    dev->endpage = pagescope_endpage;
+    dev->finish = pagescope_finish;
+
+    return dev;
+}
+
+gfxdevice_t*gfxtwopassfilter_apply(gfxtwopassfilter_t*_twopass, gfxdevice_t*out)
+{
     gfxtwopassfilter_t*twopass = (gfxtwopassfilter_t*)rfx_alloc(sizeof(gfxtwopassfilter_t));
     memcpy(twopass, _twopass, sizeof(gfxtwopassfilter_t));
+
+    if(twopass->page_scope) {
+	return pagescope_apply(twopass, out);
+    }
+
+    internal_t*i = (internal_t*)rfx_calloc(sizeof(internal_t));
+    gfxdevice_t*dev = (gfxdevice_t*)rfx_calloc(sizeof(gfxdevice_t));
    
     gfxdevice_record_init(&i->record, /*use tempfile*/1);
+    /* pass 2 needs the whole document- store it as one compressed
+       frame per page, to keep the temporary file small */
+    gfxdevice_record_set_compression(&i->record, 1);
 
     i->out = &i->record;
     i->final_out = out;
@@ -352,8 +439,14 @@ static void add_to_chain(char*cmd, dict_t*params, gfxfilterchain_t**chain, gfxfi
         f = malloc(sizeof(gfxfilter_t));
         gfxfilter_rescale_images_init((gfxfilter_t*)f);
     } else if(!strcmp(cmd, "remove_font_transforms")) {
-        f = malloc(sizeof(gfxtwopassfilter_t));
-        gfxtwopassfilter_remove_font_transforms_init((gfxtwopassfilter_t*)f);
+        char*online = dict_lookup(params, "online");
+        if(online && atoi(online)) {
+            f = malloc(sizeof(gfxfilter_t));
+            gfxfilter_remove_font_transforms_online_init((gfxfilter_t*)f);
+        } else {
+            f = malloc(sizeof(gfxtwopassfilter_t));
+            gfxtwopassfilter_remove_font_transforms_init((gfxtwopassfilter_t*)f);
+        }
     } else if(!strcmp(cmd, "remove_invisible_characters")) {
         f = malloc(sizeof(gfxtwopassfilter_t));
         gfxtwopassfilter_remove_invisible_characters_init((gfxtwopassfilter_t*)f);
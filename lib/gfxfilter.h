@@ -67,6 +67,11 @@ typedef struct _gfxtwopassfilter
     gfxfiltertype_t type;
     gfxfilter_t pass1;
     gfxfilter_t pass2;
+
+    /* set if pass 2 of a page only depends on what pass 1 saw on
+       the same page. Such filters are run one page at a time, instead
+       of recording the whole document before starting pass 2. */
+    char page_scope;
 } gfxtwopassfilter_t;
 
 gfxdevice_t*gfxfilter_apply(gfxfilter_t*filter, gfxdevice_t*dev);
@@ -97,6 +102,7 @@ void gfxfilterchain_destroy(gfxfilterchain_t*chain);
 void gfxfilter_maketransparent_init(gfxfilter_t*f, U8 alpha);
 void gfxfilter_flatten_init(gfxfilter_t*f);
 void gfxfilter_rescale_images_init(gfxfilter_t*f);
+void gfxfilter_remove_font_transforms_online_init(gfxfilter_t*f);
 void gfxtwopassfilter_remove_font_transforms_init(gfxtwopassfilter_t*f);
 void gfxtwopassfilter_one_big_font_init(gfxtwopassfilter_t*f);
 void gfxtwopassfilter_vectors_to_glyphs_init(gfxtwopassfilter_t*f);
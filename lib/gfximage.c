@@ -12,6 +12,16 @@
 #ifdef HAVE_FFTW3
 #include <fftw3.h>
 #endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+#include <pthread.h>
+#define USE_THREADS
+#endif
 
 #define MOD(x,d) (((x)+(d))%(d))
 
@@ -59,6 +69,7 @@ typedef struct rgba_int {
 } rgba_int_t;
 
 static int bicubic = 0;
+static int rescale_threads = 0;
 
 static scale_lookup_t**make_scale_lookup(int width, int newwidth)
 {
@@ -113,6 +124,14 @@ static scale_lookup_t**make_scale_lookup(int width, int newwidth)
     return lblockx;
 }
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+/* AVX2 versions are compiled in regardless of the compiler flags,
+   and selected at runtime if the cpu supports them */
+#include <immintrin.h>
+#define USE_AVX2
+#endif
+
 static void encodeMonochromeImage(gfxcolor_t*data, int width, int height, gfxcolor_t*colors)
 {
     int t;
@@ -129,7 +148,16 @@ static void encodeMonochromeImage(gfxcolor_t*data, int width, int height, gfxcol
     }
     *(U32*)&colors[0] = color1;
     *(U32*)&colors[1] = color2;
-    for(t=0;t<len;t++) {
+    t = 0;
+#ifdef __SSE2__
+    __m128i c1 = _mm_set1_epi32(color1);
+    __m128i ones = _mm_set1_epi32(0xffffffff);
+    for(;t+4<=len;t+=4) {
+	__m128i p = _mm_loadu_si128((__m128i*)&img[t]);
+	_mm_storeu_si128((__m128i*)&img[t], _mm_xor_si128(_mm_cmpeq_epi32(p, c1), ones));
+    }
+#endif
+    for(;t<len;t++) {
 	if(img[t] == color1) {
 	    img[t] = 0;
 	} else {
@@ -140,10 +168,31 @@ static void encodeMonochromeImage(gfxcolor_t*data, int width, int height, gfxcol
 
 static void decodeMonochromeImage(gfxcolor_t*data, int width, int height, gfxcolor_t*colors)
 {
-    int t;
+    int t = 0;
     int len = width*height;
 
-    for(t=0;t<len;t++) {
+#ifdef __SSE2__
+    /* the mixing is done in 16 bit lanes, two pixels at a time.
+       colors[0]*(255-m) + colors[1]*m is at most 255*255. */
+    __m128i zero = _mm_setzero_si128();
+    __m128i c0 = _mm_unpacklo_epi8(_mm_set1_epi32(*(U32*)&colors[0]), zero);
+    __m128i c1 = _mm_unpacklo_epi8(_mm_set1_epi32(*(U32*)&colors[1]), zero);
+    __m128i v255 = _mm_set1_epi16(255);
+    for(;t+4<=len;t+=4) {
+	__m128i p = _mm_loadu_si128((__m128i*)&data[t]);
+	__m128i lo = _mm_unpacklo_epi8(p, zero);
+	__m128i hi = _mm_unpackhi_epi8(p, zero);
+	/* broadcast the alpha value (the first byte) of every pixel */
+	__m128i mlo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0), 0);
+	__m128i mhi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0), 0);
+	lo = _mm_add_epi16(_mm_mullo_epi16(c0, _mm_sub_epi16(v255, mlo)), _mm_mullo_epi16(c1, mlo));
+	hi = _mm_add_epi16(_mm_mullo_epi16(c0, _mm_sub_epi16(v255, mhi)), _mm_mullo_epi16(c1, mhi));
+	lo = _mm_srli_epi16(lo, 8);
+	hi = _mm_srli_epi16(hi, 8);
+	_mm_storeu_si128((__m128i*)&data[t], _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for(;t<len;t++) {
 	U32 m = data[t].a;
 	data[t].r = (colors[0].r * (255-m) + colors[1].r * m) >> 8;
 	data[t].g = (colors[0].g * (255-m) + colors[1].g * m) >> 8;
@@ -152,10 +201,89 @@ static void decodeMonochromeImage(gfxcolor_t*data, int width, int height, gfxcol
     }
 }
 
+/* acc[i] += src[i]*weight, for weights below 65536 */
+typedef void (*blur_accumulate_t)(U32*acc, U8*src, int len, U32 weight);
+
+static void blur_accumulate_c(U32*acc, U8*src, int len, U32 weight)
+{
+    int i;
+    for(i=0;i<len;i++) {
+	acc[i] += src[i]*weight;
+    }
+}
+
+#ifdef __SSE2__
+static void blur_accumulate_sse2(U32*acc, U8*src, int len, U32 weight)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i w = _mm_set1_epi16((short)weight);
+    int i = 0;
+    for(;i+16<=len;i+=16) {
+	__m128i p = _mm_loadu_si128((__m128i*)&src[i]);
+	__m128i p1 = _mm_unpacklo_epi8(p, zero);
+	__m128i p2 = _mm_unpackhi_epi8(p, zero);
+	/* 16x16->32 bit products, from their low and high halves */
+	__m128i l1 = _mm_mullo_epi16(p1, w), h1 = _mm_mulhi_epu16(p1, w);
+	__m128i l2 = _mm_mullo_epi16(p2, w), h2 = _mm_mulhi_epu16(p2, w);
+	__m128i*a = (__m128i*)&acc[i];
+	_mm_storeu_si128(a+0, _mm_add_epi32(_mm_loadu_si128(a+0), _mm_unpacklo_epi16(l1, h1)));
+	_mm_storeu_si128(a+1, _mm_add_epi32(_mm_loadu_si128(a+1), _mm_unpackhi_epi16(l1, h1)));
+	_mm_storeu_si128(a+2, _mm_add_epi32(_mm_loadu_si128(a+2), _mm_unpacklo_epi16(l2, h2)));
+	_mm_storeu_si128(a+3, _mm_add_epi32(_mm_loadu_si128(a+3), _mm_unpackhi_epi16(l2, h2)));
+    }
+    blur_accumulate_c(&acc[i], &src[i], len-i, weight);
+}
+#endif
+
+#ifdef USE_AVX2
+__attribute__ ((target("avx2")))
+static void blur_accumulate_avx2(U32*acc, U8*src, int len, U32 weight)
+{
+    __m256i w = _mm256_set1_epi32(weight);
+    int i = 0;
+    for(;i+16<=len;i+=16) {
+	__m256i p1 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)&src[i]));
+	__m256i p2 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)&src[i+8]));
+	__m256i*a = (__m256i*)&acc[i];
+	_mm256_storeu_si256(a+0, _mm256_add_epi32(_mm256_loadu_si256(a+0), _mm256_mullo_epi32(p1, w)));
+	_mm256_storeu_si256(a+1, _mm256_add_epi32(_mm256_loadu_si256(a+1), _mm256_mullo_epi32(p2, w)));
+    }
+    blur_accumulate_c(&acc[i], &src[i], len-i, weight);
+}
+#endif
+
+static blur_accumulate_t blur_accumulate_select()
+{
+#ifdef USE_AVX2
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+	return blur_accumulate_avx2;
+#endif
+#ifdef __SSE2__
+    return blur_accumulate_sse2;
+#else
+    return blur_accumulate_c;
+#endif
+}
+
+/* stores acc[i]>>16 into dest[i], and clears acc[i] */
+static void blur_store(U8*dest, U32*acc, int len)
+{
+    int i;
+    for(i=0;i<len;i++) {
+	dest[i] = acc[i] >> 16;
+	acc[i] = 0;
+    }
+}
+
 void blurImage(gfxcolor_t*src, int width, int height, int r)  __attribute__ ((noinline));
 
 void blurImage(gfxcolor_t*src, int width, int height, int r)
 {
+    static blur_accumulate_t blur_accumulate_fast = 0;
+    if(!blur_accumulate_fast)
+	blur_accumulate_fast = blur_accumulate_select();
+
     int e = 2; // r times e is the sampling interval
     double*gauss = (double*)rfx_alloc(r*e*sizeof(double));
     double sum=0;
@@ -166,79 +294,53 @@ void blurImage(gfxcolor_t*src, int width, int height, int r)
         sum += gauss[x];
     }
     int*weights = (int*)rfx_alloc(r*e*sizeof(int));
+    char small_weights = 1;
     for(x=0;x<r*e;x++) {
         weights[x] = (int)(gauss[x]*65536.0001/sum);
+        if(weights[x] >= 65536)
+            small_weights = 0;
     }
+    blur_accumulate_t blur_accumulate = small_weights?blur_accumulate_fast:blur_accumulate_c;
     int range = r*e/2;
 
     gfxcolor_t*tmp = rfx_alloc(sizeof(gfxcolor_t)*width*height);
+    U32*acc = (U32*)rfx_calloc(sizeof(U32)*4*width);
 
+    /* Both passes compute every output row as the weighted sum of 2*range
+       shifted input rows, so that the inner loops run over consecutive
+       bytes. The sums are exact, so the order in which they are added up
+       doesn't change the result. */
     int y;
+    int inner = width - 2*range;
     for(y=0;y<height;y++) {
         gfxcolor_t*s = &src[y*width];
         gfxcolor_t*d = &tmp[y*width];
-        for(x=0;x<range && x<width;x++) {
-            d[x] = s[x];
-        }
-        for(;x<width-range;x++) {
-            int r=0;
-            int g=0;
-            int b=0;
-            int a=0;
-            int*f = weights;
-            int xx;
-            for(xx=x-range;xx<x+range;xx++) {
-                r += s[xx].r * f[0];
-                g += s[xx].g * f[0];
-                b += s[xx].b * f[0];
-                a += s[xx].a * f[0];
-                f++;
-            }
-            d[x].r = r >> 16;
-            d[x].g = g >> 16;
-            d[x].b = b >> 16;
-            d[x].a = a >> 16;
+        if(inner <= 0) {
+            memcpy(d, s, width*sizeof(gfxcolor_t));
+            continue;
         }
-        for(;x<width;x++) {
-            d[x] = s[x];
+        memcpy(d, s, range*sizeof(gfxcolor_t));
+        for(x=0;x<2*range;x++) {
+            blur_accumulate(acc, (U8*)&s[x], inner*4, weights[x]);
         }
+        blur_store((U8*)&d[range], acc, inner*4);
+        memcpy(&d[width-range], &s[width-range], range*sizeof(gfxcolor_t));
     }
 
-    for(x=0;x<width;x++) {
-        gfxcolor_t*s = &tmp[x];
-        gfxcolor_t*d = &src[x];
-        int yy=0;
-        for(y=0;y<range&&y<height;y++) {
-            d[yy] = s[yy];
-            yy+=width;
-        }
-        for(;y<height-range;y++) {
-            int r=0;
-            int g=0;
-            int b=0;
-            int a=0;
-            int*f = weights;
-            int cy,cyy=yy-range*width;
-            for(cy=y-range;cy<y+range;cy++) {
-                r += s[cyy].r * f[0];
-                g += s[cyy].g * f[0];
-                b += s[cyy].b * f[0];
-                a += s[cyy].a * f[0];
-                cyy += width;
-                f++;
-            }
-            d[yy].r = r >> 16;
-            d[yy].g = g >> 16;
-            d[yy].b = b >> 16;
-            d[yy].a = a >> 16;
-            yy += width;
+    for(y=0;y<height;y++) {
+        gfxcolor_t*d = &src[y*width];
+        if(y < range || y >= height-range) {
+            memcpy(d, &tmp[y*width], width*sizeof(gfxcolor_t));
+            continue;
         }
-        for(;y<height;y++) {
-            d[yy] = s[yy];
-            yy += width;
+        int cy;
+        for(cy=0;cy<2*range;cy++) {
+            blur_accumulate(acc, (U8*)&tmp[(y-range+cy)*width], width*4, weights[cy]);
         }
+        blur_store((U8*)d, acc, width*4);
     }
 
+    rfx_free(acc);
     rfx_free(tmp);
     rfx_free(weights);
     rfx_free(gauss);
@@ -370,6 +472,227 @@ gfximage_t* gfximage_rescale_old(gfximage_t*image, int newwidth, int newheight)
     return image2;
 }
 
+/* adds weight times one row of pixels to an accumulator row of
+   four unsigned ints per pixel */
+static void rescale_accumulate(U32*acc, gfxcolor_t*line, int width, int weight)
+{
+    int x = 0;
+#ifdef __SSE2__
+    /* weights are at most 256, so every product fits into 16 bits */
+    __m128i w = _mm_set1_epi16(weight);
+    __m128i zero = _mm_setzero_si128();
+    for(;x+4<=width;x+=4) {
+	__m128i p = _mm_loadu_si128((__m128i*)&line[x]);
+	__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(p, zero), w);
+	__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(p, zero), w);
+	__m128i*a = (__m128i*)&acc[x*4];
+	_mm_storeu_si128(a+0, _mm_add_epi32(_mm_loadu_si128(a+0), _mm_unpacklo_epi16(lo, zero)));
+	_mm_storeu_si128(a+1, _mm_add_epi32(_mm_loadu_si128(a+1), _mm_unpackhi_epi16(lo, zero)));
+	_mm_storeu_si128(a+2, _mm_add_epi32(_mm_loadu_si128(a+2), _mm_unpacklo_epi16(hi, zero)));
+	_mm_storeu_si128(a+3, _mm_add_epi32(_mm_loadu_si128(a+3), _mm_unpackhi_epi16(hi, zero)));
+    }
+#endif
+    for(;x<width;x++) {
+	U8*c = (U8*)&line[x];
+	acc[x*4+0] += c[0]*weight;
+	acc[x*4+1] += c[1]*weight;
+	acc[x*4+2] += c[2]*weight;
+	acc[x*4+3] += c[3]*weight;
+    }
+}
+
+/* resamples an accumulator row in x direction, and stores the result */
+static void rescale_row_x(U32*acc, float*facc, gfxcolor_t*dest, scale_lookup_t**lblockx, int width, int newwidth)
+{
+    int x;
+    scale_lookup_t*p_x = lblockx[0];
+#ifdef __SSE2__
+    /* The accumulated values are at most 255*256, and the x weights of one
+       pixel add up to 256, so all sums stay below 2^24 and are computed
+       exactly in single precision. */
+    for(x=0;x<width;x++) {
+	_mm_storeu_ps(&facc[x*4], _mm_cvtepi32_ps(_mm_loadu_si128((__m128i*)&acc[x*4])));
+    }
+    for(x=0;x<newwidth;x++) {
+	scale_lookup_t*p_x_to = lblockx[x+1];
+	__m128 sum = _mm_setzero_ps();
+	do {
+	    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(&facc[p_x->pos*4]), _mm_set1_ps(p_x->weight)));
+	    p_x++;
+	} while (p_x<p_x_to);
+	__m128i c = _mm_srli_epi32(_mm_cvttps_epi32(sum), 16);
+	c = _mm_packs_epi32(c, c);
+	c = _mm_packus_epi16(c, c);
+	*(U32*)&dest[x] = _mm_cvtsi128_si32(c);
+    }
+#else
+    for(x=0;x<newwidth;x++) {
+	U32 c0=0,c1=0,c2=0,c3=0;
+	scale_lookup_t*p_x_to = lblockx[x+1];
+	do {
+	    U32*col = &acc[p_x->pos*4];
+	    U32 weight = p_x->weight;
+	    c0 += col[0]*weight;
+	    c1 += col[1]*weight;
+	    c2 += col[2]*weight;
+	    c3 += col[3]*weight;
+	    p_x++;
+	} while (p_x<p_x_to);
+	U8*d = (U8*)&dest[x];
+	d[0] = c0 >> 16;
+	d[1] = c1 >> 16;
+	d[2] = c2 >> 16;
+	d[3] = c3 >> 16;
+    }
+#endif
+}
+
+#define RESCALE_ROWS_PER_JOB 16
+
+typedef struct _rescalejob {
+    gfxcolor_t*data;
+    gfxcolor_t*newdata;
+    int width, newwidth, newheight;
+    scale_lookup_t**lblockx;
+    scale_lookup_t**lblocky;
+    int num_jobs;
+    int next_job;
+#ifdef USE_THREADS
+    pthread_mutex_t mutex;
+#endif
+} rescalejob_t;
+
+static void* rescale_rows(void*_job)
+{
+    rescalejob_t*job = (rescalejob_t*)_job;
+    int width = job->width;
+    U32*acc = (U32*)rfx_alloc(width*4*sizeof(U32));
+    float*facc = (float*)rfx_alloc(width*4*sizeof(float));
+    while(1) {
+#ifdef USE_THREADS
+	pthread_mutex_lock(&job->mutex);
+#endif
+	int nr = job->next_job++;
+#ifdef USE_THREADS
+	pthread_mutex_unlock(&job->mutex);
+#endif
+	if(nr >= job->num_jobs)
+	    break;
+	int y0 = nr*RESCALE_ROWS_PER_JOB;
+	int y1 = y0 + RESCALE_ROWS_PER_JOB;
+	if(y1 > job->newheight)
+	    y1 = job->newheight;
+	int y;
+	for(y=y0;y<y1;y++) {
+	    scale_lookup_t*p_y;
+	    memset(acc, 0, width*4*sizeof(U32));
+	    for(p_y=job->lblocky[y];p_y<job->lblocky[y+1];p_y++) {
+		rescale_accumulate(acc, &job->data[p_y->pos*width], width, p_y->weight);
+	    }
+	    rescale_row_x(acc, facc, &job->newdata[y*job->newwidth], job->lblockx, width, job->newwidth);
+	}
+    }
+    rfx_free(acc);
+    rfx_free(facc);
+    return 0;
+}
+
+void gfximage_rescale_set_threads(int threads)
+{
+    rescale_threads = threads;
+}
+
+/* same filter as gfximage_rescale_old(), and the same results, but
+   processing four channels at a time, and distributing the rows of
+   large images over several threads */
+gfximage_t* gfximage_rescale_separable(gfximage_t*image, int newwidth, int newheight)
+{
+    int monochrome = 0;
+    gfxcolor_t monochrome_colors[2];
+
+    if(newwidth<1)
+	newwidth=1;
+    if(newheight<1)
+	newheight=1;
+
+    int width = image->width;
+    int height = image->height;
+    gfxcolor_t*data = image->data;
+
+    if(gfximage_getNumberOfPaletteEntries(image) == 2) {
+	monochrome=1;
+	encodeMonochromeImage(data, width, height, monochrome_colors);
+        int r1 = width / newwidth;
+        int r2 = height / newheight;
+        int r = r1<r2?r1:r2;
+        if(r>4) {
+            /* high-resolution monochrome images are usually dithered, so 
+               low-pass filter them first to get rid of any moire patterns */
+            blurImage(data, width, height, r+1);
+        }
+    }
+
+    rescalejob_t job;
+    memset(&job, 0, sizeof(job));
+    job.data = data;
+    job.newdata = (gfxcolor_t*)rfx_alloc(newwidth*newheight*sizeof(gfxcolor_t));
+    job.width = width;
+    job.newwidth = newwidth;
+    job.newheight = newheight;
+    job.lblockx = make_scale_lookup(width, newwidth);
+    job.lblocky = make_scale_lookup(height, newheight);
+    job.num_jobs = (newheight + RESCALE_ROWS_PER_JOB - 1) / RESCALE_ROWS_PER_JOB;
+
+#ifdef USE_THREADS
+    int num_threads = rescale_threads;
+    if(num_threads<=0) {
+	num_threads = 1;
+	/* starting threads only pays off for images of a few megapixels */
+#ifdef _SC_NPROCESSORS_ONLN
+	if((double)width*height >= 1048576)
+	    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if(num_threads > 8)
+	    num_threads = 8;
+	if(num_threads<=0)
+	    num_threads = 1;
+    }
+    if(num_threads > job.num_jobs)
+	num_threads = job.num_jobs;
+    pthread_t*threads = (pthread_t*)rfx_calloc(sizeof(pthread_t)*num_threads);
+    pthread_mutex_init(&job.mutex, 0);
+    int t;
+    int started = 1;
+    for(t=1;t<num_threads;t++) {
+	if(pthread_create(&threads[t], 0, rescale_rows, &job))
+	    break;
+	started++;
+    }
+    rescale_rows(&job);
+    for(t=1;t<started;t++) {
+	pthread_join(threads[t], 0);
+    }
+    pthread_mutex_destroy(&job.mutex);
+    rfx_free(threads);
+#else
+    rescale_rows(&job);
+#endif
+
+    if(monochrome)
+	decodeMonochromeImage(job.newdata, newwidth, newheight, monochrome_colors);
+
+    rfx_free(*job.lblockx);
+    rfx_free(job.lblockx);
+    rfx_free(*job.lblocky);
+    rfx_free(job.lblocky);
+
+    gfximage_t*image2 = (gfximage_t*)malloc(sizeof(gfximage_t));
+    image2->data = job.newdata;
+    image2->width = newwidth;
+    image2->height = newheight;
+    return image2;
+}
+
 #ifdef HAVE_FFTW3
 gfximage_t* gfximage_rescale_fft(gfximage_t*image, int newwidth, int newheight)
 {
@@ -472,12 +795,12 @@ gfximage_t* gfximage_rescale_fft(gfximage_t*image, int newwidth, int newheight)
 gfximage_t* gfximage_rescale(gfximage_t*image, int newwidth, int newheight)
 {
     //return gfximage_rescale_fft(image, newwidth, newheight);
-    return gfximage_rescale_old(image, newwidth, newheight);
+    return gfximage_rescale_separable(image, newwidth, newheight);
 }
 #else
 gfximage_t* gfximage_rescale(gfximage_t*image, int newwidth, int newheight)
 {
-    return gfximage_rescale_old(image, newwidth, newheight);
+    return gfximage_rescale_separable(image, newwidth, newheight);
 }
 #endif
 
@@ -500,3 +823,187 @@ void gfximage_free(gfximage_t*b)
     free(b);
 }
 
+
+#ifdef BENCHMARK
+#include <stdio.h>
+#include <sys/time.h>
+
+static double walltime()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* the previous scalar implementations, for comparison */
+static void decodeMonochromeImage_ref(gfxcolor_t*data, int width, int height, gfxcolor_t*colors)
+{
+    int t;
+    int len = width*height;
+
+    for(t=0;t<len;t++) {
+	U32 m = data[t].a;
+	data[t].r = (colors[0].r * (255-m) + colors[1].r * m) >> 8;
+	data[t].g = (colors[0].g * (255-m) + colors[1].g * m) >> 8;
+	data[t].b = (colors[0].b * (255-m) + colors[1].b * m) >> 8;
+	data[t].a = (colors[0].a * (255-m) + colors[1].a * m) >> 8;
+    }
+}
+
+static void blurImage_ref(gfxcolor_t*src, int width, int height, int r)
+{
+    int e = 2; // r times e is the sampling interval
+    double*gauss = (double*)rfx_alloc(r*e*sizeof(double));
+    double sum=0;
+    int x;
+    for(x=0;x<r*e;x++) {
+        double t = (x - r*e/2.0)/r;
+        gauss[x] = exp(-0.5*t*t);
+        sum += gauss[x];
+    }
+    int*weights = (int*)rfx_alloc(r*e*sizeof(int));
+    for(x=0;x<r*e;x++) {
+        weights[x] = (int)(gauss[x]*65536.0001/sum);
+    }
+    int range = r*e/2;
+
+    gfxcolor_t*tmp = rfx_alloc(sizeof(gfxcolor_t)*width*height);
+
+    int y;
+    for(y=0;y<height;y++) {
+        gfxcolor_t*s = &src[y*width];
+        gfxcolor_t*d = &tmp[y*width];
+        for(x=0;x<range && x<width;x++) {
+            d[x] = s[x];
+        }
+        for(;x<width-range;x++) {
+            int r=0;
+            int g=0;
+            int b=0;
+            int a=0;
+            int*f = weights;
+            int xx;
+            for(xx=x-range;xx<x+range;xx++) {
+                r += s[xx].r * f[0];
+                g += s[xx].g * f[0];
+                b += s[xx].b * f[0];
+                a += s[xx].a * f[0];
+                f++;
+            }
+            d[x].r = r >> 16;
+            d[x].g = g >> 16;
+            d[x].b = b >> 16;
+            d[x].a = a >> 16;
+        }
+        for(;x<width;x++) {
+            d[x] = s[x];
+        }
+    }
+
+    for(x=0;x<width;x++) {
+        gfxcolor_t*s = &tmp[x];
+        gfxcolor_t*d = &src[x];
+        int yy=0;
+        for(y=0;y<range&&y<height;y++) {
+            d[yy] = s[yy];
+            yy+=width;
+        }
+        for(;y<height-range;y++) {
+            int r=0;
+            int g=0;
+            int b=0;
+            int a=0;
+            int*f = weights;
+            int cy,cyy=yy-range*width;
+            for(cy=y-range;cy<y+range;cy++) {
+                r += s[cyy].r * f[0];
+                g += s[cyy].g * f[0];
+                b += s[cyy].b * f[0];
+                a += s[cyy].a * f[0];
+                cyy += width;
+                f++;
+            }
+            d[yy].r = r >> 16;
+            d[yy].g = g >> 16;
+            d[yy].b = b >> 16;
+            d[yy].a = a >> 16;
+            yy += width;
+        }
+        for(;y<height;y++) {
+            d[yy] = s[yy];
+            yy += width;
+        }
+    }
+
+    rfx_free(tmp);
+    rfx_free(weights);
+    rfx_free(gauss);
+}
+
+/* an A4 page scanned at 600 dpi, scaled down to typical screen and
+   print resolutions */
+int main(int argn, char*argv[])
+{
+    int width = 4960, height = 7016;
+    gfximage_t*img = gfximage_new(width, height);
+    int x,y;
+    unsigned int r = 0;
+    for(y=0;y<height;y++) {
+	for(x=0;x<width;x++) {
+	    gfxcolor_t*c = &img->data[y*width+x];
+	    r = r*1103515245+12345;
+	    c->r = ((x/40+y/60)&1)?240:(r>>24);
+	    c->g = (x*255/width);
+	    c->b = (y*255/height);
+	    c->a = 255;
+	}
+    }
+    int dpis[] = {300, 150, 96, 72};
+    int t;
+    for(t=0;t<sizeof(dpis)/sizeof(dpis[0]);t++) {
+	int newwidth = width*dpis[t]/600;
+	int newheight = height*dpis[t]/600;
+
+	double t1 = walltime();
+	gfximage_t*ref = gfximage_rescale_old(img, newwidth, newheight);
+	double t2 = walltime();
+	gfximage_rescale_set_threads(1);
+	gfximage_t*img1 = gfximage_rescale_separable(img, newwidth, newheight);
+	double t3 = walltime();
+	gfximage_rescale_set_threads(0);
+	gfximage_t*img2 = gfximage_rescale_separable(img, newwidth, newheight);
+	double t4 = walltime();
+
+	int size = newwidth*newheight*sizeof(gfxcolor_t);
+	printf("%d dpi (%dx%d): old %.3fs, separable %.3fs, threaded %.3fs%s\n",
+		dpis[t], newwidth, newheight, t2-t1, t3-t2, t4-t3,
+		memcmp(ref->data, img1->data, size) || memcmp(ref->data, img2->data, size) ? " MISMATCH":"");
+	gfximage_free(ref);
+	gfximage_free(img1);
+	gfximage_free(img2);
+    }
+
+    /* the low-pass filter used for dithered monochrome scans */
+    int size = width*height*sizeof(gfxcolor_t);
+    gfxcolor_t*data = (gfxcolor_t*)rfx_alloc(size);
+    memcpy(data, img->data, size);
+    double t1 = walltime();
+    blurImage_ref(data, width, height, 9);
+    double t2 = walltime();
+    blurImage(img->data, width, height, 9);
+    double t3 = walltime();
+    printf("blur: old %.3fs, new %.3fs%s\n", t2-t1, t3-t2, memcmp(data, img->data, size)?" MISMATCH":"");
+
+    gfxcolor_t colors[2] = {{255,10,20,30},{128,200,220,240}};
+    t1 = walltime();
+    decodeMonochromeImage_ref(data, width, height, colors);
+    t2 = walltime();
+    decodeMonochromeImage(img->data, width, height, colors);
+    t3 = walltime();
+    printf("monochrome decode: old %.3fs, new %.3fs%s\n", t2-t1, t3-t2, memcmp(data, img->data, size)?" MISMATCH":"");
+
+    rfx_free(data);
+    gfximage_free(img);
+    return 0;
+}
+#endif
@@ -9,6 +9,7 @@ void gfximage_save_jpeg(gfximage_t*image, const char*filename, int quality);
 void gfximage_save_png(gfximage_t*image, const char*filename);
 void gfximage_save_png_quick(gfximage_t*image, const char*filename);
 gfximage_t* gfximage_rescale(gfximage_t*image, int newwidth, int newheight);
+void gfximage_rescale_set_threads(int threads);
 bool gfximage_has_alpha(gfximage_t*image);
 void gfximage_free(gfximage_t*b);
 
@@ -54,6 +54,9 @@ gfxpoly_t* gfxpoly_union(gfxpoly_t*p1, gfxpoly_t*p2);
 double gfxpoly_area(gfxpoly_t*p);
 double gfxpoly_intersection_area(gfxpoly_t*p1, gfxpoly_t*p2);
 
+/* split large polygons into horizontal slabs and process those on this many threads */
+void gfxpoly_set_threads(int threads);
+
 /* conversion functions */
 gfxpoly_t* gfxpoly_createbox(double x1, double y1,double x2, double y2, double gridsize);
 gfxline_t* gfxline_from_gfxpoly(gfxpoly_t*poly);
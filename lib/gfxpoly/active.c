@@ -6,6 +6,10 @@
 #include "../types.h"
 #include "active.h"
 
+#ifdef BTREE
+static void node_destroy(actnode_t*n);
+#endif
+
 actlist_t* actlist_new()
 {
     NEW(actlist_t, a);
@@ -13,6 +17,10 @@ actlist_t* actlist_new()
 }
 void actlist_destroy(actlist_t*a)
 {
+#ifdef BTREE
+    if(a->root)
+	node_destroy(a->root);
+#endif
     free(a);
 }
 
@@ -39,6 +47,7 @@ void actlist_dump(actlist_t*a, int32_t y, double gridsize)
 }
 void actlist_verify(actlist_t*a, int32_t y)
 {
+#ifdef CHECKS
     segment_t*s = a->list;
     assert(!s || !s->left);
     segment_t*l = 0;
@@ -59,6 +68,7 @@ void actlist_verify(actlist_t*a, int32_t y)
         assert(!s->right || s->right->left == s);
         s = s->right;
     }
+#endif
 }
 
 static inline double single_cmp(segment_t*s, point_t p1)
@@ -193,7 +203,7 @@ segment_t* actlist_find(actlist_t*a, point_t p1, point_t p2)
 
     return last;
 }
-#else
+#elif !defined(BTREE)
 segment_t* actlist_find(actlist_t*a, point_t p1, point_t p2)
 {
     segment_t*last=0, *s = a->list;
@@ -435,6 +445,253 @@ static void actlist_splay(actlist_t*a, point_t p1, point_t p2)
 
 #endif
 
+#ifdef BTREE
+
+/* The segments of the active list are also the leaves of a B+ tree. Every node
+   keeps a copy of the line equation of the leftmost segment below each of its
+   entries, so that searching for a point only touches one node per level, and
+   none of the segments. */
+
+#define CHILD(n,i) ((actnode_t*)(n)->entry[i])
+#define SEG(n,i) ((segment_t*)(n)->entry[i])
+
+static inline void key_set(actkey_t*key, segment_t*s)
+{
+    key->k = s->k;
+    key->dx = s->delta.x;
+    key->dy = s->delta.y;
+}
+
+static inline double key_cmp(actkey_t*key, point_t p1, point_t p2)
+{
+    double d = (double)key->dy*p1.x - (double)key->dx*p1.y - key->k;
+    if(d==0)
+	d = (double)key->dy*p2.x - (double)key->dx*p2.y - key->k;
+    return d;
+}
+
+/* returns the last entry which is to the left of (or on) p1, or -1 */
+static inline int node_find(actnode_t*n, point_t p1, point_t p2)
+{
+    int min = 0, max = n->num;
+    while(min < max) {
+	int mid = (min+max)/2;
+	if(key_cmp(&n->key[mid], p1, p2) < 0)
+	    max = mid;
+	else
+	    min = mid+1;
+    }
+    return min-1;
+}
+
+static inline int node_index(actnode_t*n, void*entry)
+{
+    int i;
+    for(i=0;i<n->num;i++) {
+	if(n->entry[i] == entry)
+	    return i;
+    }
+    assert(0);
+    return -1;
+}
+
+static inline void node_adopt(actnode_t*n, int from, int to)
+{
+    int i;
+    if(n->leaf) {
+	for(i=from;i<to;i++)
+	    SEG(n,i)->leaf = n;
+    } else {
+	for(i=from;i<to;i++)
+	    CHILD(n,i)->parent = n;
+    }
+}
+
+/* the key of entry i changed- update the ancestors if that's the leftmost entry */
+static void node_update_key(actnode_t*n, int i)
+{
+    while(!i && n->parent) {
+	actnode_t*p = n->parent;
+	i = node_index(p, n);
+	p->key[i] = n->key[0];
+	n = p;
+    }
+}
+
+static void node_insert(actlist_t*a, actnode_t*n, int i, void*entry, actkey_t*key)
+{
+    if(n->num == ACTNODE_SIZE) {
+	int half = ACTNODE_SIZE/2;
+	actnode_t*n2 = (actnode_t*)rfx_calloc(sizeof(actnode_t));
+	n2->leaf = n->leaf;
+	n2->num = ACTNODE_SIZE - half;
+	memcpy(n2->key, &n->key[half], sizeof(actkey_t)*n2->num);
+	memcpy(n2->entry, &n->entry[half], sizeof(void*)*n2->num);
+	n->num = half;
+	node_adopt(n2, 0, n2->num);
+	if(!n->parent) {
+	    actnode_t*root = (actnode_t*)rfx_calloc(sizeof(actnode_t));
+	    root->num = 2;
+	    root->entry[0] = n;
+	    root->key[0] = n->key[0];
+	    root->entry[1] = n2;
+	    root->key[1] = n2->key[0];
+	    n->parent = n2->parent = root;
+	    a->root = root;
+	} else {
+	    node_insert(a, n->parent, node_index(n->parent, n)+1, n2, &n2->key[0]);
+	}
+	if(i > half) {
+	    n = n2;
+	    i -= half;
+	}
+    }
+    memmove(&n->key[i+1], &n->key[i], sizeof(actkey_t)*(n->num-i));
+    memmove(&n->entry[i+1], &n->entry[i], sizeof(void*)*(n->num-i));
+    n->key[i] = *key;
+    n->entry[i] = entry;
+    n->num++;
+    node_adopt(n, i, i+1);
+    node_update_key(n, i);
+}
+
+static void node_remove(actlist_t*a, actnode_t*n, int i)
+{
+    n->num--;
+    memmove(&n->key[i], &n->key[i+1], sizeof(actkey_t)*(n->num-i));
+    memmove(&n->entry[i], &n->entry[i+1], sizeof(void*)*(n->num-i));
+
+    if(!n->num) {
+	if(n->parent)
+	    node_remove(a, n->parent, node_index(n->parent, n));
+	else
+	    a->root = 0;
+	free(n);
+	return;
+    }
+    node_update_key(n, i);
+
+    if(!n->parent) {
+	if(!n->leaf && n->num == 1) {
+	    a->root = CHILD(n,0);
+	    a->root->parent = 0;
+	    free(n);
+	}
+	return;
+    }
+
+    if(n->num < ACTNODE_SIZE/4) {
+	/* merge with a neighbor, if the two of them fit into one node */
+	actnode_t*p = n->parent;
+	int j = node_index(p, n);
+	actnode_t*left = n, *right = n;
+	if(j+1 < p->num) {
+	    right = CHILD(p,j+1);
+	} else if(j>0) {
+	    left = CHILD(p,j-1);
+	    j--;
+	}
+	if(left != right && left->num + right->num <= ACTNODE_SIZE) {
+	    memcpy(&left->key[left->num], right->key, sizeof(actkey_t)*right->num);
+	    memcpy(&left->entry[left->num], right->entry, sizeof(void*)*right->num);
+	    node_adopt(left, left->num, left->num + right->num);
+	    left->num += right->num;
+	    right->num = 0;
+	    node_remove(a, p, j+1);
+	    free(right);
+	}
+    }
+}
+
+static void node_destroy(actnode_t*n)
+{
+    int i;
+    if(!n->leaf) {
+	for(i=0;i<n->num;i++)
+	    node_destroy(CHILD(n,i));
+    }
+    free(n);
+}
+
+#ifdef CHECKS
+static int actlist_btree_walk(actnode_t*n, actnode_t*parent, segment_t**ss)
+{
+    int i;
+    if(n->parent != parent || !n->num)
+	return 0;
+    for(i=0;i<n->num;i++) {
+	actnode_t*c = n->leaf?0:CHILD(n,i);
+	actkey_t*key = c?&c->key[0]:0;
+	if(n->leaf) {
+	    if(SEG(n,i) != *ss || SEG(n,i)->leaf != n)
+		return 0;
+	    *ss = (*ss)->right;
+	} else if(!actlist_btree_walk(c, n, ss)) {
+	    return 0;
+	}
+	if(key && memcmp(key, &n->key[i], sizeof(actkey_t)))
+	    return 0;
+    }
+    return 1;
+}
+
+static int actlist_btree_verify(actlist_t*a)
+{
+    segment_t*s = a->list;
+    if(!a->root)
+	return !s;
+    if(!actlist_btree_walk(a->root, 0, &s))
+	return 0;
+    return !s;
+}
+#endif
+
+segment_t* actlist_find(actlist_t*a, point_t p1, point_t p2)
+{
+    actnode_t*n = a->root;
+    if(!n) return 0;
+    while(!n->leaf) {
+	int i = node_find(n, p1, p2);
+	n = CHILD(n, i<0?0:i);
+    }
+    int i = node_find(n, p1, p2);
+    segment_t*last = i>=0?SEG(n,i):SEG(n,0)->left;
+
+#ifdef CHECKS
+    segment_t*l=0;
+    segment_t*s = a->list;
+    while(s) {
+        if(cmp(s, p1, p2)<0)
+            break;
+        l = s;s = s->right;
+    }
+    assert(l == last);
+#endif
+    return last;
+}
+
+#endif
+
+static inline int reach_bucket(segment_t*s, slope_t*slope)
+{
+    *slope = s->delta.x > 0 ? SLOPE_POSITIVE : SLOPE_NEGATIVE;
+    int e = 0;
+    frexp(fabs((double)s->delta.x / s->delta.y), &e);
+    return e<0?0:(e>=REACH_BUCKETS?REACH_BUCKETS-1:e);
+}
+
+/* returns an upper bound for how far any segment of the given slope extends
+   horizontally within one scanline */
+double actlist_max_reach(actlist_t*a, slope_t slope)
+{
+    int b;
+    for(b=REACH_BUCKETS-1;b>=0;b--) {
+	if(a->reach[slope][b])
+	    return b==REACH_BUCKETS-1?HUGE_VAL:ldexp(1.0, b);
+    }
+    return 0;
+}
+
 static void actlist_insert_after(actlist_t*a, segment_t*left, segment_t*s)
 {
 #ifdef SPLAY
@@ -476,7 +733,29 @@ static void actlist_insert_after(actlist_t*a, segment_t*left, segment_t*s)
   
     assert(actlist_splay_verify(a));
 #endif
+#ifdef BTREE
+    actkey_t key;
+    key_set(&key, s);
+    if(!a->root) {
+	actnode_t*n = (actnode_t*)rfx_calloc(sizeof(actnode_t));
+	n->leaf = 1;
+	a->root = n;
+	node_insert(a, n, 0, s, &key);
+    } else if(!left) {
+	actnode_t*n = a->root;
+	while(!n->leaf)
+	    n = CHILD(n,0);
+	node_insert(a, n, 0, s, &key);
+    } else {
+	actnode_t*n = left->leaf;
+	node_insert(a, n, node_index(n, left)+1, s, &key);
+    }
+    assert(actlist_btree_verify(a));
+#endif
 
+    slope_t slope;
+    int b = reach_bucket(s, &slope);
+    a->reach[slope][b]++;
     a->size++;
 }
 
@@ -496,6 +775,9 @@ void actlist_delete(actlist_t*a, segment_t*s)
         s->right->left = s->left;
     }
     s->left = s->right = 0;
+    slope_t slope;
+    int b = reach_bucket(s, &slope);
+    a->reach[slope][b]--;
     a->size--;
 #ifdef SPLAY
     assert(a->root == s);
@@ -545,6 +827,11 @@ void actlist_delete(actlist_t*a, segment_t*s)
     
     assert(actlist_splay_verify(a));
 #endif
+#ifdef BTREE
+    node_remove(a, s->leaf, node_index(s->leaf, s));
+    s->leaf = 0;
+    assert(actlist_btree_verify(a));
+#endif
 }
 int actlist_size(actlist_t*a)
 {
@@ -688,6 +975,21 @@ void actlist_swap(actlist_t*a, segment_t*s1, segment_t*s2)
 
     assert(actlist_splay_verify(a));
 #endif
+#ifdef BTREE
+    actnode_t*n1 = s1->leaf;
+    actnode_t*n2 = s2->leaf;
+    int i1 = node_index(n1, s1);
+    int i2 = node_index(n2, s2);
+    n1->entry[i1] = s2;
+    key_set(&n1->key[i1], s2);
+    s2->leaf = n1;
+    n2->entry[i2] = s1;
+    key_set(&n2->key[i2], s1);
+    s1->leaf = n2;
+    node_update_key(n1, i1);
+    node_update_key(n2, i2);
+    assert(actlist_btree_verify(a));
+#endif
 
 //#endif
 }
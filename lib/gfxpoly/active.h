@@ -3,13 +3,41 @@
 
 #include "poly.h"
 
+#ifdef BTREE
+#define ACTNODE_SIZE 32
+
+/* line equation of a segment, see LINE_EQ() */
+typedef struct _actkey {
+    double k;
+    int32_t dx, dy;
+} actkey_t;
+
+typedef struct _actnode {
+    struct _actnode*parent;
+    int num;
+    char leaf;
+    /* key of the leftmost segment below each entry */
+    actkey_t key[ACTNODE_SIZE];
+    /* segment_t* (leaf) or actnode_t* (inner node) */
+    void*entry[ACTNODE_SIZE];
+} actnode_t;
+#endif
+
+#define REACH_BUCKETS 40
+
 typedef struct _actlist
 {
     segment_t*list;
     int size;
+    /* number of segments, by how far (in powers of two) they extend to the
+       left (SLOPE_POSITIVE) or right (SLOPE_NEGATIVE) over one scanline */
+    int reach[2][REACH_BUCKETS];
 #ifdef SPLAY
     segment_t*root;
 #endif
+#ifdef BTREE
+    actnode_t*root;
+#endif
 } actlist_t;
 
 #define actlist_left(a,s) ((s)->left)
@@ -26,5 +54,6 @@ void actlist_delete(actlist_t*a, segment_t*s);
 void actlist_swap(actlist_t*a, segment_t*s1, segment_t*s2);
 segment_t* actlist_leftmost(actlist_t*a);
 segment_t* actlist_rightmost(actlist_t*a);
+double actlist_max_reach(actlist_t*a, slope_t slope);
 
 #endif
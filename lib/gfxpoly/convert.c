@@ -7,6 +7,10 @@
 #include "convert.h"
 #include "wind.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /* factor that determines into how many line fragments a spline is converted */
 #define SUBFRACTION (2.4)
 
@@ -22,35 +26,28 @@ static inline int32_t convert_coord(double x, double z)
     return ceil(x);
 }
 
-static void convert_gfxline(gfxline_t*line, polywriter_t*w, double gridsize)
+/* converts num coordinates at once, with the same results as convert_coord() */
+static void convert_coords(const double*in, int32_t*out, int num, double z)
 {
-    assert(!line || line[0].type == gfx_moveTo);
-    double lastx=0,lasty=0;
-    double z = 1.0 / gridsize;
-    while(line) {
-        if(line->type == gfx_moveTo) {
-	    if(line->next && line->next->type != gfx_moveTo && (line->x!=lastx || line->y!=lasty)) {
-		w->moveto(w, convert_coord(line->x,z), convert_coord(line->y,z));
-	    }
-        } else if(line->type == gfx_lineTo) {
-            w->lineto(w, convert_coord(line->x,z), convert_coord(line->y,z));
-	} else if(line->type == gfx_splineTo) {
-            int parts = (int)(sqrt(fabs(line->x-2*line->sx+lastx) + 
-                                   fabs(line->y-2*line->sy+lasty))*SUBFRACTION);
-            if(!parts) parts = 1;
-	    double stepsize = 1.0/parts;
-            int i;
-	    for(i=0;i<parts;i++) {
-		double t = (double)i*stepsize;
-		double sx = (line->x*t*t + 2*line->sx*t*(1-t) + lastx*(1-t)*(1-t));
-		double sy = (line->y*t*t + 2*line->sy*t*(1-t) + lasty*(1-t)*(1-t));
-		w->lineto(w, convert_coord(sx,z), convert_coord(sy,z));
-	    }
-	    w->lineto(w, convert_coord(line->x,z), convert_coord(line->y,z));
-        }
-	lastx = line->x;
-	lasty = line->y;
-        line = line->next;
+    int t = 0;
+#ifdef __SSE2__
+    __m128d zz = _mm_set1_pd(z);
+    __m128d min = _mm_set1_pd(-0x2000000);
+    __m128d max = _mm_set1_pd(0x1ffffff);
+    for(;t+2<=num;t+=2) {
+	__m128d x = _mm_mul_pd(_mm_loadu_pd(&in[t]), zz);
+	/* (the operand order makes NaNs pass through, like in convert_coord) */
+	x = _mm_min_pd(max, _mm_max_pd(min, x));
+	__m128i i = _mm_cvttpd_epi32(x);
+	/* truncation rounds positive numbers down- add one where that happened */
+	__m128i down = _mm_castpd_si128(_mm_cmplt_pd(_mm_cvtepi32_pd(i), x));
+	down = _mm_shuffle_epi32(down, _MM_SHUFFLE(3,3,2,0));
+	i = _mm_sub_epi32(i, down);
+	_mm_storel_epi64((__m128i*)&out[t], i);
+    }
+#endif
+    for(;t<num;t++) {
+	out[t] = convert_coord(in[t], z);
     }
 }
 
@@ -125,6 +122,7 @@ typedef struct _compactpoly {
     int points_size;
     segment_dir_t dir;
     char new;
+    point_t*initial_points; // not allocated on the heap, if set
 } compactpoly_t;
 
 void finish_segment(compactpoly_t*data)
@@ -156,16 +154,20 @@ void finish_segment(compactpoly_t*data)
     }
 #endif
 }
+static inline void compact_moveto(compactpoly_t*data, point_t p)
+{
+    if(p.x != data->last.x || p.y != data->last.y) {
+	data->new = 1;
+    }
+    data->last = p;
+}
 static void compactmoveto(polywriter_t*w, int32_t x, int32_t y)
 {
     compactpoly_t*data = (compactpoly_t*)w->internal;
     point_t p;
     p.x = x;
     p.y = y;
-    if(p.x != data->last.x || p.y != data->last.y) {
-	data->new = 1;
-    }
-    data->last = p;
+    compact_moveto(data, p);
 }
 
 static inline int direction(point_t p1, point_t p2)
@@ -175,13 +177,24 @@ static inline int direction(point_t p1, point_t p2)
     return p1.x - p2.x;
 }
 
-static void compactlineto(polywriter_t*w, int32_t x, int32_t y)
+/* makes room for another num points */
+static inline void compact_reserve(compactpoly_t*data, int num)
 {
-    compactpoly_t*data = (compactpoly_t*)w->internal;
-    point_t p;
-    p.x = x;
-    p.y = y;
+    if(data->num_points + num > data->points_size) {
+	while(data->num_points + num > data->points_size)
+	    data->points_size <<= 1;
+	if(data->points == data->initial_points) {
+	    data->points = (point_t*)rfx_alloc(sizeof(point_t)*data->points_size);
+	    memcpy(data->points, data->initial_points, sizeof(point_t)*data->num_points);
+	} else {
+	    data->points = rfx_realloc(data->points, sizeof(point_t)*data->points_size);
+	}
+    }
+}
 
+/* needs room for two more points, see compact_reserve() */
+static inline void compact_lineto(compactpoly_t*data, point_t p)
+{
     int diff = direction(p, data->last);
     if(!diff)
 	return;
@@ -195,14 +208,18 @@ static void compactlineto(polywriter_t*w, int32_t x, int32_t y)
     }
     data->new = 0;
 
-    if(data->points_size == data->num_points) {
-	data->points_size <<= 1;
-	assert(data->points_size > data->num_points);
-	data->points = rfx_realloc(data->points, sizeof(point_t)*data->points_size);
-    }
     data->points[data->num_points++] = p;
     data->last = p;
 }
+static void compactlineto(polywriter_t*w, int32_t x, int32_t y)
+{
+    compactpoly_t*data = (compactpoly_t*)w->internal;
+    point_t p;
+    p.x = x;
+    p.y = y;
+    compact_reserve(data, 2);
+    compact_lineto(data, p);
+}
 static void compactsetgridsize(polywriter_t*w, double gridsize)
 {
     compactpoly_t*d = (compactpoly_t*)w->internal;
@@ -214,13 +231,33 @@ static void compactsetgridsize(polywriter_t*w, double gridsize)
     gfxpolystroke_t*s2 = (gfxpolystroke_t*)_s2;
     return s1->points[0].y - s2->points[0].y;
 }*/
+static void compactpoly_init(compactpoly_t*data, point_t*initial_points, int size)
+{
+    memset(data, 0, sizeof(compactpoly_t));
+    data->poly = rfx_calloc(sizeof(gfxpoly_t));
+    data->poly->gridsize = 1.0;
+    data->new = 1;
+    data->dir = DIR_UNKNOWN;
+    if(initial_points) {
+	data->points = data->initial_points = initial_points;
+	data->points_size = size;
+    } else {
+	data->points_size = 16;
+	data->points = (point_t*)rfx_alloc(sizeof(point_t)*data->points_size);
+    }
+}
+static gfxpoly_t* compactpoly_finish(compactpoly_t*data)
+{
+    finish_segment(data);
+    if(data->points != data->initial_points)
+	free(data->points);
+    return data->poly;
+}
 static void*compactfinish(polywriter_t*w)
 {
     compactpoly_t*data = (compactpoly_t*)w->internal;
-    finish_segment(data);
     //qsort(data->poly->strokes, data->poly->num_strokes, sizeof(gfxpolystroke_t), compare_stroke);
-    free(data->points);
-    gfxpoly_t*poly = data->poly;
+    gfxpoly_t*poly = compactpoly_finish(data);
     free(w->internal);w->internal = 0;
     return (void*)poly;
 }
@@ -230,25 +267,96 @@ void gfxpolywriter_init(polywriter_t*w)
     w->lineto = compactlineto;
     w->setgridsize = compactsetgridsize;
     w->finish = compactfinish;
-    compactpoly_t*data = w->internal = rfx_calloc(sizeof(compactpoly_t));
-    data->poly = rfx_calloc(sizeof(gfxpoly_t));
-    data->poly->gridsize = 1.0;
-    data->last.x = data->last.y = 0;
-    data->num_points = 0;
-    data->points_size = 16;
-    data->new = 1;
-    data->dir = DIR_UNKNOWN;
-    data->points = (point_t*)rfx_alloc(sizeof(point_t)*data->points_size);
-    data->poly->strokes = 0;
+    w->internal = rfx_alloc(sizeof(compactpoly_t));
+    compactpoly_init((compactpoly_t*)w->internal, 0, 0);
+}
+
+/* gfxpoly_from_fill() flattens the path into chunks of points, converts
+   each chunk to the integer grid in one go, and then feeds the points to
+   the compact writer directly */
+#define CHUNK_SIZE 256
+
+typedef struct _pointchunk {
+    double xy[CHUNK_SIZE*2];
+    char moveto[CHUNK_SIZE];
+    int num;
+    double z;
+    compactpoly_t*data;
+} pointchunk_t;
+
+static void pointchunk_flush(pointchunk_t*c)
+{
+    int32_t xy[CHUNK_SIZE*2];
+    convert_coords(c->xy, xy, c->num*2, c->z);
+    compactpoly_t*data = c->data;
+    compact_reserve(data, c->num+1);
+    int t;
+    for(t=0;t<c->num;t++) {
+	point_t p;
+	p.x = xy[t*2];
+	p.y = xy[t*2+1];
+	if(c->moveto[t])
+	    compact_moveto(data, p);
+	else
+	    compact_lineto(data, p);
+    }
+    c->num = 0;
+}
+
+static inline void pointchunk_add(pointchunk_t*c, char moveto, double x, double y)
+{
+    if(c->num == CHUNK_SIZE)
+	pointchunk_flush(c);
+    c->xy[c->num*2] = x;
+    c->xy[c->num*2+1] = y;
+    c->moveto[c->num] = moveto;
+    c->num++;
+}
+
+static void convert_gfxline(gfxline_t*line, compactpoly_t*data, double gridsize)
+{
+    assert(!line || line[0].type == gfx_moveTo);
+    pointchunk_t chunk;
+    chunk.num = 0;
+    chunk.z = 1.0 / gridsize;
+    chunk.data = data;
+    double lastx=0,lasty=0;
+    while(line) {
+        if(line->type == gfx_moveTo) {
+	    if(line->next && line->next->type != gfx_moveTo && (line->x!=lastx || line->y!=lasty)) {
+		pointchunk_add(&chunk, 1, line->x, line->y);
+	    }
+        } else if(line->type == gfx_lineTo) {
+	    pointchunk_add(&chunk, 0, line->x, line->y);
+	} else if(line->type == gfx_splineTo) {
+            int parts = (int)(sqrt(fabs(line->x-2*line->sx+lastx) + 
+                                   fabs(line->y-2*line->sy+lasty))*SUBFRACTION);
+            if(!parts) parts = 1;
+	    double stepsize = 1.0/parts;
+            int i;
+	    for(i=0;i<parts;i++) {
+		double t = (double)i*stepsize;
+		double sx = (line->x*t*t + 2*line->sx*t*(1-t) + lastx*(1-t)*(1-t));
+		double sy = (line->y*t*t + 2*line->sy*t*(1-t) + lasty*(1-t)*(1-t));
+		pointchunk_add(&chunk, 0, sx, sy);
+	    }
+	    pointchunk_add(&chunk, 0, line->x, line->y);
+        }
+	lastx = line->x;
+	lasty = line->y;
+        line = line->next;
+    }
+    pointchunk_flush(&chunk);
 }
 
 gfxpoly_t* gfxpoly_from_fill(gfxline_t*line, double gridsize)
 {
-    polywriter_t writer;
-    gfxpolywriter_init(&writer);
-    writer.setgridsize(&writer, gridsize);
-    convert_gfxline(line, &writer, gridsize);
-    return (gfxpoly_t*)writer.finish(&writer);
+    compactpoly_t data;
+    point_t points[CHUNK_SIZE];
+    compactpoly_init(&data, points, CHUNK_SIZE);
+    data.poly->gridsize = gridsize;
+    convert_gfxline(line, &data, gridsize);
+    return compactpoly_finish(&data);
 }
 gfxpoly_t* gfxpoly_from_file(const char*filename, double gridsize)
 {
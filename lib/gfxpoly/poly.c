@@ -3,6 +3,11 @@
 #include <math.h>
 #include <limits.h>
 #include <time.h>
+#include "../../config.h"
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+#include <pthread.h>
+#define USE_THREADS
+#endif
 #include "../mem.h"
 #include "../types.h"
 #include "poly.h"
@@ -17,7 +22,14 @@
 #include "MD5.h"
 #endif
 
+/* the polygon being processed, for debug output on failed checks. Polygons
+   are processed on several threads (slabs, and callers like the swf device),
+   so each thread has its own */
+#if defined(USE_THREADS) && defined(__GNUC__)
+static __thread gfxpoly_t*current_polygon = 0;
+#else
 static gfxpoly_t*current_polygon = 0;
+#endif
 void gfxpoly_fail(char*expr, char*file, int line, const char*function)
 {
     if(!current_polygon) {
@@ -153,6 +165,36 @@ typedef struct _horizdata {
     int size;
 } horizdata_t;
 
+/* a scanline on which two slabs meet, see gfxpoly_process_slabs() */
+typedef struct _boundary {
+    int32_t y;
+    /* hot pixels and horizontal fragments on this scanline, as seen from the
+       slab above [0] and below [1]. Horizontal fragments can overlap, so they
+       have to be processed together */
+    int32_t*hotpixels[2];
+    int num_hotpixels[2];
+    horizdata_t horiz[2];
+    /* from the slab below: start positions and windings of the segments
+       which are active after its first scanline, from left to right */
+    int32_t*x;
+    windstate_t*wind;
+    int num;
+} boundary_t;
+
+/* the open ends of the output strokes, hashed by their last point */
+typedef struct _strokeend {
+    point_t p;
+    gfxpolystroke_t*stroke;
+    int nr; // creation order
+    struct _strokeend*next;
+} strokeend_t;
+
+typedef struct _strokeends {
+    strokeend_t**hash;
+    int hashsize;
+    int num;
+} strokeends_t;
+
 typedef struct _status {
     int32_t y;
     double gridsize;
@@ -164,8 +206,16 @@ typedef struct _status {
     segment_t*ending_segments;
 
     horizdata_t horiz;
+    boundary_t*boundary;
 
     gfxpolystroke_t*strokes;
+    strokeends_t ends;
+    int num_strokes;
+
+    /* segments which received a point in this scanline */
+    segment_t**changed;
+    int num_changed;
+    int changed_size;
 #ifdef CHECKS
     dict_t*seen_crossings; //list of crossing we saw so far
     dict_t*intersecting_segs; //list of segments intersecting in this scanline
@@ -408,9 +458,16 @@ static void segment_dump(segment_t*s)
             (double)s->delta.x / s->delta.y, s->fs);
 }
 
+/* segment numbers key the scheduled crossings, so they need to be unique
+   within a sweep. Sweeps run on several threads at once. */
+#if defined(USE_THREADS) && defined(__GNUC__)
+static __thread int segment_count = 0;
+#else
+static int segment_count = 0;
+#endif
+
 static void segment_init(segment_t*s, int32_t x1, int32_t y1, int32_t x2, int32_t y2, int polygon_nr, segment_dir_t dir)
 {
-    static int segment_count=0;
     s->nr = segment_count++;
     s->dir = dir;
     if(y1!=y2) {
@@ -790,19 +847,85 @@ static inline box_t box_new(int32_t x, int32_t y)
 
 static void store_horizontal(status_t*status, point_t p1, point_t p2, edgestyle_t*fs, segment_dir_t dir, int polygon_nr);
 
+static inline unsigned int strokeends_hash(strokeends_t*ends, point_t p)
+{
+    uint32_t h = (uint32_t)p.x*2654435761u ^ (uint32_t)p.y*2246822519u;
+    return (h ^ h>>16) & (ends->hashsize-1);
+}
+
+static void strokeends_add(strokeends_t*ends, strokeend_t*e)
+{
+    if(ends->num >= ends->hashsize) {
+	int oldsize = ends->hashsize;
+	strokeend_t**old = ends->hash;
+	ends->hashsize = oldsize?oldsize*2:1024;
+	ends->hash = rfx_calloc(sizeof(strokeend_t*)*ends->hashsize);
+	int t;
+	for(t=0;t<oldsize;t++) {
+	    strokeend_t*o = old[t];
+	    while(o) {
+		strokeend_t*next = o->next;
+		unsigned int h = strokeends_hash(ends, o->p);
+		o->next = ends->hash[h];
+		ends->hash[h] = o;
+		o = next;
+	    }
+	}
+	free(old);
+    }
+    unsigned int h = strokeends_hash(ends, e->p);
+    e->next = ends->hash[h];
+    ends->hash[h] = e;
+    ends->num++;
+}
+
+/* removes and returns the end of the most recently created stroke ending in p */
+static strokeend_t* strokeends_take(strokeends_t*ends, point_t p, segment_dir_t dir, edgestyle_t*fs)
+{
+    if(!ends->hashsize)
+	return 0;
+    strokeend_t**e = &ends->hash[strokeends_hash(ends, p)];
+    strokeend_t**best = 0;
+    for(;*e;e=&(*e)->next) {
+	if((*e)->p.x == p.x && (*e)->p.y == p.y && (*e)->stroke->fs == fs && (*e)->stroke->dir == dir &&
+	   (!best || (*e)->nr > (*best)->nr)) {
+	    best = e;
+	}
+    }
+    if(!best)
+	return 0;
+    strokeend_t*found = *best;
+    *best = found->next;
+    ends->num--;
+    return found;
+}
+
+static void strokeends_destroy(strokeends_t*ends)
+{
+    int t;
+    for(t=0;t<ends->hashsize;t++) {
+	strokeend_t*e = ends->hash[t];
+	while(e) {
+	    strokeend_t*next = e->next;
+	    free(e);
+	    e = next;
+	}
+    }
+    free(ends->hash);
+    memset(ends, 0, sizeof(strokeends_t));
+}
+
 static void append_stroke(status_t*status, point_t a, point_t b, segment_dir_t dir, edgestyle_t*fs)
 {
-    gfxpolystroke_t*stroke = status->strokes;
     /* find a stoke to attach this segment to. It has to have an endpoint
-       matching our start point, and a matching edgestyle */
-    while(stroke) {
-	point_t p = stroke->points[stroke->num_points-1];
-	if(p.x == a.x && p.y == a.y && stroke->fs == fs && stroke->dir == dir)
-	    break;
-	stroke = stroke->next;
-    }
+       matching our start point, and a matching edgestyle. If there are
+       several, take the newest one. */
+    strokeend_t*end = strokeends_take(&status->ends, a, dir, fs);
+    gfxpolystroke_t*stroke = end?end->stroke:0;
     if(!stroke) {
-	stroke = rfx_calloc(sizeof(gfxpolystroke_t));
+	end = rfx_calloc(sizeof(strokeend_t));
+	end->nr = status->num_strokes++;
+	stroke = end->stroke = rfx_calloc(sizeof(gfxpolystroke_t));
 	stroke->dir = dir;
 	stroke->fs = fs;
 	stroke->next = status->strokes;
@@ -817,6 +940,8 @@ static void append_stroke(status_t*status, point_t a, point_t b, segment_dir_t d
 	stroke->points = rfx_realloc(stroke->points, sizeof(point_t)*stroke->points_size);
     }
     stroke->points[stroke->num_points++] = b;
+    end->p = b;
+    strokeends_add(&status->ends, end);
 }
 
 static void insert_point_into_segment(status_t*status, segment_t*s, point_t p)
@@ -906,6 +1031,18 @@ static void segrange_test_segment_max(segrange_t*range, segment_t*seg, int32_t y
     }
 }
 
+static inline void mark_changed(status_t*status, segment_t*seg)
+{
+    if(seg->changed)
+	return;
+    seg->changed = 1;
+    if(status->num_changed == status->changed_size) {
+	status->changed_size = status->changed_size?status->changed_size*2:256;
+	status->changed = rfx_realloc(status->changed, sizeof(segment_t*)*status->changed_size);
+    }
+    status->changed[status->num_changed++] = seg;
+}
+
 /*
    SLOPE_POSITIVE:
       \+     \ +
@@ -918,6 +1055,9 @@ static void segrange_test_segment_max(segrange_t*range, segment_t*seg, int32_t y
 static void add_points_to_positively_sloped_segments(status_t*status, int32_t y, segrange_t*range)
 {
     segment_t*first=0, *last = 0;
+    /* the active list is sorted according to the *bottom* of the scanline, and
+       no segment is further than this to the left at the top of it */
+    double reach = actlist_max_reach(status->actlist, SLOPE_POSITIVE);
     int t;
     for(t=0;t<status->xrow->num;t++) {
         box_t box = box_new(status->xrow->x[t], y);
@@ -925,9 +1065,15 @@ static void add_points_to_positively_sloped_segments(status_t*status, int32_t y,
 
         seg = actlist_right(status->actlist, seg);
         while(seg) {
+            if(XPOS(seg, y) - reach > box.right2.x + 1) {
+                /* neither this nor any of the following segments reach
+                   into our box. (Segments which started in this scanline
+                   are marked by their own hot pixel) */
+                break;
+            }
             if(seg->a.y == y) {
                 // this segment started in this scanline, ignore it
-                seg->changed = 1;last = seg;if(!first) {first=seg;}
+                mark_changed(status, seg);last = seg;if(!first) {first=seg;}
             } else if(seg->delta.x <= 0) {
                 // ignore segment w/ negative slope
             } else {
@@ -935,13 +1081,8 @@ static void add_points_to_positively_sloped_segments(status_t*status, int32_t y,
                 double d1 = LINE_EQ(box.right1, seg);
                 double d2 = LINE_EQ(box.right2, seg);
                 if(d1>0 || d2>=0) {
-                    seg->changed = 1;
+                    mark_changed(status, seg);
                     insert_point_into_segment(status, seg, box.right2);
-                } else {
-                    /* we unfortunately can't break here- the active list is sorted according
-                       to the *bottom* of the scanline. hence pretty much everything that's still
-                       coming might reach into our box */
-                    //break;
                 }
             }
             seg = seg->right;
@@ -961,15 +1102,19 @@ static void add_points_to_positively_sloped_segments(status_t*status, int32_t y,
 static void add_points_to_negatively_sloped_segments(status_t*status, int32_t y, segrange_t*range)
 {
     segment_t*first=0, *last = 0;
+    double reach = actlist_max_reach(status->actlist, SLOPE_NEGATIVE);
     int t;
     for(t=status->xrow->num-1;t>=0;t--) {
         box_t box = box_new(status->xrow->x[t], y);
         segment_t*seg = actlist_find(status->actlist, box.right2, box.right2);
 
         while(seg) {
+            if(XPOS(seg, y) + reach < box.left2.x - 1) {
+                break;
+            }
             if(seg->a.y == y) {
                 // this segment started in this scanline, ignore it
-                seg->changed = 1;last = seg;if(!first) {first=seg;}
+                mark_changed(status, seg);last = seg;if(!first) {first=seg;}
             } else if(seg->delta.x > 0) {
                 // ignore segment w/ positive slope
             } else {
@@ -977,10 +1122,8 @@ static void add_points_to_negatively_sloped_segments(status_t*status, int32_t y,
                 double d1 = LINE_EQ(box.left1, seg);
                 double d2 = LINE_EQ(box.left2, seg);
                 if(d1<0 || d2<0) {
-                    seg->changed = 1;
+                    mark_changed(status, seg);
                     insert_point_into_segment(status, seg, box.right2);
-                } else {
-                    //break;
                 }
             }
             seg = seg->left;
@@ -1017,11 +1160,21 @@ static void add_points_to_ending_segments(status_t*status, int32_t y)
             point_t p = {status->xrow->x[0], y};
             insert_point_into_segment(status, seg, p);
         } else {
+            /* only hot pixels close to where the segment runs through
+               this scanline can be touched by it */
+            int32_t y1 = y-1;
+            double x1 = seg->a.y >= y1 ? seg->a.x : XPOS(seg, y1);
+            double x2 = seg->b.x;
+            if(x1 > x2) {double x=x1;x1=x2;x2=x;}
             int t;
-            int start=0,end=status->xrow->num,dir=1;
+            int start = xrow_find(status->xrow, (int32_t)floor(x1) - 2);
+            int end = xrow_find(status->xrow, (int32_t)ceil(x2) + 1);
+            int dir=1;
             if(seg->delta.x < 0) {
-                start = status->xrow->num-1;
-                end = dir = -1;
+                int first = start;
+                start = end-1;
+                end = first-1;
+                dir = -1;
             }
 #ifdef CHECKS
 	    char ok = 0;
@@ -1055,6 +1208,27 @@ static void add_points_to_ending_segments(status_t*status, int32_t y)
     status->ending_segments = 0;
 }
 
+static void recalculate_winding(status_t*status, segment_t*s)
+{
+    segment_t* left = actlist_left(status->actlist, s);
+    windstate_t wind = left?left->wind:status->windrule->start(status->context);
+    s->wind = status->windrule->add(status->context, wind, s->fs, s->dir, s->polygon_nr);
+    edgestyle_t*fs_old = s->fs_out;
+    s->fs_out = status->windrule->diff(&wind, &s->wind);
+
+#ifdef DEBUG
+    fprintf(stderr, "[%d] dir=%s wind=%d wind.filled=%s fs_old/new=%s/%s %s\n", s->nr, s->dir==DIR_UP?"up":"down", s->wind.wind_nr, s->wind.is_filled?"fill":"nofill", 
+	    fs_old?"draw":"omit", s->fs_out?"draw":"omit",
+	    fs_old!=s->fs_out?"CHANGED":"");
+#endif
+    assert(!(!s->changed && fs_old!=s->fs_out));
+    s->changed = 0;
+
+#ifdef CHECKS
+    s->fs_out_ok = 1;
+#endif
+}
+
 static void recalculate_windings(status_t*status, segrange_t*range)
 {
 #ifdef DEBUG
@@ -1063,7 +1237,6 @@ static void recalculate_windings(status_t*status, segrange_t*range)
     segrange_adjust_endpoints(range, status->y);
 
     segment_t*s = range->segmin;
-    segment_t*end = range->segmax;
     segment_t*last = 0;
 
 #ifdef DEBUG
@@ -1093,36 +1266,26 @@ static void recalculate_windings(status_t*status, segrange_t*range)
     /* in check mode, go through the whole interval so we can test
        that all polygons where the edgestyle changed also have seg->changed=1 */
     s = actlist_leftmost(status->actlist);
-    end = 0;
-#endif
-
-    if(end)
-        end = end->right;
-    while(s!=end) {
-#ifndef CHECKS
-        if(s->changed)
-#endif
-        {
-            segment_t* left = actlist_left(status->actlist, s);
-            windstate_t wind = left?left->wind:status->windrule->start(status->context);
-            s->wind = status->windrule->add(status->context, wind, s->fs, s->dir, s->polygon_nr);
-            edgestyle_t*fs_old = s->fs_out;
-            s->fs_out = status->windrule->diff(&wind, &s->wind);
-
-#ifdef DEBUG
-            fprintf(stderr, "[%d] dir=%s wind=%d wind.filled=%s fs_old/new=%s/%s %s\n", s->nr, s->dir==DIR_UP?"up":"down", s->wind.wind_nr, s->wind.is_filled?"fill":"nofill", 
-		    fs_old?"draw":"omit", s->fs_out?"draw":"omit",
-		    fs_old!=s->fs_out?"CHANGED":"");
-#endif
-            assert(!(!s->changed && fs_old!=s->fs_out));
-            s->changed = 0;
-
-#ifdef CHECKS
-            s->fs_out_ok = 1;
-#endif
-        }
+    while(s) {
+        recalculate_winding(status, s);
         s = s->right;
     }
+#else
+    /* only segments which received a point can have a different winding now.
+       Every winding depends on the segment to the left, so we process runs of
+       adjacent changed segments from left to right. */
+    int t;
+    for(t=0;t<status->num_changed;t++) {
+        s = status->changed[t];
+        if(!s->changed)
+            continue; // already done, as part of an earlier run
+        while(s->left && s->left->changed)
+            s = s->left;
+        for(;s && s->changed;s=s->right)
+            recalculate_winding(status, s);
+    }
+#endif
+    status->num_changed = 0;
 }
 
 /* we need to handle horizontal lines in order to add points to segments
@@ -1189,8 +1352,28 @@ void horiz_destroy(horizdata_t*horiz)
     horiz->data = 0;
 }
 
+/* on a slab boundary, all segments below the horizontal lines start on this
+   scanline, so the segment to the left of x1 is simply the last one starting at
+   or before x1 */
+static windstate_t get_boundary_windstate(status_t*status, int x1)
+{
+    boundary_t*b = status->boundary;
+    int min = 0, max = b->num;
+    while(min < max) {
+	int mid = (min+max)/2;
+	if(b->x[mid] <= x1)
+	    min = mid+1;
+	else
+	    max = mid;
+    }
+    return min?b->wind[min-1]:status->windrule->start(status->context);
+}
+
 static windstate_t get_horizontal_first_windstate(status_t*status, int x1, int x2)
 {
+    if(status->boundary)
+	return get_boundary_windstate(status, x1);
+
     point_t p1 = {x1,status->y};
     point_t p2 = {x2,status->y};
     segment_t*left = actlist_find(status->actlist, p1, p2);
@@ -1501,7 +1684,42 @@ static void check_status(status_t*status)
 }
 #endif
 
-gfxpoly_t* gfxpoly_process(gfxpoly_t*poly1, gfxpoly_t*poly2, windrule_t*windrule, windcontext_t*context, moments_t*moments)
+static void boundary_save_hotpixels(boundary_t*b, int side, xrow_t*xrow)
+{
+    b->num_hotpixels[side] = xrow->num;
+    b->hotpixels[side] = rfx_alloc(sizeof(int32_t)*(xrow->num+1));
+    memcpy(b->hotpixels[side], xrow->x, sizeof(int32_t)*xrow->num);
+}
+
+static void boundary_save_windings(boundary_t*b, status_t*status)
+{
+    actlist_t*actlist = status->actlist;
+    int num = 0;
+    segment_t*s;
+    for(s=actlist_leftmost(actlist);s;s=s->right)
+	num++;
+    b->x = rfx_alloc(sizeof(int32_t)*(num+1));
+    b->wind = rfx_alloc(sizeof(windstate_t)*(num+1));
+    for(s=actlist_leftmost(actlist);s;s=s->right) {
+	assert(s->a.y == b->y);
+	b->x[b->num] = s->a.x;
+	b->wind[b->num] = s->wind;
+	b->num++;
+    }
+}
+
+static void boundary_save_horizontals(boundary_t*b, int side, status_t*status)
+{
+    b->horiz[side] = status->horiz;
+    memset(&status->horiz, 0, sizeof(horizdata_t));
+    boundary_save_hotpixels(b, side, status->xrow);
+}
+
+/* sweeps poly1 (and poly2). If top is set, the windings after the first scanline
+   are stored there, if top or bottom is set, horizontal lines on the first or last
+   scanline are stored there instead of being processed */
+static gfxpoly_t* sweep(gfxpoly_t*poly1, gfxpoly_t*poly2, windrule_t*windrule, windcontext_t*context, moments_t*moments,
+			boundary_t*top, boundary_t*bottom)
 {
     current_polygon = poly1;
 
@@ -1574,7 +1792,14 @@ gfxpoly_t* gfxpoly_process(gfxpoly_t*poly1, gfxpoly_t*poly2, windrule_t*windrule
         recalculate_windings(&status, &range);
         
 	actlist_verify(status.actlist, status.y);
-	process_horizontals(&status);
+	if(top && status.y == top->y) {
+	    boundary_save_windings(top, &status);
+	    boundary_save_horizontals(top, 1, &status);
+	} else if(bottom && status.y == bottom->y) {
+	    boundary_save_horizontals(bottom, 0, &status);
+	} else {
+	    process_horizontals(&status);
+	}
 #ifdef CHECKS
         check_status(&status);
         dict_destroy(status.intersecting_segs);
@@ -1589,6 +1814,8 @@ gfxpoly_t* gfxpoly_process(gfxpoly_t*poly1, gfxpoly_t*poly2, windrule_t*windrule
     queue_destroy(&status.queue);
     horiz_destroy(&status.horiz);
     xrow_destroy(status.xrow);
+    strokeends_destroy(&status.ends);
+    free(status.changed);
 
     gfxpoly_t*p = (gfxpoly_t*)malloc(sizeof(gfxpoly_t));
     p->gridsize = poly1->gridsize;
@@ -1606,15 +1833,425 @@ gfxpoly_t* gfxpoly_process(gfxpoly_t*poly1, gfxpoly_t*poly2, windrule_t*windrule
     return p;
 }
 
+gfxpoly_t* gfxpoly_process(gfxpoly_t*poly1, gfxpoly_t*poly2, windrule_t*windrule, windcontext_t*context, moments_t*moments)
+{
+    return sweep(poly1, poly2, windrule, context, moments, 0, 0);
+}
+
+/* Slab mode: the polygons are cut into horizontal slabs at a few scanlines,
+   every slab is swept on its own (possibly on its own thread), and the
+   results are glued back together.
+   A segment crossing a slab boundary is split at the (rounded up) x position
+   where it intersects the boundary scanline. Both halves share that point, so
+   the slab results line up, but the output isn't necessarily identical to a
+   single sweep: the split points act as additional hot pixels on the boundary
+   scanlines.
+   Horizontal lines on a boundary scanline need the windings of the slab below,
+   and the ones from both slabs have to be processed together, so this happens
+   after all slabs are done. */
+
+#define MIN_SEGMENTS_PER_SLAB 4096
+
+static int num_threads = 1;
+
+void gfxpoly_set_threads(int threads)
+{
+    num_threads = threads>1?threads:1;
+}
+
+typedef struct _slab {
+    int32_t y1, y2; // [y1,y2)
+    gfxpoly_t poly[2];
+    gfxpoly_t*result;
+    moments_t moments;
+    boundary_t*top;
+    boundary_t*bottom;
+} slab_t;
+
+typedef struct _slabjob {
+    slab_t*slabs;
+    int num_slabs;
+    int next_slab;
+    windrule_t*windrule;
+    windcontext_t*context;
+    char two_polygons;
+    char do_moments;
+#ifdef USE_THREADS
+    pthread_mutex_t mutex;
+#endif
+} slabjob_t;
+
+static int compare_int32(const void*a, const void*b)
+{
+    int32_t y1 = *(int32_t*)a;
+    int32_t y2 = *(int32_t*)b;
+    return y1<y2?-1:(y1>y2?1:0);
+}
+
+/* find the slab containing scanline y */
+static int slab_find(slab_t*slabs, int num_slabs, int32_t y)
+{
+    int min = 0, max = num_slabs-1;
+    while(min < max) {
+	int mid = (min+max+1)/2;
+	if(y < slabs[mid].y1)
+	    max = mid-1;
+	else
+	    min = mid;
+    }
+    return min;
+}
+
+static void slab_append(slab_t*slab, int nr, gfxpolystroke_t*in, gfxpolystroke_t**current, point_t a, point_t b)
+{
+    gfxpolystroke_t*stroke = *current;
+    if(!stroke || stroke->points[stroke->num_points-1].x != a.x ||
+		  stroke->points[stroke->num_points-1].y != a.y) {
+	stroke = rfx_calloc(sizeof(gfxpolystroke_t));
+	stroke->dir = in->dir;
+	stroke->fs = in->fs;
+	stroke->points_size = 4;
+	stroke->points = rfx_alloc(sizeof(point_t)*stroke->points_size);
+	stroke->points[stroke->num_points++] = a;
+	stroke->next = slab->poly[nr].strokes;
+	slab->poly[nr].strokes = stroke;
+	*current = stroke;
+    } else if(stroke->num_points == stroke->points_size) {
+	stroke->points_size *= 2;
+	stroke->points = rfx_realloc(stroke->points, sizeof(point_t)*stroke->points_size);
+    }
+    stroke->points[stroke->num_points++] = b;
+}
+
+static void slabs_split(slab_t*slabs, int num_slabs, gfxpoly_t*poly, int nr)
+{
+    gfxpolystroke_t*stroke = poly->strokes;
+    for(;stroke;stroke=stroke->next) {
+	gfxpolystroke_t*current = 0;
+	int current_slab = -1;
+	int s;
+	for(s=0;s<stroke->num_points-1;s++) {
+	    point_t a0 = stroke->points[s];
+	    point_t b = stroke->points[s+1];
+	    point_t a = a0;
+	    int k = slab_find(slabs, num_slabs, a.y);
+	    if(a.y != b.y) {
+		while(b.y > slabs[k].y2) {
+		    point_t p;
+		    p.y = slabs[k].y2;
+		    p.x = (int32_t)ceil(a0.x + (double)(b.x - a0.x)*(p.y - a0.y)/(b.y - a0.y));
+		    if(k != current_slab) {current = 0;current_slab = k;}
+		    slab_append(&slabs[k], nr, stroke, &current, a, p);
+		    a = p;
+		    k++;
+		}
+	    }
+	    if(k != current_slab) {current = 0;current_slab = k;}
+	    slab_append(&slabs[k], nr, stroke, &current, a, b);
+	}
+    }
+}
+
+static void* slabs_process(void*_job)
+{
+    slabjob_t*job = (slabjob_t*)_job;
+    while(1) {
+#ifdef USE_THREADS
+	pthread_mutex_lock(&job->mutex);
+#endif
+	int nr = job->next_slab++;
+#ifdef USE_THREADS
+	pthread_mutex_unlock(&job->mutex);
+#endif
+	if(nr >= job->num_slabs)
+	    break;
+	slab_t*slab = &job->slabs[nr];
+	slab->result = sweep(&slab->poly[0], job->two_polygons?&slab->poly[1]:0, job->windrule, job->context,
+			     job->do_moments?&slab->moments:0, slab->top, slab->bottom);
+    }
+    return 0;
+}
+
+static gfxpolystroke_t* boundary_process(boundary_t*b, windrule_t*windrule, windcontext_t*context, double gridsize)
+{
+    status_t status;
+    memset(&status, 0, sizeof(status_t));
+    status.y = b->y;
+    status.gridsize = gridsize;
+    status.windrule = windrule;
+    status.context = context;
+    status.boundary = b;
+    status.xrow = xrow_new();
+    int side, t;
+    for(side=0;side<2;side++) {
+	for(t=0;t<b->num_hotpixels[side];t++)
+	    xrow_add(status.xrow, b->hotpixels[side][t]);
+	free(b->hotpixels[side]);
+	horizdata_t*h = &b->horiz[side];
+	for(t=0;t<h->num;t++) {
+	    horizontal_t*d = &h->data[t];
+	    point_t p1 = {d->x1, d->y};
+	    point_t p2 = {d->x2, d->y};
+	    store_horizontal(&status, p1, p2, d->fs, d->dir, d->polygon_nr);
+	}
+	horiz_destroy(h);
+    }
+    xrow_sort(status.xrow);
+    process_horizontals(&status);
+    xrow_destroy(status.xrow);
+    horiz_destroy(&status.horiz);
+    strokeends_destroy(&status.ends);
+    free(b->x);
+    free(b->wind);
+    return status.strokes;
+}
+
+static int compare_stroke_starts(const void*_s1, const void*_s2)
+{
+    gfxpolystroke_t*s1 = *(gfxpolystroke_t**)_s1;
+    gfxpolystroke_t*s2 = *(gfxpolystroke_t**)_s2;
+    if(s1->points[0].x != s2->points[0].x)
+	return s1->points[0].x < s2->points[0].x?-1:1;
+    if(s1->fs != s2->fs)
+	return s1->fs < s2->fs?-1:1;
+    return (int)s1->dir - (int)s2->dir;
+}
+static int compare_stroke_ends(const void*_s1, const void*_s2)
+{
+    gfxpolystroke_t*s1 = *(gfxpolystroke_t**)_s1;
+    gfxpolystroke_t*s2 = *(gfxpolystroke_t**)_s2;
+    point_t p1 = s1->points[s1->num_points-1];
+    point_t p2 = s2->points[s2->num_points-1];
+    if(p1.x != p2.x)
+	return p1.x < p2.x?-1:1;
+    if(s1->fs != s2->fs)
+	return s1->fs < s2->fs?-1:1;
+    return (int)s1->dir - (int)s2->dir;
+}
+
+/* attach strokes of the next slab which start on the boundary scanline y to
+   the (already glued) strokes ending there. Returns the strokes of the next
+   slab that couldn't be attached. */
+static gfxpolystroke_t* slabs_glue(gfxpolystroke_t*strokes, gfxpolystroke_t*next, int32_t y)
+{
+    int num_ends = 0, num_starts = 0;
+    gfxpolystroke_t*s;
+    for(s=strokes;s;s=s->next) {
+	if(s->points[s->num_points-1].y == y) num_ends++;
+    }
+    for(s=next;s;s=s->next) {
+	if(s->points[0].y == y) num_starts++;
+    }
+    if(!num_ends || !num_starts)
+	return next;
+
+    gfxpolystroke_t**ends = rfx_alloc(sizeof(gfxpolystroke_t*)*num_ends);
+    gfxpolystroke_t**starts = rfx_alloc(sizeof(gfxpolystroke_t*)*num_starts);
+    num_ends = num_starts = 0;
+    for(s=strokes;s;s=s->next) {
+	if(s->points[s->num_points-1].y == y) ends[num_ends++] = s;
+    }
+    for(s=next;s;s=s->next) {
+	if(s->points[0].y == y) starts[num_starts++] = s;
+    }
+    qsort(ends, num_ends, sizeof(gfxpolystroke_t*), compare_stroke_ends);
+    qsort(starts, num_starts, sizeof(gfxpolystroke_t*), compare_stroke_starts);
+
+    int i = 0, j = 0;
+    while(i < num_ends && j < num_starts) {
+	gfxpolystroke_t*e = ends[i];
+	gfxpolystroke_t*b = starts[j];
+	point_t p = e->points[e->num_points-1];
+	int d = p.x != b->points[0].x ? (p.x < b->points[0].x?-1:1) :
+		e->fs != b->fs ? (e->fs < b->fs?-1:1) :
+		(int)e->dir - (int)b->dir;
+	if(d<0) {
+	    i++;
+	} else if(d>0) {
+	    j++;
+	} else {
+	    int num = e->num_points + b->num_points - 1;
+	    if(num > e->points_size) {
+		e->points_size = num;
+		e->points = rfx_realloc(e->points, sizeof(point_t)*e->points_size);
+	    }
+	    memcpy(&e->points[e->num_points], &b->points[1], sizeof(point_t)*(b->num_points-1));
+	    e->num_points = num;
+	    b->num_points = 0; // mark as consumed
+	    i++;j++;
+	}
+    }
+    free(ends);
+    free(starts);
+
+    gfxpolystroke_t*rest = 0;
+    s = next;
+    while(s) {
+	gfxpolystroke_t*n = s->next;
+	if(!s->num_points) {
+	    free(s->points);
+	    free(s);
+	} else {
+	    s->next = rest;
+	    rest = s;
+	}
+	s = n;
+    }
+    return rest;
+}
+
+static void strokes_free(gfxpolystroke_t*stroke)
+{
+    while(stroke) {
+	gfxpolystroke_t*next = stroke->next;
+	free(stroke->points);
+	free(stroke);
+	stroke = next;
+    }
+}
+
+/* like gfxpoly_process(), but splits the work into up to num_slabs horizontal slabs,
+   which are processed on num_slabs threads. */
+gfxpoly_t* gfxpoly_process_slabs(gfxpoly_t*poly1, gfxpoly_t*poly2, windrule_t*windrule, windcontext_t*context, moments_t*moments, int num_slabs)
+{
+    int num_points = 0;
+    gfxpolystroke_t*stroke;
+    for(stroke=poly1->strokes;stroke;stroke=stroke->next)
+	num_points += stroke->num_points;
+    if(poly2) {
+	for(stroke=poly2->strokes;stroke;stroke=stroke->next)
+	    num_points += stroke->num_points;
+    }
+    if(num_slabs > num_points / MIN_SEGMENTS_PER_SLAB)
+	num_slabs = num_points / MIN_SEGMENTS_PER_SLAB;
+    if(num_slabs <= 1)
+	return gfxpoly_process(poly1, poly2, windrule, context, moments);
+
+    /* choose the slab boundaries such that every slab has about the
+       same number of points */
+    int32_t*y = rfx_alloc(sizeof(int32_t)*num_points);
+    int n = 0;
+    gfxpoly_t*polys[2] = {poly1, poly2};
+    int p;
+    for(p=0;p<2;p++) {
+	if(!polys[p]) continue;
+	for(stroke=polys[p]->strokes;stroke;stroke=stroke->next) {
+	    int s;
+	    for(s=0;s<stroke->num_points;s++)
+		y[n++] = stroke->points[s].y;
+	}
+    }
+    qsort(y, n, sizeof(int32_t), compare_int32);
+
+    slab_t*slabs = rfx_calloc(sizeof(slab_t)*num_slabs);
+    boundary_t*boundaries = rfx_calloc(sizeof(boundary_t)*num_slabs);
+    int k = 0;
+    slabs[0].y1 = INT_MIN;
+    int t;
+    for(t=1;t<num_slabs;t++) {
+	int32_t b = y[(int)((double)n*t/num_slabs)];
+	if(b > slabs[k].y1 && b > y[0]) {
+	    slabs[k].y2 = b;
+	    slabs[++k].y1 = b;
+	}
+    }
+    slabs[k].y2 = INT_MAX;
+    num_slabs = k+1;
+    free(y);
+
+    for(t=0;t<num_slabs;t++) {
+	slabs[t].poly[0].gridsize = slabs[t].poly[1].gridsize = poly1->gridsize;
+	if(t) {
+	    boundaries[t-1].y = slabs[t].y1;
+	    slabs[t-1].bottom = &boundaries[t-1];
+	    slabs[t].top = &boundaries[t-1];
+	}
+    }
+    slabs_split(slabs, num_slabs, poly1, 0);
+    if(poly2) {
+	assert(poly1->gridsize == poly2->gridsize);
+	slabs_split(slabs, num_slabs, poly2, 1);
+    }
+
+    slabjob_t job;
+    memset(&job, 0, sizeof(job));
+    job.slabs = slabs;
+    job.num_slabs = num_slabs;
+    job.windrule = windrule;
+    job.context = context;
+    job.two_polygons = !!poly2;
+    job.do_moments = !!moments;
+
+#ifdef USE_THREADS
+    pthread_t*threads = (pthread_t*)rfx_calloc(sizeof(pthread_t)*num_slabs);
+    pthread_mutex_init(&job.mutex, 0);
+    int started = 0;
+    for(t=1;t<num_slabs;t++) {
+	if(pthread_create(&threads[t], 0, slabs_process, &job))
+	    break;
+	started++;
+    }
+    slabs_process(&job);
+    for(t=1;t<=started;t++) {
+	pthread_join(threads[t], 0);
+    }
+    pthread_mutex_destroy(&job.mutex);
+    rfx_free(threads);
+#else
+    slabs_process(&job);
+#endif
+
+    /* glue the slabs together, top to bottom */
+    gfxpolystroke_t*strokes = 0;
+    if(moments)
+	memset(moments, 0, sizeof(moments_t));
+    for(t=0;t<num_slabs;t++) {
+	gfxpolystroke_t*next = slabs[t].result->strokes;
+	if(t) {
+	    gfxpolystroke_t*h = boundary_process(&boundaries[t-1], windrule, context, poly1->gridsize);
+	    while(h) {
+		gfxpolystroke_t*n = h->next;
+		h->next = strokes;
+		strokes = h;
+		h = n;
+	    }
+	    next = slabs_glue(strokes, next, slabs[t].y1);
+	}
+	while(next) {
+	    gfxpolystroke_t*n = next->next;
+	    next->next = strokes;
+	    strokes = next;
+	    next = n;
+	}
+	free(slabs[t].result);
+	strokes_free(slabs[t].poly[0].strokes);
+	strokes_free(slabs[t].poly[1].strokes);
+	if(moments) {
+	    int i,j;
+	    moments->area += slabs[t].moments.area;
+	    for(i=0;i<3;i++)
+		for(j=0;j<3;j++)
+		    moments->m[i][j] += slabs[t].moments.m[i][j];
+	}
+    }
+    free(slabs);
+    free(boundaries);
+
+    gfxpoly_t*result = (gfxpoly_t*)malloc(sizeof(gfxpoly_t));
+    result->gridsize = poly1->gridsize;
+    result->strokes = strokes;
+    return result;
+}
+
 static windcontext_t onepolygon = {1};
 static windcontext_t twopolygons = {2};
 gfxpoly_t* gfxpoly_intersect(gfxpoly_t*p1, gfxpoly_t*p2)
 {
-    return gfxpoly_process(p1, p2, &windrule_intersect, &twopolygons, 0);
+    return gfxpoly_process_slabs(p1, p2, &windrule_intersect, &twopolygons, 0, num_threads);
 }
 gfxpoly_t* gfxpoly_union(gfxpoly_t*p1, gfxpoly_t*p2)
 {
-    return gfxpoly_process(p1, p2, &windrule_union, &twopolygons, 0);
+    return gfxpoly_process_slabs(p1, p2, &windrule_union, &twopolygons, 0, num_threads);
 }
 double gfxpoly_area(gfxpoly_t*p)
 {
@@ -7,7 +7,9 @@
 #include "wind.h"
 
 /* features */
-#define SPLAY
+#ifndef SPLAY
+#define BTREE // active list index: B+ tree (default) or splay tree
+#endif
 #define DONT_REMEMBER_CROSSINGS
 
 typedef enum {EVENT_CROSS, EVENT_END, EVENT_START, EVENT_HORIZONTAL} eventtype_t;
@@ -57,6 +59,9 @@ typedef struct _segment {
     struct _segment*parent;
     struct _segment*leftchild;
     struct _segment*rightchild;
+#endif
+#ifdef BTREE
+    struct _actnode*leaf;
 #endif
     struct _segment*left;
     struct _segment*right;
@@ -102,6 +107,10 @@ void gfxpoly_dump(gfxpoly_t*poly);
 void gfxpoly_save(gfxpoly_t*poly, const char*filename);
 void gfxpoly_save_arrows(gfxpoly_t*poly, const char*filename);
 gfxpoly_t* gfxpoly_process(gfxpoly_t*poly1, gfxpoly_t*poly2, windrule_t*windrule, windcontext_t*context, moments_t*moments);
+gfxpoly_t* gfxpoly_process_slabs(gfxpoly_t*poly1, gfxpoly_t*poly2, windrule_t*windrule, windcontext_t*context, moments_t*moments, int num_slabs);
+
+/* number of threads used by gfxpoly_intersect() and gfxpoly_union() */
+void gfxpoly_set_threads(int threads);
 
 gfxpoly_t* gfxpoly_intersect(gfxpoly_t*p1, gfxpoly_t*p2);
 gfxpoly_t* gfxpoly_union(gfxpoly_t*p1, gfxpoly_t*p2);
@@ -1,13 +1,16 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <memory.h>
+#include <string.h>
 #include <math.h>
 #include <sys/times.h>
+#include <sys/time.h>
 #include "../gfxtools.h"
 #include "poly.h"
 #include "convert.h"
 #include "renderpoly.h"
 #include "stroke.h"
+#include "moments.h"
 
 #ifdef CHECKS
 #error "speedtest must be compiled without CHECKS"
@@ -139,8 +142,132 @@ int test_speed()
     gfxline_free(b);
 }
 
+static double walltime()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* union of two large sets of circles, in slab mode with 1, 2, 4 and 8 threads */
+int test_slabs(int num_circles)
+{
+    gfxline_t*b1 = make_circles(0, num_circles);
+    gfxline_t*b2 = make_circles(0, num_circles);
+    gfxmatrix_t m;
+    memset(&m, 0, sizeof(gfxmatrix_t));
+    m.m00 = m.m11 = 2.0;
+    m.tx = 13.7;
+    gfxline_transform(b1, &m);
+    m.m00 = 1.8;
+    m.tx = 31.3;m.ty = 7.1;
+    gfxline_transform(b2, &m);
+
+    gfxpoly_t*poly1 = gfxpoly_from_fill(b1, 0.05);
+    gfxpoly_t*poly2 = gfxpoly_from_fill(b2, 0.05);
+    printf("%d circles, %d+%d segments\n", num_circles, gfxpoly_size(poly1), gfxpoly_size(poly2));
+
+    int threads;
+    double time1 = 0;
+    for(threads=1;threads<=8;threads*=2) {
+	moments_t moments;
+	double t = walltime();
+	gfxpoly_t*poly3 = gfxpoly_process_slabs(poly1, poly2, &windrule_union, &twopolygons, &moments, threads);
+	t = walltime() - t;
+	if(threads==1)
+	    time1 = t;
+	moments_normalize(&moments, poly1->gridsize);
+	printf("%d thread(s): %.3fs (speedup %.2f), %d segments, area %.2f\n", threads, t, time1/t, gfxpoly_size(poly3), moments.area);
+	gfxpoly_destroy(poly3);
+    }
+    gfxpoly_destroy(poly1);
+    gfxpoly_destroy(poly2);
+    gfxline_free(b1);
+    gfxline_free(b2);
+}
+
+/* a hatch pattern: many thin, jagged, non-overlapping strips which are all active
+   at the same time, so that the sweep spends its time in the active list */
+int test_activelist(int num_segments)
+{
+    int num_strips = num_segments / 100;
+    int num_points = 50;
+    int step = 97;
+    int len = num_points*2+1;
+    gfxline_t*b = malloc(sizeof(gfxline_t)*len*num_strips);
+    int s, t;
+    for(s=0;s<num_strips;s++) {
+	gfxline_t*l = &b[s*len];
+	for(t=0;t<num_points;t++) {
+	    int x = s*10 + (t&1) + t/8;
+	    l[t].type = gfx_lineTo;
+	    l[t].x = x;
+	    l[t].y = t*step + s%step;
+	    l[num_points*2-1-t].type = gfx_lineTo;
+	    l[num_points*2-1-t].x = x + 5 + ((t/2)&1);
+	    l[num_points*2-1-t].y = t*step + (s*7)%step;
+	}
+	l[0].type = gfx_moveTo;
+	l[num_points*2] = l[0];
+	l[num_points*2].type = gfx_lineTo;
+    }
+    for(t=0;t<len*num_strips-1;t++)
+	b[t].next = &b[t+1];
+    b[len*num_strips-1].next = 0;
+    gfxpoly_t*poly = gfxpoly_from_fill(b, 0.05);
+
+    double t1 = walltime();
+    gfxpoly_t*poly2 = gfxpoly_process(poly, 0, &windrule_evenodd, &onepolygon, 0);
+    double t2 = walltime();
+    printf("%d segments (%d active): %.3fs, %d segments in result\n", gfxpoly_size(poly), num_strips*2, t2-t1, gfxpoly_size(poly2));
+
+    gfxpoly_destroy(poly);
+    gfxpoly_destroy(poly2);
+    gfxline_free(b);
+}
+
+/* many small shapes, where converting them to the integer grid is a
+   considerable part of the work */
+int test_convert(int num_shapes)
+{
+    gfxline_t**shapes = malloc(sizeof(gfxline_t*)*num_shapes);
+    int t;
+    for(t=0;t<num_shapes;t++) {
+	double r = 2 + t%5;
+	shapes[t] = gfxline_makecircle(t%300, t/300, r, r);
+    }
+    double t1 = walltime();
+    int num_segments = 0;
+    for(t=0;t<num_shapes;t++) {
+	gfxpoly_t*poly = gfxpoly_from_fill(shapes[t], 0.05);
+	num_segments += gfxpoly_size(poly);
+	gfxpoly_destroy(poly);
+    }
+    double t2 = walltime();
+    printf("%d shapes, %d segments: %.3fs\n", num_shapes, num_segments, t2-t1);
+    for(t=0;t<num_shapes;t++)
+	gfxline_free(shapes[t]);
+    free(shapes);
+}
+
 int main(int argn, char*argv[])
 {
+    if(argn>1 && !strcmp(argv[1], "slabs")) {
+	test_slabs(argn>2?atoi(argv[2]):2000);
+	return 0;
+    }
+    if(argn>1 && !strcmp(argv[1], "activelist")) {
+	int n;
+	for(n=100000;n<=1000000;n*=10) if(argn<3 || n==atoi(argv[2])) {
+	    test_activelist(n);
+	    test_activelist(n*3);
+	}
+	return 0;
+    }
+    if(argn>1 && !strcmp(argv[1], "convert")) {
+	test_convert(argn>2?atoi(argv[2]):100000);
+	return 0;
+    }
     struct tms t1,t2;
     times(&t1);
     test_speed();
@@ -25,18 +25,32 @@ void xrow_add(xrow_t*r, int32_t x)
     r->x[r->num++]=x;
 }
 
-int compare_int32(const void*_i1,const void*_i2)
+static int compare_int32(const void*_i1,const void*_i2)
 {
-    int32_t*i1 = (int32_t*)_i1;
-    int32_t*i2 = (int32_t*)_i2;
-    return *i1-*i2;
+    int32_t i1 = *(int32_t*)_i1;
+    int32_t i2 = *(int32_t*)_i2;
+    return i1<i2?-1:(i1>i2?1:0);
 }
 
 void xrow_sort(xrow_t*r)
 {
     if(!r->num)
         return;
-    qsort(r->x, r->num, sizeof(r->x[0]), compare_int32);
+    if(r->num <= 16) {
+        /* most scanlines only have a handful of hot pixels */
+        int t;
+        for(t=1;t<r->num;t++) {
+            int32_t x = r->x[t];
+            int s = t;
+            while(s && r->x[s-1] > x) {
+                r->x[s] = r->x[s-1];
+                s--;
+            }
+            r->x[s] = x;
+        }
+    } else {
+        qsort(r->x, r->num, sizeof(r->x[0]), compare_int32);
+    }
     int t;
     int pos = 1;
     int32_t lastx=r->x[0];
@@ -24,6 +24,7 @@
 #include <assert.h>
 #include <memory.h>
 #include <limits.h>
+#include <math.h>
 #include "q.h"
 #include "kdtree.h"
 
@@ -502,7 +503,142 @@ void kdtree_destroy(kdtree_t*tree)
     free(tree);
 }
 
+kdindex_t* kdindex_new()
+{
+    NEW(kdindex_t,index);
+    return index;
+}
+
+void kdindex_add_box(kdindex_t*index, int32_t x1, int32_t y1, int32_t x2, int32_t y2, void*data)
+{
+    if(index->num == index->size) {
+	index->size = index->size ? index->size*2 : 16;
+	index->boxes = (kdindex_entry_t*)rfx_realloc(index->boxes, sizeof(kdindex_entry_t)*index->size);
+    }
+    kdindex_entry_t*e = &index->boxes[index->num++];
+    e->bbox.xmin = min32(x1,x2);
+    e->bbox.ymin = min32(y1,y2);
+    e->bbox.xmax = max32(x1,x2);
+    e->bbox.ymax = max32(y1,y2);
+    e->data = data;
+    index->dirty = 1;
+}
+
+/* returns the range of grid cells (inclusive) the interval [v1,v2] falls into */
+static inline void kdindex_cellrange(int32_t v1, int32_t v2, int32_t origin, int32_t size, int*c1, int*c2)
+{
+    *c1 = (int)(((int64_t)v1 - origin) / size);
+    *c2 = (int)(((int64_t)v2 - origin) / size);
+}
+
+void kdindex_build(kdindex_t*index)
+{
+    int t;
+    if(index->cellstart) {
+	free(index->cellstart);
+	index->cellstart = 0;
+    }
+    if(index->entries) {
+	free(index->entries);
+	index->entries = 0;
+    }
+    index->dirty = 0;
+    index->cols = index->rows = 0;
+    if(!index->num)
+	return;
+
+    kdbbox_t b = index->boxes[0].bbox;
+    for(t=1;t<index->num;t++) {
+	kdbbox_t*e = &index->boxes[t].bbox;
+	b.xmin = min32(b.xmin, e->xmin);
+	b.ymin = min32(b.ymin, e->ymin);
+	b.xmax = max32(b.xmax, e->xmax);
+	b.ymax = max32(b.ymax, e->ymax);
+    }
+    index->bbox = b;
+
+    /* aim for about two cells per box, shaped like the area the boxes cover */
+    int64_t width = (int64_t)b.xmax - b.xmin + 1;
+    int64_t height = (int64_t)b.ymax - b.ymin + 1;
+    int64_t cells = index->num*2;
+    if(cells > 65536)
+	cells = 65536;
+    int64_t cols = (int64_t)(sqrt((double)cells * width / height) + 0.5);
+    if(cols < 1) cols = 1;
+    if(cols > cells) cols = cells;
+    if(cols > width) cols = width;
+    int64_t rows = cells / cols;
+    if(rows < 1) rows = 1;
+    if(rows > height) rows = height;
+    index->cellwidth = (int32_t)((width + cols - 1) / cols);
+    index->cellheight = (int32_t)((height + rows - 1) / rows);
+    index->cols = (int)((width + index->cellwidth - 1) / index->cellwidth);
+    index->rows = (int)((height + index->cellheight - 1) / index->cellheight);
+
+    /* counting sort of all (cell, box) pairs into one flat array */
+    int num_cells = index->cols*index->rows;
+    index->cellstart = (int*)rfx_calloc(sizeof(int)*(num_cells+1));
+    for(t=0;t<index->num;t++) {
+	kdbbox_t*e = &index->boxes[t].bbox;
+	int x1,x2,y1,y2,x,y;
+	kdindex_cellrange(e->xmin, e->xmax, b.xmin, index->cellwidth, &x1, &x2);
+	kdindex_cellrange(e->ymin, e->ymax, b.ymin, index->cellheight, &y1, &y2);
+	for(y=y1;y<=y2;y++)
+	for(x=x1;x<=x2;x++)
+	    index->cellstart[y*index->cols+x+1]++;
+    }
+    for(t=0;t<num_cells;t++) {
+	index->cellstart[t+1] += index->cellstart[t];
+    }
+    int*pos = (int*)rfx_alloc(sizeof(int)*num_cells);
+    memcpy(pos, index->cellstart, sizeof(int)*num_cells);
+    index->entries = (kdindex_entry_t*)rfx_alloc(sizeof(kdindex_entry_t)*index->cellstart[num_cells]);
+    /* newest boxes first, so that the first hit in a cell is the one that wins */
+    for(t=index->num-1;t>=0;t--) {
+	kdindex_entry_t*e = &index->boxes[t];
+	int x1,x2,y1,y2,x,y;
+	kdindex_cellrange(e->bbox.xmin, e->bbox.xmax, b.xmin, index->cellwidth, &x1, &x2);
+	kdindex_cellrange(e->bbox.ymin, e->bbox.ymax, b.ymin, index->cellheight, &y1, &y2);
+	for(y=y1;y<=y2;y++)
+	for(x=x1;x<=x2;x++)
+	    index->entries[pos[y*index->cols+x]++] = *e;
+    }
+    free(pos);
+}
+
+void* kdindex_find(kdindex_t*index, int x, int y)
+{
+    if(index->dirty)
+	kdindex_build(index);
+    if(!index->num ||
+       x < index->bbox.xmin || x > index->bbox.xmax ||
+       y < index->bbox.ymin || y > index->bbox.ymax)
+	return 0;
+    int cell = ((int64_t)y - index->bbox.ymin) / index->cellheight * index->cols +
+	       ((int64_t)x - index->bbox.xmin) / index->cellwidth;
+    kdindex_entry_t*e = &index->entries[index->cellstart[cell]];
+    kdindex_entry_t*end = &index->entries[index->cellstart[cell+1]];
+    for(;e<end;e++) {
+	if(x >= e->bbox.xmin && x <= e->bbox.xmax &&
+	   y >= e->bbox.ymin && y <= e->bbox.ymax)
+	    return e->data;
+    }
+    return 0;
+}
+
+void kdindex_destroy(kdindex_t*index)
+{
+    if(index->boxes)
+	free(index->boxes);
+    if(index->cellstart)
+	free(index->cellstart);
+    if(index->entries)
+	free(index->entries);
+    free(index);
+}
+
 #ifdef MAIN
+#include <string.h>
 int main()
 {
     assert((1^vx[2]) < 0);
@@ -527,5 +663,89 @@ int main()
     assert(!a || !a->data);
     
     kdtree_destroy(tree);
+
+    kdindex_t*index = kdindex_new();
+    kdindex_add_box(index, 10,30,20,40, "first");
+    kdindex_add_box(index, 12,50,15,60, "second");
+    kdindex_add_box(index, 14,34,16,36, "third");
+    assert(!strcmp(kdindex_find(index, 11,31), "first"));
+    assert(!strcmp(kdindex_find(index, 15,35), "third"));
+    assert(!strcmp(kdindex_find(index, 13,55), "second"));
+    assert(!kdindex_find(index, 15,25));
+    assert(!kdindex_find(index, 15,45));
+    assert(!kdindex_find(index, 5,35));
+    assert(!kdindex_find(index, 45,35));
+    kdindex_destroy(index);
+}
+#endif
+
+#ifdef BENCHMARK
+#include <time.h>
+
+/* link layout of a table of contents (one wide link per line) or of
+   an index (several short page number links per line) */
+static void make_links(int toc, void(*add)(void*, int32_t, int32_t, int32_t, int32_t, void*), void*tree)
+{
+    int line, col;
+    for(line=0;line<60;line++) {
+	int y = 40 + line*12;
+	if(toc) {
+	    add(tree, 50, y, 560, y+10, INT_AS_PTR(line+1));
+	} else {
+	    for(col=0;col<2*8;col++) {
+		int x = 60 + (col/8)*280 + (col%8)*30;
+		add(tree, x, y, x+20, y+10, INT_AS_PTR(line*16+col+1));
+	    }
+	}
+    }
+}
+
+static void tree_add(void*tree, int32_t x1, int32_t y1, int32_t x2, int32_t y2, void*data)
+{
+    kdtree_add_box((kdtree_t*)tree, x1, y1, x2, y2, data);
+}
+static void index_add(void*index, int32_t x1, int32_t y1, int32_t x2, int32_t y2, void*data)
+{
+    kdindex_add_box((kdindex_t*)index, x1, y1, x2, y2, data);
+}
+
+static void benchmark(const char*name, int toc)
+{
+    const int pages = 200;
+    int t, p, x, y;
+    long hits1 = 0, hits2 = 0;
+
+    /* every glyph on a 612x792 page, in 6x12 steps */
+    clock_t c1 = clock();
+    for(p=0;p<pages;p++) {
+	kdtree_t*tree = kdtree_new();
+	make_links(toc, tree_add, tree);
+	for(y=0;y<792;y+=12)
+	for(x=0;x<612;x+=6) {
+	    kdarea_t*a = kdtree_find(tree, x, y+5);
+	    hits1 += a && a->data;
+	}
+	kdtree_destroy(tree);
+    }
+    clock_t c2 = clock();
+    for(p=0;p<pages;p++) {
+	kdindex_t*index = kdindex_new();
+	make_links(toc, index_add, index);
+	for(y=0;y<792;y+=12)
+	for(x=0;x<612;x+=6) {
+	    hits2 += kdindex_find(index, x, y+5)!=0;
+	}
+	kdindex_destroy(index);
+    }
+    clock_t c3 = clock();
+    printf("%-6s kdtree: %6.1f ms  kdindex: %6.1f ms  (%ld/%ld hits)\n", name,
+	    (c2-c1)*1000.0/CLOCKS_PER_SEC, (c3-c2)*1000.0/CLOCKS_PER_SEC, hits1, hits2);
+}
+
+int main()
+{
+    benchmark("toc", 1);
+    benchmark("index", 0);
+    return 0;
 }
 #endif
@@ -81,6 +81,35 @@ typedef struct _kdresult_list {
     struct _kdresult_list*next;
 } kdresult_list_t;
 
+/* static, bulk-built variant for point queries only. Boxes are collected
+   with kdindex_add_box() and packed into a flat grid on the first lookup,
+   so that a hit-test touches one cell and the (few) boxes stored with it.
+   As with kdtree_add_box(), boxes added later take precedence. */
+typedef struct _kdindex_entry {
+    kdbbox_t bbox;
+    void*data;
+} kdindex_entry_t;
+
+typedef struct _kdindex {
+    kdindex_entry_t*boxes;
+    int num;
+    int size;
+
+    /* grid, valid only if !dirty */
+    char dirty;
+    kdbbox_t bbox;
+    int32_t cellwidth, cellheight;
+    int cols, rows;
+    int*cellstart;
+    kdindex_entry_t*entries;
+} kdindex_t;
+
+kdindex_t* kdindex_new();
+void kdindex_add_box(kdindex_t*index, int32_t x1, int32_t y1, int32_t x2, int32_t y2, void*data);
+void kdindex_build(kdindex_t*index);
+void* kdindex_find(kdindex_t*index, int x, int y);
+void kdindex_destroy(kdindex_t*index);
+
 kdtree_t* kdtree_new();
 void kdarea_destroy(kdarea_t*area);
 void kdbranch_destroy(kdbranch_t*b);
@@ -244,8 +244,15 @@ memfile_t* memfile_open(const char*path)
         return 0;
     }
     file->len = sb.st_size;
-    file->data = mmap(0, sb.st_size, PROT_READ, MAP_PRIVATE, fi, 0);
+    /* the mapping is private: callers may modify the data in place
+       without the changes reaching the file */
+    file->data = mmap(0, sb.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fi, 0);
     close(fi);
+    if(file->data == MAP_FAILED) {
+        perror(path);
+        free(file);
+        return 0;
+    }
 #else
     FILE*fi = fopen(path, "rb");
     if(!fi) {
@@ -280,35 +287,57 @@ void memfile_close(memfile_t*file)
     free(file);
 }
 
-void move_file(const char*from, const char*to)
+int copy_file(const char*from, const char*to)
 {
-    int result = rename(from, to);
-
-    if(result==0) return; //done!
-
-    /* if we can't rename, for some reason, copy the file
-       manually */
+    if(!strcmp(from, to))
+	return 0;
     FILE*fi = fopen(from, "rb");
     if(!fi) {
 	perror(from);
-	return;
+	return -1;
     }
     FILE*fo = fopen(to, "wb");
     if(!fo) {
 	perror(to);
-	return;
+	fclose(fi);
+	return -1;
     }
     char buffer[16384];
+    int ok = 1;
     while(1) {
 	int bytes = fread(buffer, 1, 16384, fi);
 	if(bytes<=0)
 	    break;
-	fwrite(buffer, bytes, 1, fo);
+	if(fwrite(buffer, bytes, 1, fo) != 1) {
+	    perror(to);
+	    ok = 0;
+	    break;
+	}
+    }
+    if(ferror(fi)) {
+	perror(from);
+	ok = 0;
+    }
+    if(fclose(fo)) {
+	perror(to);
+	ok = 0;
     }
-
-    fclose(fo);
     fclose(fi);
+    return ok ? 0 : -1;
+}
+
+int move_file(const char*from, const char*to)
+{
+    int result = rename(from, to);
+
+    if(result==0) return 0; //done!
+
+    /* if we can't rename, for some reason, copy the file
+       manually */
+    if(copy_file(from, to)<0)
+	return -1;
     unlink(from);
+    return 0;
 }
 
 char file_exists(const char*filename)
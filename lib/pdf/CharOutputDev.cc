@@ -198,6 +198,9 @@ void unlinkfont(char* filename)
     }
 }
 
+extern int config_remove_font_transforms;
+extern int config_remove_invisible_outlines;
+
 static int config_use_fontconfig = 1;
 static int fcinitcalled = 0; 
 
@@ -525,6 +528,10 @@ CharOutputDev::CharOutputDev(InfoOutputDev*info, PDFDoc*doc, int*page2page, int
     this->num_pages = 0;
     this->links = 0;
     this->last_link = 0;
+    this->resolved_font = 0;
+    this->resolved_fontinfo = 0;
+    this->resolved_gfxfont = 0;
+    this->resolved_matrix_valid = 0;
 };
 
 CharOutputDev::~CharOutputDev()
@@ -682,7 +689,7 @@ void CharOutputDev::endPage()
     }
 
     if(this->links) {
-	kdtree_destroy(this->links);
+	kdindex_destroy(this->links);
 	this->links = 0;
     }
     GFXLink*l = this->last_link;
@@ -738,6 +745,44 @@ char* makeStringPrintable(char*str)
 
 void CharOutputDev::updateTextMat(GfxState*state)
 {
+    this->resolved_matrix_valid = 0;
+}
+
+/* The FontInfo of a glyph only changes with the font (updateFont()),
+   unless remove_font_transforms or remove_invisible_outlines make the
+   matrix and color part of the font class. */
+FontInfo* CharOutputDev::resolveFont(GfxState*state)
+{
+    GfxFont*font = state->getFont();
+    if(resolved_fontinfo && font == resolved_font &&
+       !config_remove_font_transforms && !config_remove_invisible_outlines) {
+	return resolved_fontinfo;
+    }
+    FontInfo*fontinfo = this->info->getFontInfo(state);
+    if(fontinfo != resolved_fontinfo) {
+	resolved_matrix_valid = 0;
+    }
+    resolved_font = font;
+    resolved_fontinfo = fontinfo;
+    resolved_gfxfont = fontinfo ? fontinfo->getGfxFont() : 0;
+    return fontinfo;
+}
+
+/* Not every wrapping device passes updateTextMat() and CTM changes on to us,
+   so the cached font matrix is checked against the values it's derived from. */
+gfxmatrix_t CharOutputDev::resolveFontMatrix(GfxState*state)
+{
+    double*ctm = state->getCTM();
+    double*textMat = state->getTextMat();
+    double key[10] = {ctm[0], ctm[1], ctm[2], ctm[3],
+	              textMat[0], textMat[1], textMat[2], textMat[3],
+		      state->getFontSize(), state->getHorizScaling()};
+    if(!resolved_matrix_valid || memcmp(key, resolved_matrix_state, sizeof(key))) {
+	resolved_matrix = resolved_fontinfo->get_gfxmatrix(state);
+	memcpy(resolved_matrix_state, key, sizeof(key));
+	resolved_matrix_valid = 1;
+    }
+    return resolved_matrix;
 }
 
 void CharOutputDev::beginString(GfxState *state, GString *s) 
@@ -761,40 +806,28 @@ void CharOutputDev::drawChar(GfxState *state, double x, double y,
 			double originX, double originY,
 			CharCode charid, int nBytes, Unicode *_u, int uLen)
 {
-    FontInfo*current_fontinfo = this->info->getFontInfo(state);
+    FontInfo*current_fontinfo = resolveFont(state);
 
-    if(!current_fontinfo || (unsigned)charid >= current_fontinfo->num_glyphs || !current_fontinfo->glyphs[charid]) {
+    if(!current_fontinfo || (unsigned)charid >= current_fontinfo->num_glyphids || current_fontinfo->glyphids[charid]<0) {
 	msg("<error> Invalid charid %d for font %p (%d characters)", charid, current_fontinfo, current_fontinfo?current_fontinfo->num_glyphs:0);
 	return;
     }
 
-    gfxfont_t*current_gfxfont = current_fontinfo->getGfxFont();
+    gfxfont_t*current_gfxfont = resolved_gfxfont;
     if(!current_fontinfo->seen) {
 	dumpFontInfo("<verbose>", state->getFont());
 	device->addfont(device, current_gfxfont);
         current_fontinfo->seen = 1;
     }
 
-    CharCode glyphid = current_fontinfo->glyphs[charid]->glyphid;
+    CharCode glyphid = current_fontinfo->glyphids[charid];
 
     int render = state->getRender();
     gfxcolor_t col = gfxstate_getfillcolor(state);
 
     GFXLink*link = 0;
     if(links) {
-	kdarea_t*a = kdtree_find(this->links, x+dx/2,y+dy/2);
-	if(a) {
-	    link = (GFXLink*)a->data;
-#if 0
-            if(link) {
-                printf("area [%d %d %d %d] (link [%f %f %f %f]) contains (%f,%f)\n", 
-                        a->bbox.xmin, a->bbox.ymin, a->bbox.xmax, a->bbox.ymax,
-                        link->x1, link->y1, link->x2, link->y2,
-                        x+dx/2, y+dy/2
-                        );
-            }
-#endif
-	}
+	link = (GFXLink*)kdindex_find(this->links, x+dx/2,y+dy/2);
         if(link != previous_link) {
             previous_link = link;
             device->setparameter(device, "link", link?link->action:"");
@@ -820,7 +853,7 @@ void CharOutputDev::drawChar(GfxState *state, double x, double y,
 
     Unicode u = uLen?(_u[0]):0;
 
-    gfxmatrix_t m = current_fontinfo->get_gfxmatrix(state);
+    gfxmatrix_t m = resolveFontMatrix(state);
     this->transformXY(state, x-originX, y-originY, &m.tx, &m.ty);
 
     gfxbbox_t bbox;
@@ -971,6 +1004,10 @@ void CharOutputDev::beginPage(GfxState *state, int pageNum)
     this->last_ascent = 0;
     this->last_descent = 0;
     this->previous_link = 0;
+    this->resolved_font = 0;
+    this->resolved_fontinfo = 0;
+    this->resolved_gfxfont = 0;
+    this->resolved_matrix_valid = 0;
 }
 
 void GFXLink::draw(CharOutputDev*out, gfxdevice_t*dev)
@@ -1201,9 +1238,10 @@ void CharOutputDev::processLink(Link *link, Catalog *catalog)
     
     this->last_link = new GFXLink(this->last_link, action, x1, y1, x2, y2);
     if(!this->links) {
-	this->links = kdtree_new();
+	this->links = kdindex_new();
     }
-    kdtree_add_box(this->links, x1,y1,x2,y2, this->last_link);
+    /* the grid is packed once, on the first lookup after the last link of the page */
+    kdindex_add_box(this->links, x1,y1,x2,y2, this->last_link);
 #if 0
     printf("adding link %p at %f %f %f %f to tree\n", this->last_link, x1, y1, x2, y2);
 #endif
@@ -1224,11 +1262,15 @@ void CharOutputDev::restoreState(GfxState *state)
  
 void CharOutputDev::updateFont(GfxState *state) 
 {
+    this->resolved_font = 0;
+    this->resolved_fontinfo = 0;
+
     GfxFont* gfxFont = state->getFont();
     if (!gfxFont) {
 	return; 
     }  
     
+
     char*id = getFontID(gfxFont);
     msg("<verbose> Updating font to %s", FIXNULL(id));
     free(id);id=0;
@@ -79,9 +79,20 @@ public:
   double last_descent;
   char last_char_was_space;
     
+  // the current font, as resolved by resolveFont()
+  GfxFont*resolved_font;
+  FontInfo*resolved_fontinfo;
+  gfxfont_t*resolved_gfxfont;
+  double resolved_matrix_state[10];
+  gfxmatrix_t resolved_matrix;
+  char resolved_matrix_valid;
+
+  FontInfo* resolveFont(GfxState*state);
+  gfxmatrix_t resolveFontMatrix(GfxState*state);
+
   GFXLink*last_link;
   GFXLink*previous_link;
-  kdtree_t*links;
+  kdindex_t*links;
   
   /* config */
   int config_use_fontconfig;
@@ -7,6 +7,7 @@
 #include "../log.h"
 #include "../types.h"
 #include "../q.h"
+#include "../mem.h"
 #include "../gfxdevice.h"
 #include "../gfxfont.h"
 #include <math.h>
@@ -105,9 +106,17 @@ InfoOutputDev::InfoOutputDev(XRef*xref)
     SplashColor white = {255,255,255};
     splash = new SplashOutputDev(splashModeRGB8,320,0,white,0,0);
     splash->startDoc(xref);
+    this->xref = xref;
     last_font = 0;
     current_type3_font = 0;
     fontcache = dict_new2(&fontclass_type);
+    fontkeys = ohash_new(sizeof(fontkey_t));
+    last_key_font = 0;
+    current_splash_font = 0;
+    fontprograms = ohash_new(sizeof(Ref));
+    current_cached_font = 0;
+    current_font_state = 0;
+    current_font_valid = 0;
 }
 InfoOutputDev::~InfoOutputDev() 
 {
@@ -117,6 +126,16 @@ InfoOutputDev::~InfoOutputDev()
 	delete fd;
     }
     dict_destroy(this->fontcache);this->fontcache=0;
+    ohash_destroy(this->fontkeys);this->fontkeys=0;
+
+    if(current_cached_font) {
+	glyphcache_release(current_cached_font);
+	current_cached_font = 0;
+    }
+    delete current_font_state;current_font_state=0;
+    ohash_foreach_value(this->fontprograms, free);
+    ohash_destroy(this->fontprograms);this->fontprograms=0;
+    glyphcache_print_statistics();
 
     delete splash;splash=0;
 }
@@ -144,6 +163,8 @@ FontInfo::FontInfo(fontclass_t*fontclass)
     this->seen = 0;
     this->num_glyphs = 0;
     this->glyphs = 0;
+    this->glyphids = 0;
+    this->num_glyphids = 0;
     this->gfxfont = 0;
     this->space_char = -1;
     this->ascender = 0;
@@ -166,6 +187,7 @@ FontInfo::~FontInfo()
 	}
     }
     free(glyphs);glyphs=0;
+    free(glyphids);glyphids=0;
     if(this->gfxfont)
         gfxfont_free(this->gfxfont);
 
@@ -416,6 +438,14 @@ gfxfont_t* FontInfo::getGfxFont()
     if(!this->gfxfont) {
         this->gfxfont = this->createGfxFont();
         this->gfxfont->id = strdup(this->id);
+
+	this->num_glyphids = this->num_glyphs;
+	this->glyphids = (int*)malloc(sizeof(int)*(this->num_glyphs?this->num_glyphs:1));
+	int t;
+	for(t=0;t<this->num_glyphs;t++) {
+	    this->glyphids[t] = this->glyphs[t] ? this->glyphs[t]->glyphid : -1;
+	}
+
 	this->space_char = findSpace(this->gfxfont);
 	this->average_advance = find_average_glyph_advance(this->gfxfont);
 
@@ -557,27 +587,108 @@ GBool InfoOutputDev::needNonText()
     return gFalse; 
 }
 
+cachedfont_t* InfoOutputDev::getCachedFont(GfxFont*font, double hscale)
+{
+    Ref*ref = font->getID();
+    if(ref->gen == 999999) {
+	/* made-up reference of a direct font dictionary, not unique */
+	return 0;
+    }
+    glyphcache_key_t*key = (glyphcache_key_t*)ohash_lookup(this->fontprograms, ref);
+    if(!key) {
+	key = (glyphcache_key_t*)rfx_calloc(sizeof(glyphcache_key_t));
+	if(!glyphcache_key_from_font(key, font, this->xref)) {
+	    key->len = 0;
+	}
+	ohash_put(this->fontprograms, ref, key);
+    }
+    if(!key->len)
+	return 0;
+
+    /* the outlines are created with the current horizontal scaling applied */
+    glyphcache_key_t k = *key;
+    float f = hscale;
+    k.hscale = *(U32*)&f;
+    return glyphcache_get(&k);
+}
+
+void InfoOutputDev::loadSplashFont()
+{
+    splash->updateCTM(current_font_state, 0,0,0,0,0,0);
+    splash->doUpdateFont(current_font_state);
+    delete current_font_state;current_font_state = 0;
+
+    current_splash_font = splash->getCurrentFont();
+    if(current_splash_font) {
+	current_font_valid = 1;
+	current_ascender = current_splash_font->ascender;
+	current_descender = current_splash_font->descender;
+    }
+    if(current_cached_font) {
+	glyphcache_set_metrics(current_cached_font, current_splash_font);
+    }
+}
+
+void InfoOutputDev::loadGlyph(CharCode code, GlyphInfo*g)
+{
+    if(current_cached_font) {
+	cachedglyph_t*cached = glyphcache_find_glyph(current_cached_font, code);
+	if(cached) {
+	    g->path = cached->path?cached->path->copy():0;
+	    g->advance = cached->advance;
+	    return;
+	}
+    }
+    if(current_font_state) {
+	loadSplashFont();
+    }
+    if(!current_splash_font) {
+	g->path = 0;
+	g->advance = -1;
+	return;
+    }
+    current_splash_font->last_advance = -1;
+    g->path = current_splash_font->getGlyphPath(code);
+    g->advance = current_splash_font->last_advance;
+    if(current_cached_font) {
+	glyphcache_add_glyph(current_cached_font, code, g->path, g->advance);
+    }
+}
+
 void InfoOutputDev::updateFont(GfxState *state) 
 {
+    if(current_cached_font) {
+	glyphcache_release(current_cached_font);
+	current_cached_font = 0;
+    }
+    delete current_font_state;current_font_state = 0;
+    current_splash_font = 0;
+    current_font_valid = 0;
+
     GfxFont*font = state->getFont();
     if(!font) {
-	current_splash_font = 0;
 	return;
     }
     if(font->getType() == fontType3) {
-	current_splash_font = 0;
 	return;
     }
     GfxState* state2 = state->copy();
     state2->setPath(0);
     state2->setCTM(1.0,0,0,1.0,0,0);
-    splash->updateCTM(state2, 0,0,0,0,0,0);
     state2->setTextMat(1.0,0,0,1.0,0,0);
     state2->setFont(font, 1024.0);
-    splash->doUpdateFont(state2);
-
-    current_splash_font = splash->getCurrentFont();
-    delete state2;
+    current_font_state = state2;
+
+    current_cached_font = getCachedFont(font, state->getHorizScaling());
+    char broken = 0;
+    if(current_cached_font && glyphcache_get_metrics(current_cached_font, &broken, &current_ascender, &current_descender)) {
+	/* we've seen this font program before (possibly in another document).
+	   Don't parse it again unless we encounter a glyph that's not
+	   in the cache. */
+	current_font_valid = !broken;
+	return;
+    }
+    loadSplashFont();
 }
 
 double matrix_scale_factor(gfxmatrix_t*m)
@@ -681,24 +792,85 @@ static inline void fontclass_clear(fontclass_t*cls)
     free(cls->id);cls->id=0;
 }
 
+/* fills in the fontkey_t for the current font. Returns 0 if the font
+   can't be identified by its reference alone. */
+static inline char fontkey_from_state(fontkey_t*key, GfxState*state)
+{
+    Ref*ref = state->getFont()->getID();
+    if(ref->gen == 999999) {
+	/* made-up reference of a direct font dictionary, not unique */
+	return 0;
+    }
+    memset(key, 0, sizeof(fontkey_t));
+    key->num = ref->num;
+    key->gen = ref->gen;
+    if(config_remove_font_transforms || config_remove_invisible_outlines) {
+	/* same bits fontclass_equals() compares */
+	fontclass_t cls;
+	gfxcolor_t col = gfxstate_getfontcolor(state);
+	gfxmatrix_t m = gfxmatrix_from_state(state);
+	font_classify(&cls, &m, 0, &col);
+	if(config_remove_font_transforms) {
+	    key->m00 = (*(U32*)&cls.m00)&0xfff00000;
+	    key->m01 = (*(U32*)&cls.m01)&0xfff00000;
+	    key->m10 = (*(U32*)&cls.m10)&0xfff00000;
+	    key->m11 = (*(U32*)&cls.m11)&0xfff00000;
+	}
+	if(config_remove_invisible_outlines) {
+	    key->alpha = cls.alpha;
+	}
+    }
+    return 1;
+}
+
+FontInfo* InfoOutputDev::lookupFontInfo(GfxState*state, fontkey_t*key, char*has_key)
+{
+    *has_key = fontkey_from_state(key, state);
+    if(!*has_key)
+	return 0;
+    if(last_key_font && !memcmp(key, &last_key, sizeof(fontkey_t)))
+	return last_key_font;
+    FontInfo*fontinfo = (FontInfo*)ohash_lookup(this->fontkeys, key);
+    if(fontinfo) {
+	last_key = *key;
+	last_key_font = fontinfo;
+    }
+    return fontinfo;
+}
+
+void InfoOutputDev::rememberFontInfo(fontkey_t*key, FontInfo*fontinfo)
+{
+    ohash_put(this->fontkeys, key, fontinfo);
+    last_key = *key;
+    last_key_font = fontinfo;
+}
+
 FontInfo* InfoOutputDev::getOrCreateFontInfo(GfxState*state)
 {
     GfxFont*font = state->getFont();
-    fontclass_t fontclass = fontclass_from_state(state);
+    fontkey_t key;
+    char has_key;
 
-    FontInfo* fontinfo = (FontInfo*)dict_lookup(this->fontcache, &fontclass);
+    FontInfo* fontinfo = lookupFontInfo(state, &key, &has_key);
     if(!fontinfo) {
-	fontinfo = new FontInfo(&fontclass);
-	dict_put(this->fontcache, &fontclass, fontinfo);
-	fontinfo->font = font;
-	fontinfo->max_size = 0;
-	if(current_splash_font) {
-	    fontinfo->ascender = current_splash_font->ascender;
-	    fontinfo->descender = current_splash_font->descender;
-	} else {
-	    fontinfo->ascender = fontinfo->descender = 0;
+	fontclass_t fontclass = fontclass_from_state(state);
+	fontinfo = (FontInfo*)dict_lookup(this->fontcache, &fontclass);
+	if(!fontinfo) {
+	    fontinfo = new FontInfo(&fontclass);
+	    dict_put(this->fontcache, &fontclass, fontinfo);
+	    fontinfo->font = font;
+	    fontinfo->max_size = 0;
+	    if(current_font_valid) {
+		fontinfo->ascender = current_ascender;
+		fontinfo->descender = current_descender;
+	    } else {
+		fontinfo->ascender = fontinfo->descender = 0;
+	    }
+	    num_fonts++;
 	}
-	num_fonts++;
+	fontclass_clear(&fontclass);
+	if(has_key)
+	    rememberFontInfo(&key, fontinfo);
     }
 
     if(last_font && fontinfo!=last_font) {
@@ -706,17 +878,24 @@ FontInfo* InfoOutputDev::getOrCreateFontInfo(GfxState*state)
     }
 
     this->last_font = fontinfo;
-    fontclass_clear(&fontclass);
     return fontinfo;
 }
 
 FontInfo* InfoOutputDev::getFontInfo(GfxState*state)
 {
+    fontkey_t key;
+    char has_key;
+    FontInfo*result = lookupFontInfo(state, &key, &has_key);
+    if(result)
+	return result;
+
     fontclass_t fontclass = fontclass_from_state(state);
-    FontInfo*result = (FontInfo*)dict_lookup(this->fontcache, &fontclass);
+    result = (FontInfo*)dict_lookup(this->fontcache, &fontclass);
     if(!result) {
 	printf("NOT FOUND: ");
 	fontclass_print(&fontclass);
+    } else if(has_key) {
+	rememberFontInfo(&key, result);
     }
     fontclass_clear(&fontclass);
     return result;
@@ -754,7 +933,7 @@ void InfoOutputDev::drawChar(GfxState *state, double x, double y,
 	msg("<error> Internal error: No fontinfo for font");
 	return; //error
     }
-    if(!current_splash_font) {
+    if(!current_font_valid) {
 	msg("<error> Internal error: No current splash fontinfo");
 	return; //error
     }
@@ -778,9 +957,7 @@ void InfoOutputDev::drawChar(GfxState *state, double x, double y,
     if(!g) {
 	g = fontinfo->glyphs[code] = new GlyphInfo();
 	g->advance_max = 0;
-	current_splash_font->last_advance = -1;
-	g->path = current_splash_font->getGlyphPath(code);
-	g->advance = current_splash_font->last_advance;
+	loadGlyph(code, g);
 	g->unicode = 0;
     }
     if(uLen && ((u[0]>=32 && u[0]<g->unicode) || !g->unicode)) {
@@ -845,17 +1022,25 @@ GBool InfoOutputDev::beginType3Char(GfxState *state, double x, double y, double
 	return gTrue;
 
     current_splash_font = 0;
+    current_font_valid = 0;
 
-    fontclass_t fontclass = fontclass_from_state(state);
-    FontInfo* fontinfo = (FontInfo*)dict_lookup(this->fontcache, &fontclass);
+    fontkey_t key;
+    char has_key;
+    FontInfo* fontinfo = lookupFontInfo(state, &key, &has_key);
     if(!fontinfo) {
-	fontinfo = new FontInfo(&fontclass);
-	dict_put(this->fontcache, &fontclass, fontinfo);
-	fontinfo->font = font;
-	fontinfo->max_size = 0;
-	num_fonts++;
+	fontclass_t fontclass = fontclass_from_state(state);
+	fontinfo = (FontInfo*)dict_lookup(this->fontcache, &fontclass);
+	if(!fontinfo) {
+	    fontinfo = new FontInfo(&fontclass);
+	    dict_put(this->fontcache, &fontclass, fontinfo);
+	    fontinfo->font = font;
+	    fontinfo->max_size = 0;
+	    num_fonts++;
+	}
+	fontclass_clear(&fontclass);
+	if(has_key)
+	    rememberFontInfo(&key, fontinfo);
     }
-    fontclass_clear(&fontclass);
 
     current_type3_font = fontinfo;
     fontinfo->grow(code+1);
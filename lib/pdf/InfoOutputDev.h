@@ -49,6 +49,7 @@
 #include "../gfxtools.h"
 #include "../gfxfont.h"
 #include "../q.h"
+#include "glyphcache.h"
 
 #define INTERNAL_FONT_SIZE 1024.0
 #define GLYPH_IS_SPACE(g) ((!(g)->line || ((g)->line->type==gfx_moveTo && !(g)->line->next)) && (g)->advance)
@@ -70,6 +71,15 @@ typedef struct _fontclass {
     unsigned char alpha;
 } fontclass_t;
 
+/* fixed-size equivalent of a fontclass_t, for the allocation free lookup
+   in InfoOutputDev::getFontInfo(). The font is identified by its object
+   reference instead of its id string. */
+typedef struct _fontkey {
+    int num, gen;
+    uint32_t m00,m01,m10,m11;
+    uint32_t alpha;
+} fontkey_t;
+
 class FontInfo
 {
     gfxfont_t*gfxfont;
@@ -102,6 +112,11 @@ public:
     int num_glyphs;
     GlyphInfo**glyphs;
 
+    /* charid -> index into getGfxFont()->glyphs (-1 if unused),
+       filled in by getGfxFont() */
+    int*glyphids;
+    int num_glyphids;
+
     char seen;
     int space_char;
     float average_advance;
@@ -117,14 +132,26 @@ class InfoOutputDev: public OutputDev
 {
     GlyphInfo* currentglyph;
     SplashOutputDev*splash;
+    XRef*xref;
     char previous_was_char;
     Page *page;
 
     dict_t*fontcache;
+    ohash_t*fontkeys;
+    fontkey_t last_key;
+    FontInfo*last_key_font;
     FontInfo*last_font;
     FontInfo*current_type3_font;
     SplashFont*current_splash_font;
 
+    /* font object reference -> glyphcache_key_t (with len=0 if the
+       font can't be cached) */
+    ohash_t*fontprograms;
+    cachedfont_t*current_cached_font;
+    GfxState*current_font_state; // for loading the font program on demand
+    char current_font_valid;
+    double current_ascender, current_descender;
+
     public:
     int x1,y1,x2,y2;
     int num_links;
@@ -203,6 +230,11 @@ class InfoOutputDev: public OutputDev
     private:
     
     FontInfo* getOrCreateFontInfo(GfxState*state);
+    FontInfo* lookupFontInfo(GfxState*state, fontkey_t*key, char*has_key);
+    void rememberFontInfo(fontkey_t*key, FontInfo*fontinfo);
+    cachedfont_t* getCachedFont(GfxFont*font, double hscale);
+    void loadSplashFont();
+    void loadGlyph(CharCode code, GlyphInfo*g);
 };
 
 #endif //__infooutputdev_h__
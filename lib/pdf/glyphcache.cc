@@ -0,0 +1,336 @@
+/* glyphcache.cc
+   Process-wide cache of glyph outlines, shared between documents.
+
+   This file is part of swftools.
+
+   Swftools is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   Swftools is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with swftools; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#include <string.h>
+#include "../../config.h"
+#include "gmem.h"
+#include "glyphcache.h"
+#include "../log.h"
+#include "../mem.h"
+#include "../q.h"
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+#include <pthread.h>
+#define USE_THREADS
+#endif
+
+/* Loading a font program means writing it to a temporary file and parsing
+   it with FreeType, once per document. In batch conversions, the same
+   (subset) fonts tend to show up in document after document, so we keep
+   the outlines around, keyed by a hash of the font program.
+   Documents may be converted on several threads at once, so the table, the
+   LRU list and the statistics are guarded by a mutex. Fonts and glyphs
+   handed out stay valid while the font is referenced, as only unreferenced
+   fonts are evicted. */
+
+#ifdef USE_THREADS
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK() pthread_mutex_lock(&mutex)
+#define UNLOCK() pthread_mutex_unlock(&mutex)
+#else
+#define LOCK()
+#define UNLOCK()
+#endif
+
+static dict_t*fonts = 0;
+static cachedfont_t*first = 0; // most recently used
+static cachedfont_t*last = 0;  // least recently used
+
+static size_t maxsize = 32*1024*1024;
+static size_t total_size = 0;
+
+static int font_hits = 0;
+static int font_misses = 0;
+static int glyph_hits = 0;
+static int glyph_misses = 0;
+static int evictions = 0;
+
+static uint32_t fnv_add_bytes(uint32_t h, const void*data, int len)
+{
+    const unsigned char*p = (const unsigned char*)data;
+    int t;
+    for(t=0;t<len;t++) {
+	h ^= p[t];
+	h *= 16777619;
+    }
+    return h;
+}
+
+static char glyphcache_key_equals(const void*o1, const void*o2)
+{
+    return !memcmp(o1, o2, sizeof(glyphcache_key_t));
+}
+static unsigned int glyphcache_key_hash(const void*o)
+{
+    return ((glyphcache_key_t*)o)->crc ^ ((glyphcache_key_t*)o)->hscale;
+}
+static void* glyphcache_key_dup(const void*o)
+{
+    glyphcache_key_t*key = (glyphcache_key_t*)malloc(sizeof(glyphcache_key_t));
+    memcpy(key, o, sizeof(glyphcache_key_t));
+    return key;
+}
+static void glyphcache_key_free(void*o)
+{
+    free(o);
+}
+
+static type_t glyphcache_key_type = {
+    glyphcache_key_equals,
+    glyphcache_key_hash,
+    glyphcache_key_dup,
+    glyphcache_key_free
+};
+
+#define KEY_ADD(key, data, len) \
+    {(key)->crc = crc32_add_bytes((key)->crc, (data), (len)); \
+     (key)->fnv = fnv_add_bytes((key)->fnv, (data), (len));}
+
+char glyphcache_key_from_font(glyphcache_key_t*key, GfxFont*font, XRef*xref)
+{
+    Ref embRef;
+    if(!maxsize || font->getType() == fontType3 || !font->getEmbeddedFontID(&embRef))
+	return 0;
+
+    int len = 0;
+    char*data = font->readEmbFontFile(xref, &len);
+    if(!data)
+	return 0;
+
+    memset(key, 0, sizeof(glyphcache_key_t));
+    key->fnv = 2166136261u;
+    KEY_ADD(key, data, len);
+    gfree(data);
+    key->len = len;
+    key->type = font->getType();
+
+    /* the glyph a character code maps to also depends on the font
+       dictionary, see SplashOutputDev::doUpdateFont() */
+    int flags = font->getFlags();
+    KEY_ADD(key, &flags, sizeof(flags));
+    if(font->isCIDFont()) {
+	GfxCIDFont*cidfont = (GfxCIDFont*)font;
+	int n = cidfont->getCIDToGIDLen();
+	KEY_ADD(key, &n, sizeof(n));
+	if(cidfont->getCIDToGID()) {
+	    KEY_ADD(key, cidfont->getCIDToGID(), n*sizeof(Gushort));
+	}
+    } else {
+	Gfx8BitFont*font8 = (Gfx8BitFont*)font;
+	char**encoding = font8->getEncoding();
+	int t;
+	for(t=0;t<256;t++) {
+	    const char*name = encoding[t]?encoding[t]:"";
+	    KEY_ADD(key, name, strlen(name)+1);
+	}
+	char b[2] = {(char)font8->getHasEncoding(), (char)font8->getUsesMacRomanEnc()};
+	KEY_ADD(key, b, 2);
+    }
+    return 1;
+}
+
+static void cachedfont_unlink(cachedfont_t*font)
+{
+    if(font->prev) font->prev->next = font->next;
+    else first = font->next;
+    if(font->next) font->next->prev = font->prev;
+    else last = font->prev;
+    font->prev = font->next = 0;
+}
+
+static void cachedfont_link(cachedfont_t*font)
+{
+    font->prev = 0;
+    font->next = first;
+    if(first) first->prev = font;
+    first = font;
+    if(!last) last = font;
+}
+
+static void cachedfont_destroy(cachedfont_t*font)
+{
+    int t;
+    for(t=0;t<font->num_glyphs;t++) {
+	if(font->glyphs[t]) {
+	    delete font->glyphs[t]->path;
+	    free(font->glyphs[t]);
+	}
+    }
+    free(font->glyphs);
+    total_size -= font->size;
+    free(font);
+}
+
+/* evict least recently used fonts until another <needed> bytes fit.
+   Called with the mutex held. */
+static void glyphcache_shrink(size_t needed)
+{
+    cachedfont_t*font = last;
+    while(font && total_size + needed > maxsize) {
+	cachedfont_t*prev = font->prev;
+	if(!font->refcount) {
+	    cachedfont_unlink(font);
+	    dict_del(fonts, &font->key);
+	    cachedfont_destroy(font);
+	    evictions++;
+	}
+	font = prev;
+    }
+}
+
+cachedfont_t* glyphcache_get(glyphcache_key_t*key)
+{
+    LOCK();
+    if(!fonts)
+	fonts = dict_new2(&glyphcache_key_type);
+
+    cachedfont_t*font = (cachedfont_t*)dict_lookup(fonts, key);
+    if(font && font->loaded) {
+	font_hits++;
+    } else {
+	font_misses++;
+    }
+    if(font) {
+	cachedfont_unlink(font);
+    } else {
+	font = (cachedfont_t*)rfx_calloc(sizeof(cachedfont_t));
+	font->key = *key;
+	font->size = sizeof(cachedfont_t);
+	total_size += font->size;
+	dict_put(fonts, key, font);
+    }
+    cachedfont_link(font);
+    font->refcount++;
+    UNLOCK();
+    return font;
+}
+
+void glyphcache_release(cachedfont_t*font)
+{
+    LOCK();
+    font->refcount--;
+    glyphcache_shrink(0);
+    UNLOCK();
+}
+
+void glyphcache_set_metrics(cachedfont_t*font, SplashFont*splash_font)
+{
+    LOCK();
+    if(!font->loaded) {
+	if(splash_font) {
+	    font->ascender = splash_font->ascender;
+	    font->descender = splash_font->descender;
+	} else {
+	    font->broken = 1;
+	}
+	font->loaded = 1;
+    }
+    UNLOCK();
+}
+
+char glyphcache_get_metrics(cachedfont_t*font, char*broken, double*ascender, double*descender)
+{
+    LOCK();
+    char loaded = font->loaded;
+    if(loaded) {
+	*broken = font->broken;
+	*ascender = font->ascender;
+	*descender = font->descender;
+    }
+    UNLOCK();
+    return loaded;
+}
+
+cachedglyph_t* glyphcache_find_glyph(cachedfont_t*font, int code)
+{
+    cachedglyph_t*g = 0;
+    LOCK();
+    if(code>=0 && code<font->num_glyphs && font->glyphs[code]) {
+	g = font->glyphs[code];
+	glyph_hits++;
+    } else {
+	glyph_misses++;
+    }
+    UNLOCK();
+    return g;
+}
+
+void glyphcache_add_glyph(cachedfont_t*font, int code, SplashPath*path, double advance)
+{
+    if(code<0)
+	return;
+    size_t size = sizeof(cachedglyph_t);
+    if(path)
+	size += sizeof(SplashPath) + path->getLength()*(sizeof(SplashPathPoint)+sizeof(Guchar));
+    if(code >= font->num_glyphs)
+	size += (code+1-font->num_glyphs)*sizeof(cachedglyph_t*);
+
+    LOCK();
+    glyphcache_shrink(size);
+    if(total_size + size > maxsize) {
+	/* everything that's left is in use */
+	UNLOCK();
+	return;
+    }
+
+    if(code >= font->num_glyphs) {
+	font->glyphs = (cachedglyph_t**)rfx_realloc(font->glyphs, sizeof(cachedglyph_t*)*(code+1));
+	memset(&font->glyphs[font->num_glyphs], 0, sizeof(cachedglyph_t*)*(code+1-font->num_glyphs));
+	font->num_glyphs = code+1;
+    }
+    if(font->glyphs[code]) {
+	UNLOCK();
+	return;
+    }
+
+    cachedglyph_t*g = (cachedglyph_t*)malloc(sizeof(cachedglyph_t));
+    g->path = path?path->copy():0;
+    g->advance = advance;
+    font->glyphs[code] = g;
+    font->size += size;
+    total_size += size;
+    UNLOCK();
+}
+
+void glyphcache_set_maxsize(size_t size)
+{
+    LOCK();
+    maxsize = size;
+    glyphcache_shrink(0);
+    UNLOCK();
+}
+
+void glyphcache_clear()
+{
+    LOCK();
+    size_t old_maxsize = maxsize;
+    maxsize = 0;
+    glyphcache_shrink(0);
+    maxsize = old_maxsize;
+    UNLOCK();
+}
+
+void glyphcache_print_statistics()
+{
+    LOCK();
+    msg("<verbose> Glyph cache: %d/%d fonts, %d/%d glyphs found, %d fonts (%lu bytes) cached, %d evicted",
+	    font_hits, font_hits+font_misses,
+	    glyph_hits, glyph_hits+glyph_misses,
+	    fonts?dict_count(fonts):0, (unsigned long)total_size, evictions);
+    UNLOCK();
+}
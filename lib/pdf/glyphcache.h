@@ -0,0 +1,93 @@
+/* glyphcache.h
+   Process-wide cache of glyph outlines, shared between documents.
+
+   This file is part of swftools.
+
+   Swftools is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   Swftools is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with swftools; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#ifndef __glyphcache_h__
+#define __glyphcache_h__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "popplercompat.h"
+#include "GfxFont.h"
+#include "XRef.h"
+
+#ifdef HAVE_POPPLER
+  #include <splash/SplashPath.h>
+  #include <splash/SplashFont.h>
+#else
+  #include "SplashPath.h"
+  #include "SplashFont.h"
+#endif
+
+/* An embedded font program, plus everything that influences how character
+   codes are mapped to glyphs (font type, flags, encoding, CIDToGIDMap).
+   Two fonts with the same key produce the same glyph outlines, no matter
+   which document they come from. */
+typedef struct _glyphcache_key {
+    uint32_t crc;
+    uint32_t fnv;
+    uint32_t len;
+    uint32_t type;
+    /* bit pattern of the horizontal scaling the outlines were created with */
+    uint32_t hscale;
+} glyphcache_key_t;
+
+typedef struct _cachedglyph {
+    SplashPath*path;
+    double advance;
+} cachedglyph_t;
+
+typedef struct _cachedfont {
+    glyphcache_key_t key;
+
+    char loaded; // ascender, descender and broken are valid
+    char broken; // the font program couldn't be loaded
+    double ascender, descender;
+
+    int num_glyphs;
+    cachedglyph_t**glyphs;
+
+    size_t size; // approximate memory used by this font, in bytes
+    int refcount;
+    struct _cachedfont*prev;
+    struct _cachedfont*next;
+} cachedfont_t;
+
+/* computes the key for an (embedded, non-Type3) font. Returns 0 if
+   the font can't be cached. */
+char glyphcache_key_from_font(glyphcache_key_t*key, GfxFont*font, XRef*xref);
+
+/* returns the cache entry for the given key, creating an empty one if
+   necessary. The entry stays valid until glyphcache_release() is called. */
+cachedfont_t* glyphcache_get(glyphcache_key_t*key);
+void glyphcache_release(cachedfont_t*font);
+
+/* stores ascender and descender of a freshly loaded font (splash_font=0 if
+   loading failed), unless another thread did so already */
+void glyphcache_set_metrics(cachedfont_t*font, SplashFont*splash_font);
+/* returns 0 if the font wasn't loaded yet */
+char glyphcache_get_metrics(cachedfont_t*font, char*broken, double*ascender, double*descender);
+cachedglyph_t* glyphcache_find_glyph(cachedfont_t*font, int code);
+void glyphcache_add_glyph(cachedfont_t*font, int code, SplashPath*path, double advance);
+
+/* maximum number of bytes used for glyph outlines. 0 disables the cache. */
+void glyphcache_set_maxsize(size_t size);
+void glyphcache_clear();
+void glyphcache_print_statistics();
+
+#endif //__glyphcache_h__
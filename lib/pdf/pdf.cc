@@ -457,6 +457,14 @@ static void pdf_setparameter(gfxsource_t*src, const char*name, const char*value)
 	msg("<error> %s not supported anymore. Please use jpegsubpixels/ppmsubpixels");
     } else if(!strcmp(name, "multiply")) {
         multiply = atof(value);
+    } else if(!strcmp(name, "glyphcache")) {
+        /* in megabytes. Clamp, so that the byte count fits into a size_t */
+        long mb = atol(value);
+        if(mb < 0)
+            mb = 0;
+        if((unsigned long)mb > (size_t)-1/(1024*1024))
+            mb = (size_t)-1/(1024*1024);
+        glyphcache_set_maxsize((size_t)mb*1024*1024);
     } else if(!strcmp(name, "help")) {
 	printf("\nPDF device global parameters:\n");
 	printf("fontdir=<dir>     a directory with additional fonts\n");
@@ -465,6 +473,7 @@ static void pdf_setparameter(gfxsource_t*src, const char*name, const char*value)
 	printf("zoom=<dpi>        the resultion (default: 72)\n");
 	printf("languagedir=<dir> Add an xpdf language directory\n");
 	printf("multiply=<times>  Render everything at <times> the resolution\n");
+	printf("glyphcache=<mb>   Memory used for caching glyphs between documents (default: 32, 0=off)\n");
 	printf("poly2bitmap       Convert graphics to bitmaps\n");
 	printf("bitmap            Convert everything to bitmaps\n");
     }	
@@ -24,6 +24,14 @@
 #include <fcntl.h>
 #include <zlib.h>
 #include <limits.h>
+#include "../config.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+#include <pthread.h>
+#define USE_THREADS
+#endif
 
 #ifdef EXPORT
 #undef EXPORT
@@ -31,6 +39,7 @@
 
 #ifdef PNG_INLINE_EXPORTS
 #define EXPORT static
+typedef struct _pngwriter pngwriter_t;
 #else
 #define EXPORT
 #include "png.h"
@@ -167,278 +176,118 @@ static inline byte PaethPredictor (byte a,byte b,byte c)
         else return c;
 }
 
-static void applyfilter1(int mode, unsigned char*src, unsigned char*old, unsigned char*dest, unsigned width)
+#ifdef __SSE2__
+/* loads (and stores) a pixel of 3 or 4 bytes into the lower lanes of an sse
+   register. For 3 byte pixels, this reads one byte past the pixel. */
+static inline __m128i load_pixel(unsigned char*p)
 {
-    int x;
-    unsigned char last=0;
-    unsigned char upperlast=0;
-
-    if(mode==0) {
-	for(x=0;x<width;x++) {
-	    *dest = *src;
-	    dest++;
-	    src++;
-	}
-    }
-    else if(mode==1) {
-	for(x=0;x<width;x++) {
-	    *dest = *src+last;
-	    last = *dest;
-	    dest++;
-	    src++;
-	}
-    }
-    else if(mode==2) {
-	for(x=0;x<width;x++) {
-	    *dest = *src+*old;
-	    dest++;
-	    old++;
-	    src++;
-	}
-    }
-    else if(mode==3) {
-	for(x=0;x<width;x++) {
-	    *dest = *src+(*old+last)/2;
-	    last = *dest;
-	    dest++;
-	    old++;
-	    src++;
-	}
-    }
-    else if(mode==4) {
-	for(x=0;x<width;x++) {
-	    *dest = *src+PaethPredictor(last,*old,upperlast);
-	    last = *dest;
-	    upperlast = *old;
-	    dest++;
-	    old++;
-	    src++;
-	}
-    }    
-
+    int v;
+    memcpy(&v, p, 4);
+    return _mm_cvtsi32_si128(v);
 }
-
-static void applyfilter2(int mode, unsigned char*src, unsigned char*old, unsigned char*dest, unsigned width)
+static inline void store_pixel(unsigned char*p, __m128i v, int bypp)
 {
-    int x;
-    unsigned char lasta=0;
-    unsigned char lastb=0;
-    unsigned char upperlasta=0;
-    unsigned char upperlastb=0;
-
-    if(mode==0) {
-	for(x=0;x<width;x++) {
-	    dest[0] = src[0];
-	    dest[1] = src[1];
-	    dest+=2;
-	    src+=2;
-	}
-    }
-    else if(mode==1) {
-	for(x=0;x<width;x++) {
-	    dest[0] = src[0]+lasta;
-	    dest[1] = src[1]+lastb;
-	    lasta = dest[0];
-	    lastb = dest[1];
-	    dest+=2;
-	    src+=2;
-	}
-    }
-    else if(mode==2) {
-	for(x=0;x<width;x++) {
-	    dest[0] = src[0]+old[0];
-	    dest[1] = src[1]+old[1];
-	    dest+=2;
-	    old+=2;
-	    src+=2;
-	}
-    }
-    else if(mode==3) {
-	for(x=0;x<width;x++) {
-	    dest[0] = src[0]+(old[0]+lasta)/2;
-	    dest[1] = src[1]+(old[1]+lastb)/2;
-	    lasta = dest[0];
-	    lastb = dest[1];
-	    dest+=2;
-	    old+=2;
-	    src+=2;
-	}
-    }
-    else if(mode==4) {
-	for(x=0;x<width;x++) {
-	    dest[0] = src[0]+PaethPredictor(lasta,old[0],upperlasta);
-	    dest[1] = src[1]+PaethPredictor(lastb,old[1],upperlastb);
-	    lasta = dest[0];
-	    lastb = dest[1];
-	    upperlasta = old[0];
-	    upperlastb = old[1];
-	    dest+=2;
-	    old+=2;
-	    src+=2;
-	}
-    }    
+    int i = _mm_cvtsi128_si32(v);
+    memcpy(p, &i, bypp);
 }
+static inline __m128i paeth_pixel(__m128i a, __m128i b, __m128i c)
+{
+    __m128i zero = _mm_setzero_si128();
+    a = _mm_unpacklo_epi8(a, zero);
+    b = _mm_unpacklo_epi8(b, zero);
+    c = _mm_unpacklo_epi8(c, zero);
+    __m128i bc = _mm_sub_epi16(b, c);
+    __m128i ac = _mm_sub_epi16(a, c);
+    __m128i abc = _mm_add_epi16(ac, bc);
+    __m128i pa = _mm_max_epi16(bc, _mm_sub_epi16(zero, bc));
+    __m128i pb = _mm_max_epi16(ac, _mm_sub_epi16(zero, ac));
+    __m128i pc = _mm_max_epi16(abc, _mm_sub_epi16(zero, abc));
+    __m128i not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+    __m128i not_b = _mm_cmpgt_epi16(pb, pc);
+    __m128i bc_pred = _mm_or_si128(_mm_andnot_si128(not_b, b), _mm_and_si128(not_b, c));
+    __m128i pred = _mm_or_si128(_mm_andnot_si128(not_a, a), _mm_and_si128(not_a, bc_pred));
+    return _mm_packus_epi16(pred, zero);
+}
+#endif
 
-
-/* also performs 24 bit conversion! */
-static void applyfilter3(int mode, unsigned char*src, unsigned char*old, unsigned char*dest, unsigned width)
+/* undoes the png filter of a line of len bytes, in place. old is the
+   (already unfiltered) previous line, or zeroes.
+   For bypp=3, both lines need one byte of padding at the end. */
+static void png_unfilter_line(int mode, unsigned char*line, unsigned char*old, int len, int bypp)
 {
-    int x;
-    unsigned char lastr=0;
-    unsigned char lastg=0;
-    unsigned char lastb=0;
-    unsigned char upperlastr=0;
-    unsigned char upperlastg=0;
-    unsigned char upperlastb=0;
-
-    if(mode==0) {
-	for(x=0;x<width;x++) {
-	    dest[0] = 255;
-	    dest[1] = src[0];
-	    dest[2] = src[1];
-	    dest[3] = src[2];
-	    dest+=4;
-	    src+=3;
-	}
-    }
-    else if(mode==1) {
-	for(x=0;x<width;x++) {
-	    dest[0] = 255;
-	    dest[1] = src[0]+lastr;
-	    dest[2] = src[1]+lastg;
-	    dest[3] = src[2]+lastb;
-	    lastr = dest[1];
-	    lastg = dest[2];
-	    lastb = dest[3];
-	    dest+=4;
-	    src+=3;
+    int x = 0;
+    if(mode==2) {
+#ifdef __SSE2__
+	for(;x+16<=len;x+=16) {
+	    __m128i v = _mm_add_epi8(_mm_loadu_si128((__m128i*)&line[x]), _mm_loadu_si128((__m128i*)&old[x]));
+	    _mm_storeu_si128((__m128i*)&line[x], v);
 	}
+#endif
+	for(;x<len;x++)
+	    line[x] += old[x];
+	return;
     }
-    else if(mode==2) {
-	for(x=0;x<width;x++) {
-	    dest[0] = 255;
-	    dest[1] = src[0]+old[1];
-	    dest[2] = src[1]+old[2];
-	    dest[3] = src[2]+old[3];
-	    dest+=4;
-	    old+=4;
-	    src+=3;
+    if(mode!=1 && mode!=3 && mode!=4)
+	return;
+
+#ifdef __SSE2__
+    if(bypp==3 || bypp==4) {
+	__m128i a = _mm_setzero_si128(); // left
+	__m128i c = _mm_setzero_si128(); // upper left
+	__m128i one = _mm_set1_epi8(1);
+	for(x=0;x<len;x+=bypp) {
+	    __m128i v = load_pixel(&line[x]);
+	    if(mode==1) {
+		a = _mm_add_epi8(v, a);
+	    } else {
+		__m128i b = load_pixel(&old[x]);
+		if(mode==3) {
+		    __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+		    a = _mm_add_epi8(v, avg);
+		} else {
+		    a = _mm_add_epi8(v, paeth_pixel(a, b, c));
+		    c = b;
+		}
+	    }
+	    store_pixel(&line[x], a, bypp);
 	}
+	return;
     }
-    else if(mode==3) {
-	for(x=0;x<width;x++) {
-	    dest[0] = 255;
-	    dest[1] = src[0]+(old[1]+lastr)/2;
-	    dest[2] = src[1]+(old[2]+lastg)/2;
-	    dest[3] = src[2]+(old[3]+lastb)/2;
-	    lastr = dest[1];
-	    lastg = dest[2];
-	    lastb = dest[3];
-	    dest+=4;
-	    old+=4;
-	    src+=3;
-	}
+#endif
+    if(mode==1) {
+	for(x=bypp;x<len;x++)
+	    line[x] += line[x-bypp];
+    } else if(mode==3) {
+	for(x=0;x<bypp;x++)
+	    line[x] += old[x]/2;
+	for(;x<len;x++)
+	    line[x] += (line[x-bypp]+old[x])/2;
+    } else if(mode==4) {
+	for(x=0;x<bypp;x++)
+	    line[x] += PaethPredictor(0,old[x],0);
+	for(;x<len;x++)
+	    line[x] += PaethPredictor(line[x-bypp],old[x],old[x-bypp]);
     }
-    else if(mode==4) {
-	for(x=0;x<width;x++) {
-	    dest[0] = 255;
-	    dest[1] = src[0]+PaethPredictor(lastr,old[1],upperlastr);
-	    dest[2] = src[1]+PaethPredictor(lastg,old[2],upperlastg);
-	    dest[3] = src[2]+PaethPredictor(lastb,old[3],upperlastb);
-	    lastr = dest[1];
-	    lastg = dest[2];
-	    lastb = dest[3];
-	    upperlastr = old[1];
-	    upperlastg = old[2];
-	    upperlastb = old[3];
-	    dest+=4;
-	    old+=4;
-	    src+=3;
-	}
-    }    
 }
 
+/* undoes the png filter of a 32 bit (rgba) line, and converts it to argb.
+   old is the previous line, in argb. */
 void png_inverse_filter_32(int mode, unsigned char*src, unsigned char*old, unsigned char*dest, unsigned width)
 {
     int x;
-    unsigned char lastr=0;
-    unsigned char lastg=0;
-    unsigned char lastb=0;
-    unsigned char lasta=0;
-    unsigned char upperlastr=0;
-    unsigned char upperlastg=0;
-    unsigned char upperlastb=0;
-    unsigned char upperlasta=0;
-
-    if(mode==0) {
-	for(x=0;x<width;x++) {
-	    dest[0] = src[3];
-	    dest[1] = src[0];
-	    dest[2] = src[1];
-	    dest[3] = src[2];
-	    dest+=4;
-	    src+=4;
-	}
-    }
-    else if(mode==1) {
-	for(x=0;x<width;x++) {
-	    dest[0] = src[3]+lasta;
-	    dest[1] = src[0]+lastr;
-	    dest[2] = src[1]+lastg;
-	    dest[3] = src[2]+lastb;
-	    lasta = dest[0];
-	    lastr = dest[1];
-	    lastg = dest[2];
-	    lastb = dest[3];
-	    dest+=4;
-	    src+=4;
-	}
-    }
-    else if(mode==2) {
-	for(x=0;x<width;x++) {
-	    dest[0] = src[3]+old[0];
-	    dest[1] = src[0]+old[1];
-	    dest[2] = src[1]+old[2];
-	    dest[3] = src[2]+old[3];
-	    dest+=4;
-	    old+=4;
-	    src+=4;
-	}
-    }
-    else if(mode==3) {
-	for(x=0;x<width;x++) {
-	    dest[0] = src[3]+(old[0]+lasta)/2;
-	    dest[1] = src[0]+(old[1]+lastr)/2;
-	    dest[2] = src[1]+(old[2]+lastg)/2;
-	    dest[3] = src[2]+(old[3]+lastb)/2;
-	    lasta = dest[0];
-	    lastr = dest[1];
-	    lastg = dest[2];
-	    lastb = dest[3];
-	    dest+=4;
-	    old+=4;
-	    src+=4;
-	}
+    /* the filters work on each channel separately, so we can just as well
+       reorder the channels first */
+    for(x=0;x<width;x++) {
+	u32 v;
+	memcpy(&v, &src[x*4], 4);
+#ifdef WORDS_BIGENDIAN
+	v = v>>8|v<<24;
+#else
+	v = v<<8|v>>24;
+#endif
+	memcpy(&dest[x*4], &v, 4);
     }
-    else if(mode==4) {
-	for(x=0;x<width;x++) {
-	    dest[0] = src[3]+PaethPredictor(lasta,old[0],upperlasta);
-	    dest[1] = src[0]+PaethPredictor(lastr,old[1],upperlastr);
-	    dest[2] = src[1]+PaethPredictor(lastg,old[2],upperlastg);
-	    dest[3] = src[2]+PaethPredictor(lastb,old[3],upperlastb);
-	    lasta = dest[0];
-	    lastr = dest[1];
-	    lastg = dest[2];
-	    lastb = dest[3];
-	    upperlasta = old[0];
-	    upperlastr = old[1];
-	    upperlastg = old[2];
-	    upperlastb = old[3];
-	    dest+=4;
-	    old+=4;
-	    src+=4;
-	}
-    }    
+    png_unfilter_line(mode, dest, old, width*4, 4);
 }
 
 EXPORT int png_getdimensions(const char*sname, unsigned*destwidth, unsigned*destheight)
@@ -459,14 +308,53 @@ EXPORT int png_getdimensions(const char*sname, unsigned*destwidth, unsigned*dest
     return 1;
 }
 
+/* inflates the IDAT chunks of a png file, a line at a time */
+typedef struct _idatreader {
+    FILE*fi;
+    z_stream zs;
+    unsigned remaining; // bytes left in the current IDAT chunk
+    unsigned char buf[16384];
+} idatreader_t;
+
+static int idat_read(idatreader_t*r, unsigned char*dest, int len)
+{
+    r->zs.next_out = dest;
+    r->zs.avail_out = len;
+    while(r->zs.avail_out) {
+	if(!r->zs.avail_in) {
+	    while(!r->remaining) {
+		/* skip the crc, and continue with the next IDAT chunk */
+		unsigned char head[8];
+		fseek(r->fi, 4, SEEK_CUR);
+		if(!fread(head, 8, 1, r->fi) || !strncmp((char*)&head[4], "IEND", 4))
+		    return 0;
+		unsigned chunklen = head[0]<<24|head[1]<<16|head[2]<<8|head[3];
+		if(!strncmp((char*)&head[4], "IDAT", 4))
+		    r->remaining = chunklen;
+		else
+		    fseek(r->fi, chunklen, SEEK_CUR);
+	    }
+	    int l = r->remaining < sizeof(r->buf) ? r->remaining : sizeof(r->buf);
+	    if(!fread(r->buf, l, 1, r->fi))
+		return 0;
+	    r->remaining -= l;
+	    r->zs.next_in = r->buf;
+	    r->zs.avail_in = l;
+	}
+	int ret = inflate(&r->zs, Z_NO_FLUSH);
+	if(ret == Z_STREAM_END)
+	    return !r->zs.avail_out;
+	if(ret != Z_OK)
+	    return 0;
+    }
+    return 1;
+}
+
 EXPORT int png_load(const char*sname, unsigned*destwidth, unsigned*destheight, unsigned char**destdata)
 {
     char tagid[4];
     int len;
     unsigned char*data;
-    unsigned char*imagedata;
-    unsigned char*zimagedata=0;
-    unsigned long int zimagedatalen=0;
     unsigned char*palette = 0;
     int palettelen = 0;
     unsigned char*alphapalette = 0;
@@ -476,9 +364,11 @@ EXPORT int png_load(const char*sname, unsigned*destwidth, unsigned*destheight, u
     unsigned char*data2 = 0;
     unsigned char alphacolor[3];
     int hasalphacolor=0;
+    idatreader_t*r;
+    char found_idat = 0;
+    unsigned idatlen = 0;
 
     FILE *fi;
-    unsigned char *scanline;
 
     if ((fi = fopen(sname, "rb")) == NULL) {
 	printf("Couldn't open %s\n", sname);
@@ -496,18 +386,35 @@ EXPORT int png_load(const char*sname, unsigned*destwidth, unsigned*destheight, u
     else if(header.mode == 6) bypp = 4;
     else {
 	printf("ERROR: mode:%d\n", header.mode);
+	fclose(fi);
+	return 0;
+    }
+    if((header.bpp != 8 && (header.mode == 2 || header.mode == 4 || header.mode == 6)) || header.bpp > 8) {
+	/* not implemented yet */
+	fprintf(stderr, "ERROR: mode=%d bpp:%d\n", header.mode, header.bpp);
+	fclose(fi);
 	return 0;
     }
 
     unsigned long long imagedatalen_64 = ((unsigned long long)header.width + 1) * header.height * bypp;
-    if(imagedatalen_64 > 0xffffffff)
+    if(imagedatalen_64 > 0xffffffff) {
+	fclose(fi);
 	return 0;
-    unsigned long imagedatalen = (unsigned long)imagedatalen_64;
-    imagedata = (unsigned char*)malloc(imagedatalen);
+    }
 
+    /* read everything up to the first IDAT chunk. The image data itself
+       is inflated (and unfiltered) one line at a time, straight from the
+       chunks, into the destination image. */
     fseek(fi,8,SEEK_SET);
     while(!feof(fi))
     {
+	unsigned char head[8];
+	if(fread(head, 8, 1, fi) && !strncmp((char*)&head[4], "IDAT", 4)) {
+	    idatlen = head[0]<<24|head[1]<<16|head[2]<<8|head[3];
+	    found_idat = 1;
+	    break;
+	}
+	fseek(fi, -8, SEEK_CUR);
 	if(!png_read_chunk(&tagid, &len, &data, fi))
 	    break;
 	if(!strncmp(tagid, "IEND", 4)) {
@@ -537,431 +444,468 @@ EXPORT int png_load(const char*sname, unsigned*destwidth, unsigned*destheight, u
 		hasalphacolor = 1;
 	    }
 	}
-	if(!strncmp(tagid, "IDAT", 4)) {
-	    if(!zimagedata) {
-		zimagedatalen = len;
-		zimagedata = (unsigned char*)malloc(len);
-		memcpy(zimagedata,data,len);
-	    } else {
-		zimagedata = (unsigned char*)realloc(zimagedata, zimagedatalen+len);
-		memcpy(&zimagedata[zimagedatalen], data, len);
-		zimagedatalen += len;
-	    }
-	}
-	if(!strncmp(tagid, "tEXt", 4)) {
-	    /*int t;
-	    printf("Image Text: ");
-	    for(t=0;t<len;t++) {
-		if(data[t]>=32 && data[t]<128)
-		    printf("%c", data[t]);
-		else
-		    printf("?");
-	    }
-	    printf("\n");*/
-	}
 	if(data) {
 	    free(data); data=0;
         }
     }
     
-    fclose(fi);
-    if(!zimagedata || uncompress(imagedata, &imagedatalen, zimagedata, zimagedatalen) != Z_OK) {
+    r = (idatreader_t*)calloc(1, sizeof(idatreader_t));
+    r->fi = fi;
+    if(found_idat) {
+	/* we're right behind the chunk header */
+	r->remaining = idatlen;
+    }
+    if(!found_idat || inflateInit(&r->zs) != Z_OK) {
 	printf("Couldn't uncompress %s!\n", sname);
-	if(zimagedata)
-	    free(zimagedata);
+	free(r);
+	fclose(fi);
 	return 0;
     }
-    free(zimagedata);
 
     *destwidth = header.width;
     *destheight = header.height;
 	
     data2 = (unsigned char*)malloc(header.width*header.height*4);
 
-    if(header.mode == 4)
-    {
-	int i,s=0;
-	int x,y;
-	int pos=0;
-	unsigned char* old= (unsigned char*)malloc(header.width*2);
-	memset(old, 0, header.width*2);
-	*destdata = data2;
-	for(y=0;y<header.height;y++) {
-	    int mode = imagedata[pos++]; //filter mode
-	    unsigned char*src;
-	    unsigned char*dest;
-	    int x;
-	    dest = &data2[(y*header.width)*4];
-
-	    if(header.bpp == 8) {
-		/* one byte per pixel */
-		src = &imagedata[pos];
-		pos+=header.width*2;
-	    } else {
-		/* not implemented yet */
-		fprintf(stderr, "ERROR: mode=4 bpp:%d\n", header.bpp);
-		free(data2);
-		return 0;
-	    }
-
-	    applyfilter2(mode, src, old, dest, header.width);
-	    memcpy(old, dest, header.width*2);
-
-	    for(x=header.width-1;x>=0;x--) {
-		unsigned char gray = dest[x*2+0];
-		unsigned char alpha = dest[x*2+1];
-		dest[x*4+0] = alpha;
-		dest[x*4+1] = gray;
-		dest[x*4+2] = gray;
-		dest[x*4+3] = gray;
+    /* the current and the previous line, still in png layout. (Plus
+       some padding, for png_unfilter_line()) */
+    int linelen = header.mode == 0 || header.mode == 3 ?
+	(header.width*header.bpp+7)/8 : header.width*bypp;
+    unsigned char*line = (unsigned char*)malloc(linelen+2);
+    unsigned char*lastline = (unsigned char*)calloc(1, linelen+2);
+    unsigned char*zeroline = (unsigned char*)calloc(1, header.width*4);
+    COL*rgba = 0;
+    int i,x,y;
+    char ok = 1;
+
+    if(header.mode == 0) { // grayscale palette
+	int mult = (0x1ff>>header.bpp);
+	palettelen = 1<<header.bpp;
+	rgba = (COL*)malloc(palettelen*sizeof(COL));
+	for(i=0;i<palettelen;i++) {
+	    rgba[i].a = 255;
+	    rgba[i].r = i*mult;
+	    rgba[i].g = i*mult;
+	    rgba[i].b = i*mult;
+	    if(hasalphacolor) {
+		if(rgba[i].r == alphacolor[0])
+		    rgba[i].a = 0;
 	    }
 	}
-	free(old);
-        free(imagedata);
-    } else if(header.mode == 6 || header.mode == 2) {
-	int i,s=0;
-	int x,y;
-	int pos=0;
-	*destdata = data2;
-	
-	unsigned char* firstline = malloc(header.width*4);
-	memset(firstline,0,header.width*4);
-	for(y=0;y<header.height;y++) {
-	    int mode = imagedata[pos++]; //filter mode
-	    unsigned char*src;
-	    unsigned char*dest;
-	    unsigned char*old;
-	    dest = &data2[(y*header.width)*4];
-
-	    if(header.bpp == 8)
-	    {
-		/* one byte per pixel */
-		src = &imagedata[pos];
-		pos+=header.width*(header.mode==6?4:3);
-	    } else {
-		/* not implemented yet */
-		fprintf(stderr, "ERROR: bpp:%d\n", header.bpp);
-		free(data2);
-		return 0;
-	    }
-
-	    if(!y) {
-		old = firstline;
-	    } else {
-		old = &data2[(y-1)*header.width*4];
-	    }
-	    if(header.mode == 6) { 
-		png_inverse_filter_32(mode, src, old, dest, header.width);
-	    } else { // header.mode = 2
-		applyfilter3(mode, src, old, dest, header.width);
-		/* replace alpha color */
-		if(hasalphacolor) {
-		    int x;
-		    for(x=0;x<header.width;x++) {
-			if(dest[x*4+1] == alphacolor[0] &&
-			   dest[x*4+2] == alphacolor[1] &&
-			   dest[x*4+3] == alphacolor[2]) {
-			    *(u32*)&dest[x*4] = 0;
-			}
-		    }
-		}
-	    }
+    } else if(header.mode == 3) {
+	if(!palette) {
+	    fprintf(stderr, "Error: No palette found!\n");
+	    exit(1);
 	}
-	free(firstline);
-        free(imagedata);
-    } else if(header.mode == 0 || header.mode == 3) {
-	COL*rgba = 0;
-	unsigned char*tmpline = (unsigned char*)malloc(header.width+1);
-	unsigned char*destline = (unsigned char*)malloc(header.width+1);
-	int i,x,y;
-	int pos=0;
-	
-	*destdata = data2;
-	
-	if(header.mode == 0) { // grayscale palette
-            int mult = (0x1ff>>header.bpp);
-	    palettelen = 1<<header.bpp;
-	    rgba = (COL*)malloc(palettelen*sizeof(COL));
-	    for(i=0;i<palettelen;i++) {
+	/* entries beyond the end of the palette are black */
+	rgba = (COL*)calloc(256, sizeof(COL));
+	/* 24->32 bit conversion */
+	for(i=0;i<palettelen && i<256;i++) {
+	    rgba[i].r = palette[i*3+0];
+	    rgba[i].g = palette[i*3+1];
+	    rgba[i].b = palette[i*3+2];
+	    if(alphapalette && i<alphapalettelen) {
+		rgba[i].a = alphapalette[i];
+		/*rgba[i].r = ((int)rgba[i].r*rgba[i].a)/255;
+		rgba[i].g = ((int)rgba[i].g*rgba[i].a)/255;
+		rgba[i].b = ((int)rgba[i].b*rgba[i].a)/255;*/
+	    } else {
 		rgba[i].a = 255;
-		rgba[i].r = i*mult;
-		rgba[i].g = i*mult;
-		rgba[i].b = i*mult;
-		if(hasalphacolor) {
-		    if(rgba[i].r == alphacolor[0])
-			rgba[i].a = 0;
-		}
 	    }
-	} else {
-	    if(!palette) {
-		fprintf(stderr, "Error: No palette found!\n");
-		exit(1);
-	    }
-	    rgba = (COL*)malloc(palettelen*4);
-	    /* 24->32 bit conversion */
-	    for(i=0;i<palettelen;i++) {
-		rgba[i].r = palette[i*3+0];
-		rgba[i].g = palette[i*3+1];
-		rgba[i].b = palette[i*3+2];
-		if(alphapalette && i<alphapalettelen) {
-		    rgba[i].a = alphapalette[i];
-		    /*rgba[i].r = ((int)rgba[i].r*rgba[i].a)/255;
-		    rgba[i].g = ((int)rgba[i].g*rgba[i].a)/255;
-		    rgba[i].b = ((int)rgba[i].b*rgba[i].a)/255;*/
-		} else {
-		    rgba[i].a = 255;
-		}
-		if(hasalphacolor) {
-		    if(rgba[i].r == alphacolor[0] &&
-		       rgba[i].g == alphacolor[1] &&
-		       rgba[i].b == alphacolor[2])
-			rgba[i].a = 0;
-		}
+	    if(hasalphacolor) {
+		if(rgba[i].r == alphacolor[0] &&
+		   rgba[i].g == alphacolor[1] &&
+		   rgba[i].b == alphacolor[2])
+		    rgba[i].a = 0;
 	    }
 	}
+    }
 
-	for(y=0;y<header.height;y++) {
-	    int mode = imagedata[pos++]; //filter mode
-	    int x;
-	    unsigned char*old;
-	    unsigned char*src;
-	    src = &imagedata[pos];
-	    if(header.bpp == 8) {
-		pos+=header.width;
-	    } else {
-		int x,s=0;
-		int bitpos = 0;
-		u32 v = (1<<header.bpp)-1;
+    for(y=0;y<header.height;y++) {
+	unsigned char mode;
+	unsigned char*dest = &data2[(y*header.width)*4];
+	if(!idat_read(r, &mode, 1) || !idat_read(r, line, linelen)) {
+	    ok = 0;
+	    break;
+	}
+
+	if(header.mode == 6) {
+	    unsigned char*old = y?&data2[(y-1)*header.width*4]:zeroline;
+	    png_inverse_filter_32(mode, line, old, dest, header.width);
+	    continue;
+	}
+
+	png_unfilter_line(mode, line, lastline, linelen, bypp);
+
+	if(header.mode == 2) {
+	    for(x=0;x<header.width;x++) {
+		dest[x*4+0] = 255;
+		dest[x*4+1] = line[x*3+0];
+		dest[x*4+2] = line[x*3+1];
+		dest[x*4+3] = line[x*3+2];
+	    }
+	    /* replace alpha color */
+	    if(hasalphacolor) {
 		for(x=0;x<header.width;x++) {
-		    u32 r = src[s/8]<<8 | 
-			    src[s/8+1];
-		    int t;
-		    tmpline[x] = (r>>(16-header.bpp-(s&7)))&v;
-		    s+=header.bpp;
+		    if(dest[x*4+1] == alphacolor[0] &&
+		       dest[x*4+2] == alphacolor[1] &&
+		       dest[x*4+3] == alphacolor[2]) {
+			*(u32*)&dest[x*4] = 0;
+		    }
 		}
-		src = tmpline;
-		pos+=(header.width*header.bpp+7)/8;
 	    }
-
-	    if(!y) {
-		memset(destline,0,header.width);
-		old = &destline[y*header.width];
-	    } else {
-		old = tmpline;
+	} else if(header.mode == 4) {
+	    for(x=0;x<header.width;x++) {
+		unsigned char gray = line[x*2+0];
+		unsigned char alpha = line[x*2+1];
+		dest[x*4+0] = alpha;
+		dest[x*4+1] = gray;
+		dest[x*4+2] = gray;
+		dest[x*4+3] = gray;
 	    }
-	    applyfilter1(mode, src, old, destline, header.width);
-	    memcpy(tmpline,destline,header.width);
+	} else if(header.bpp == 8) {
+	    for(x=0;x<header.width;x++) {
+		*(COL*)&dest[x*4] = rgba[line[x]];
+	    }
+	} else {
+	    int s=0;
+	    u32 v = (1<<header.bpp)-1;
 	    for(x=0;x<header.width;x++) {
-		*(COL*)&data2[y*header.width*4+x*4+0] = rgba[destline[x]];
+		int index = (line[s/8]>>(8-header.bpp-(s&7)))&v;
+		*(COL*)&dest[x*4] = rgba[index];
+		s+=header.bpp;
 	    }
 	}
-	free(tmpline);
-	free(destline);
+	unsigned char*tmp = line;
+	line = lastline;
+	lastline = tmp;
+    }
+    inflateEnd(&r->zs);
+    free(r);
+    fclose(fi);
+    free(line);
+    free(lastline);
+    free(zeroline);
+    if(rgba)
 	free(rgba);
-        free(imagedata);
-    } else {
-	printf("expected PNG mode to be 2, 3 or 6 (is:%d)\n", header.mode);
+    if(palette)
+	free(palette);
+    if(alphapalette)
+	free(alphapalette);
+
+    if(!ok) {
+	printf("Couldn't uncompress %s!\n", sname);
+	free(data2);
 	return 0;
     }
-
+    *destdata = data2;
     return 1;
 }
 
-static char hasAlpha(unsigned char*_image, int size)
+static inline u32 color_hash(u32 col32)
 {
-    COL*image = (COL*)_image;
+    /* fibonacci hashing- use the upper bits of the result */
+    return col32 * 0x9e3779b1u;
+}
+
+/* collects the colors of an image, and maps the image to them, in a single
+   pass. Gives up as soon as there are more than maxcolors (<=256) different
+   colors, and returns -1 in that case. */
+static int png_find_palette(COL*img, int size, int maxcolors, COL*palette, char*has_alpha, unsigned char*dest)
+{
+    short table[1024]; // palette index+1, or 0 for empty slots
+    int num = 0;
     int t;
+    memset(table, 0, sizeof(table));
+    *has_alpha = 0;
+
+    u32 lastcol32 = (*(u32*)&img[0])^0xffffffff; // don't match
+    int lastindex = 0;
     for(t=0;t<size;t++) {
-        if(image[t].a!=255)
-            return 1;
+	u32 col32 = *(u32*)&img[t];
+	if(col32 != lastcol32) {
+	    u32 hash = color_hash(col32)>>22;
+	    while(table[hash] && *(u32*)&palette[table[hash]-1] != col32)
+		hash = (hash+1)&1023;
+	    if(!table[hash]) {
+		if(num == maxcolors)
+		    return -1;
+		palette[num] = img[t];
+		if(img[t].a != 255)
+		    *has_alpha = 1;
+		table[hash] = ++num;
+	    }
+	    lastcol32 = col32;
+	    lastindex = table[hash]-1;
+	}
+	dest[t] = lastindex;
     }
-    return 0;
+    return num;
+}
+
+/* a color cluster of the quantizer: all colors which are the same
+   if the lower two bits of every channel are ignored */
+typedef struct _colorbucket {
+    u32 key;
+    u32 count;
+    double sum[4]; // a,r,g,b
+    unsigned char c[4]; // average color
+    int index; // palette entry
+} colorbucket_t;
+
+typedef struct _colorbox {
+    int start, end; // range in the bucket order
+    int channel; // the channel with the widest spread
+    double score; // how much we gain by splitting this box
+} colorbox_t;
+
+/* weights for squared channel differences (a,r,g,b) */
+static const int channel_weight[4] = {6,5,6,4};
+
+static int color_distance(unsigned char*c1, unsigned char*c2)
+{
+    int d = 0;
+    int s;
+    for(s=0;s<4;s++) {
+	int v = c1[s] - c2[s];
+	d += v*v*channel_weight[s];
+    }
+    return d;
 }
 
-typedef struct {
-    u32 num;
-    u32 color;
-} colornum_t;
+typedef struct _colorhistogram {
+    colorbucket_t*buckets;
+    int num;
+    int*slots; // bucket index+1
+    int slotmask;
+} colorhistogram_t;
+
+static int histogram_lookup(colorhistogram_t*h, u32 key, char create)
+{
+    u32 hash = color_hash(key)>>8;
+    while(1) {
+	hash &= h->slotmask;
+	int i = h->slots[hash];
+	if(!i)
+	    break;
+	if(h->buckets[i-1].key == key)
+	    return i-1;
+	hash++;
+    }
+    if(!create)
+	return -1;
+    if((h->num+1)*2 > h->slotmask) {
+	/* grow */
+	int newsize = (h->slotmask+1)*2;
+	int t;
+	free(h->slots);
+	h->slots = (int*)calloc(newsize, sizeof(int));
+	h->slotmask = newsize-1;
+	h->buckets = realloc(h->buckets, sizeof(colorbucket_t)*newsize/2);
+	for(t=0;t<h->num;t++) {
+	    u32 hash2 = color_hash(h->buckets[t].key)>>8;
+	    while(h->slots[hash2&h->slotmask])
+		hash2++;
+	    h->slots[hash2&h->slotmask] = t+1;
+	}
+	return histogram_lookup(h, key, create);
+    }
+    colorbucket_t*b = &h->buckets[h->num];
+    memset(b, 0, sizeof(colorbucket_t));
+    b->key = key;
+    h->slots[hash] = ++h->num;
+    return h->num-1;
+}
 
-static int compare_colors(const void*_c1, const void*_c2) {
-    colornum_t*c1 = (colornum_t*)_c1;
-    colornum_t*c2 = (colornum_t*)_c2;
-    return c2->num - c1->num;
+static void colorbox_update(colorbox_t*box, colorbucket_t*buckets, int*order)
+{
+    int min[4] = {255,255,255,255};
+    int max[4] = {0,0,0,0};
+    double count = 0;
+    int t,s;
+    for(t=box->start;t<box->end;t++) {
+	colorbucket_t*b = &buckets[order[t]];
+	for(s=0;s<4;s++) {
+	    if(b->c[s] < min[s]) min[s] = b->c[s];
+	    if(b->c[s] > max[s]) max[s] = b->c[s];
+	}
+	count += b->count;
+    }
+    int best = -1;
+    box->channel = 0;
+    for(s=0;s<4;s++) {
+	int range = max[s]-min[s];
+	int v = range*range*channel_weight[s];
+	if(v > best) {
+	    best = v;
+	    box->channel = s;
+	}
+    }
+    box->score = box->end-box->start > 1 ? best*count : 0;
 }
 
-static colornum_t* getColors(COL*image, int size, int*num)
+/* splits box at the (weighted) median of its widest channel */
+static void colorbox_split(colorbox_t*box, colorbox_t*newbox, colorbucket_t*buckets, int*order)
 {
-    unsigned char*colexists = malloc((256*256*256)/8);
-    memset(colexists, 0, (256*256*256)/8);
+    double hist[256];
+    double total = 0;
+    int ch = box->channel;
+    int min = 255, max = 0;
     int t;
-    int count=0;
-
-    /* find all different colors in the image */
-    for(t=0;t<size;t++) {
-        int index = (image[t].r)|(image[t].g)<<8|(image[t].b)<<16;
-        if(!(colexists[index/8]&(1<<(index&7)))) {
-            count++;
-            colexists[index/8]|=(1<<(index&7));
-        }
+    memset(hist, 0, sizeof(hist));
+    for(t=box->start;t<box->end;t++) {
+	colorbucket_t*b = &buckets[order[t]];
+	hist[b->c[ch]] += b->count;
+	total += b->count;
+	if(b->c[ch] < min) min = b->c[ch];
+	if(b->c[ch] > max) max = b->c[ch];
     }
-    
-    /* now store them in an array */
-    colornum_t*colors=(colornum_t*)malloc(sizeof(colornum_t)*count);
-    int pos=0;
-    for(t=0;t<256*256*256;t++) {
-        if(colexists[t/8]&(1<<(t&7))) {
-            colors[pos].color = t;
-            colors[pos].num = 0;
-            pos++;
-        }
+    double sum = 0;
+    int split;
+    for(split=min;split<max-1;split++) {
+	sum += hist[split];
+	if(sum*2 >= total)
+	    break;
     }
+    /* everything <= split goes into the first box */
+    int i = box->start, j = box->end-1;
+    while(i <= j) {
+	if(buckets[order[i]].c[ch] <= split) {
+	    i++;
+	} else {
+	    int tmp = order[i]; order[i] = order[j]; order[j] = tmp;
+	    j--;
+	}
+    }
+    newbox->start = i;
+    newbox->end = box->end;
+    box->end = i;
+    colorbox_update(box, buckets, order);
+    colorbox_update(newbox, buckets, order);
+}
 
-    /* next, count how often each color occurs */
-    for(t=0;t<size;t++) {
-        int col = (image[t].r)|(image[t].g)<<8|(image[t].b)<<16;
-        int min,max,i,l;
-        for(min=0, max=count, i=count/2, l=count; i != l; l=i,i=(min+max)/2) {
-	    // binary search
-            if(colors[i].color >= col) max=i;
-            else min=i+1;
-        }
-        assert(colors[i].color==col);
-        colors[i].num++;
+static void assign_colors(colorbucket_t*buckets, int num, COL*palette, int numcolors)
+{
+    int t,s;
+    for(t=0;t<num;t++) {
+	int best = INT_MAX;
+	for(s=0;s<numcolors;s++) {
+	    int d = color_distance(buckets[t].c, (unsigned char*)&palette[s]);
+	    if(d < best) {
+		best = d;
+		buckets[t].index = s;
+	    }
+	}
     }
-    free(colexists);
-    *num = count;
-    return colors;
 }
 
-static void getOptimalPalette(COL*image, int size, int palettesize, COL*palette)
+static void average_colors(colorbucket_t*buckets, int num, COL*palette, int numcolors)
 {
-    int num;
-    memset(palette, 0, sizeof(COL)*256);
-    colornum_t*colors = getColors(image, size, &num);
-
-    assert(palettesize<=256);
-
-    qsort(colors, num, sizeof(colornum_t), compare_colors);
-
-    if(num<=palettesize) {
-        /* if there are not more than palettesize different colors in 
-           the image anyway, we are done */
-        int t;
-        for(t=0;t<num;t++) {
-            palette[t].r = colors[t].color;
-            palette[t].g = colors[t].color>>8;
-            palette[t].b = colors[t].color>>16;
-            palette[t].a = 255;
-        }
-        return;
+    double*sums = calloc(numcolors*5, sizeof(double));
+    int t,s;
+    for(t=0;t<num;t++) {
+	double*sum = &sums[buckets[t].index*5];
+	for(s=0;s<4;s++)
+	    sum[s] += buckets[t].sum[s];
+	sum[4] += buckets[t].count;
+    }
+    for(t=0;t<numcolors;t++) {
+	double*sum = &sums[t*5];
+	if(!sum[4])
+	    continue;
+	unsigned char*c = (unsigned char*)&palette[t];
+	for(s=0;s<4;s++)
+	    c[s] = (int)(sum[s]/sum[4]+0.5);
     }
+    free(sums);
+}
 
-    if(num>2048) {
-	/* if there are too many different colors, pick the ones that
-	   occur most often */
-	num = 2048;
+/* reduces the image to (at most) numcolors colors: median cut on a
+   histogram of the image, followed by a round of k-means refinement.
+   Returns the number of palette entries. */
+static int png_quantize_image(COL*image, int size, int numcolors, COL*palette, char*has_alpha, unsigned char*dest)
+{
+    colorhistogram_t h;
+    int t,s;
+    memset(&h, 0, sizeof(h));
+    h.slotmask = 4095;
+    h.slots = (int*)calloc(h.slotmask+1, sizeof(int));
+    h.buckets = (colorbucket_t*)malloc(sizeof(colorbucket_t)*(h.slotmask+1)/2);
+
+    u32 lastkey = ((*(u32*)&image[0])&0xfcfcfcfc)^0xffffffff;
+    colorbucket_t*b = 0;
+    for(t=0;t<size;t++) {
+	u32 key = (*(u32*)&image[t])&0xfcfcfcfc;
+	if(key != lastkey) {
+	    /* histogram_lookup may realloc h.buckets, so don't take
+	       the address before it returned */
+	    int idx = histogram_lookup(&h, key, 1);
+	    b = &h.buckets[idx];
+	    lastkey = key;
+	}
+	unsigned char*c = (unsigned char*)&image[t];
+	b->count++;
+	for(s=0;s<4;s++)
+	    b->sum[s] += c[s];
+    }
+    for(t=0;t<h.num;t++) {
+	for(s=0;s<4;s++)
+	    h.buckets[t].c[s] = (int)(h.buckets[t].sum[s]/h.buckets[t].count+0.5);
     }
 
-    colornum_t*centers = malloc(sizeof(colornum_t)*palettesize);
-    int t;
-    for(t=0;t<palettesize;t++) {
-        centers[t].color = colors[t].color;
-    }
-    unsigned char*belongsto = (unsigned char*)malloc(num);
-    memset(belongsto, 0, num);
-    /* do a k-means clustering on the colors */
-    char change = 1;
-    int tries = 0;
-    while(change) {
-        if(tries++ >= (palettesize+num)*2) {
-            fprintf(stderr, "Warning: didn't find optimal palette\n");
-            break;
-        }
-        change = 0;
-        int s,t;
-        for(s=0;s<palettesize;s++) {
-            centers[s].num = 0;
-        }
-        for(t=0;t<num;t++) {
-            int best=0x7fffffff;
-            int bestpos=0;
-            for(s=0;s<palettesize;s++) {
-                int distance = 0;
-                distance += abs((centers[s].color>>0&0xff) - (colors[t].color>>0&0xff));
-                distance += abs((centers[s].color>>8&0xff) - (colors[t].color>>8&0xff));
-                distance += abs((centers[s].color>>16&0xff) - (colors[t].color>>16&0xff));
-                distance *= colors[t].num;
-                if(distance<best) {
-                    best = distance;
-                    bestpos = s;
-                }
-            }
-            if(bestpos!=belongsto[t])
-                change = 1;
-            belongsto[t] = bestpos;
-        }
-        for(s=0;s<palettesize;s++) {
-            int r=0;
-            int g=0;
-            int b=0;
-            int count=0;
-            for(t=0;t<num;t++) {
-                if(belongsto[t]==s) {
-                    r += ((colors[t].color>>0)&0xff)*colors[t].num;
-                    g += ((colors[t].color>>8)&0xff)*colors[t].num;
-                    b += ((colors[t].color>>16)&0xff)*colors[t].num;
-                    count+=colors[t].num;
-                }
-            }
-            if(!count) {
-                int random = rand()%num;
-                centers[s].color = colors[random].color;
-                centers[s].num = 0;
-                change = 1;
-            } else {
-                r /= count;
-                g /= count;
-                b /= count;
-                centers[s].color = r|g<<8|b<<16;
-                centers[s].num = count;
-            }
-        }
+    int*order = (int*)malloc(sizeof(int)*h.num);
+    for(t=0;t<h.num;t++)
+	order[t] = t;
+    colorbox_t boxes[256];
+    int numboxes = 1;
+    boxes[0].start = 0;
+    boxes[0].end = h.num;
+    colorbox_update(&boxes[0], h.buckets, order);
+    while(numboxes < numcolors) {
+	int best = 0;
+	for(t=1;t<numboxes;t++) {
+	    if(boxes[t].score > boxes[best].score)
+		best = t;
+	}
+	if(boxes[best].score <= 0)
+	    break;
+	colorbox_split(&boxes[best], &boxes[numboxes++], h.buckets, order);
     }
-    free(belongsto);
-    free(colors);
-    for(t=0;t<palettesize;t++) {
-        palette[t].r = centers[t].color;
-        palette[t].g = centers[t].color>>8;
-        palette[t].b = centers[t].color>>16;
-        palette[t].a = 255;
+    for(t=0;t<numboxes;t++) {
+	for(s=boxes[t].start;s<boxes[t].end;s++)
+	    h.buckets[order[s]].index = t;
+    }
+    free(order);
+    average_colors(h.buckets, h.num, palette, numboxes);
+
+    /* move every color to the closest palette entry, which isn't necessarily
+       the one of its box. That's numboxes*h.num distance computations, so
+       skip it for really colorful images. */
+    if((double)h.num*numboxes < 16*1024*1024) {
+	assign_colors(h.buckets, h.num, palette, numboxes);
+	average_colors(h.buckets, h.num, palette, numboxes);
+	assign_colors(h.buckets, h.num, palette, numboxes);
     }
-    free(centers);
-}
 
-static int sqr(const int x) {return x*x;}
+    *has_alpha = 0;
+    for(t=0;t<numboxes;t++) {
+	if(palette[t].a != 255)
+	    *has_alpha = 1;
+    }
 
-static void png_quantize_image(unsigned char*_image, int size, int numcolors, unsigned char**newimage, COL*palette) 
-{
-    COL*image = (COL*)_image;
-    getOptimalPalette(image, size, numcolors, palette);
-    *newimage = (unsigned char*)malloc(size);
-    int t;
+    lastkey = ((*(u32*)&image[0])&0xfcfcfcfc)^0xffffffff;
+    int index = 0;
     for(t=0;t<size;t++) {
-        int best=0x7fffffff;
-        int bestcol = 0;
-        int s;
-        for(s=0;s<numcolors;s++) {
-            int distance = 0;
-            distance += sqr((palette[s].r) - (image[t].r))*5;
-            distance += sqr((palette[s].g) - (image[t].g))*6;
-            distance += sqr((palette[s].b) - (image[t].b))*4;
-            if(distance<best) {
-                best = distance;
-                bestcol = s;
-            }
-        }
-        (*newimage)[t] = bestcol;
+	u32 key = (*(u32*)&image[t])&0xfcfcfcfc;
+	if(key != lastkey) {
+	    index = h.buckets[histogram_lookup(&h, key, 0)].index;
+	    lastkey = key;
+	}
+	dest[t] = index;
     }
+    free(h.slots);
+    free(h.buckets);
+    return numboxes;
 }
 
 static u32 mycrc32;
@@ -1021,9 +965,9 @@ static void png_patch_len(FILE*fi, int pos, int len)
 }
 static void png_write_bytes(FILE*fi, unsigned char*bytes, int len)
 {
-    int t;
-    for(t=0;t<len;t++)
-	png_write_byte(fi,bytes[t]);
+    fwrite(bytes,len,1,fi);
+    /* zlib's crc32() does the pre- and post-conditioning itself */
+    mycrc32 = crc32(mycrc32^0xffffffff, bytes, len)^0xffffffff;
 }
 static void png_write_dword(FILE*fi, u32 dword)
 {
@@ -1145,372 +1089,174 @@ static int finishzlib(z_stream*zs, FILE*fi)
     return size;
 }
 
-static inline u32 color_hash(COL*col)
-{
-    u32 col32 = *(u32*)col;
-    u32 hash = (col32 >> 17) ^ col32;
-    hash ^= ((hash>>8) + 1) ^ hash;
-    return hash;
-}
-
-static int png_get_number_of_palette_entries(COL*img, unsigned width, unsigned height, COL*palette, char*has_alpha)
+/* computes the sub, up, average and paeth filters of a line, in the
+   byte order of src. Filters 2-4 are only computed if up is set. */
+static void png_compute_filters(unsigned char*src, unsigned char*up, int w, int bypp, unsigned char*f[5])
 {
-    int len = width*height;
-    int t;
-    int palsize = 0;
-    int size[256];
-    int palette_overflow = 0;
-    u32 lastcol32 = 0;
-    
-    memset(size, 0, sizeof(size));
-
-    u32*pal = (u32*)malloc(65536*sizeof(u32));
-    int*count = (int*)malloc(65536*sizeof(int));
-
-    assert(sizeof(COL)==sizeof(u32));
-    assert(width && height);
-
-    lastcol32 = (*(u32*)&img[0])^0xffffffff; // don't match
-
-    for(t=0;t<len;t++) {
-	u32 col32 = *(u32*)&img[t];
-	if(col32 == lastcol32)
-	    continue;
-	
-	if(img[t].a!=255)
-	    *has_alpha=1;
-	int i;
-	
-	u32 hash = color_hash(&img[t])&255;
-
-	int csize = size[hash];
-	u32*cpal = &pal[hash*256];
-	int*ccount = &count[hash*256];
-	for(i=0;i<csize;i++) {
-	    if(col32 == cpal[i]) {
-		ccount[i]++;
-		break;
-	    }
-	}
-	if(i==csize) {
-	    if(palsize==256) {
-		palette_overflow = 1;
-		break;
-	    }
-	    count[size[hash]] = 1;
-	    cpal[size[hash]++] = col32;
-	    palsize++;
-	}
-	lastcol32 = col32;
-    }
-    if(palette_overflow) {
-	free(pal);
-	*has_alpha=1;
-	return width*height;
-    }
-    if(palette) {
-	int i = 0;
-	int occurences[256];
-	for(t=0;t<256;t++) {
-	    int s;
-	    int csize = size[t];
-	    u32* cpal = &pal[t*256];
-	    int* ccount = &count[t*256];
-	    for(s=0;s<csize;s++) {
-		occurences[i] = ccount[s];
-		palette[i++] = *(COL*)(&cpal[s]);
-	    }
-	}
-	assert(i==palsize);
-	int j;
-	for(i=0;i<palsize-1;i++) {
-	    for(j=i+1;j<palsize;j++) {
-		if(occurences[j] < occurences[i]) {
-		    int o = occurences[i];
-		    COL c = palette[i];
-		    occurences[i] = occurences[j];
-		    palette[i] = palette[j];
-		    occurences[j] = o;
-		    palette[j] = c;
-		}
-	    }
+    int x;
+    for(x=0;x<bypp;x++) {
+	f[1][x] = src[x];
+	if(up) {
+	    f[2][x] = src[x] - up[x];
+	    f[3][x] = src[x] - up[x]/2;
+	    f[4][x] = src[x] - PaethPredictor(0, up[x], 0);
 	}
     }
-    free(pal);
-    free(count);
-    return palsize;
-}
-
-static void png_map_to_palette(COL*src, unsigned char*dest, int size, COL*palette, int palette_size)
-{
-    int t;
-    int palette_hash[1024];
-    memset(palette_hash, 0, sizeof(int)*1024);
-    
-    for(t=0;t<palette_size;t++) {
-	u32 hash = color_hash(&palette[t])&1023;
-	while(palette_hash[hash])
-	    hash = (hash+1)&1023;
-	palette_hash[hash] = t;
-    }
-
-    for(t=0;t<size;t++) {
-	u32 hash = color_hash(&src[t]);
-	int index = 0;
-	while(1) {
-	    hash&=1023;
-	    index = palette_hash[hash];
-	    if(!memcmp(&palette[index], &src[t], sizeof(COL)))
-		break;
-	    hash++;
+    memcpy(f[0], src, w);
+    x = bypp;
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128i one = _mm_set1_epi8(1);
+    for(;x+16<=w;x+=16) {
+	__m128i s = _mm_loadu_si128((__m128i*)&src[x]);
+	__m128i a = _mm_loadu_si128((__m128i*)&src[x-bypp]);
+	_mm_storeu_si128((__m128i*)&f[1][x], _mm_sub_epi8(s, a));
+	if(!up)
+	    continue;
+	__m128i b = _mm_loadu_si128((__m128i*)&up[x]);
+	__m128i c = _mm_loadu_si128((__m128i*)&up[x-bypp]);
+	_mm_storeu_si128((__m128i*)&f[2][x], _mm_sub_epi8(s, b));
+	/* _mm_avg_epu8 rounds up, the png average filter rounds down */
+	__m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+	_mm_storeu_si128((__m128i*)&f[3][x], _mm_sub_epi8(s, avg));
+
+	__m128i pred[2];
+	int h;
+	for(h=0;h<2;h++) {
+	    __m128i a16 = h?_mm_unpackhi_epi8(a, zero):_mm_unpacklo_epi8(a, zero);
+	    __m128i b16 = h?_mm_unpackhi_epi8(b, zero):_mm_unpacklo_epi8(b, zero);
+	    __m128i c16 = h?_mm_unpackhi_epi8(c, zero):_mm_unpacklo_epi8(c, zero);
+	    __m128i bc = _mm_sub_epi16(b16, c16);
+	    __m128i ac = _mm_sub_epi16(a16, c16);
+	    __m128i abc = _mm_add_epi16(ac, bc);
+	    __m128i pa = _mm_max_epi16(bc, _mm_sub_epi16(zero, bc));
+	    __m128i pb = _mm_max_epi16(ac, _mm_sub_epi16(zero, ac));
+	    __m128i pc = _mm_max_epi16(abc, _mm_sub_epi16(zero, abc));
+	    __m128i not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+	    __m128i not_b = _mm_cmpgt_epi16(pb, pc);
+	    __m128i bc_pred = _mm_or_si128(_mm_andnot_si128(not_b, b16), _mm_and_si128(not_b, c16));
+	    pred[h] = _mm_or_si128(_mm_andnot_si128(not_a, a16), _mm_and_si128(not_a, bc_pred));
 	}
-	dest[t] = palette_hash[hash];
+	_mm_storeu_si128((__m128i*)&f[4][x], _mm_sub_epi8(s, _mm_packus_epi16(pred[0], pred[1])));
     }
-}
-
-static int png_apply_specific_filter_8(int filtermode, unsigned char*dest, unsigned char*src, unsigned width)
-{
-    int pos2 = 0;
-    int pos = 0;
-    int srcwidth = width;
-    int x;
-    if(filtermode == 0) {
-	for(x=0;x<width;x++) {
-	    dest[pos2++]=src[pos++]; //alpha
-	}
-    } else if(filtermode == 1) {
-	/* x difference filter */
-	dest[pos2++]=src[pos++];
-	for(x=1;x<width;x++) {
-	    dest[pos2++]=src[pos] - src[pos-1];
-	    pos++;
-	}
-    } else if(filtermode == 2) {
-	/* y difference filter */
-	for(x=0;x<width;x++) {
-	    dest[pos2++]=src[pos+0] - src[pos-srcwidth+0]; //alpha
-	    pos++;
-	}
-    } else if(filtermode == 3) {
-	dest[pos2++]=src[pos+0] - src[pos-srcwidth+0]/2;
-	pos++;
-	/* x+y difference filter */
-	for(x=1;x<width;x++) {
-	    dest[pos2++]=src[pos+0] - (src[pos-1+0] + src[pos-srcwidth+0])/2; //alpha
-	    pos++;
-	}
-    } else if(filtermode == 4) {
-	dest[pos2++]=src[pos+0] - PaethPredictor(0, src[pos-srcwidth+0], 0);
-	pos++;
-	/* paeth difference filter */
-	for(x=1;x<width;x++) {
-	    dest[pos2++]=src[pos+0] - PaethPredictor(src[pos-1+0], src[pos-srcwidth+0], src[pos-1-srcwidth+0]);
-	    pos++;
+#endif
+    for(;x<w;x++) {
+	f[1][x] = src[x] - src[x-bypp];
+	if(up) {
+	    f[2][x] = src[x] - up[x];
+	    f[3][x] = src[x] - (src[x-bypp] + up[x])/2;
+	    f[4][x] = src[x] - PaethPredictor(src[x-bypp], up[x], up[x-bypp]);
 	}
     }
-    return filtermode;
 }
 
-static int png_apply_specific_filter_32(int filtermode, unsigned char*dest, unsigned char*src, unsigned width)
+/* approximation for zlib compressability: count how many different
+   pairs of successive bytes occur.
+   (This only ever looked at pairs where the low three bits of the first
+   byte are zero. We keep it that way, so that the filters we choose, and
+   hence the files we write, don't change.) */
+static int png_count_pairs(unsigned char*f, unsigned char old, int start, int w, unsigned char*seen)
 {
-    int pos2 = 0;
-    int pos = 0;
-    int srcwidth = width*4;
-    int x;
-    if(filtermode == 0) {
-	for(x=0;x<width;x++) {
-	    dest[pos2++]=src[pos+1];
-	    dest[pos2++]=src[pos+2];
-	    dest[pos2++]=src[pos+3];
-	    dest[pos2++]=src[pos+0]; //alpha
-	    pos+=4;
-	}
-    } else if(filtermode == 1) {
-	/* x difference filter */
-	dest[pos2++]=src[pos+1];
-	dest[pos2++]=src[pos+2];
-	dest[pos2++]=src[pos+3];
-	dest[pos2++]=src[pos+0];
-	pos+=4;
-	for(x=1;x<width;x++) {
-	    dest[pos2++]=src[pos+1] - src[pos-4+1];
-	    dest[pos2++]=src[pos+2] - src[pos-4+2];
-	    dest[pos2++]=src[pos+3] - src[pos-4+3];
-	    dest[pos2++]=src[pos+0] - src[pos-4+0]; //alpha
-	    pos+=4;
+    int different_pairs = 0;
+    int x = start;
+    memset(seen, 0, 1024);
+#ifdef __SSE2__
+    /* Only pairs whose first byte is a multiple of 8 are counted. Find those
+       16 bytes at a time, and only visit the bit set for the (few) matches.
+       The set lookup itself stays scalar, as SSE2 has no gather/scatter. */
+    if(x+16<w) {
+	if(!(old&7)) {
+	    int p = f[x]<<5|old>>3;
+	    seen[p>>3] |= 1<<(p&7);
+	    different_pairs++;
 	}
-    } else if(filtermode == 2) {
-	/* y difference filter */
-	for(x=0;x<width;x++) {
-	    dest[pos2++]=src[pos+1] - src[pos-srcwidth+1];
-	    dest[pos2++]=src[pos+2] - src[pos-srcwidth+2];
-	    dest[pos2++]=src[pos+3] - src[pos-srcwidth+3];
-	    dest[pos2++]=src[pos+0] - src[pos-srcwidth+0]; //alpha
-	    pos+=4;
-	}
-    } else if(filtermode == 3) {
-	dest[pos2++]=src[pos+1] - src[pos-srcwidth+1]/2;
-	dest[pos2++]=src[pos+2] - src[pos-srcwidth+2]/2;
-	dest[pos2++]=src[pos+3] - src[pos-srcwidth+3]/2;
-	dest[pos2++]=src[pos+0] - src[pos-srcwidth+0]/2;
-	pos+=4;
-	/* x+y difference filter */
-	for(x=1;x<width;x++) {
-	    dest[pos2++]=src[pos+1] - (src[pos-4+1] + src[pos-srcwidth+1])/2;
-	    dest[pos2++]=src[pos+2] - (src[pos-4+2] + src[pos-srcwidth+2])/2;
-	    dest[pos2++]=src[pos+3] - (src[pos-4+3] + src[pos-srcwidth+3])/2;
-	    dest[pos2++]=src[pos+0] - (src[pos-4+0] + src[pos-srcwidth+0])/2; //alpha
-	    pos+=4;
-	}
-    } else if(filtermode == 4) {
-	dest[pos2++]=src[pos+1] - PaethPredictor(0, src[pos-srcwidth+1], 0);
-	dest[pos2++]=src[pos+2] - PaethPredictor(0, src[pos-srcwidth+2], 0);
-	dest[pos2++]=src[pos+3] - PaethPredictor(0, src[pos-srcwidth+3], 0);
-	dest[pos2++]=src[pos+0] - PaethPredictor(0, src[pos-srcwidth+0], 0);
-	pos+=4;
-	/* paeth difference filter */
-	for(x=1;x<width;x++) {
-	    dest[pos2++]=src[pos+1] - PaethPredictor(src[pos-4+1], src[pos-srcwidth+1], src[pos-4-srcwidth+1]);
-	    dest[pos2++]=src[pos+2] - PaethPredictor(src[pos-4+2], src[pos-srcwidth+2], src[pos-4-srcwidth+2]);
-	    dest[pos2++]=src[pos+3] - PaethPredictor(src[pos-4+3], src[pos-srcwidth+3], src[pos-4-srcwidth+3]);
-	    dest[pos2++]=src[pos+0] - PaethPredictor(src[pos-4+0], src[pos-srcwidth+0], src[pos-4-srcwidth+0]);
-	    pos+=4;
+	x++;
+	__m128i seven = _mm_set1_epi8(7);
+	__m128i zero = _mm_setzero_si128();
+	for(;x+16<=w;x+=16) {
+	    __m128i prev = _mm_loadu_si128((__m128i*)&f[x-1]);
+	    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(prev, seven), zero));
+	    while(mask) {
+		int i = __builtin_ctz(mask);
+		mask &= mask-1;
+		int p = f[x+i]<<5|f[x+i-1]>>3;
+		if(!(seen[p>>3]&(1<<(p&7)))) {
+		    seen[p>>3] |= 1<<(p&7);
+		    different_pairs++;
+		}
+	    }
 	}
+	old = f[x-1];
     }
-    return filtermode;
-}
-
-static int*num_bits_table = 0;
-
-static void make_num_bits_table()
-{
-    if(num_bits_table) return;
-    num_bits_table = malloc(sizeof(num_bits_table[0])*256);
-    int t;
-    for(t=0;t<256;t++) {
-	int bits=0;
-	int v = t;
-	while(v) {
-	    bits++;
-	    v&=v-1;
+#endif
+    for(;x<w;x++) {
+	if(!(old&7)) {
+	    int p = f[x]<<5|old>>3;
+	    if(!(seen[p>>3]&(1<<(p&7)))) {
+		seen[p>>3] |= 1<<(p&7);
+		different_pairs++;
+	    }
 	}
-	num_bits_table[t]=bits;
+	old = f[x];
     }
+    return different_pairs;
 }
 
-static int png_find_best_filter(unsigned char*src, unsigned width, int bpp, int y)
+/* filters a line (of width pixels with bpp bits each), using the filter
+   which png_count_pairs() thinks compresses best. scratch needs to have
+   space for 5*width*bpp/8 + 1024 bytes. */
+static int png_filter_line(unsigned char*dest, unsigned char*src, unsigned width, int y, int bpp, unsigned char*scratch)
 {
-    make_num_bits_table();
-    
+    int bypp = bpp>>3;
+    int w = width*bypp;
     int num_filters = y>0?5:2; //don't apply y-direction filter in first line
-    
-    int bytes_per_pixel = bpp>>3;
-    int w = width*bytes_per_pixel;
-    int back_x = bytes_per_pixel;
-    int back_y = y?width*bytes_per_pixel:0;
-
-    unsigned char*pairs[5];
-    pairs[0] = calloc(1, 8192);
-    pairs[1] = calloc(1, 8192);
-    pairs[2] = calloc(1, 8192);
-    pairs[3] = calloc(1, 8192);
-    pairs[4] = calloc(1, 8192);
-    
-    unsigned char old[5];
-    int l = bytes_per_pixel - 1;
-    old[0] = src[l];
-    old[1] = src[l];
-    old[2] = src[l] - src[l-back_y];
-    old[3] = src[l] - src[l-back_y];
-    old[4] = src[l] - PaethPredictor(0, src[l-back_y], 0);
+    unsigned char*up = y>0?src-w:0;
+    unsigned char*f[5];
+    int t;
+    for(t=0;t<5;t++)
+	f[t] = &scratch[t*w];
+    unsigned char*seen = &scratch[5*w];
 
-    int different_pairs[5] = {0,0,0,0,0};
+    png_compute_filters(src, up, w, bypp, f);
 
-    int x;
-    for(x=bytes_per_pixel;x<w;x++) {
-	unsigned char dest[5];
-	dest[0] = src[x];
-	dest[1] = src[x] - src[x-back_x];
-	dest[2] = src[x] - src[x-back_y];
-	dest[3] = src[x] - (src[x-back_x] + src[x-back_y])/2;
-	dest[4] = src[x] - PaethPredictor(src[x-back_x], src[x-back_y], src[x-back_x-back_y]);
-
-	int i;
-	for(i=0;i<5;i++) {
-	    int v = dest[i]<<8|old[i];
-	    int p = v>>3;
-	    int b = 1<<(v&7);
-	    if(!pairs[i][p]&b) {
-		pairs[i][p]|=b;
-		different_pairs[i]++;
-	    }
-	}
-	memcpy(old, dest, sizeof(old));
-    }
-    int f;
+    int l = bypp - 1;
     int best_nr = 0;
     int best_energy = INT_MAX;
-    for(f=0;f<num_filters;f++) {
-	int energy = different_pairs[f];
+    for(t=0;t<num_filters;t++) {
+	unsigned char old = f[t][l];
+	if(t==3) {
+	    /* the average filter's predecessor is computed like the up
+	       filter's, for the first pixel */
+	    old = src[l] - up[l];
+	}
+	int energy = png_count_pairs(f[t], old, bypp, w, seen);
 	if(energy<best_energy) {
-	    best_nr = f;
+	    best_nr = t;
 	    best_energy = energy;
 	}
     }
-    free(pairs[0]);
-    free(pairs[1]);
-    free(pairs[2]);
-    free(pairs[3]);
-    free(pairs[4]);
+
+    if(bpp==8) {
+	memcpy(dest, f[best_nr], w);
+    } else {
+	/* argb -> rgba */
+	unsigned char*s = f[best_nr];
+	int x;
+	for(x=0;x<w;x+=4) {
+	    dest[x+0] = s[x+1];
+	    dest[x+1] = s[x+2];
+	    dest[x+2] = s[x+3];
+	    dest[x+3] = s[x+0];
+	}
+    }
     return best_nr;
 }
-    
-    
+
 static int png_apply_filter(unsigned char*dest, unsigned char*src, unsigned width, int y, int bpp)
 {
-    int best_nr = 0;
-#if 0
-    make_num_bits_table();
-    int num_filters = y>0?5:2; //don't apply y-direction filter in first line
-    int f;
-    int best_energy = INT_MAX;
-    int w = width*(bpp/8);
-    unsigned char* pairs = malloc(8192);
-    assert(bpp==8 || bpp==32);
-    for(f=0;f<num_filters;f++) {
-	if(bpp==8)
-	    png_apply_specific_filter_8(f, dest, src, width);
-	else
-	    png_apply_specific_filter_32(f, dest, src, width);
-	int x;
-
-	/* approximation for zlib compressability: test how many different
-	   (byte1,byte2) occur */
-	memset(pairs, 0, 8192);
-	int different_pairs = 0;
-	for(x=0;x<w-1;x++) {
-	    int v = dest[x+1]<<8|dest[x];
-	    int p = v>>3;
-	    int b = 1<<(v&7);
-	    if(!pairs[p]&b) {
-		pairs[p]|=b;
-		different_pairs ++;
-	    }
-	}
-	int energy = different_pairs;
-	if(energy<best_energy) {
-	    best_nr = f;
-	    best_energy = energy;
-	}
-    }
-    free(pairs);
-#else
-    best_nr = png_find_best_filter(src, width, bpp, y);
-#endif
-    if(bpp==8)
-	png_apply_specific_filter_8(best_nr, dest, src, width);
-    else
-	png_apply_specific_filter_32(best_nr, dest, src, width);
+    unsigned char*scratch = malloc(width*(bpp>>3)*5 + 1024);
+    int best_nr = png_filter_line(dest, src, width, y, bpp, scratch);
+    free(scratch);
     return best_nr;
 }
 
@@ -1523,79 +1269,92 @@ int png_apply_filter_32(unsigned char*dest, unsigned char*src, unsigned width, i
     return png_apply_filter(dest, src, width, y, 32);
 }
 
-static void png_write_palette_based2(const char*filename, unsigned char*data, unsigned width, unsigned height, int numcolors, int compression)
-{
+/* with more than one thread, the image data is split into chunks of (at
+   least) this many bytes, which are deflated independently, like pigz does */
+#define PNG_CHUNK_SIZE 131072
+#define PNG_DICT_SIZE 32768
+
+typedef struct _pngchunk {
+    int level;
+    unsigned char*dict; // the last 32k of the previous chunk
+    int dictlen;
+    unsigned char*data; // filtered lines
+    int len;
+    char last;
+    unsigned char*out;
+    int outlen;
+    int outsize;
+} pngchunk_t;
+
+struct _pngwriter {
     FILE*fi;
-    int crc;
-    int t;
-    unsigned char format;
-    unsigned char tmp;
-    unsigned char* data2=0;
+    unsigned width;
+    unsigned height;
+    int bpp;
+    unsigned y;
+    u32 crc;
+    long idatpos;
+    long idatsize;
+    z_stream zs;
+    Bytef*writebuf;
+    unsigned char*line;
+    unsigned linelen;
+    /* the last row we were passed, followed by space for the current one. The
+       y-direction filters need both of them next to each other. */
+    unsigned char*rows;
+    unsigned char*scratch;
+    int compression;
+
+    /* with threads>1, one chunk per thread, and the chunk we're filling */
+    int threads;
+    pngchunk_t*chunks;
+    int current;
+    unsigned char*dict;
+    int dictlen;
+    uLong adler;
+};
+
+static pngwriter_t* png_writer_new2(const char*filename, unsigned width, unsigned height, int bpp, COL*palette, int cols, char has_alpha, int compression)
+{
     unsigned char head[] = {137,80,78,71,13,10,26,10}; // PNG header
-    int cols;
     char alpha = 1;
-    int pos = 0;
-    int error;
-    u32 tmp32;
-    int bpp;
+    int t;
     int ret;
-    char has_alpha=0;
-    z_stream zs;
-    COL palette[256];
 
     make_crc32_table();
 
-    if(numcolors>256) {
-	bpp = 32;
-	cols = 0;
-	format = 5;
-    } else if(!numcolors) {
-	int num = png_get_number_of_palette_entries((COL*)data, width, height, palette, &has_alpha);
-	if(num<=255) {
-	    //printf("image has %d different colors (alpha=%d)\n", num, has_alpha);
-	    data2 = malloc(width*height);
-	    png_map_to_palette((COL*)data, data2, width*height, palette, num);
-	    data = data2;
-	    bpp = 8;
-	    cols = num;
-	    format = 3;
-	} else {
-	    bpp = 32;
-	    cols = 0;
-	    format = 5;
-	}
-    } else {
-        bpp = 8;
-        cols = numcolors;
-        format = 3;
-        png_quantize_image(data, width*height, numcolors, &data, palette);
-    }
-
-    fi = fopen(filename, "wb");
+    FILE*fi = fopen(filename, "wb");
     if(!fi) {
 	perror("open");
-	return;
+	return 0;
     }
-    fwrite(head,sizeof(head),1,fi);     
+    pngwriter_t*w = (pngwriter_t*)calloc(1, sizeof(pngwriter_t));
+    w->fi = fi;
+    w->width = width;
+    w->height = height;
+    w->bpp = bpp;
+    w->compression = compression;
+    w->threads = 1;
+
+    fwrite(head,sizeof(head),1,fi);
 
     png_start_chunk(fi, "IHDR", 13);
      png_write_dword(fi,width);
      png_write_dword(fi,height);
      png_write_byte(fi,8);
-     if(format == 3)
+     if(bpp == 8)
      png_write_byte(fi,3); //indexed
-     else if(format == 5 && alpha==0)
+     else if(alpha==0)
      png_write_byte(fi,2); //rgb
-     else if(format == 5 && alpha==1)
+     else
      png_write_byte(fi,6); //rgba
-     else return;
 
      png_write_byte(fi,0); //compression mode
      png_write_byte(fi,0); //filter mode
      png_write_byte(fi,0); //interlace mode
     png_end_chunk(fi);
 
-    if(format == 3) {
+    if(bpp == 8) {
 	png_start_chunk(fi, "PLTE", cols*3);
 	for(t=0;t<cols;t++) {
 	    png_write_byte(fi,palette[t].r);
@@ -1613,84 +1372,283 @@ static void png_write_palette_based2(const char*filename, unsigned char*data, un
 	}
     }
 
-    long idatpos = png_start_chunk(fi, "IDAT", 0);
+    w->idatpos = png_start_chunk(fi, "IDAT", 0);
     
-    memset(&zs,0,sizeof(z_stream));
-    Bytef*writebuf = (Bytef*)malloc(ZLIB_BUFFER_SIZE);
-    zs.zalloc = Z_NULL;
-    zs.zfree  = Z_NULL;
-    zs.opaque = Z_NULL;
-    zs.next_out = writebuf;
-    zs.avail_out = ZLIB_BUFFER_SIZE;
-    ret = deflateInit(&zs, compression);
+    w->writebuf = (Bytef*)malloc(ZLIB_BUFFER_SIZE);
+    w->zs.zalloc = Z_NULL;
+    w->zs.zfree  = Z_NULL;
+    w->zs.opaque = Z_NULL;
+    w->zs.next_out = w->writebuf;
+    w->zs.avail_out = ZLIB_BUFFER_SIZE;
+    ret = deflateInit(&w->zs, compression);
     if (ret != Z_OK) {
-	fprintf(stderr, "error in deflateInit(): %s", zs.msg?zs.msg:"unknown");
+	fprintf(stderr, "error in deflateInit(): %s", w->zs.msg?w->zs.msg:"unknown");
+	fclose(fi);
+	free(w->writebuf);
+	free(w);
+	return 0;
+    }
+
+    int bypp = bpp/8;
+    unsigned srcwidth = width * bypp;
+    w->linelen = 1 + srcwidth;
+    if(bypp==2) 
+	w->linelen = 1 + ((srcwidth+1)&~1);
+    else if(bypp==3) 
+	w->linelen = 1 + ((srcwidth+2)/3)*3;
+    else if(bypp==4) 
+	w->linelen = 1 + ((srcwidth+3)&~3);
+    w->line = (unsigned char*)calloc(1, w->linelen);
+    w->rows = (unsigned char*)malloc(srcwidth*2);
+    w->scratch = (unsigned char*)malloc(srcwidth*5 + 1024);
+
+    /* the IDAT crc is accumulated across png_writer_write_lines() calls */
+    w->crc = mycrc32;
+    return w;
+}
+
+EXPORT pngwriter_t* png_writer_new(const char*filename, unsigned width, unsigned height)
+{
+    return png_writer_new2(filename, width, height, 32, 0, 0, 0, Z_BEST_COMPRESSION);
+}
+
+EXPORT void png_writer_set_threads(pngwriter_t*w, int threads)
+{
+#ifdef USE_THREADS
+    if(w->y || threads<=1 || w->threads>1)
 	return;
+    /* we write the zlib header and trailer ourselves, and use raw
+       deflate streams for the chunks */
+    deflateEnd(&w->zs);
+    w->threads = threads;
+    w->chunks = (pngchunk_t*)calloc(threads, sizeof(pngchunk_t));
+    int t;
+    for(t=0;t<threads;t++) {
+	w->chunks[t].level = w->compression;
+	w->chunks[t].data = malloc(PNG_CHUNK_SIZE + w->linelen);
     }
+    w->dict = malloc(PNG_DICT_SIZE);
+    w->adler = adler32(0, 0, 0);
+
+    int level = w->compression;
+    int flevel = level==Z_DEFAULT_COMPRESSION ? 2 : (level<2 ? 0 : (level<6 ? 1 : (level==6 ? 2 : 3)));
+    unsigned char head[2];
+    head[0] = 0x78; // deflate, 32k window
+    head[1] = flevel<<6;
+    head[1] += 31 - (head[0]*256+head[1])%31;
+    mycrc32 = w->crc;
+    png_write_bytes(w->fi, head, 2);
+    w->crc = mycrc32;
+    w->idatsize += 2;
+#endif
+}
 
-    long idatsize = 0;
-    {
-	int x,y;
-        int bypp = bpp/8;
-	unsigned srcwidth = width * bypp;
-	unsigned linelen = 1 + srcwidth;
-        if(bypp==2) 
-            linelen = 1 + ((srcwidth+1)&~1);
-        else if(bypp==3) 
-            linelen = 1 + ((srcwidth+2)/3)*3;
-        else if(bypp==4) 
-            linelen = 1 + ((srcwidth+3)&~3);
-	unsigned char* line = (unsigned char*)malloc(linelen);
-	memset(line, 0, linelen);
-#if 0
-	unsigned char* bestline = (unsigned char*)malloc(linelen);
-	memset(bestline, 0, linelen);
-	for(y=0;y<height;y++)
-	{
-	    int filtermode;
-	    int bestsize = 0x7fffffff;
-	    for(filtermode=0;filtermode<=4;filtermode++) {
-		if(!y && filtermode>=2)
-		    continue; // don't do y direction filters in the first row
-		
-		line[0]=filtermode; //filter type
-                if(bpp==8)
-		    png_apply_specific_filter_8(filtermode, line+1, &data[y*srcwidth], width);
-                else
-		    png_apply_specific_filter_32(filtermode, line+1, &data[y*srcwidth], width);
-
-		int size = test_line(&zs, line, linelen);
-		if(size < bestsize) {
-		    memcpy(bestline, line, linelen);
-		    bestsize = size;
-		}
-	    }
-	    idatsize += compress_line(&zs, bestline, linelen, fi);
+static void* png_compress_chunk(void*_c)
+{
+    pngchunk_t*c = (pngchunk_t*)_c;
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    c->outlen = 0;
+    if(deflateInit2(&zs, c->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+	fprintf(stderr, "error in deflateInit2(): %s\n", zs.msg?zs.msg:"unknown");
+	return 0;
+    }
+    if(c->dictlen)
+	deflateSetDictionary(&zs, c->dict, c->dictlen);
+
+    int size = deflateBound(&zs, c->len) + 64;
+    if(c->outsize < size) {
+	c->out = realloc(c->out, size);
+	c->outsize = size;
+    }
+    zs.next_in = c->data;
+    zs.avail_in = c->len;
+    while(1) {
+	zs.next_out = c->out + c->outlen;
+	zs.avail_out = c->outsize - c->outlen;
+	/* non-final chunks end on a byte boundary, so that they can be
+	   concatenated */
+	int ret = deflate(&zs, c->last?Z_FINISH:Z_SYNC_FLUSH);
+	if(ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+	    fprintf(stderr, "error in deflate(): %s\n", zs.msg?zs.msg:"unknown");
+	    break;
 	}
-	free(bestline);
-#else
-	for(y=0;y<height;y++) {
-            if(bpp==8)
-		line[0] = png_apply_filter_8(line+1, &data[y*srcwidth], width, y);
-            else
-		line[0] = png_apply_filter_32(line+1, &data[y*srcwidth], width, y);
+	c->outlen = c->outsize - zs.avail_out;
+	if(ret == Z_STREAM_END || (!c->last && zs.avail_out))
+	    break;
+	c->outsize *= 2;
+	c->out = realloc(c->out, c->outsize);
+    }
+    deflateEnd(&zs);
+    return 0;
+}
 
-	    idatsize += compress_line(&zs, line, linelen, fi);
+/* compresses chunks 0..num-1 in parallel, and writes them out in order */
+static void png_flush_chunks(pngwriter_t*w, int num)
+{
+    int t;
+    for(t=0;t<num;t++) {
+	pngchunk_t*c = &w->chunks[t];
+	if(t) {
+	    pngchunk_t*prev = &w->chunks[t-1];
+	    c->dictlen = prev->len < PNG_DICT_SIZE ? prev->len : PNG_DICT_SIZE;
+	    c->dict = prev->data + prev->len - c->dictlen;
+	} else {
+	    c->dict = w->dict;
+	    c->dictlen = w->dictlen;
 	}
+    }
+#ifdef USE_THREADS
+    pthread_t*threads = (pthread_t*)calloc(num, sizeof(pthread_t));
+    char*started = (char*)calloc(num, 1);
+    for(t=1;t<num;t++) {
+	started[t] = !pthread_create(&threads[t], 0, png_compress_chunk, &w->chunks[t]);
+    }
+    png_compress_chunk(&w->chunks[0]);
+    for(t=1;t<num;t++) {
+	if(started[t])
+	    pthread_join(threads[t], 0);
+	else
+	    png_compress_chunk(&w->chunks[t]);
+    }
+    free(started);
+    free(threads);
+#else
+    for(t=0;t<num;t++)
+	png_compress_chunk(&w->chunks[t]);
 #endif
-	free(line);
+    mycrc32 = w->crc;
+    for(t=0;t<num;t++) {
+	png_write_bytes(w->fi, w->chunks[t].out, w->chunks[t].outlen);
+	w->idatsize += w->chunks[t].outlen;
     }
-    idatsize += finishzlib(&zs, fi);
-    png_patch_len(fi, idatpos, idatsize);
-    png_end_chunk(fi);
+    w->crc = mycrc32;
+
+    pngchunk_t*lastchunk = &w->chunks[num-1];
+    w->dictlen = lastchunk->len < PNG_DICT_SIZE ? lastchunk->len : PNG_DICT_SIZE;
+    memcpy(w->dict, lastchunk->data + lastchunk->len - w->dictlen, w->dictlen);
+    for(t=0;t<num;t++)
+	w->chunks[t].len = 0;
+    w->current = 0;
+}
 
-    png_start_chunk(fi, "IEND", 0);
-    png_end_chunk(fi);
+static void png_add_line(pngwriter_t*w)
+{
+    if(w->threads<=1) {
+	w->idatsize += compress_line(&w->zs, w->line, w->linelen, w->fi);
+	return;
+    }
+    pngchunk_t*c = &w->chunks[w->current];
+    memcpy(c->data + c->len, w->line, w->linelen);
+    c->len += w->linelen;
+    w->adler = adler32(w->adler, w->line, w->linelen);
+    if(c->len >= PNG_CHUNK_SIZE) {
+	if(++w->current == w->threads) {
+	    png_flush_chunks(w, w->threads);
+	}
+    }
+}
+
+EXPORT void png_writer_write_lines(pngwriter_t*w, unsigned char*data, unsigned num)
+{
+    unsigned srcwidth = w->width * (w->bpp/8);
+    unsigned t;
+    mycrc32 = w->crc;
+    for(t=0;t<num && w->y<w->height;t++) {
+	unsigned char*src = &data[t*srcwidth];
+	if(t==0 && w->y>0) {
+	    /* the previous row came with the last call */
+	    memcpy(w->rows+srcwidth, src, srcwidth);
+	    src = w->rows+srcwidth;
+	}
+	w->line[0] = png_filter_line(w->line+1, src, w->width, w->y, w->bpp, w->scratch);
+	png_add_line(w);
+	w->y++;
+    }
+    if(t)
+	memcpy(w->rows, &data[(t-1)*srcwidth], srcwidth);
+    w->crc = mycrc32;
+}
 
-    free(writebuf);
+EXPORT void png_writer_finish(pngwriter_t*w)
+{
+    if(w->y < w->height) {
+	fprintf(stderr, "png_writer_finish: only %d of %d lines written\n", w->y, w->height);
+    }
+    if(w->threads>1) {
+	/* the last chunk carries the final deflate block (and may be empty) */
+	w->chunks[w->current].last = 1;
+	png_flush_chunks(w, w->current+1);
+	mycrc32 = w->crc;
+	png_write_dword(w->fi, w->adler);
+	w->idatsize += 4;
+	int t;
+	for(t=0;t<w->threads;t++) {
+	    free(w->chunks[t].data);
+	    free(w->chunks[t].out);
+	}
+	free(w->chunks);
+	free(w->dict);
+    } else {
+	mycrc32 = w->crc;
+	w->idatsize += finishzlib(&w->zs, w->fi);
+    }
+    png_patch_len(w->fi, w->idatpos, w->idatsize);
+    png_end_chunk(w->fi);
+
+    png_start_chunk(w->fi, "IEND", 0);
+    png_end_chunk(w->fi);
+
+    fclose(w->fi);
+    free(w->writebuf);
+    free(w->line);
+    free(w->rows);
+    free(w->scratch);
+    free(w);
+}
+
+static void png_write_palette_based2(const char*filename, unsigned char*data, unsigned width, unsigned height, int numcolors, int compression)
+{
+    unsigned char* data2=0;
+    int cols;
+    int bpp;
+    char has_alpha=0;
+    COL palette[256];
+
+    if(numcolors>256) {
+	bpp = 32;
+	cols = 0;
+    } else if(!numcolors) {
+	data2 = malloc(width*height);
+	int num = png_find_palette((COL*)data, width*height, 255, palette, &has_alpha, data2);
+	if(num>=0) {
+	    //printf("image has %d different colors (alpha=%d)\n", num, has_alpha);
+	    data = data2;
+	    bpp = 8;
+	    cols = num;
+	} else {
+	    free(data2);
+	    data2 = 0;
+	    bpp = 32;
+	    cols = 0;
+	}
+    } else {
+	data2 = malloc(width*height);
+	cols = png_find_palette((COL*)data, width*height, numcolors, palette, &has_alpha, data2);
+	if(cols<0) {
+	    cols = png_quantize_image((COL*)data, width*height, numcolors, palette, &has_alpha, data2);
+	}
+	data = data2;
+        bpp = 8;
+    }
+
+    pngwriter_t*w = png_writer_new2(filename, width, height, bpp, palette, cols, has_alpha, compression);
+    if(w) {
+	png_writer_write_lines(w, data, height);
+	png_writer_finish(w);
+    }
     if(data2)
 	free(data2);
-    fclose(fi);
 }
 
 EXPORT void png_write_palette_based(const char*filename, unsigned char*data, unsigned width, unsigned height, int numcolors)
@@ -1709,3 +1667,41 @@ EXPORT void png_write_palette_based_2(const char*filename, unsigned char*data, u
 {
     png_write_palette_based2(filename, data, width, height, 256, Z_BEST_COMPRESSION);
 }
+
+#ifdef MAIN
+int main()
+{
+    /* enough distinct colors to make png_quantize_image() grow its
+       histogram several times while it's being filled */
+    unsigned width = 256, height = 64;
+    unsigned char*data = (unsigned char*)malloc(width*height*4);
+    int x,y;
+    for(y=0;y<height;y++)
+    for(x=0;x<width;x++) {
+	unsigned char*p = &data[(y*width+x)*4];
+	p[0] = 255;
+	p[1] = x;
+	p[2] = y*4;
+	p[3] = (x*y)&0xfc;
+    }
+    const char*filename = "png_test.png";
+    png_write_palette_based_2(filename, data, width, height);
+
+    unsigned w2=0, h2=0;
+    unsigned char*data2 = 0;
+    int ok = png_load(filename, &w2, &h2, &data2);
+    assert(ok && w2 == width && h2 == height);
+    int maxdiff = 0;
+    for(x=0;x<width*height*4;x++) {
+	int diff = abs(data[x]-data2[x]);
+	if(diff > maxdiff)
+	    maxdiff = diff;
+    }
+    printf("%dx%d image quantized, max channel error %d\n", width, height, maxdiff);
+    assert(maxdiff < 128);
+    free(data2);
+    free(data);
+    remove(filename);
+    return 0;
+}
+#endif
@@ -35,6 +35,16 @@ void png_write(const char*filename, unsigned char*data, unsigned width, unsigned
 void png_write_quick(const char*filename, unsigned char*data, unsigned width, unsigned height);
 void png_write_palette_based_2(const char*filename, unsigned char*data, unsigned width, unsigned height);
 
+/* writes a (32 bit RGBA) png file row by row, for images which don't fit
+   into memory in one piece */
+typedef struct _pngwriter pngwriter_t;
+pngwriter_t* png_writer_new(const char*filename, unsigned width, unsigned height);
+/* compress the image data on this many threads. Needs to be called
+   before the first line is written. */
+void png_writer_set_threads(pngwriter_t*w, int threads);
+void png_writer_write_lines(pngwriter_t*w, unsigned char*data, unsigned num);
+void png_writer_finish(pngwriter_t*w);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1390,6 +1390,142 @@ void dict_destroy(dict_t*dict)
     rfx_free(dict);
 }
 
+// ------------------------------- ohash_t ------------------------------------
+
+ohash_t*ohash_new(int key_size)
+{
+    NEW(ohash_t,h);
+    h->key_size = key_size;
+    return h;
+}
+
+static inline unsigned int ohash_hash(const void*key, int len)
+{
+    /* FNV-1a, word at a time where possible */
+    const unsigned char*p = (const unsigned char*)key;
+    unsigned int h = 2166136261u;
+    while(len >= 4) {
+        U32 w;
+        memcpy(&w, p, 4);
+        h = (h ^ w) * 16777619u;
+        p += 4;len -= 4;
+    }
+    while(len--) {
+        h = (h ^ *p++) * 16777619u;
+    }
+    h ^= h >> 15;
+    /* hash 0 marks an empty slot */
+    return h ? h : 1;
+}
+
+static void ohash_insert(ohash_t*h, unsigned int hash, const void*key, void*data)
+{
+    unsigned int mask = h->size-1;
+    unsigned int pos = hash & mask;
+    while(h->hashes[pos]) {
+        pos = (pos+1) & mask;
+    }
+    h->hashes[pos] = hash;
+    memcpy(&h->keys[pos*h->key_size], key, h->key_size);
+    h->data[pos] = data;
+    h->num++;
+}
+
+static void ohash_expand(ohash_t*h, int newsize)
+{
+    unsigned char*oldkeys = h->keys;
+    unsigned int*oldhashes = h->hashes;
+    void**olddata = h->data;
+    int oldsize = h->size;
+    int t;
+
+    h->size = newsize;
+    h->num = 0;
+    h->keys = (unsigned char*)rfx_alloc(h->key_size*newsize);
+    h->hashes = (unsigned int*)rfx_calloc(sizeof(unsigned int)*newsize);
+    h->data = (void**)rfx_alloc(sizeof(void*)*newsize);
+    for(t=0;t<oldsize;t++) {
+        if(oldhashes[t])
+            ohash_insert(h, oldhashes[t], &oldkeys[t*h->key_size], olddata[t]);
+    }
+    if(oldsize) {
+        rfx_free(oldkeys);
+        rfx_free(oldhashes);
+        rfx_free(olddata);
+    }
+}
+
+/* returns the slot of key, or -1 */
+static inline int ohash_find(ohash_t*h, unsigned int hash, const void*key)
+{
+    if(!h->num)
+        return -1;
+    unsigned int mask = h->size-1;
+    unsigned int pos = hash & mask;
+    while(h->hashes[pos]) {
+        if(h->hashes[pos] == hash &&
+           !memcmp(&h->keys[pos*h->key_size], key, h->key_size))
+            return pos;
+        pos = (pos+1) & mask;
+    }
+    return -1;
+}
+
+void ohash_put(ohash_t*h, const void*key, void*data)
+{
+    unsigned int hash = ohash_hash(key, h->key_size);
+    int pos = ohash_find(h, hash, key);
+    if(pos>=0) {
+        h->data[pos] = data;
+        return;
+    }
+    /* keep the table at most half full, so that probe sequences stay short */
+    if((h->num+1)*2 > h->size) {
+        ohash_expand(h, h->size?h->size*2:16);
+    }
+    ohash_insert(h, hash, key, data);
+}
+
+void* ohash_lookup(ohash_t*h, const void*key)
+{
+    int pos = ohash_find(h, ohash_hash(key, h->key_size), key);
+    return pos>=0 ? h->data[pos] : 0;
+}
+
+int ohash_count(ohash_t*h)
+{
+    return h->num;
+}
+
+void ohash_foreach_value(ohash_t*h, void (*runFunction)(void*))
+{
+    int t;
+    for(t=0;t<h->size;t++) {
+        if(h->hashes[t])
+            runFunction(h->data[t]);
+    }
+}
+
+void ohash_clear(ohash_t*h)
+{
+    if(h->size) {
+        rfx_free(h->keys);
+        rfx_free(h->hashes);
+        rfx_free(h->data);
+    }
+    int key_size = h->key_size;
+    memset(h, 0, sizeof(ohash_t));
+    h->key_size = key_size;
+}
+
+void ohash_destroy(ohash_t*h)
+{
+    if(!h)
+        return;
+    ohash_clear(h);
+    rfx_free(h);
+}
+
 // ------------------------------- mtf_t --------------------------------------
 mtf_t* mtf_new(type_t*type)
 {
@@ -93,6 +93,18 @@ typedef struct _dict {
     int num;
 } dict_t;
 
+/* (void*) pointers referenced by fixed-size binary keys. Open addressing
+   (linear probing), with the keys stored inline, so that lookups don't
+   allocate and don't call through a type_t */
+typedef struct _ohash {
+    unsigned char*keys;
+    unsigned int*hashes;
+    void**data;
+    int key_size;
+    int size;
+    int num;
+} ohash_t;
+
 /* array of key/value pairs, with fast lookup */
 typedef struct _array_entry {
     void*name;
@@ -235,6 +247,14 @@ void dict_destroy(dict_t*dict);
     for(v1##_i=0;v1##_i<(d)->hashsize;v1##_i++) \
         for(v1##_e=(d)->slots[v1##_i]; v1##_e && (((v1=(t1)v1##_e->key)||1)&&((v2=(t2)v1##_e->data)||1)); v1##_e=v1##_e->next)
 
+ohash_t*ohash_new(int key_size);
+void ohash_put(ohash_t*h, const void*key, void*data);
+void* ohash_lookup(ohash_t*h, const void*key);
+int ohash_count(ohash_t*h);
+void ohash_foreach_value(ohash_t*h, void (*runFunction)(void*));
+void ohash_clear(ohash_t*h);
+void ohash_destroy(ohash_t*h);
+
 void map_init(map_t*map);
 void map_put(map_t*map, string_t t1, string_t t2);
 const char* map_lookup(map_t*map, const char*name);
@@ -22,12 +22,26 @@ typedef struct _swf_page_internal
     int frame;
 } swf_page_internal_t;
 
+/* the position of a tag in the (uncompressed) file data */
+typedef struct _swftag
+{
+    U16 id;
+    U32 pos;
+    U32 len;
+} swftag_t;
+
 typedef struct _swf_doc_internal
 {
     map16_t*id2char;
-    SWF swf;
+    SWF swf; // header only
     int width,height;
     MATRIX m;
+
+    /* the file is inflated in one pass, and only the positions of the tags
+       are recorded. Tags are parsed when a frame needs them. */
+    U8*data;
+    swftag_t*tags;
+    int num_tags;
 } swf_doc_internal_t;
 
 #define TYPE_SHAPE 1
@@ -39,7 +53,8 @@ typedef struct _swf_doc_internal
 typedef struct _character
 {
     U16 id;
-    TAG*tag;
+    swftag_t*index;
+    TAG*tag; // 0 until the character is used
     char type;
     void*data;
 } character_t;
@@ -54,10 +69,13 @@ typedef struct _placement
 typedef struct _sprite
 {
     int frameCount;
+    swftag_t*tags;
+    int num_tags;
 } sprite_t;
 
 typedef struct _render
 {
+    swf_doc_internal_t*doc;
     map16_t*id2char;
     gfxdevice_t*device;
     MATRIX m;
@@ -214,9 +232,11 @@ static gfximage_t* gfximage_new(RGBA*data, int width, int height)
     return b;
 }
 
+static character_t* get_character(render_t*r, int id);
+
 static gfximage_t* findimage(render_t*r, U16 id)
 {
-    character_t*c = (character_t*)map16_get_id(r->id2char, id);
+    character_t*c = get_character(r, id);
     assert(c && c->type == TYPE_BITMAP);
     gfximage_t*img = (gfximage_t*)c->data;
 
@@ -285,7 +305,7 @@ static void textcallback(void*self, int*chars, int*xpos, int nr, int fontid, int
     textcallbackblock_t * info = (textcallbackblock_t*)self;
     font_t*font = 0;
     int t;
-    character_t*cfont = map16_get_id(info->r->id2char, fontid);
+    character_t*cfont = get_character(info->r, fontid);
     if(!cfont) {
 	fprintf(stderr, "Font %d unknown\n", fontid);
         return;
@@ -408,93 +428,191 @@ static void textcallback(void*self, int*chars, int*xpos, int nr, int fontid, int
 
 //---- tag handling ----
 
-static map16_t* extractDefinitions(SWF*swf)
+/* a TAG pointing into the file data, for the rfxswf parsing functions */
+static TAG* tag_view(swf_doc_internal_t*i, swftag_t*t, TAG*tag)
 {
-    map16_t*map = map16_new();
-    TAG*tag = swf->firstTag;
-    while(tag)
-    {
-	int id = 0;
-	if(swf_isDefiningTag(tag)) {
-	    id = swf_GetDefineID(tag);
-	}
+    memset(tag, 0, sizeof(TAG));
+    tag->id = t->id;
+    tag->len = t->len;
+    tag->data = i->data + t->pos;
+    return tag;
+}
 
-	if(tag->id == ST_DEFINESPRITE) {
-	    character_t*c = rfx_calloc(sizeof(character_t));
-	    sprite_t*s = rfx_calloc(sizeof(sprite_t));
-	    swf_SetTagPos(tag, 0);
-	    swf_GetU16(tag); //id
-	    s->frameCount = swf_GetU16(tag); //frameno
-	    c->tag = tag;
-	    c->type = TYPE_SPRITE;
-	    c->data = s;
-	    map16_add_id(map, id, c);
+/* record the positions of the tags in data[pos..end], without parsing them */
+static int index_tags(U8*data, U32 pos, U32 end, swftag_t**tags)
+{
+    swftag_t*list = 0;
+    int num = 0, size = 0;
+    while(pos + 2 <= end) {
+	U16 raw = GET16(&data[pos]);
+	U32 len = raw&0x3f;
+	pos += 2;
+	if(len == 0x3f) {
+	    if(pos + 4 > end)
+		break;
+	    len = GET32(&data[pos]);
+	    pos += 4;
+	}
+	if(len > end - pos) {
+	    msg("<warning> Tag %d is truncated", raw>>6);
+	    break;
 	}
-	else if(tag->id == ST_DEFINESHAPE ||
-		tag->id == ST_DEFINESHAPE2 ||
-		tag->id == ST_DEFINESHAPE3) {
-	    character_t*c = rfx_calloc(sizeof(character_t));
-	    c->tag = tag;
-	    c->type = TYPE_SHAPE;
-	    map16_add_id(map, id, c);
+	if(num == size) {
+	    size = size ? size*2 : 256;
+	    list = (swftag_t*)rfx_realloc(list, sizeof(swftag_t)*size);
 	}
-	else if(tag->id == ST_DEFINEFONT ||
-		tag->id == ST_DEFINEFONT2 ||
-		tag->id == ST_DEFINEFONT3) {
-	    character_t*c = rfx_calloc(sizeof(character_t));
-	    SWFFONT*swffont = 0;
-	    font_t*font = (font_t*)rfx_calloc(sizeof(font_t));
-	    swf_FontExtract(swf, id, &swffont);
-            font->swffont = swffont;
-            font->numchars = swffont->numchars;
-            font->glyphs = (gfxline_t**)rfx_calloc(sizeof(gfxline_t*)*font->numchars);
-            int t;
-            RGBA color_white = {255,255,255,255};
-            for(t=0;t<font->numchars;t++) {
-                if(!swffont->glyph[t].shape->fillstyle.n) {
-                    swf_ShapeAddSolidFillStyle(swffont->glyph[t].shape, &color_white);
-                }
-                SHAPE2*s2 = swf_ShapeToShape2(swffont->glyph[t].shape);
-                font->glyphs[t] = swfline_to_gfxline(s2->lines, 0, 1, true);
-		if(tag->id==ST_DEFINEFONT3) {
-		    gfxmatrix_t m = {1/20.0,0,0, 0,1/20.0,0};
-		    gfxline_transform(font->glyphs[t], &m);
-		}
-                swf_Shape2Free(s2);
-            }
-            /*swf_FontFree(swffont);*/
+	list[num].id = raw>>6;
+	list[num].pos = pos;
+	list[num].len = len;
+	num++;
+	pos += len;
+	if((raw>>6) == ST_END)
+	    break;
+    }
+    *tags = list;
+    return num;
+}
 
-	    c->tag = tag;
-	    c->type = TYPE_FONT;
-	    c->data = font;
-	    map16_add_id(map, id, c);
+static map16_t* extractDefinitions(swf_doc_internal_t*i)
+{
+    map16_t*map = map16_new();
+    int t;
+    for(t=0;t<i->num_tags;t++) {
+	swftag_t*tag = &i->tags[t];
+	char type = 0;
+	switch(tag->id) {
+	    case ST_DEFINESPRITE:
+		type = TYPE_SPRITE;
+	    break;
+	    case ST_DEFINESHAPE:
+	    case ST_DEFINESHAPE2:
+	    case ST_DEFINESHAPE3:
+		type = TYPE_SHAPE;
+	    break;
+	    case ST_DEFINEFONT:
+	    case ST_DEFINEFONT2:
+	    case ST_DEFINEFONT3:
+		type = TYPE_FONT;
+	    break;
+	    case ST_DEFINETEXT:
+	    case ST_DEFINETEXT2:
+		type = TYPE_TEXT;
+	    break;
+	    case ST_DEFINEBITSJPEG:
+	    case ST_DEFINEBITSJPEG2:
+	    case ST_DEFINEBITSJPEG3:
+	    case ST_DEFINEBITSLOSSLESS:
+	    case ST_DEFINEBITSLOSSLESS2:
+		type = TYPE_BITMAP;
+	    break;
 	}
-	else if(tag->id == ST_DEFINETEXT ||
-		tag->id == ST_DEFINETEXT2) {
-	    character_t*c = rfx_calloc(sizeof(character_t));
-	    c->tag = tag;
-	    c->type = TYPE_TEXT;
-	    c->data = 0;
-	    map16_add_id(map, id, c);
+	if(!type || tag->len < 2)
+	    continue;
+	character_t*c = rfx_calloc(sizeof(character_t));
+	c->id = GET16(&i->data[tag->pos]);
+	c->index = tag;
+	c->type = type;
+	map16_add_id(map, c->id, c);
+    }
+    return map;
+}
+
+static font_t* extractFont(swf_doc_internal_t*i, character_t*c)
+{
+    /* swf_FontExtract() also looks at font infos, glyph names and
+       text tags, so give it those */
+    TAG*tags = (TAG*)rfx_calloc(sizeof(TAG)*i->num_tags);
+    TAG*last = 0;
+    SWF swf;
+    memset(&swf, 0, sizeof(SWF));
+    int t;
+    for(t=0;t<i->num_tags;t++) {
+	switch(i->tags[t].id) {
+	    case ST_DEFINEFONT:
+	    case ST_DEFINEFONT2:
+	    case ST_DEFINEFONT3:
+	    case ST_DEFINEFONTALIGNZONES:
+	    case ST_DEFINEFONTINFO:
+	    case ST_DEFINEFONTINFO2:
+	    case ST_DEFINETEXT:
+	    case ST_DEFINETEXT2:
+	    case ST_GLYPHNAMES: {
+		TAG*tag = tag_view(i, &i->tags[t], &tags[t]);
+		tag->prev = last;
+		if(last) last->next = tag;
+		else swf.firstTag = tag;
+		last = tag;
+	    }
 	}
-	else if(tag->id == ST_DEFINEBITSJPEG || 
-		tag->id == ST_DEFINEBITSJPEG2 || 
-		tag->id == ST_DEFINEBITSJPEG3 ||
-		tag->id == ST_DEFINEBITSLOSSLESS || 
-		tag->id == ST_DEFINEBITSLOSSLESS2) {
-	    character_t*c = rfx_calloc(sizeof(character_t));
-	    int width, height;
-	    void*data = swf_ExtractImage(tag, &width, &height);
-	    gfximage_t*b = gfximage_new(data, width, height);
-	    c->tag = tag;
-	    c->type = TYPE_BITMAP;
-	    c->data = b;
-	    map16_add_id(map, id, c);
+    }
+
+    SWFFONT*swffont = 0;
+    font_t*font = (font_t*)rfx_calloc(sizeof(font_t));
+    swf_FontExtract(&swf, c->id, &swffont);
+    free(tags);
+
+    font->swffont = swffont;
+    font->numchars = swffont->numchars;
+    font->glyphs = (gfxline_t**)rfx_calloc(sizeof(gfxline_t*)*font->numchars);
+    RGBA color_white = {255,255,255,255};
+    for(t=0;t<font->numchars;t++) {
+	if(!swffont->glyph[t].shape->fillstyle.n) {
+	    swf_ShapeAddSolidFillStyle(swffont->glyph[t].shape, &color_white);
 	}
+	SHAPE2*s2 = swf_ShapeToShape2(swffont->glyph[t].shape);
+	font->glyphs[t] = swfline_to_gfxline(s2->lines, 0, 1, true);
+	if(c->index->id==ST_DEFINEFONT3) {
+	    gfxmatrix_t m = {1/20.0,0,0, 0,1/20.0,0};
+	    gfxline_transform(font->glyphs[t], &m);
+	}
+	swf_Shape2Free(s2);
+    }
+    /*swf_FontFree(swffont);*/
+    return font;
+}
 
-	tag = tag->next;
+static void loadCharacter(swf_doc_internal_t*i, character_t*c)
+{
+    TAG*tag = c->tag = tag_view(i, c->index, (TAG*)rfx_alloc(sizeof(TAG)));
+    if(c->type == TYPE_SPRITE) {
+	sprite_t*s = rfx_calloc(sizeof(sprite_t));
+	swf_SetTagPos(tag, 0);
+	swf_GetU16(tag); //id
+	s->frameCount = swf_GetU16(tag); //frameno
+	s->num_tags = index_tags(i->data, c->index->pos + 4, c->index->pos + c->index->len, &s->tags);
+	c->data = s;
+    } else if(c->type == TYPE_FONT) {
+	c->data = extractFont(i, c);
+    } else if(c->type == TYPE_BITMAP) {
+	int width, height;
+	void*data = swf_ExtractImage(tag, &width, &height);
+	c->data = gfximage_new(data, width, height);
     }
-    return map;
+}
+
+static character_t* get_character(render_t*r, int id)
+{
+    character_t*c = map16_get_id(r->id2char, id);
+    if(c && !c->tag)
+	loadCharacter(r->doc, c);
+    return c;
+}
+
+static void freeCharacter(void*self, int id, void*data)
+{
+    character_t*c = (character_t*)data;
+    if(c->type == TYPE_SPRITE && c->data) {
+	sprite_t*s = (sprite_t*)c->data;
+	free(s->tags);
+	free(s);
+    } else if(c->type == TYPE_BITMAP && c->data) {
+	gfximage_t*img = (gfximage_t*)c->data;
+	free(img->data);
+	free(img);
+    }
+    if(c->tag)
+	free(c->tag);
+    free(c);
 }
 
 void swf_FreeTaglist(TAG*tag)
@@ -515,25 +633,21 @@ static void increaseAge(void*self, int id, void*data)
     p->age++;
 }
 
-static map16_t* extractFrame(TAG*startTag, int frame_to_extract)
+static map16_t* extractFrame(swf_doc_internal_t*i, swftag_t*tags, int num_tags, int frame_to_extract)
 {
     map16_t*depthmap = map16_new();
-    TAG*tag = startTag;
     int frame = 1;
-    int insprite = 0;
+    int t;
 
-    for(;tag;tag = tag->next) {
-	if(tag->id == ST_DEFINESPRITE) {
-	    while(tag->id != ST_END)
-		tag = tag->next;
-	    continue;
-	}
+    for(t=0;t<num_tags;t++) {
+	swftag_t*tag = &tags[t];
 	if(tag->id == ST_PLACEOBJECT ||
 	   tag->id == ST_PLACEOBJECT2) {
             placement_t* p = rfx_calloc(sizeof(placement_t));
+	    TAG view;
 	    p->age = 1;
 	    p->startFrame = frame;
-            swf_GetPlaceObject(tag, &p->po);
+            swf_GetPlaceObject(tag_view(i, tag, &view), &p->po);
 	    if(p->po.move) {
 		placement_t*old = (placement_t*)map16_get_id(depthmap, p->po.depth);
 	
@@ -549,10 +663,11 @@ static map16_t* extractFrame(TAG*startTag, int frame_to_extract)
 	}
 	if(tag->id == ST_REMOVEOBJECT ||
 	   tag->id == ST_REMOVEOBJECT2) {
-	    U16 depth = swf_GetDepth(tag);
+	    TAG view;
+	    U16 depth = swf_GetDepth(tag_view(i, tag, &view));
 	    map16_remove_id(depthmap, depth);
 	}
-	if(tag->id == ST_SHOWFRAME || tag->id == ST_END || !tag->next) {
+	if(tag->id == ST_SHOWFRAME || tag->id == ST_END || t == num_tags-1) {
 	    if(frame == frame_to_extract) {
 		return depthmap;
 	    }
@@ -668,7 +783,7 @@ static void placeObject(void*self, int id, void*data)
 {
     render_t*r = (render_t*)self;
     placement_t*p = (placement_t*)data;
-    character_t*c = map16_get_id(r->id2char, p->po.id);
+    character_t*c = get_character(r, p->po.id);
     
     if(!c)  {
         fprintf(stderr, "Error: ID %d unknown\n", p->po.id);
@@ -684,8 +799,7 @@ static void placeObject(void*self, int id, void*data)
 
         sprite_t* s = (sprite_t*)c->data;
 
-	TAG*spritetags = c->tag->next;
-        map16_t* depths = extractFrame(spritetags, s->frameCount>0? p->age % s->frameCount : 0);
+        map16_t* depths = extractFrame(r->doc, s->tags, s->num_tags, s->frameCount>0? p->age % s->frameCount : 0);
         map16_enumerate(depths, placeObject, r);
        
         int t;
@@ -716,8 +830,9 @@ void swfpage_render(gfxpage_t*page, gfxdevice_t*output)
 {
     swf_page_internal_t*i = (swf_page_internal_t*)page->internal;
     swf_doc_internal_t*pi = (swf_doc_internal_t*)page->parent->internal;
-    map16_t* depths = extractFrame(pi->swf.firstTag, i->frame);
+    map16_t* depths = extractFrame(pi, pi->tags, pi->num_tags, i->frame);
     render_t r;
+    r.doc = pi;
     r.id2char = pi->id2char;
     r.clips = 0;
     r.device = output;
@@ -749,7 +864,11 @@ void swfpage_rendersection(gfxpage_t*page, gfxdevice_t*output, gfxcoord_t x, gfx
 void swf_doc_destroy(gfxdocument_t*gfx)
 {
     swf_doc_internal_t*i= (swf_doc_internal_t*)gfx->internal;
-    swf_FreeTags(&i->swf);
+    map16_enumerate(i->id2char, freeCharacter, 0);
+    map16_free(i->id2char);
+    free(i->id2char);
+    free(i->tags);
+    free(i->data);
     free(gfx->internal);gfx->internal=0;
     free(gfx);gfx=0;
 }
@@ -787,6 +906,61 @@ void swf_setparameter(gfxsource_t*src, const char*name, const char*value)
     msg("<verbose> setting parameter %s to \"%s\"", name, value);
 }
 
+/* read the SWF header, inflate the rest of the file in one go, and
+   record where the tags are */
+static int readSWF(swf_doc_internal_t*i, int f)
+{
+    reader_t file, zreader;
+    reader_t*reader = &file;
+    U8 b[8];
+
+    reader_init_filereader(&file, f);
+    if(reader->read(reader, b, 8) < 8)
+	return -1;
+    if((b[0]!='F' && b[0]!='C') || b[1]!='W' || b[2]!='S')
+	return -1;
+    i->swf.fileVersion = b[3];
+    i->swf.fileSize = GET32(&b[4]);
+    if(b[0]=='C') {
+	reader_init_zlibinflate(&zreader, &file);
+	reader = &zreader;
+    }
+
+    /* the header tells us the uncompressed size. Allocate one byte more
+       than that, so that we see the end of the file without growing */
+    U32 size = 65536;
+    if(i->swf.fileSize > 8 && i->swf.fileSize < 0x40000000)
+	size = i->swf.fileSize - 8 + 1;
+    U32 len = 0;
+    U8*data = (U8*)rfx_alloc(size);
+    while(1) {
+	if(len == size) {
+	    size *= 2;
+	    data = (U8*)rfx_realloc(data, size);
+	}
+	int l = reader->read(reader, data+len, size-len);
+	if(l<=0)
+	    break;
+	len += l;
+    }
+    if(reader == &zreader)
+	zreader.dealloc(&zreader);
+
+    TAG header;
+    swftag_t all = {0, 0, len};
+    i->data = data;
+    tag_view(i, &all, &header);
+    swf_GetRect(&header, &i->swf.movieSize);
+    i->swf.frameRate = swf_GetU16(&header);
+    i->swf.frameCount = swf_GetU16(&header);
+    if(header.pos > len)
+	return -1;
+
+    i->num_tags = index_tags(data, header.pos, len, &i->tags);
+    msg("<verbose> %d bytes, %d tags", len, i->num_tags);
+    return len;
+}
+
 gfxdocument_t*swf_open(gfxsource_t*src, const char*filename)
 {
     gfxdocument_t*swf_doc = (gfxdocument_t*)malloc(sizeof(gfxdocument_t));
@@ -808,14 +982,14 @@ gfxdocument_t*swf_open(gfxsource_t*src, const char*filename)
         perror("Couldn't open file: ");
         return 0;
     }
-    if FAILED(swf_ReadSWF(f,&i->swf)) { 
+    if FAILED(readSWF(i, f)) { 
         fprintf(stderr, "%s is not a valid SWF file or contains errors.\n",filename);
         close(f);
         return 0;
     }
-    swf_UnFoldAll(&i->swf);
+    close(f);
     
-    i->id2char = extractDefinitions(&i->swf);
+    i->id2char = extractDefinitions(i);
     i->width = (i->swf.movieSize.xmax - i->swf.movieSize.xmin) / 20;
     i->height = (i->swf.movieSize.ymax - i->swf.movieSize.ymin) / 20;
     
@@ -199,32 +199,44 @@ int swf_SetU32(TAG * t,U32 v)
   return 0;
 }
 
+/* bit offset (0..7) of a readBit/writeBit mask, counted from the most significant bit */
+static const U8 bitoffset[16] = {0,3,2,0,1,0,0,0,0,0,0,0,0,0,0,0};
+#define BITOFFSET(mask) ((mask)&0xf0 ? bitoffset[(mask)>>4] : 4+bitoffset[(mask)&15])
+
+static inline U64 get64be(const U8*p)
+{
+  return ((U64)p[0]<<56) | ((U64)p[1]<<48) | ((U64)p[2]<<40) | ((U64)p[3]<<32) |
+         ((U64)p[4]<<24) | ((U64)p[5]<<16) | ((U64)p[6]<<8)  |  (U64)p[7];
+}
+
 U32 swf_GetBits(TAG * t,int nbits)
-{ U32 res = 0;
+{ U64 w;
+  int off,end;
   if (!nbits) return 0;
-  if (!t->readBit) t->readBit = 0x80;
-  while (nbits)
-  { res<<=1;
+  off = t->readBit ? BITOFFSET(t->readBit) : 0;
+  end = off+nbits;
+  // off<=7 and nbits<=32, so all bits are in the next 8 bytes
+  if (t->pos+8<=t->len) {
+    w = get64be(&t->data[t->pos]);
+  } else {
+    int i,n = (end+7)>>3;
 #ifdef DEBUG_RFXSWF
-    if (t->pos>=t->len) 
+    if (t->pos+n>t->len) 
     { fprintf(stderr,"GetBits() out of bounds: TagID = %i, pos=%d, len=%d\n",t->id, t->pos, t->len);
       int i,m=t->len>10?10:t->len;
       for(i=-1;i<m;i++) {
         fprintf(stderr, "(%d)%02x ", i, t->data[i]);
       } 
       fprintf(stderr, "\n");
-      return res;
+      return 0;
     }
 #endif
-    if (t->data[t->pos]&t->readBit) res|=1;
-    t->readBit>>=1;
-    nbits--;
-    if (!t->readBit)
-    { if (nbits) t->readBit = 0x80;
-      t->pos++;
-    }
+    w = 0;
+    for(i=0;i<n;i++) w |= (U64)t->data[t->pos+i]<<(56-8*i);
   }
-  return res;
+  t->pos += end>>3;
+  t->readBit = (end&7) ? 0x80>>(end&7) : 0;
+  return (U32)((w<<off)>>(64-nbits));
 }
 
 S32 swf_GetSBits(TAG * t,int nbits)
@@ -243,18 +255,30 @@ S32 reader_GetSBits(reader_t*reader, int nbits)
 }
 
 int swf_SetBits(TAG * t,U32 v,int nbits)
-{ U32 bm = 1<<(nbits-1);
-
-  while (nbits)
-  { if (!t->writeBit)
-    { if (FAILED(swf_SetU8(t,0))) return -1;
-      t->writeBit = 0x80;
-    }
-    if (v&bm) t->data[t->len-1] |= t->writeBit;
-    bm>>=1;
-    t->writeBit>>=1;
-    nbits--;
+{ U64 w;
+  U32 start;
+  int off,end,n,i;
+  if (!nbits) return 0;
+  if (t->writeBit) {
+    off = BITOFFSET(t->writeBit);
+    start = t->len-1;
+  } else {
+    off = 0;
+    start = t->len;
   }
+  end = off+nbits;
+  n = (end+7)>>3;
+  if (start+n>t->memsize)
+  { U32  newmem  = MEMSIZE(start+n);
+    t->data    = (U8*)rfx_realloc(t->data,newmem);
+    t->memsize = newmem;
+  }
+  // new bytes start out empty, the current one keeps its upper bits
+  for(i=t->len-start;i<n;i++) t->data[start+i] = 0;
+  w = ((U64)v<<(64-nbits))>>off;
+  for(i=0;i<n;i++) t->data[start+i] |= (U8)(w>>(56-8*i));
+  t->len = start+n;
+  t->writeBit = (end&7) ? 0x80>>(end&7) : 0;
   return 0;
 }
 
@@ -1953,3 +1977,199 @@ void swf_FreeTags(SWF * swf)                 // Frees all malloc'ed memory for t
 //#include "modules/swfdraw.c"
 //#include "modules/swfrender.c"
 //#include "modules/swffilter.c"
+
+#ifdef BENCHMARK
+#include <sys/time.h>
+
+static double walltime()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* the previous bit-at-a-time implementations, for comparison */
+static U32 swf_GetBits_ref(TAG * t,int nbits)
+{ U32 res = 0;
+  if (!nbits) return 0;
+  if (!t->readBit) t->readBit = 0x80;
+  while (nbits)
+  { res<<=1;
+    if (t->data[t->pos]&t->readBit) res|=1;
+    t->readBit>>=1;
+    nbits--;
+    if (!t->readBit)
+    { if (nbits) t->readBit = 0x80;
+      t->pos++;
+    }
+  }
+  return res;
+}
+static int swf_SetBits_ref(TAG * t,U32 v,int nbits)
+{ U32 bm = 1<<(nbits-1);
+  while (nbits)
+  { if (!t->writeBit)
+    { if (FAILED(swf_SetU8(t,0))) return -1;
+      t->writeBit = 0x80;
+    }
+    if (v&bm) t->data[t->len-1] |= t->writeBit;
+    bm>>=1;
+    t->writeBit>>=1;
+    nbits--;
+  }
+  return 0;
+}
+static unsigned int reader_readbits_ref(reader_t*r, int num)
+{
+    int t;
+    int val = 0;
+    for(t=0;t<num;t++) {
+	val<<=1;
+	val|=reader_readbit(r);
+    }
+    return val;
+}
+static void writer_writebits_ref(writer_t*w, unsigned int data, int bits)
+{
+    int t;
+    for(t=0;t<bits;t++)
+	writer_writebit(w, (data >> (bits-t-1))&1);
+}
+
+/* bit fields laid out like shape edge records: flags, a 4 bit size, and
+   one or two coordinates of that size */
+static int make_fields(U32**values, U8**widths, int num_edges)
+{
+    U32*v = (U32*)rfx_alloc(sizeof(U32)*num_edges*6);
+    U8*w = (U8*)rfx_alloc(num_edges*6);
+    unsigned int r = 0;
+    int t,n = 0;
+    for(t=0;t<num_edges;t++) {
+	r = r*1103515245+12345;
+	int bits = 2 + (r>>16)%16;
+	v[n] = 1;w[n++] = 1; // edge
+	v[n] = (r>>8)&1;w[n++] = 1; // straight
+	v[n] = bits-2;w[n++] = 4;
+	v[n] = r>>7;w[n++] = 1; // general line
+	v[n] = r;w[n++] = bits;
+	v[n] = r>>3;w[n++] = bits;
+    }
+    *values = v;
+    *widths = w;
+    return n;
+}
+
+static void test_tagbits(int num_edges)
+{
+    U32*v;U8*w;
+    int num = make_fields(&v, &w, num_edges);
+    U32*out = (U32*)rfx_alloc(sizeof(U32)*num);
+    TAG*t1 = swf_InsertTag(0, ST_DEFINESHAPE);
+    TAG*t2 = swf_InsertTag(0, ST_DEFINESHAPE);
+    int t, errors = 0;
+
+    double s1 = walltime();
+    for(t=0;t<num;t++) swf_SetBits_ref(t1, v[t], w[t]);
+    double s2 = walltime();
+    for(t=0;t<num;t++) swf_SetBits(t2, v[t], w[t]);
+    double s3 = walltime();
+    for(t=0;t<num;t++) out[t] = swf_GetBits_ref(t1, w[t]);
+    double s4 = walltime();
+    for(t=0;t<num;t++) errors += swf_GetBits(t2, w[t]) != out[t];
+    double s5 = walltime();
+    for(t=0;t<num;t++) errors += out[t] != (v[t] & (0xffffffff>>(32-w[t])));
+
+    printf("swf_SetBits: old %.3fs new %.3fs, swf_GetBits: old %.3fs new %.3fs (%d fields, %d bytes)%s\n",
+	    s2-s1, s3-s2, s4-s3, s5-s4, num, t2->len,
+	    errors || t1->len != t2->len || memcmp(t1->data, t2->data, t1->len) ? " MISMATCH" : "");
+    swf_DeleteTag(0, t1);
+    swf_DeleteTag(0, t2);
+    free(v);free(w);free(out);
+}
+
+static void test_readerbits(int num_edges)
+{
+    U32*v;U8*w;
+    int num = make_fields(&v, &w, num_edges);
+    int t, errors = 0;
+    writer_t w1, w2;
+    reader_t r1, r2;
+    int len1, len2;
+    writer_init_growingmemwriter(&w1, 65536);
+    writer_init_growingmemwriter(&w2, 65536);
+
+    double s1 = walltime();
+    for(t=0;t<num;t++) writer_writebits_ref(&w1, v[t], w[t]);
+    double s2 = walltime();
+    for(t=0;t<num;t++) writer_writebits(&w2, v[t], w[t]);
+    double s3 = walltime();
+    writer_resetbits(&w1);
+    writer_resetbits(&w2);
+    U8*d1 = writer_growmemwrite_memptr(&w1, &len1);
+    U8*d2 = writer_growmemwrite_memptr(&w2, &len2);
+
+    reader_init_memreader(&r1, d1, len1);
+    reader_init_memreader(&r2, d2, len2);
+    double s4 = walltime();
+    for(t=0;t<num;t++) errors += reader_readbits_ref(&r1, w[t]) != (v[t] & (0xffffffff>>(32-w[t])));
+    double s5 = walltime();
+    for(t=0;t<num;t++) errors += reader_readbits(&r2, w[t]) != (v[t] & (0xffffffff>>(32-w[t])));
+    double s6 = walltime();
+
+    printf("writer_writebits: old %.3fs new %.3fs, reader_readbits: old %.3fs new %.3fs%s\n",
+	    s2-s1, s3-s2, s5-s4, s6-s5,
+	    errors || len1 != len2 || memcmp(d1, d2, len1) ? " MISMATCH" : "");
+    r1.dealloc(&r1);r2.dealloc(&r2);
+    w1.finish(&w1);w2.finish(&w2);
+    free(v);free(w);
+}
+
+static void test_shapes(int num_edges)
+{
+    RGBA red = {255,255,0,0};
+    SRECT bbox = {-0x100000,-0x100000,0x100000,0x100000};
+    SHAPE*s;
+    SHAPE2 shape2;
+    unsigned int r = 0;
+    int t;
+
+    double s1 = walltime();
+    TAG*tag = swf_InsertTag(0, ST_DEFINESHAPE3);
+    swf_ShapeNew(&s);
+    swf_ShapeAddSolidFillStyle(s, &red);
+    swf_ShapeAddLineStyle(s, 20, &red);
+    swf_SetU16(tag, 1);
+    swf_SetRect(tag, &bbox);
+    swf_SetShapeHeader(tag, s);
+    swf_ShapeSetAll(tag, s, 0, 0, 1, 1, 0);
+    for(t=0;t<num_edges;t++) {
+	r = r*1103515245+12345;
+	int range = 1<<((r>>24)%14);
+	int dx = (r>>4)%range - range/2;
+	int dy = (r>>12)%range - range/2;
+	if(r&0x8000)
+	    swf_ShapeSetCurve(tag, s, dx, dy, dy, -dx);
+	else
+	    swf_ShapeSetLine(tag, s, dx, dy);
+    }
+    swf_ShapeSetEnd(tag);
+    double s2 = walltime();
+    swf_ParseDefineShape(tag, &shape2);
+    double s3 = walltime();
+
+    printf("%d edges, %d bytes: encode %.3fs (%.1f MB/s), decode %.3fs (%.1f MB/s)\n",
+	    num_edges, tag->len, s2-s1, tag->len/(s2-s1)/1048576.0, s3-s2, tag->len/(s3-s2)/1048576.0);
+    swf_Shape2Free(&shape2);
+    swf_ShapeFree(s);
+    swf_DeleteTag(0, tag);
+}
+
+int main(int argn, char*argv[])
+{
+    int num_edges = argn>1 ? atoi(argv[1]) : 1000000;
+    test_tagbits(num_edges);
+    test_readerbits(num_edges);
+    test_shapes(num_edges);
+    return 0;
+}
+#endif
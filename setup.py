@@ -270,7 +270,7 @@ rfxswf_sources = [
 libpdf_sources = [
 "lib/pdf/VectorGraphicOutputDev.cc",
 "lib/pdf/CharOutputDev.cc",
-"lib/pdf/InfoOutputDev.cc", "lib/pdf/BitmapOutputDev.cc",
+"lib/pdf/InfoOutputDev.cc", "lib/pdf/glyphcache.cc", "lib/pdf/BitmapOutputDev.cc",
 "lib/pdf/FullBitmapOutputDev.cc",
 "lib/pdf/CommonOutputDev.cc",
 "lib/pdf/bbox.c",
@@ -266,6 +266,7 @@ int main(int argn, char *argv[])
         } else if(!strcasecmp(format, "img") || !strcasecmp(format, "png")) {
             gfxdevice_render_init(out);
 	    out->setparameter(out, "antialize", "4");
+	    out->setparameter(out, "threads", "0");
         } else if(!strcasecmp(format, "txt")) {
             gfxdevice_text_init(out);
         } else if(!strcasecmp(format, "log")) {